@@ -0,0 +1,929 @@
+/* gzshim.c -- zlib's gz* functions, compressing in parallel with libpigz
+ * Copyright (C) 2007-2015 Mark Adler
+ * Version 2.3.3  24 Jan 2015  Mark Adler
+ */
+
+/*
+  This software is provided 'as-is', without any express or implied
+  warranty.  In no event will the author be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the following restrictions:
+
+  1. The origin of this software must not be misrepresented; you must not
+     claim that you wrote the original software. If you use this software
+     in a product, an acknowledgment in the product documentation would be
+     appreciated but is not required.
+  2. Altered source versions must be plainly marked as such, and must not be
+     misrepresented as being the original software.
+  3. This notice may not be removed or altered from any source distribution.
+
+  Mark Adler
+  madler@alumni.caltech.edu
+ */
+
+/* libgzpigz.so provides zlib's gzopen(), gzwrite(), gzclose(), and the rest
+   of the gz* file functions, with the same interface as zlib's, but with the
+   compression done by libpigz in parallel.  An application that writes gzip
+   files with zlib gets the parallel compression without being changed, by
+   either linking with -lgzpigz ahead of -lz, or running it with
+   LD_PRELOAD=libgzpigz.so.  Its gzip files are written as by pigz, using the
+   compression level in the gzopen() mode, and the pigz options in the GZPIGZ
+   environment variable, if set (e.g. GZPIGZ="-p 8 -b 512").  The "T" mode
+   writes without compression as in zlib, and the "f", "h", "R", and "F"
+   strategies are accepted and ignored.
+
+   Reading decompresses gzip files with libpigz's pigz_decompress_*(), in the
+   thread that called gzread().  pigz -d runs its reading, writing, and check
+   calculation in threads that get ahead of the inflating, but gzread() must
+   return exactly the data asked for before it returns, and the reading and
+   writing are the application's own calls, so here there is nothing for
+   those threads to overlap.  A file that does not start with a gzip header
+   is read as is, as in zlib.  gzseek() is supported when
+   reading, and forward when writing.  gzsetparams() and gzflush() with
+   Z_FINISH end the gzip member being written, starting another for the data
+   that follows, which zlib and pigz decompress as one stream.
+
+   The gzFile returned by gzopen() begins with the struct gzFile_s that
+   zlib's gzgetc() macro uses, so that compiled calls of gzgetc() also work.
+   The functions for one gzFile must not be called from more than one thread
+   at a time. */
+
+#define _LARGEFILE64_SOURCE     /* declare gzopen64() et al. in zlib.h */
+#undef _FILE_OFFSET_BITS        /* but don't rename gzopen() et al. */
+
+#include <stdio.h>      /* vsnprintf() */
+#include <stdlib.h>     /* malloc(), realloc(), free(), getenv() */
+#include <string.h>     /* memcpy(), memmove(), memset(), strlen(), strchr() */
+#include <stdarg.h>     /* va_list, va_start(), va_end() */
+#include <limits.h>     /* INT_MAX */
+#include <errno.h>      /* errno, ENOMEM, EINVAL */
+#include <fcntl.h>      /* open(), O_* */
+#include <unistd.h>     /* read(), write(), lseek(), close() */
+#include "zlib.h"       /* gzFile, struct gzFile_s, Z_* */
+#include "pigz.h"       /* pigz_compress_*(), pigz_decompress_*() */
+
+#undef gzgetc           /* defined as a macro in zlib.h */
+
+/* libgzpigz.so is compiled with -fvisibility=hidden, so that libpigz, yarn,
+   try, and zopfli are not exported -- only the gz* functions here are */
+#pragma GCC visibility push(default)
+
+#define INSIZE 16384    /* size of compressed reads */
+
+/* state of an open gzip file */
+struct gzshim {
+    struct gzFile_s x;          /* have, next, and pos for gzgetc() */
+    int fd;                     /* file descriptor */
+    int write;                  /* true if writing, false if reading */
+    int direct;                 /* -1: not known, 0: gzip, 1: copy as is */
+    char *path;                 /* path for error messages */
+    int err;                    /* zlib error code, or Z_OK */
+    char *msg;                  /* error message, or NULL */
+    volatile int ioerr;         /* errno from the sink, or zero */
+    /* writing */
+    int level;                  /* compression level, -1 for default */
+    int members;                /* number of gzip members completed */
+    pigz_stream *strm;          /* compression or decompression stream */
+    /* reading */
+    off_t start;                /* file offset of the start of the data */
+    int eof;                    /* true if at the end of the input */
+    int past;                   /* true if read was attempted past the end */
+    unsigned char *buf;         /* decompressed data (x.next points here) */
+    size_t len, size;           /* length of data in buf, allocated size */
+    unsigned char in[INSIZE];   /* compressed input */
+};
+
+/* set the error for state to err with the message msg, or clear it if msg is
+   NULL -- the message includes the path and the error string */
+static void set_err(struct gzshim *state, int err, const char *msg)
+{
+    size_t len;
+
+    free(state->msg);
+    state->msg = NULL;
+    state->err = err;
+    if (msg == NULL)
+        return;
+    len = strlen(state->path) + strlen(msg) + 3;
+    state->msg = malloc(len);
+    if (state->msg == NULL) {
+        state->err = Z_MEM_ERROR;
+        return;
+    }
+    snprintf(state->msg, len, "%s: %s", state->path, msg);
+}
+
+/* write len bytes at buf to fd, return false on error */
+static int write_all(int fd, const unsigned char *buf, size_t len)
+{
+    ssize_t ret;
+
+    while (len) {
+        ret = write(fd, buf, len);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+        buf += ret;
+        len -= (size_t)ret;
+    }
+    return 1;
+}
+
+/* libpigz sink for compressed data, called from a libpigz thread */
+static void put(void *opaque, const unsigned char *buf, size_t len)
+{
+    struct gzshim *state = opaque;
+
+    if (state->ioerr == 0 && !write_all(state->fd, buf, len))
+        state->ioerr = errno;
+}
+
+/* libpigz sink for decompressed data, appended to state->buf */
+static void keep(void *opaque, const unsigned char *buf, size_t len)
+{
+    struct gzshim *state = opaque;
+    unsigned char *more;
+
+    if (state->ioerr)
+        return;
+    if (state->len + len > state->size) {
+        more = realloc(state->buf, 2 * (state->len + len));
+        if (more == NULL) {
+            state->ioerr = ENOMEM;
+            return;
+        }
+        state->buf = more;
+        state->size = 2 * (state->len + len);
+    }
+    memcpy(state->buf + state->len, buf, len);
+    state->len += len;
+}
+
+/* make the error from the sink the error for state, return -1 if there was
+   an error, 0 if not */
+static int sink_err(struct gzshim *state)
+{
+    if (state->ioerr == 0)
+        return 0;
+    if (state->ioerr == ENOMEM)
+        set_err(state, Z_MEM_ERROR, "out of memory");
+    else
+        set_err(state, Z_ERRNO, strerror(state->ioerr));
+    return -1;
+}
+
+/* -- writing -- */
+
+/* start a gzip member using the compression level and GZPIGZ */
+static int w_start(struct gzshim *state)
+{
+    char *env, *opts;
+    size_t len;
+
+    env = getenv("GZPIGZ");
+    if (env == NULL)
+        env = "";
+    len = strlen(env) + 6;
+    opts = malloc(len);
+    if (opts == NULL) {
+        set_err(state, Z_MEM_ERROR, "out of memory");
+        return -1;
+    }
+    if (state->level >= 0)
+        snprintf(opts, len, "%s -%d", env, state->level);
+    else
+        snprintf(opts, len, "%s", env);
+    state->strm = pigz_compress_init(opts, put, state);
+    free(opts);
+    if (state->strm == NULL) {
+        set_err(state, errno == ENOMEM ? Z_MEM_ERROR : Z_STREAM_ERROR,
+                errno == ENOMEM ? "out of memory" : "invalid GZPIGZ options");
+        return -1;
+    }
+    return 0;
+}
+
+/* complete the gzip member being written, if any */
+static int w_end(struct gzshim *state)
+{
+    int ret;
+
+    if (state->strm == NULL)
+        return 0;
+    ret = pigz_compress_end(state->strm);
+    state->strm = NULL;
+    state->members++;
+    if (sink_err(state))
+        return -1;
+    if (ret) {
+        set_err(state, ret == ENOMEM ? Z_MEM_ERROR : Z_STREAM_ERROR,
+                strerror(ret));
+        return -1;
+    }
+    return 0;
+}
+
+/* compress len bytes at buf, return -1 on error */
+static int w_data(struct gzshim *state, const void *buf, size_t len)
+{
+    int ret;
+
+    if (state->err != Z_OK)
+        return -1;
+    if (len == 0)
+        return 0;
+    if (state->direct == 1) {
+        if (!write_all(state->fd, buf, len)) {
+            set_err(state, Z_ERRNO, strerror(errno));
+            return -1;
+        }
+    }
+    else {
+        if (state->strm == NULL && w_start(state))
+            return -1;
+        ret = pigz_compress_write(state->strm, buf, len);
+        if (sink_err(state))
+            return -1;
+        if (ret) {
+            set_err(state, ret == ENOMEM ? Z_MEM_ERROR : Z_STREAM_ERROR,
+                    strerror(ret));
+            return -1;
+        }
+    }
+    state->x.pos += len;
+    return 0;
+}
+
+/* -- reading -- */
+
+/* read into state->in, return the number of bytes read or -1 on error --
+   the error is saved in state */
+static ssize_t r_raw(struct gzshim *state, size_t want)
+{
+    ssize_t ret;
+    size_t got = 0;
+
+    while (got < want) {
+        ret = read(state->fd, state->in + got, INSIZE - got);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            set_err(state, Z_ERRNO, strerror(errno));
+            return -1;
+        }
+        if (ret == 0) {
+            state->eof = 1;
+            break;
+        }
+        got += (size_t)ret;
+    }
+    return (ssize_t)got;
+}
+
+/* refill the decompressed data when it's all been used -- return -1 on error,
+   leaving x.have zero at the end of the input */
+static int r_fill(struct gzshim *state)
+{
+    int ret;
+    ssize_t got;
+
+    state->len = 0;
+    while (state->len == 0 && !state->eof) {
+        /* read compressed data, at least two bytes the first time to see if
+           it is gzip */
+        got = r_raw(state, state->direct == -1 ? 2 : 1);
+        if (got < 0)
+            return -1;
+        if (state->direct == -1) {
+            state->direct = got < 2 || state->in[0] != 0x1f ||
+                            state->in[1] != 0x8b;
+            if (!state->direct) {
+                state->strm = pigz_decompress_init(keep, state);
+                if (state->strm == NULL) {
+                    set_err(state, Z_MEM_ERROR, "out of memory");
+                    return -1;
+                }
+            }
+        }
+
+        /* decompress or copy it to state->buf */
+        if (state->direct)
+            keep(state, state->in, (size_t)got);
+        else if (got) {
+            ret = pigz_decompress_write(state->strm, state->in, (size_t)got);
+            if (ret) {
+                set_err(state, ret == ENOMEM ? Z_MEM_ERROR : Z_DATA_ERROR,
+                        ret == ENOMEM ? "out of memory" :
+                                        "invalid compressed data");
+                return -1;
+            }
+        }
+        if (sink_err(state))
+            return -1;
+
+        /* check that the last gzip member was complete */
+        if (state->eof && state->strm != NULL) {
+            ret = pigz_decompress_end(state->strm);
+            state->strm = NULL;
+            if (ret) {
+                set_err(state, Z_BUF_ERROR, "unexpected end of file");
+                return -1;
+            }
+        }
+    }
+    state->x.next = state->buf;
+    state->x.have = (unsigned)state->len;
+    return 0;
+}
+
+/* skip len bytes of decompressed data */
+static int r_skip(struct gzshim *state, z_off64_t len)
+{
+    unsigned n;
+
+    while (len) {
+        if (state->x.have == 0 && (state->eof || r_fill(state)))
+            return state->err == Z_OK ? 0 : -1;
+        if (state->x.have == 0)
+            return 0;
+        n = (z_off64_t)state->x.have > len ? (unsigned)len : state->x.have;
+        state->x.have -= n;
+        state->x.next += n;
+        state->x.pos += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* go back to the start of the data */
+static int r_rewind(struct gzshim *state)
+{
+    if (lseek(state->fd, state->start, SEEK_SET) == -1) {
+        set_err(state, Z_ERRNO, strerror(errno));
+        return -1;
+    }
+    if (state->strm != NULL) {
+        pigz_decompress_end(state->strm);
+        state->strm = NULL;
+    }
+    state->direct = -1;
+    state->eof = 0;
+    state->past = 0;
+    state->x.have = 0;
+    state->x.pos = 0;
+    set_err(state, Z_OK, NULL);
+    return 0;
+}
+
+/* -- opening and closing -- */
+
+/* open a gzip file on fd, or on path if fd is -1 */
+static gzFile gz_open(const char *path, int fd, const char *mode)
+{
+    int oflag = 0, excl = 0, append = 0, cloexec = 0;
+    struct gzshim *state;
+
+    state = calloc(1, sizeof(struct gzshim));
+    if (state == NULL)
+        return NULL;
+    state->write = -1;
+    state->direct = -1;
+    state->level = -1;
+    for (; *mode; mode++)
+        if (*mode >= '0' && *mode <= '9')
+            state->level = *mode - '0';
+        else
+            switch (*mode) {
+            case 'r':
+                state->write = 0;
+                break;
+            case 'a':
+                append = 1;
+                /* fall through */
+            case 'w':
+                state->write = 1;
+                break;
+            case 'x':
+                excl = 1;
+                break;
+            case 'e':
+                cloexec = 1;
+                break;
+            case 'T':
+                state->direct = 1;
+                break;
+            case '+':           /* can't read and write at the same time */
+                free(state);
+                return NULL;
+            default:            /* 'b', and the strategies f, h, R, F */
+                ;
+            }
+    if (state->write == -1 || (!state->write && state->direct == 1)) {
+        free(state);
+        return NULL;
+    }
+    if (state->write && state->direct == -1)
+        state->direct = 0;
+
+    /* save the path for error messages */
+    if (fd == -1)
+        state->path = malloc(strlen(path) + 1);
+    else
+        state->path = malloc(32);
+    if (state->path == NULL) {
+        free(state);
+        return NULL;
+    }
+    if (fd == -1)
+        strcpy(state->path, path);
+    else
+        snprintf(state->path, 32, "<fd:%d>", fd);
+
+    /* open the file */
+    if (fd == -1) {
+        oflag = state->write ?
+                O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC) |
+                (excl ? O_EXCL : 0) : O_RDONLY;
+#ifdef O_CLOEXEC
+        if (cloexec)
+            oflag |= O_CLOEXEC;
+#endif
+        fd = open(path, oflag, 0666);
+        if (fd == -1) {
+            free(state->path);
+            free(state);
+            return NULL;
+        }
+    }
+    state->fd = fd;
+    if (!state->write) {
+        state->start = lseek(fd, 0, SEEK_CUR);
+        if (state->start == -1)
+            state->start = 0;
+    }
+    return (gzFile)state;
+}
+
+gzFile ZEXPORT gzopen(const char *path, const char *mode)
+{
+    return path == NULL ? NULL : gz_open(path, -1, mode);
+}
+
+gzFile ZEXPORT gzopen64(const char *path, const char *mode)
+{
+    return path == NULL ? NULL : gz_open(path, -1, mode);
+}
+
+gzFile ZEXPORT gzdopen(int fd, const char *mode)
+{
+    return fd < 0 ? NULL : gz_open(NULL, fd, mode);
+}
+
+int ZEXPORT gzbuffer(gzFile file, unsigned size)
+{
+    (void)size;             /* libpigz chooses its own buffer sizes */
+    return file == NULL ? -1 : 0;
+}
+
+/* close and free state, returning ret, or Z_ERRNO if close() fails */
+static int gz_free(struct gzshim *state, int ret)
+{
+    if (close(state->fd) == -1 && ret == Z_OK)
+        ret = Z_ERRNO;
+    free(state->buf);
+    free(state->msg);
+    free(state->path);
+    free(state);
+    return ret;
+}
+
+int ZEXPORT gzclose_w(gzFile file)
+{
+    int ret;
+    struct gzshim *state = (struct gzshim *)file;
+
+    if (state == NULL || !state->write)
+        return Z_STREAM_ERROR;
+
+    /* write an empty gzip member if nothing was written, as zlib does */
+    if (state->direct == 0 && state->strm == NULL && state->members == 0 &&
+        state->err == Z_OK)
+        w_start(state);
+    w_end(state);
+    ret = state->err;
+    return gz_free(state, ret);
+}
+
+int ZEXPORT gzclose_r(gzFile file)
+{
+    int ret;
+    struct gzshim *state = (struct gzshim *)file;
+
+    if (state == NULL || state->write)
+        return Z_STREAM_ERROR;
+    if (state->strm != NULL)
+        pigz_decompress_end(state->strm);
+    ret = state->err == Z_BUF_ERROR ? Z_BUF_ERROR : Z_OK;
+    return gz_free(state, ret);
+}
+
+int ZEXPORT gzclose(gzFile file)
+{
+    struct gzshim *state = (struct gzshim *)file;
+
+    if (state == NULL)
+        return Z_STREAM_ERROR;
+    return state->write ? gzclose_w(file) : gzclose_r(file);
+}
+
+/* -- reading functions -- */
+
+int ZEXPORT gzread(gzFile file, voidp buf, unsigned len)
+{
+    unsigned n, got = 0;
+    struct gzshim *state = (struct gzshim *)file;
+
+    if (state == NULL || state->write)
+        return -1;
+    if (state->err != Z_OK && state->err != Z_BUF_ERROR)
+        return -1;
+    if ((int)len < 0) {
+        set_err(state, Z_STREAM_ERROR, "request does not fit in an int");
+        return -1;
+    }
+    while (got < len) {
+        if (state->x.have == 0) {
+            if (state->eof) {
+                state->past = 1;
+                break;
+            }
+            if (r_fill(state))
+                return got ? (int)got : -1;
+            continue;
+        }
+        n = len - got < state->x.have ? len - got : state->x.have;
+        memcpy((unsigned char *)buf + got, state->x.next, n);
+        state->x.next += n;
+        state->x.have -= n;
+        state->x.pos += n;
+        got += n;
+    }
+    return (int)got;
+}
+
+z_size_t ZEXPORT gzfread(voidp buf, z_size_t size, z_size_t nitems,
+                         gzFile file)
+{
+    int ret;
+    z_size_t len, got = 0;
+    struct gzshim *state = (struct gzshim *)file;
+
+    if (state == NULL || state->write || size == 0)
+        return 0;
+    len = nitems * size;
+    if (len / size != nitems) {
+        set_err(state, Z_STREAM_ERROR, "request does not fit in a size_t");
+        return 0;
+    }
+    while (got < len) {
+        ret = gzread(file, (unsigned char *)buf + got,
+                     len - got > INT_MAX ? INT_MAX : (unsigned)(len - got));
+        if (ret <= 0)
+            break;
+        got += (z_size_t)ret;
+    }
+    return got / size;
+}
+
+int ZEXPORT gzgetc(gzFile file)
+{
+    unsigned char c;
+
+    return gzread(file, &c, 1) == 1 ? c : -1;
+}
+
+int ZEXPORT gzgetc_(gzFile file)
+{
+    return gzgetc(file);
+}
+
+int ZEXPORT gzungetc(int c, gzFile file)
+{
+    unsigned char *more;
+    struct gzshim *state = (struct gzshim *)file;
+
+    if (state == NULL || state->write || c < 0 ||
+        (state->err != Z_OK && state->err != Z_BUF_ERROR))
+        return -1;
+    if (state->x.have == 0) {
+        state->x.next = state->buf;
+        state->len = 0;
+    }
+    if (state->x.next == state->buf) {
+        /* make room at the front of the buffer */
+        if (state->x.have + 1 > state->size) {
+            more = realloc(state->buf, state->x.have + 1);
+            if (more == NULL) {
+                set_err(state, Z_MEM_ERROR, "out of memory");
+                return -1;
+            }
+            state->buf = more;
+            state->size = state->x.have + 1;
+        }
+        memmove(state->buf + 1, state->buf, state->x.have);
+        state->x.next = state->buf + 1;
+    }
+    *--state->x.next = (unsigned char)c;
+    state->x.have++;
+    state->x.pos--;
+    state->past = 0;
+    return c;
+}
+
+char * ZEXPORT gzgets(gzFile file, char *buf, int len)
+{
+    int n = 0, c;
+
+    if (file == NULL || buf == NULL || len < 1)
+        return NULL;
+    while (n < len - 1 && (c = gzgetc(file)) != -1) {
+        buf[n++] = (char)c;
+        if (c == '\n')
+            break;
+    }
+    buf[n] = 0;
+    return n == 0 || ((struct gzshim *)file)->err == Z_DATA_ERROR ? NULL : buf;
+}
+
+int ZEXPORT gzdirect(gzFile file)
+{
+    struct gzshim *state = (struct gzshim *)file;
+
+    if (state == NULL)
+        return 0;
+    if (!state->write && state->direct == -1 && state->x.have == 0)
+        (void)r_fill(state);
+    return state->direct == 1;
+}
+
+int ZEXPORT gzeof(gzFile file)
+{
+    struct gzshim *state = (struct gzshim *)file;
+
+    return state != NULL && !state->write && state->past;
+}
+
+/* -- writing functions -- */
+
+int ZEXPORT gzwrite(gzFile file, voidpc buf, unsigned len)
+{
+    struct gzshim *state = (struct gzshim *)file;
+
+    if (state == NULL || !state->write)
+        return 0;
+    if ((int)len < 0) {
+        set_err(state, Z_DATA_ERROR, "requested length does not fit in int");
+        return 0;
+    }
+    return w_data(state, buf, len) ? 0 : (int)len;
+}
+
+z_size_t ZEXPORT gzfwrite(voidpc buf, z_size_t size, z_size_t nitems,
+                          gzFile file)
+{
+    z_size_t len;
+    struct gzshim *state = (struct gzshim *)file;
+
+    if (state == NULL || !state->write || size == 0)
+        return 0;
+    len = nitems * size;
+    if (len / size != nitems) {
+        set_err(state, Z_STREAM_ERROR, "request does not fit in a size_t");
+        return 0;
+    }
+    return w_data(state, buf, len) ? 0 : nitems;
+}
+
+int ZEXPORT gzputc(gzFile file, int c)
+{
+    unsigned char ch = (unsigned char)c;
+
+    return gzwrite(file, &ch, 1) == 1 ? ch : -1;
+}
+
+int ZEXPORT gzputs(gzFile file, const char *s)
+{
+    size_t len = strlen(s);
+    struct gzshim *state = (struct gzshim *)file;
+
+    if (state == NULL || !state->write)
+        return -1;
+    if (len > INT_MAX) {
+        set_err(state, Z_STREAM_ERROR, "string length does not fit in int");
+        return -1;
+    }
+    return w_data(state, s, len) ? -1 : (int)len;
+}
+
+int ZEXPORTVA gzvprintf(gzFile file, const char *format, va_list va)
+{
+    int len;
+    char small[1024], *big;
+    va_list copy;
+    struct gzshim *state = (struct gzshim *)file;
+
+    if (state == NULL || !state->write)
+        return Z_STREAM_ERROR;
+    if (state->err != Z_OK)
+        return state->err;
+    va_copy(copy, va);
+    len = vsnprintf(small, sizeof(small), format, copy);
+    va_end(copy);
+    if (len < 0)
+        return 0;
+    if ((size_t)len < sizeof(small))
+        return w_data(state, small, (size_t)len) ? state->err : len;
+    big = malloc((size_t)len + 1);
+    if (big == NULL) {
+        set_err(state, Z_MEM_ERROR, "out of memory");
+        return Z_MEM_ERROR;
+    }
+    vsnprintf(big, (size_t)len + 1, format, va);
+    if (w_data(state, big, (size_t)len))
+        len = state->err;
+    free(big);
+    return len;
+}
+
+int ZEXPORTVA gzprintf(gzFile file, const char *format, ...)
+{
+    int ret;
+    va_list va;
+
+    va_start(va, format);
+    ret = gzvprintf(file, format, va);
+    va_end(va);
+    return ret;
+}
+
+int ZEXPORT gzflush(gzFile file, int flush)
+{
+    int ret;
+    struct gzshim *state = (struct gzshim *)file;
+
+    if (state == NULL || !state->write || flush < 0 || flush > Z_FINISH)
+        return Z_STREAM_ERROR;
+    if (state->err != Z_OK)
+        return state->err;
+    if (state->direct == 1 || (state->strm == NULL && flush != Z_FINISH))
+        return Z_OK;
+    if (flush == Z_FINISH) {
+        if (state->strm == NULL && w_start(state))
+            return state->err;
+        return w_end(state) ? state->err : Z_OK;
+    }
+    ret = pigz_compress_flush(state->strm);
+    if (sink_err(state))
+        return state->err;
+    if (ret) {
+        set_err(state, Z_STREAM_ERROR, strerror(ret));
+        return state->err;
+    }
+    return Z_OK;
+}
+
+int ZEXPORT gzsetparams(gzFile file, int level, int strategy)
+{
+    struct gzshim *state = (struct gzshim *)file;
+
+    (void)strategy;
+    if (state == NULL || !state->write || level < -1 || level > 9)
+        return Z_STREAM_ERROR;
+    if (state->err != Z_OK)
+        return state->err;
+    if (level == state->level)
+        return Z_OK;
+
+    /* libpigz can't change the level in a stream, so start a new member */
+    if (w_end(state))
+        return state->err;
+    state->level = level;
+    return Z_OK;
+}
+
+/* -- positioning -- */
+
+z_off64_t ZEXPORT gzseek64(gzFile file, z_off64_t offset, int whence)
+{
+    static const char zeros[1024] = {0};
+    struct gzshim *state = (struct gzshim *)file;
+
+    if (state == NULL || (whence != SEEK_SET && whence != SEEK_CUR))
+        return -1;
+    if (state->err != Z_OK && state->err != Z_BUF_ERROR)
+        return -1;
+    if (whence == SEEK_CUR)
+        offset += state->x.pos;
+    if (offset < 0)
+        return -1;
+
+    /* writing: only forward, by writing zeros */
+    if (state->write) {
+        if (offset < state->x.pos)
+            return -1;
+        while (offset > state->x.pos)
+            if (w_data(state, zeros, offset - state->x.pos > 1024 ? 1024 :
+                                     (size_t)(offset - state->x.pos)))
+                return -1;
+        return offset;
+    }
+
+    /* reading: rewind if going back, then skip forward */
+    if (offset < state->x.pos && r_rewind(state))
+        return -1;
+    if (r_skip(state, offset - state->x.pos))
+        return -1;
+    state->past = 0;
+    return state->x.pos;
+}
+
+z_off_t ZEXPORT gzseek(gzFile file, z_off_t offset, int whence)
+{
+    z_off64_t ret;
+
+    ret = gzseek64(file, (z_off64_t)offset, whence);
+    return ret == (z_off_t)ret ? (z_off_t)ret : -1;
+}
+
+int ZEXPORT gzrewind(gzFile file)
+{
+    struct gzshim *state = (struct gzshim *)file;
+
+    if (state == NULL || state->write)
+        return -1;
+    return r_rewind(state);
+}
+
+z_off64_t ZEXPORT gztell64(gzFile file)
+{
+    return file == NULL ? -1 : file->pos;
+}
+
+z_off_t ZEXPORT gztell(gzFile file)
+{
+    z_off64_t ret;
+
+    ret = gztell64(file);
+    return ret == (z_off_t)ret ? (z_off_t)ret : -1;
+}
+
+z_off64_t ZEXPORT gzoffset64(gzFile file)
+{
+    off_t pos;
+    struct gzshim *state = (struct gzshim *)file;
+
+    if (state == NULL)
+        return -1;
+    pos = lseek(state->fd, 0, SEEK_CUR);
+    return pos == -1 ? -1 : pos - (state->write ? 0 : state->start);
+}
+
+z_off_t ZEXPORT gzoffset(gzFile file)
+{
+    z_off64_t ret;
+
+    ret = gzoffset64(file);
+    return ret == (z_off_t)ret ? (z_off_t)ret : -1;
+}
+
+/* -- errors -- */
+
+const char * ZEXPORT gzerror(gzFile file, int *errnum)
+{
+    struct gzshim *state = (struct gzshim *)file;
+
+    if (state == NULL)
+        return NULL;
+    if (errnum != NULL)
+        *errnum = state->err;
+    return state->err == Z_MEM_ERROR ? "out of memory" :
+           state->msg == NULL ? "" : state->msg;
+}
+
+void ZEXPORT gzclearerr(gzFile file)
+{
+    struct gzshim *state = (struct gzshim *)file;
+
+    if (state == NULL)
+        return;
+    if (!state->write) {
+        state->eof = 0;
+        state->past = 0;
+    }
+    set_err(state, Z_OK, NULL);
+}
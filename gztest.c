@@ -0,0 +1,79 @@
+/* gztest.c -- test libgzpigz by copying stdin to stdout with zlib's gz*
+ * Copyright (C) 2007-2015 Mark Adler
+ * Version 2.3.3  24 Jan 2015  Mark Adler
+ */
+
+/* Usage: gztest [-d] [mode]
+
+   Without -d, compress stdin to stdout with gzdopen(1, mode), where mode
+   defaults to "wb", and gzwrite(), gzputc(), and gzprintf(), ending with
+   gzclose().  With -d, decompress stdin to stdout with gzdopen(0, "rb"),
+   gzread(), gzgetc(), and gzungetc().  gztest is linked with zlib, and run
+   with LD_PRELOAD=./libgzpigz.so to use libgzpigz instead. */
+
+#include <stdio.h>
+#include <string.h>
+#include "zlib.h"
+
+int main(int argc, char **argv)
+{
+    int decode = 0, c, err;
+    unsigned len = 1;
+    char *mode = "wb";
+    gzFile gz;
+    static unsigned char buf[65536];
+    size_t got;
+
+    while (--argc) {
+        argv++;
+        if (strcmp(*argv, "-d") == 0)
+            decode = 1;
+        else
+            mode = *argv;
+    }
+
+    if (decode) {
+        gz = gzdopen(0, "rb");
+        if (gz == NULL)
+            return 1;
+        while ((c = gzgetc(gz)) != -1) {
+            if (gzungetc(c, gz) != c)
+                break;
+            got = gzread(gz, buf, len);
+            if (got == 0)
+                break;
+            fwrite(buf, 1, got, stdout);
+            len = len < sizeof(buf) / 2 ? 2 * len + 1 : len;
+        }
+        gzerror(gz, &err);
+        if (err != Z_OK) {
+            fprintf(stderr, "gztest: %s\n", gzerror(gz, &err));
+            return 1;
+        }
+        return gzclose(gz) != Z_OK;
+    }
+
+    gz = gzdopen(1, mode);
+    if (gz == NULL)
+        return 1;
+    while ((got = fread(buf, 1, len, stdin)) != 0) {
+        if (got > 1 && gzprintf(gz, "%c", buf[0]) != 1)
+            break;
+        if (got > 2 && gzputc(gz, buf[1]) != buf[1])
+            break;
+        if (got > 2 && gzwrite(gz, buf + 2, got - 2) != (int)got - 2)
+            break;
+        if (got == 1 && gzwrite(gz, buf, 1) != 1)
+            break;
+        if (got == 2 && gzputs(gz, "") != 0)
+            break;
+        if (got == 2 && gzwrite(gz, buf + 1, 1) != 1)
+            break;
+        len = len < sizeof(buf) / 2 ? 2 * len + 1 : len;
+    }
+    if (gzclose(gz) != Z_OK) {
+        fputs("gztest: write error\n", stderr);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,343 @@
+/* kbench.c -- microbenchmarks of the pigz kernels
+ * Copyright (C) 2007-2015 Mark Adler
+ * Version 2.3.3  24 Jan 2015  Mark Adler
+ */
+
+/* Usage: kbench [-s secs] [-c baseline] [-t percent]
+
+   Time each of the kernels that pigz spends its time in, and write a line for
+   each to stdout with the kernel name, the number of operations run, the
+   nanoseconds per operation, and the MB/s of data processed (or "-" if the
+   kernel does not process data).  Each kernel is run for at least secs
+   seconds (default 0.2).  Lines that start with "#" are comments.  This is
+   made and run with "make bench", which saves the output in kbench.out, or
+   with "make bench BASE=kbench.out", which compares to the saved output and
+   replaces it only if no kernel was slower.
+
+   With -c, the ns/op of each kernel is compared to the ns/op for the same
+   kernel in the baseline file, which is a saved output of kbench, and two more
+   columns are written: the change in time as a percentage, and "slower" if
+   it is more than percent (default 10) slower.  kbench then exits with status
+   1 if any kernel was slower.
+
+   kbench includes pigz.c, so that it can run the local functions of pigz
+   directly, on the generated text corpus of pigz --bench. */
+
+#define main pigz_cli_main
+#include "pigz.c"
+#undef main
+#include "zopfli/src/zopfli/blocksplitter.h"
+#include "zopfli/src/zopfli/katajainen.h"
+#include "zopfli/src/zopfli/squeeze.h"
+
+/* input data */
+#define KLEN 131072
+local unsigned char *text;
+
+/* kernel state */
+local unsigned long kcheck;
+local z_stream kstrm;
+local struct space kout;
+local struct job kjob;
+local unsigned char klens[4096];
+local size_t klen;
+local lock *kball;
+local ZopfliOptions kopts;
+local size_t kfreqs[288];
+local unsigned kbits[288];
+
+/* baseline results */
+local struct {
+    int n;
+    struct base {
+        char name[64];
+        double ns;
+    } *list;
+} base;
+
+/* -- kernels -- */
+
+local void k_crc32(void)
+{
+    g.form = 0;
+    kcheck = CHECK(kcheck, text, KLEN);
+}
+
+local void k_adler32(void)
+{
+    g.form = 1;
+    kcheck = CHECK(kcheck, text, KLEN);
+}
+
+local void k_crc32_comb(void)
+{
+    kcheck = crc32_comb(kcheck, 0x12345678UL, KLEN);
+}
+
+local void k_adler32_comb(void)
+{
+    kcheck = adler32_comb(kcheck, 0x12345678UL, KLEN);
+}
+
+local void k_deflate(void)
+{
+    (void)deflateReset(&kstrm);
+    kstrm.next_in = text;
+    kstrm.avail_in = KLEN;
+    kout.len = 0;
+    deflate_engine(&kstrm, &kout, Z_FINISH);
+}
+
+/* the rsyncable hash loop of parallel_compress(), with its append_len() */
+local void k_rsync(void)
+{
+    unsigned hash = RSYNCHIT;
+    unsigned char *scan = text, *end = text + KLEN, *last = text;
+
+    while (scan < end) {
+        hash = ((hash << 1) ^ *scan++) & RSYNCMASK;
+        if (hash == RSYNCHIT) {
+            append_len(&kjob, scan - last);
+            last = scan;
+        }
+    }
+    append_len(&kjob, 0);
+    drop_space(kjob.lens);
+    kjob.lens = NULL;
+}
+
+local void k_next_len(void)
+{
+    unsigned char *next = klens;
+    size_t left = KLEN;
+
+    while (next < klens + klen)
+        left -= next_len(&next, left);
+    kcheck += left;
+}
+
+/* the handoff in k_yarn_thread() */
+local void k_yarn_thread(void *dummy)
+{
+    long n;
+
+    (void)dummy;
+    do {
+        possess(kball);
+        wait_for(kball, NOT_TO_BE, 0);
+        n = peek_lock(kball);
+        twist(kball, TO, 0);
+    } while (n > 0);
+}
+
+/* hand the lock to another thread and back */
+local void k_yarn(void)
+{
+    possess(kball);
+    twist(kball, TO, 1);
+    possess(kball);
+    wait_for(kball, TO_BE, 0);
+    release(kball);
+}
+
+local void k_pool(void)
+{
+    drop_space(get_space(&g.in_pool));
+}
+
+/* GetBestLengths() and its trace, with the fixed tree */
+local void k_zopfli_lengths(void)
+{
+    ZopfliBlockState s;
+    ZopfliLZ77Store store;
+
+    s.options = &kopts;
+    s.blockstart = 0;
+    s.blockend = KLEN >> 2;
+    s.lmc = malloc(sizeof(ZopfliLongestMatchCache));
+    ZopfliInitCache(KLEN >> 2, s.lmc);
+    ZopfliInitLZ77Store(&store);
+    ZopfliLZ77OptimalFixed(&s, text, 0, KLEN >> 2, &store);
+    ZopfliCleanLZ77Store(&store);
+    ZopfliCleanCache(s.lmc);
+    free(s.lmc);
+}
+
+local void k_zopfli_split(void)
+{
+    size_t *points = NULL, npoints = 0;
+
+    ZopfliBlockSplit(&kopts, text, 0, KLEN >> 2, 15, &points, &npoints);
+    free(points);
+}
+
+local void k_zopfli_code_lengths(void)
+{
+    (void)ZopfliLengthLimitedCodeLengths(kfreqs, 288, 15, kbits);
+}
+
+/* -- measurement -- */
+
+/* load the baseline results from path */
+local void load_base(char *path)
+{
+    FILE *in;
+    char line[256];
+
+    in = fopen(path, "r");
+    if (in == NULL)
+        throw(errno, "cannot read %s (%s)", path, strerror(errno));
+    while (fgets(line, sizeof(line), in) != NULL) {
+        if (line[0] == '#')
+            continue;
+        base.list = alloc(base.list, (base.n + 1) * sizeof(struct base));
+        if (sscanf(line, "%63s %*s %lf", base.list[base.n].name,
+                   &base.list[base.n].ns) == 2)
+            base.n++;
+    }
+    fclose(in);
+}
+
+/* time each kernel for at least secs seconds */
+local double secs = 0.2;
+
+/* percent slower than the baseline to report */
+local double limit = 10;
+
+/* true if any kernel was slower than the baseline */
+local int slow = 0;
+
+/* run op() in doubling batches for at least secs seconds, and write the
+   results for name with bytes per operation (or 0) -- note in slow if it was
+   slower than the baseline by more than limit percent */
+local void run(char *name, void (*op)(void), size_t bytes)
+{
+    unsigned long ops = 0, n, k;
+    double start, took, ns, was;
+    int j;
+
+    n = 1;
+    start = seconds();
+    do {
+        for (k = 0; k < n; k++)
+            op();
+        ops += n;
+        n <<= 1;
+        took = seconds() - start;
+    } while (took < secs);
+    ns = took * 1e9 / ops;
+    printf("%-24s %10lu %14.1f", name, ops, ns);
+    if (bytes)
+        printf(" %10.1f", bytes * 1e3 / ns);
+    else
+        printf(" %10s", "-");
+    for (j = 0; j < base.n; j++)
+        if (strcmp(base.list[j].name, name) == 0)
+            break;
+    if (j < base.n) {
+        was = base.list[j].ns;
+        printf(" %+8.1f%%", 100 * (ns - was) / was);
+        if (ns > was * (1 + limit / 100)) {
+            fputs(" slower", stdout);
+            slow = 1;
+        }
+    }
+    putchar('\n');
+}
+
+int main(int argc, char **argv)
+{
+    int lev;
+    char name[32];
+    char *volatile was = NULL;
+    thread *th;
+    size_t k;
+    ball_t err;
+
+    while (--argc) {
+        argv++;
+        if (strcmp(*argv, "-s") == 0 && argc > 1)
+            secs = atof(*++argv), argc--;
+        else if (strcmp(*argv, "-c") == 0 && argc > 1)
+            was = *++argv, argc--;
+        else if (strcmp(*argv, "-t") == 0 && argc > 1)
+            limit = atof(*++argv), argc--;
+        else {
+            fputs("usage: kbench [-s secs] [-c baseline] [-t percent]\n",
+                  stderr);
+            return 2;
+        }
+    }
+
+    try {
+        g.prog = "kbench";
+        yarn_prefix = g.prog;
+        yarn_abort = cut_yarn;
+        defaults();
+        if (was != NULL)
+            load_base(was);
+
+        /* use the generated text of --bench, discarding the rest */
+        bench_make();
+        text = bench.corp[0].buf;
+        for (k = 1; k < (size_t)bench.n; k++)
+            free(bench.corp[k].buf);
+        for (k = 0; k < (size_t)bench.n; k++)
+            free(bench.corp[k].name);
+
+        /* set up the pools, a block lengths list, and the zopfli inputs */
+        setup_jobs();
+        kjob.lens = NULL;
+        for (k = 1; kjob.lens == NULL || kjob.lens->len < sizeof(klens) - 8;
+             k = k * 5 + 3)
+            append_len(&kjob, 1 + k % 2999999);     /* all four encodings */
+        append_len(&kjob, 0);
+        klen = kjob.lens->len;
+        memcpy(klens, kjob.lens->buf, klen);
+        drop_space(kjob.lens);
+        kjob.lens = NULL;
+        ZopfliInitOptions(&kopts);
+        for (k = 0; k < KLEN; k++)
+            kfreqs[text[k]]++;
+        kfreqs[256] = 1;
+
+        printf("# %-22s %10s %14s %10s\n", "kernel", "ops", "ns/op", "MB/s");
+        run("check_crc32", k_crc32, KLEN);
+        run("check_adler32", k_adler32, KLEN);
+        run("crc32_comb", k_crc32_comb, 0);
+        run("adler32_comb", k_adler32_comb, 0);
+        kout.size = KLEN + (KLEN >> 3);
+        kout.buf = alloc(NULL, kout.size);
+        for (lev = 1; lev <= 9; lev++) {
+            if (deflateInit2(&kstrm, lev, Z_DEFLATED, -15, 8,
+                             Z_DEFAULT_STRATEGY) != Z_OK)
+                throw(ENOMEM, "not enough memory");
+            sprintf(name, "deflate_engine_%d", lev);
+            run(name, k_deflate, KLEN);
+            (void)deflateEnd(&kstrm);
+        }
+        free(kout.buf);
+        run("rsync_hash", k_rsync, KLEN);
+        run("next_len", k_next_len, 0);
+        kball = new_lock(0);
+        th = launch(k_yarn_thread, NULL);
+        run("yarn_handoff", k_yarn, 0);
+        possess(kball);
+        twist(kball, TO, -1);
+        join(th);
+        free_lock(kball);
+        run("pool_get_drop", k_pool, 0);
+        run("zopfli_best_lengths", k_zopfli_lengths, KLEN >> 2);
+        run("zopfli_block_split", k_zopfli_split, KLEN >> 2);
+        run("zopfli_code_lengths", k_zopfli_code_lengths, 0);
+        printf("# check %08lx\n", kcheck);
+        free(text);
+        RELEASE(bench.corp);
+        RELEASE(base.list);
+        finish_jobs();
+    }
+    catch (err) {
+        THREADABORT(err);
+    }
+    return slow;
+}
@@ -0,0 +1,172 @@
+/* libtest.c -- test libpigz by compressing or decompressing stdin to stdout
+ * Copyright (C) 2007-2015 Mark Adler
+ * Version 2.3.3  24 Jan 2015  Mark Adler
+ */
+
+/* Usage: libtest [-d] [-f] [-2] [-B] ["pigz options"]
+
+   -d decompresses instead of compressing.  -f flushes the compressed stream
+   after every input buffer.  -2 compresses the input with two streams at the
+   same time, writes the output of the first, and checks that the output of
+   the second is the same.  -B compresses the input as a batch of 1000-byte
+   pieces, checks that a batch decompression of those gives the pieces back,
+   and writes the concatenated compressed pieces. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "pigz.h"
+
+/* output saved by the second stream for -2 */
+struct saved {
+    unsigned char *buf;
+    size_t len, size;
+};
+
+/* write output to stdout */
+static void put(void *opaque, const unsigned char *buf, size_t len)
+{
+    (void)opaque;
+    fwrite(buf, 1, len, stdout);
+}
+
+/* save output in memory */
+static void save(void *opaque, const unsigned char *buf, size_t len)
+{
+    struct saved *out = opaque;
+
+    if (out->len + len > out->size) {
+        out->size = 2 * (out->len + len);
+        out->buf = realloc(out->buf, out->size);
+        if (out->buf == NULL) {
+            fputs("libtest: out of memory\n", stderr);
+            exit(1);
+        }
+    }
+    memcpy(out->buf + out->len, buf, len);
+    out->len += len;
+}
+
+/* save output in memory and write it to stdout */
+static void both(void *opaque, const unsigned char *buf, size_t len)
+{
+    save(opaque, buf, len);
+    put(NULL, buf, len);
+}
+
+static int fail(const char *what, int err)
+{
+    fprintf(stderr, "libtest: %s failed (%s)\n", what, strerror(err));
+    return 1;
+}
+
+/* compress stdin in pieces with a batch, check it, and write it to stdout */
+static int batch(char *opts)
+{
+    int ret;
+    size_t len = 0, size = 65536, n, k;
+    unsigned char *in;
+    pigz_batch *items, *back;
+
+    in = malloc(size);
+    while (in != NULL && (n = fread(in + len, 1, size - len, stdin)) != 0)
+        if ((len += n) == size)
+            in = realloc(in, size <<= 1);
+    n = (len + 999) / 1000;
+    items = calloc(n + 1, sizeof(pigz_batch));
+    back = calloc(n + 1, sizeof(pigz_batch));
+    if (in == NULL || items == NULL || back == NULL)
+        return fail("batch", ENOMEM);
+    for (k = 0; k < n; k++) {
+        items[k].in = in + k * 1000;
+        items[k].in_len = len - k * 1000 < 1000 ? len - k * 1000 : 1000;
+    }
+    if ((ret = pigz_compress_batch(opts, items, n)) != 0)
+        return fail("compress batch", ret);
+    for (k = 0; k < n; k++) {
+        back[k].in = items[k].out;
+        back[k].in_len = items[k].out_len;
+    }
+    if ((ret = pigz_decompress_batch(opts, back, n)) != 0)
+        return fail("decompress batch", ret);
+    for (k = 0; k < n; k++) {
+        if (back[k].out_len != items[k].in_len ||
+            memcmp(back[k].out, items[k].in, items[k].in_len)) {
+            fputs("libtest: batch round trip mismatch\n", stderr);
+            return 1;
+        }
+        fwrite(items[k].out, 1, items[k].out_len, stdout);
+        free(items[k].out);
+        free(back[k].out);
+    }
+    free(back);
+    free(items);
+    free(in);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int decode = 0, flush = 0, two = 0, pieces = 0, ret;
+    char *opts = NULL;
+    size_t got;
+    pigz_stream *strm, *strm2 = NULL;
+    struct saved out = {NULL, 0, 0}, out2 = {NULL, 0, 0};
+    static unsigned char buf[65536];
+
+    while (--argc) {
+        argv++;
+        if (strcmp(*argv, "-d") == 0)
+            decode = 1;
+        else if (strcmp(*argv, "-f") == 0)
+            flush = 1;
+        else if (strcmp(*argv, "-2") == 0)
+            two = 1;
+        else if (strcmp(*argv, "-B") == 0)
+            pieces = 1;
+        else
+            opts = *argv;
+    }
+
+    if (pieces)
+        return batch(opts);
+    if (decode) {
+        strm = pigz_decompress_init(put, NULL);
+        if (strm == NULL)
+            return fail("init", errno);
+        while ((got = fread(buf, 1, sizeof(buf), stdin)) != 0)
+            if ((ret = pigz_decompress_write(strm, buf, got)) != 0)
+                return fail("decompress", ret);
+        if ((ret = pigz_decompress_end(strm)) != 0)
+            return fail("decompress", ret);
+        return 0;
+    }
+
+    strm = pigz_compress_init(opts, two ? both : put, &out);
+    if (strm == NULL)
+        return fail("init", errno);
+    if (two && (strm2 = pigz_compress_init(opts, save, &out2)) == NULL)
+        return fail("init", errno);
+    while ((got = fread(buf, 1, sizeof(buf), stdin)) != 0) {
+        if ((ret = pigz_compress_write(strm, buf, got)) != 0 ||
+            (strm2 != NULL && (ret = pigz_compress_write(strm2, buf, got))))
+            return fail("compress", ret);
+        if (flush && (ret = pigz_compress_flush(strm)) != 0)
+            return fail("flush", ret);
+        if (flush && strm2 != NULL && (ret = pigz_compress_flush(strm2)) != 0)
+            return fail("flush", ret);
+    }
+    if ((ret = pigz_compress_end(strm)) != 0)
+        return fail("compress", ret);
+    if (strm2 != NULL) {
+        if ((ret = pigz_compress_end(strm2)) != 0)
+            return fail("compress", ret);
+        if (out.len != out2.len || memcmp(out.buf, out2.buf, out.len)) {
+            fputs("libtest: concurrent streams differ\n", stderr);
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -242,7 +242,12 @@
    through the yarn.h interface to yarn.c.  yarn.c can be replaced with
    equivalent implementations using other thread libraries.  pigz can be
    compiled with NOTHREAD #defined to not use threads at all (in which case
-   pigz will not be able to live up to the "parallel" in its name).
+   pigz will not be able to live up to the "parallel" in its name).  Where the
+   compiler has the gcc __atomic builtins and __thread, pigz uses them for a
+   few counters and per-thread variables.  Otherwise, or if NOATOMIC is
+   #defined, those counters are protected by a yarn lock instead, --trace-json
+   has a track per stage instead of per thread, --perf has no counters, and
+   the debug log has one ring for all of the threads.
  */
 
 /*
@@ -318,8 +323,9 @@
                         /* puts(), printf(), vasprintf(), stderr, EOF, NULL,
                            SEEK_END, size_t, off_t */
 #include <stdlib.h>     /* exit(), malloc(), free(), realloc(), atol(), */
-                        /* atoi(), getenv() */
+                        /* atoi(), getenv(), qsort(), abort() */
 #include <stdarg.h>     /* va_start(), va_end(), va_list */
+#include <stddef.h>     /* offsetof() */
 #include <string.h>     /* memset(), memchr(), memcpy(), strcmp(), strcpy() */
                         /* strncpy(), strlen(), strcat(), strrchr(),
                            strerror() */
@@ -329,15 +335,24 @@
 #include <signal.h>     /* signal(), SIGINT */
 #include <sys/types.h>  /* ssize_t */
 #include <sys/stat.h>   /* chmod(), stat(), fstat(), lstat(), struct stat, */
-                        /* S_IFDIR, S_IFLNK, S_IFMT, S_IFREG */
+                        /* S_IFDIR, S_IFLNK, S_IFMT, S_IFREG, umask() */
 #include <sys/time.h>   /* utimes(), gettimeofday(), struct timeval */
+#include <sys/resource.h>   /* getrusage(), struct rusage, RUSAGE_SELF */
 #include <unistd.h>     /* unlink(), _exit(), read(), write(), close(), */
                         /* lseek(), isatty(), chown() */
+#include <poll.h>       /* poll(), struct pollfd, POLLIN */
 #include <fcntl.h>      /* open(), O_CREAT, O_EXCL, O_RDONLY, O_TRUNC, */
                         /* O_WRONLY */
 #include <dirent.h>     /* opendir(), readdir(), closedir(), DIR, */
                         /* struct dirent */
-#include <limits.h>     /* UINT_MAX, INT_MAX */
+#include <limits.h>     /* UINT_MAX, INT_MAX, LONG_MAX */
+#ifdef __linux__
+#  include <sys/ioctl.h>        /* ioctl() */
+#  include <linux/fs.h>         /* FICLONE */
+#  include <sys/inotify.h>      /* inotify_init(), inotify_add_watch() */
+#  include <sys/syscall.h>      /* syscall(), SYS_perf_event_open */
+#  include <linux/perf_event.h> /* struct perf_event_attr, PERF_* */
+#endif
 #if __STDC_VERSION__-0 >= 199901L || __GNUC__-0 >= 3
 #  include <inttypes.h> /* intmax_t */
 #endif
@@ -375,7 +390,21 @@
 #ifndef NOTHREAD
 #  include "yarn.h"     /* thread, launch(), join(), join_all(), */
                         /* lock, new_lock(), possess(), twist(), wait_for(),
-                           release(), peek_lock(), free_lock(), yarn_name */
+                           release(), peek_lock(), free_lock(), yarn_name,
+                           yarn_count(), label_lock(), yarn_count_show() */
+#endif
+#ifndef NOTHREAD
+#  include <sys/socket.h>   /* socket(), bind(), listen(), accept(), */
+                            /* connect(), sendmsg(), recvmsg(), send(), */
+                            /* getsockopt(), SO_PEERCRED, getpeereid() */
+#  include <sys/un.h>   /* struct sockaddr_un */
+#endif
+#ifdef PIGZ_LIB
+#  include <pthread.h>  /* pthread_mutex_t, pthread_mutex_lock(), */
+                        /* pthread_mutex_unlock(), pthread_once(), */
+                        /* pthread_key_create(), pthread_getspecific(),
+                           pthread_setspecific() */
+#  include "pigz.h"     /* pigz_stream, pigz_sink, pigz_compress_init(), ... */
 #endif
 #include "zopfli/src/zopfli/deflate.h"  /* ZopfliDeflatePart(),
                                            ZopfliInitOptions(),
@@ -403,6 +432,49 @@
         } \
     } while (0)
 
+/* counters and flags shared by threads without a lock of their own -- with
+   gcc and clang these use the __atomic builtins, so that the pipeline can
+   count as it goes without taking a lock, and ATOMIC is defined, which also
+   means that __thread is available for thread-local variables.  Otherwise, or
+   if NOATOMIC is defined, they are accessed while possessing the yarn lock
+   atom.  Without threads they are plain variables.  ATOM_GET(v, x) sets v to
+   x, and ATOM_SWAP(v, x, n) sets v to x and x to n.  MINE declares a
+   thread-local variable where there is __thread, and is otherwise empty, so
+   that without ATOMIC such a variable is shared by the threads. */
+#if defined(NOTHREAD)
+#  define MINE
+#  define ATOM_INIT()
+#  define ATOM_ADD(x, n) ((void)((x) += (n)))
+#  define ATOM_SET(x, n) ((void)((x) = (n)))
+#  define ATOM_GET(v, x) ((void)((v) = (x)))
+#  define ATOM_SWAP(v, x, n) ((void)((v) = (x), (x) = (n)))
+#elif defined(__ATOMIC_RELAXED) && !defined(NOATOMIC)
+#  define ATOMIC
+#  define MINE __thread
+#  define ATOM_INIT()
+#  define ATOM_ADD(x, n) ((void)__atomic_add_fetch(&(x), n, __ATOMIC_RELAXED))
+#  define ATOM_SET(x, n) __atomic_store_n(&(x), n, __ATOMIC_RELEASE)
+#  define ATOM_GET(v, x) \
+    ((void)((v) = __atomic_load_n(&(x), __ATOMIC_ACQUIRE)))
+#  define ATOM_SWAP(v, x, n) \
+    ((void)((v) = __atomic_exchange_n(&(x), n, __ATOMIC_ACQ_REL)))
+#else
+  local lock *atom = NULL;
+#  define MINE
+#  define ATOM_INIT() \
+    do { \
+        if (atom == NULL) { \
+            atom = new_lock(0); \
+            label_lock(atom, "atom", NULL); \
+        } \
+    } while (0)
+#  define ATOM_ADD(x, n) (possess(atom), (x) += (n), release(atom))
+#  define ATOM_SET(x, n) (possess(atom), (x) = (n), release(atom))
+#  define ATOM_GET(v, x) (possess(atom), (v) = (x), release(atom))
+#  define ATOM_SWAP(v, x, n) \
+    (possess(atom), (v) = (x), (x) = (n), release(atom))
+#endif
+
 /* sliding dictionary size for deflate */
 #define DICT 32768U
 
@@ -468,8 +540,42 @@
 /* input buffer size */
 #define BUF 32768U
 
-/* globals (modified by main thread only when it's the only thread) */
-local struct {
+#ifndef NOTHREAD
+/* a space (one buffer for each space) */
+struct space {
+    lock *use;              /* use count -- return to pool when zero */
+    unsigned char *buf;     /* buffer of size size */
+    size_t size;            /* current size of this buffer */
+    size_t len;             /* for application usage (initially zero) */
+    struct pool *pool;      /* pool to return to */
+    struct space *next;     /* for pool linked list */
+};
+
+/* pool of spaces (one pool for each type needed) */
+struct pool {
+    char *name;             /* name of the pool for lock labels */
+    lock *have;             /* unused spaces available, lock for list */
+    struct space *head;     /* linked list of available buffers */
+    size_t size;            /* size of new buffers in this pool */
+    int limit;              /* number of new spaces allowed, or -1 */
+    int made;               /* number of buffers made */
+    size_t bytes;           /* total size of the buffers made */
+};
+#endif
+
+/* descriptor value for readn() and writen() to use g.get() and g.put() */
+#define IOFUNC -2
+
+/* maximum number of --tee destinations */
+#define TEES 8
+
+/* globals for one stream (modified by main thread only when it's the only
+   thread) -- the globals are accessed as g, through the pointer gp, which is
+   the same for all threads unless pigz is compiled as a library, in which
+   case each thread has its own gp that BIND() sets to the stream it is working
+   on -- this permits several streams to be compressed at once by one set of
+   compression threads */
+struct globals {
     char *prog;             /* name by which pigz was invoked */
     int ind;                /* input file descriptor */
     int outd;               /* output file descriptor */
@@ -496,6 +602,29 @@ local struct {
     int procs;              /* maximum number of compression threads (>= 1) */
     int setdict;            /* true to initialize dictionary in each thread */
     size_t block;           /* uncompressed input size per thread (>= 32K) */
+    char *index;            /* block index file to write, or NULL */
+    char *reuse;            /* previous output to reuse blocks from, or NULL */
+    char *cache;            /* compressed block cache directory, or NULL */
+    char *cachedir;         /* whole file output cache directory, or NULL */
+    uint64_t cachemax;      /* maximum size of cachedir, or 0 for no limit */
+    size_t align;           /* output alignment of blocks, or 0 for none */
+    int resume;             /* true to journal and resume compression */
+    int flushint;           /* ms to hold input before a flush, or 0 */
+    int follow;             /* true to keep reading a growing input file */
+    char *tee[TEES];        /* more destinations for the compressed output */
+    int teeform[TEES];      /* format of each tee[] (as for form), or -1 */
+    int tees;               /* number of paths in tee[] */
+    char *digest;           /* where to write SHA-256 digest lines, or NULL */
+    int bench;              /* true to benchmark instead of processing files */
+    int stats;              /* true to report pipeline statistics at exit */
+    int lockstats;          /* true to report lock use counts at exit */
+    int progress;           /* true to report progress while processing */
+    int perf;               /* true to add performance counters to --stats */
+    char *tracejson;        /* where to write a timeline trace, or NULL */
+    int json;               /* true to write -l, -t, and --stats as JSON */
+    char *metrics;          /* where to write Prometheus metrics, or NULL */
+    unsigned long files;    /* number of inputs opened */
+    unsigned long errors;   /* number of inputs skipped or failed */
 
     /* saved gzip/zip header data for decompression, testing, and listing */
     time_t stamp;               /* time stamp from gzip header */
@@ -513,6 +642,7 @@ local struct {
     off_t in_tot;           /* total bytes read from input */
     off_t out_tot;          /* total bytes written to output */
     unsigned long out_check;    /* check value of output */
+    unsigned char *window;  /* inflateBack() window, or NULL to use out_buf */
 
 #ifndef NOTHREAD
     /* globals for decompression parallel reading */
@@ -521,8 +651,62 @@ local struct {
     int in_which;           /* -1: start, 0: in_buf2, 1: in_buf */
     lock *load_state;       /* value = 0 to wait, 1 to read a buffer */
     thread *load_thread;    /* load_read() thread for joining */
+
+    /* parallel compression resources for this stream */
+    struct pool in_pool;        /* input buffers */
+    struct pool out_pool;       /* compressed output buffers */
+    struct pool dict_pool;      /* dictionary buffers */
+    struct pool lens_pool;      /* block lengths buffers */
+    lock *write_first;          /* lowest sequence number in write list */
+    struct job *write_head;     /* list of write jobs */
+    thread *writeth;            /* write thread if running */
+    lock *wrote;                /* input bytes written if not NULL (low 31) */
+#endif
+
+    /* input and output functions when ind or outd is IOFUNC */
+    ssize_t (*get)(void *, unsigned char *, size_t);    /* read */
+    ssize_t (*put)(void *, unsigned char *, size_t);    /* write */
+    void *io;               /* opaque pointer for get() and put() */
+    int flushed;            /* true if get() returned 0 to flush */
+#ifdef PIGZ_LIB
+    int fail;               /* error that ended the output (write_first) */
+#endif
+    int unflushed;          /* true if input was read since the last flush */
+    struct timeval since;   /* when the unflushed input started arriving */
+
+    /* daemon state */
+    char *sock;             /* --daemon or --socket path, or NULL if neither */
+    int serve;              /* true for --daemon, false for --socket */
+    int daemon;             /* true if serving requests as a daemon */
+    int werr;               /* deferred write error in a request, or 0 */
+};
+local struct globals gs;
+#if defined(PIGZ_LIB) && defined(ATOMIC)
+local __thread struct globals *gp = &gs;
+#  define BIND(p) (gp = (p))
+#elif defined(PIGZ_LIB)
+/* without __thread, each thread's gp is kept with a pthread key */
+local pthread_key_t gp_key;
+local pthread_once_t gp_once = PTHREAD_ONCE_INIT;
+local void gp_make(void)
+{
+    if (pthread_key_create(&gp_key, NULL))
+        abort();
+}
+local struct globals *gp_get(void)
+{
+    pthread_once(&gp_once, gp_make);
+    return pthread_getspecific(gp_key) == NULL ? &gs :
+           (struct globals *)pthread_getspecific(gp_key);
+}
+#  define gp gp_get()
+#  define BIND(p) \
+    (pthread_once(&gp_once, gp_make), (void)pthread_setspecific(gp_key, p))
+#else
+local struct globals *const gp = &gs;
+#  define BIND(p) ((void)(p))
 #endif
-} g;
+#define g (*gp)
 
 /* display a complaint with the program name on stderr */
 local int complain(char *fmt, ...)
@@ -540,6 +724,9 @@ local int complain(char *fmt, ...)
     return 0;
 }
 
+/* count an input that was skipped or failed, for --metrics-file */
+#define FAILED() ATOM_ADD(g.errors, 1)
+
 #ifdef DEBUG
 
 /* memory tracking */
@@ -668,14 +855,58 @@ local void *alloc(void *ptr, size_t size)
 /* starting time of day for tracing */
 local struct timeval start;
 
-/* trace log */
-local struct log {
+/* The trace log is kept in a ring of fixed-size binary records for each
+   thread, so that adding an entry takes no lock, allocates no memory, and does
+   no formatting -- the record saves the time, the format string, which serves
+   as the event id, and the arguments, which are formatted only when the log is
+   shown.  The format must be a string constant, and so must the arguments for
+   any %s conversions, since those are saved as pointers.  Only the last
+   LOGRING entries of each thread are kept.  A thread's ring is made and added
+   to the list of rings (the only use of the log lock) on its first entry.
+   Without thread-local storage (see ATOMIC), there is instead one ring shared
+   by all of the threads, and entries are added to it while possessing the log
+   lock. */
+
+/* maximum arguments and number of records kept per thread */
+#define LOGARGS 4
+#define LOGRING 4096
+
+/* types of log arguments */
+#define LOG_INT 0
+#define LOG_LONG 1
+#define LOG_LLONG 2
+#define LOG_UINT 3
+#define LOG_ULONG 4
+#define LOG_ULLONG 5
+#define LOG_STR 6
+#define LOG_END 7
+
+/* trace log record */
+struct log {
     struct timeval when;    /* time of entry */
-    char *msg;              /* message */
-    struct log *next;       /* next entry */
-} *log_head, **log_tail = NULL;
+    char *fmt;              /* format of message */
+    union {
+        long long i;
+        unsigned long long u;
+        char *s;
+    } arg[LOGARGS];         /* arguments for the format */
+};
+
+/* trace log ring for one thread */
+local struct ring {
+    struct log rec[LOGRING];    /* records, the oldest overwritten first */
+    unsigned long next;         /* number of records added */
+    unsigned long shown;        /* number of records shown or skipped */
+    struct ring *link;          /* next ring in the list */
+} *log_rings, **log_tail = NULL;
+local unsigned long log_gen = 0;        /* incremented by log_init() */
+local MINE struct ring *log_mine;       /* this thread's ring */
+local MINE unsigned long log_mine_gen;  /* log_gen when log_mine made */
 #ifndef NOTHREAD
   local lock *log_lock = NULL;
+#  ifndef ATOMIC
+#    define LOG_SHARED                  /* log_mine is for all threads */
+#  endif
 #endif
 
 /* maximum log entry length */
@@ -690,92 +921,230 @@ local void log_init(void)
         mem_track.max = 0;
 #ifndef NOTHREAD
         mem_track.lock = new_lock(0);
+        label_lock(mem_track.lock, "mem_track", NULL);
         yarn_mem(yarn_malloc, yarn_free);
         log_lock = new_lock(0);
+        label_lock(log_lock, "log_lock", NULL);
 #endif
-        log_head = NULL;
-        log_tail = &log_head;
+        log_rings = NULL;
+        log_tail = &log_rings;
+        log_gen++;
     }
 }
 
+/* return the type of the conversion at or after *fmt, advancing *fmt past it,
+   and copy the conversion specification to spec (of size MAXMSG), or return
+   LOG_END if there are no more conversions -- %% is skipped */
+local int log_conv(char **fmt, char *spec)
+{
+    char *p = *fmt, *end;
+    int len;
+
+    for (;;) {
+        while (*p && *p != '%')
+            p++;
+        if (*p == 0) {
+            *fmt = p;
+            return LOG_END;
+        }
+        if (p[1] != '%')
+            break;
+        p += 2;
+    }
+    end = p + 1;
+    while (*end && strchr("diouxXsc", *end) == NULL)
+        end++;
+    if (*end == 0 || end - p >= MAXMSG) {
+        *fmt = end;
+        return LOG_END;
+    }
+    memcpy(spec, p, end - p + 1);
+    spec[end - p + 1] = 0;
+    *fmt = end + 1;
+    len = end[-1] != 'l' ? 0 : end[-2] == 'l' ? 2 : 1;
+    if (*end == 's')
+        return LOG_STR;
+    if (*end == 'd' || *end == 'i' || *end == 'c')
+        return LOG_INT + len;
+    return LOG_UINT + len;
+}
+
 /* add entry to trace log */
 local void log_add(char *fmt, ...)
 {
-    struct timeval now;
-    struct log *me;
+    struct ring *me;
+    struct log *rec;
+    char *p, spec[MAXMSG];
+    int n;
     va_list ap;
-    char msg[MAXMSG];
 
-    gettimeofday(&now, NULL);
-    me = alloc(NULL, sizeof(struct log));
-    me->when = now;
-    va_start(ap, fmt);
-    vsnprintf(msg, MAXMSG, fmt, ap);
-    va_end(ap);
-    me->msg = alloc(NULL, strlen(msg) + 1);
-    strcpy(me->msg, msg);
-    me->next = NULL;
-#ifndef NOTHREAD
+    /* get this thread's ring, making it the first time */
+#ifdef LOG_SHARED
     assert(log_lock != NULL);
     possess(log_lock);
 #endif
-    *log_tail = me;
-    log_tail = &(me->next);
-#ifndef NOTHREAD
-    twist(log_lock, BY, +1);
+    me = log_mine;
+    if (me == NULL || log_mine_gen != log_gen) {
+        me = alloc(NULL, sizeof(struct ring));
+        me->next = 0;
+        me->shown = 0;
+        me->link = NULL;
+#if !defined(NOTHREAD) && !defined(LOG_SHARED)
+        assert(log_lock != NULL);
+        possess(log_lock);
+#endif
+        *log_tail = me;
+        log_tail = &(me->link);
+#if !defined(NOTHREAD) && !defined(LOG_SHARED)
+        twist(log_lock, BY, +1);
+#endif
+        log_mine = me;
+        log_mine_gen = log_gen;
+    }
+
+    /* fill the next record */
+    rec = me->rec + me->next % LOGRING;
+    gettimeofday(&rec->when, NULL);
+    rec->fmt = fmt;
+    p = fmt;
+    va_start(ap, fmt);
+    for (n = 0; n < LOGARGS; n++)
+        switch (log_conv(&p, spec)) {
+        case LOG_INT:
+            rec->arg[n].i = va_arg(ap, int);
+            break;
+        case LOG_LONG:
+            rec->arg[n].i = va_arg(ap, long);
+            break;
+        case LOG_LLONG:
+            rec->arg[n].i = va_arg(ap, long long);
+            break;
+        case LOG_UINT:
+            rec->arg[n].u = va_arg(ap, unsigned);
+            break;
+        case LOG_ULONG:
+            rec->arg[n].u = va_arg(ap, unsigned long);
+            break;
+        case LOG_ULLONG:
+            rec->arg[n].u = va_arg(ap, unsigned long long);
+            break;
+        case LOG_STR:
+            rec->arg[n].s = va_arg(ap, char *);
+            break;
+        default:
+            n = LOGARGS;
+        }
+    va_end(ap);
+    me->next++;
+#ifdef LOG_SHARED
+    release(log_lock);
 #endif
 }
 
-/* pull entry from trace log and print it, return false if empty */
+/* format the message of rec into msg[MAXMSG] */
+local void log_format(struct log *rec, char *msg)
+{
+    char *p, spec[MAXMSG];
+    size_t have = 0;
+    int n = 0;
+
+    p = rec->fmt;
+    while (*p && have < MAXMSG - 1) {
+        /* copy text, with %% as % */
+        if (*p != '%' || p[1] == '%') {
+            msg[have++] = *p;
+            p += *p == '%' ? 2 : 1;
+            continue;
+        }
+
+        /* convert the next argument */
+        switch (n < LOGARGS ? log_conv(&p, spec) : LOG_END) {
+        case LOG_INT:
+            snprintf(msg + have, MAXMSG - have, spec, (int)rec->arg[n].i);
+            break;
+        case LOG_LONG:
+            snprintf(msg + have, MAXMSG - have, spec, (long)rec->arg[n].i);
+            break;
+        case LOG_LLONG:
+            snprintf(msg + have, MAXMSG - have, spec, rec->arg[n].i);
+            break;
+        case LOG_UINT:
+            snprintf(msg + have, MAXMSG - have, spec,
+                     (unsigned)rec->arg[n].u);
+            break;
+        case LOG_ULONG:
+            snprintf(msg + have, MAXMSG - have, spec,
+                     (unsigned long)rec->arg[n].u);
+            break;
+        case LOG_ULLONG:
+            snprintf(msg + have, MAXMSG - have, spec, rec->arg[n].u);
+            break;
+        case LOG_STR:
+            snprintf(msg + have, MAXMSG - have, spec, rec->arg[n].s);
+            break;
+        default:
+            p = "";
+        }
+        have += strlen(msg + have);
+        n++;
+    }
+    msg[have] = 0;
+}
+
+/* pull the earliest entry from the trace log rings and print it, return false
+   if empty */
 local int log_show(void)
 {
-    struct log *me;
+    struct ring *me, *min;
+    struct log *rec;
     struct timeval diff;
+    char msg[MAXMSG];
 
     if (log_tail == NULL)
         return 0;
-#ifndef NOTHREAD
-    possess(log_lock);
-#endif
-    me = log_head;
-    if (me == NULL) {
-#ifndef NOTHREAD
-        release(log_lock);
-#endif
-        return 0;
+
+    /* find the ring with the earliest unshown entry, noting lost entries */
+    min = NULL;
+    for (me = log_rings; me != NULL; me = me->link) {
+        if (me->next - me->shown > LOGRING) {
+            fprintf(stderr, "trace (%lu entries lost)\n",
+                    me->next - me->shown - LOGRING);
+            me->shown = me->next - LOGRING;
+        }
+        if (me->shown < me->next &&
+            (min == NULL ||
+             timercmp(&me->rec[me->shown % LOGRING].when,
+                      &min->rec[min->shown % LOGRING].when, <)))
+            min = me;
     }
-    log_head = me->next;
-    if (me->next == NULL)
-        log_tail = &log_head;
-#ifndef NOTHREAD
-    twist(log_lock, BY, -1);
-#endif
-    diff.tv_usec = me->when.tv_usec - start.tv_usec;
-    diff.tv_sec = me->when.tv_sec - start.tv_sec;
+    if (min == NULL)
+        return 0;
+    rec = min->rec + min->shown++ % LOGRING;
+
+    diff.tv_usec = rec->when.tv_usec - start.tv_usec;
+    diff.tv_sec = rec->when.tv_sec - start.tv_sec;
     if (diff.tv_usec < 0) {
         diff.tv_usec += 1000000L;
         diff.tv_sec--;
     }
+    log_format(rec, msg);
     fprintf(stderr, "trace %ld.%06ld %s\n",
-            (long)diff.tv_sec, (long)diff.tv_usec, me->msg);
+            (long)diff.tv_sec, (long)diff.tv_usec, msg);
     fflush(stderr);
-    FREE(me->msg);
-    FREE(me);
     return 1;
 }
 
 /* release log resources (need to do log_init() to use again) */
 local void log_free(void)
 {
-    struct log *me;
+    struct ring *me;
 
     if (log_tail != NULL) {
 #ifndef NOTHREAD
         possess(log_lock);
 #endif
-        while ((me = log_head) != NULL) {
-            log_head = me->next;
-            FREE(me->msg);
+        while ((me = log_rings) != NULL) {
+            log_rings = me->link;
             FREE(me);
         }
 #ifndef NOTHREAD
@@ -826,7 +1195,7 @@ local void cut_short(int sig)
     if (sig == SIGINT) {
         Trace(("termination by user"));
     }
-    if (g.outd != -1 && g.outd != 1) {
+    if (g.outd != -1 && g.outd != 1 && !g.resume) {
         unlink(g.outf);
         RELEASE(g.outf);
         g.outd = -1;
@@ -835,10 +1204,15 @@ local void cut_short(int sig)
     _exit(sig < 0 ? -sig : ECANCELED);
 }
 
+/* function to call before ending the process on an error, or NULL */
+local void (*on_abort)(void) = NULL;
+
 /* common code for catch block of top routine in the thread */
 #define THREADABORT(ball) \
     do { \
         complain("abort: %s", (ball).why); \
+        if (on_abort != NULL) \
+            on_abort(); \
         drop(ball); \
         cut_short(-(ball).code); \
     } while (0)
@@ -896,7 +1270,8 @@ local inline size_t vstrcpy(char **str, size_t *size, size_t off, void *cpy)
     return vmemcpy(str, size, off, cpy, strlen(cpy) + 1);
 }
 
-/* read up to len bytes into buf, repeating read() calls as needed */
+/* read up to len bytes into buf, repeating read() calls as needed (or g.get()
+   calls if desc is IOFUNC) */
 local size_t readn(int desc, unsigned char *buf, size_t len)
 {
     ssize_t ret;
@@ -904,7 +1279,7 @@ local size_t readn(int desc, unsigned char *buf, size_t len)
 
     got = 0;
     while (len) {
-        ret = read(desc, buf, len);
+        ret = desc == IOFUNC ? g.get(g.io, buf, len) : read(desc, buf, len);
         if (ret < 0)
             throw(errno, "read error on %s (%s)", g.inf, strerror(errno));
         if (ret == 0)
@@ -916,13 +1291,20 @@ local size_t readn(int desc, unsigned char *buf, size_t len)
     return got;
 }
 
-/* write len bytes, repeating write() calls as needed */
+/* write len bytes, repeating write() calls as needed (or g.put() calls if desc
+   is IOFUNC) -- when serving as a daemon, a write error is saved in g.werr
+   instead of thrown, and the rest of the output is discarded, so that an error
+   in a write thread ends the request instead of the daemon */
 local void writen(int desc, unsigned char *buf, size_t len)
 {
     ssize_t ret;
 
-    while (len) {
-        ret = write(desc, buf, len);
+    while (len && !g.werr) {
+        ret = desc == IOFUNC ? g.put(g.io, buf, len) : write(desc, buf, len);
+        if (ret < 1 && g.daemon) {
+            g.werr = ret < 0 ? errno : EIO;
+            break;
+        }
         if (ret < 1)
             throw(errno, "write error on %s (%s)", g.outf, strerror(errno));
         buf += ret;
@@ -956,13 +1338,35 @@ local unsigned long time2dos(time_t t)
 #define PUT4L(a,b) (PUT2L(a,(b)&0xffff),PUT2L((a)+2,(b)>>16))
 #define PUT4M(a,b) (*(a)=(b)>>24,(a)[1]=(b)>>16,(a)[2]=(b)>>8,(a)[3]=(b))
 
-/* write a gzip, zlib, or zip header using the information in the globals */
-local unsigned long put_header(void)
+/* pull LSB order or MSB order integers from an unsigned char buffer */
+#define PULL2L(p) ((p)[0] + ((unsigned)((p)[1]) << 8))
+#define PULL4L(p) (PULL2L(p) + ((unsigned long)(PULL2L((p) + 2)) << 16))
+#define PULL2M(p) (((unsigned)((p)[0]) << 8) + (p)[1])
+#define PULL4M(p) (((unsigned long)(PULL2M(p)) << 16) + PULL2M((p) + 2))
+
+/* hook to copy the compressed output, set while --tee destinations are open */
+local void (*out_tee)(unsigned char *, size_t) = NULL;
+
+/* false while writing a header or trailer for the --also destinations only */
+local int out_main = 1;
+
+/* write len bytes of compressed output to g.outd, and to out_tee() if set */
+local void outn(unsigned char *buf, size_t len)
+{
+    if (out_main)
+        writen(g.outd, buf, len);
+    if (out_tee != NULL)
+        out_tee(buf, len);
+}
+
+/* write a gzip, zlib, or zip header for the format form (as for g.form) using
+   the information in the globals */
+local unsigned long put_header(int form)
 {
     unsigned long len;
     unsigned char head[30];
 
-    if (g.form > 1) {               /* zip */
+    if (form > 1) {                 /* zip */
         /* write local header */
         PUT4L(head, 0x04034b50UL);  /* local header signature */
         PUT2L(head + 4, 20);        /* version needed to extract (2.0) */
@@ -975,14 +1379,14 @@ local unsigned long put_header(void)
         PUT2L(head + 26, g.name == NULL ? 1 :   /* length of name */
                                           strlen(g.name));
         PUT2L(head + 28, 9);        /* length of extra field (see below) */
-        writen(g.outd, head, 30);   /* write local header */
+        outn(head, 30);             /* write local header */
         len = 30;
 
         /* write file name (use "-" for stdin) */
         if (g.name == NULL)
-            writen(g.outd, (unsigned char *)"-", 1);
+            outn((unsigned char *)"-", 1);
         else
-            writen(g.outd, (unsigned char *)g.name, strlen(g.name));
+            outn((unsigned char *)g.name, strlen(g.name));
         len += g.name == NULL ? 1 : strlen(g.name);
 
         /* write extended timestamp extra field block (9 bytes) */
@@ -990,17 +1394,17 @@ local unsigned long put_header(void)
         PUT2L(head + 2, 5);         /* number of data bytes in this block */
         head[4] = 1;                /* flag presence of mod time */
         PUT4L(head + 5, g.mtime);   /* mod time */
-        writen(g.outd, head, 9);    /* write extra field block */
+        outn(head, 9);              /* write extra field block */
         len += 9;
     }
-    else if (g.form) {              /* zlib */
+    else if (form) {                /* zlib */
         head[0] = 0x78;             /* deflate, 32K window */
         head[1] = (g.level >= 9 ? 3 :
                    (g.level == 1 ? 0 :
                     (g.level >= 6 || g.level == Z_DEFAULT_COMPRESSION ?
                         1 : 2))) << 6;
         head[1] += 31 - (((head[0] << 8) + head[1]) % 31);
-        writen(g.outd, head, 2);
+        outn(head, 2);
         len = 2;
     }
     else {                          /* gzip */
@@ -1011,23 +1415,26 @@ local unsigned long put_header(void)
         PUT4L(head + 4, g.mtime);
         head[8] = g.level >= 9 ? 2 : (g.level == 1 ? 4 : 0);
         head[9] = 3;                /* unix */
-        writen(g.outd, head, 10);
+        outn(head, 10);
         len = 10;
         if (g.name != NULL)
-            writen(g.outd, (unsigned char *)g.name, strlen(g.name) + 1);
+            outn((unsigned char *)g.name, strlen(g.name) + 1);
         if (g.name != NULL)
             len += strlen(g.name) + 1;
     }
     return len;
 }
 
-/* write a gzip, zlib, or zip trailer */
-local void put_trailer(unsigned long ulen, unsigned long clen,
-                       unsigned long check, unsigned long head)
+/* write a gzip, zlib, or zip trailer for the format form, return the trailer
+   length */
+local unsigned long put_trailer(unsigned long ulen, unsigned long clen,
+                                unsigned long check, unsigned long head,
+                                int form)
 {
+    unsigned long len;
     unsigned char tail[46];
 
-    if (g.form > 1) {               /* zip */
+    if (form > 1) {                 /* zip */
         unsigned long cent;
 
         /* write data descriptor (as promised in local header) */
@@ -1035,7 +1442,7 @@ local void put_trailer(unsigned long ulen, unsigned long clen,
         PUT4L(tail + 4, check);
         PUT4L(tail + 8, clen);
         PUT4L(tail + 12, ulen);
-        writen(g.outd, tail, 16);
+        outn(tail, 16);
 
         /* write central file header */
         PUT4L(tail, 0x02014b50UL);  /* central header signature */
@@ -1056,14 +1463,14 @@ local void put_trailer(unsigned long ulen, unsigned long clen,
         PUT2L(tail + 36, 0);        /* internal file attributes */
         PUT4L(tail + 38, 0);        /* external file attributes (ignored) */
         PUT4L(tail + 42, 0);        /* offset of local header */
-        writen(g.outd, tail, 46);   /* write central file header */
+        outn(tail, 46);             /* write central file header */
         cent = 46;
 
         /* write file name (use "-" for stdin) */
         if (g.name == NULL)
-            writen(g.outd, (unsigned char *)"-", 1);
+            outn((unsigned char *)"-", 1);
         else
-            writen(g.outd, (unsigned char *)g.name, strlen(g.name));
+            outn((unsigned char *)g.name, strlen(g.name));
         cent += g.name == NULL ? 1 : strlen(g.name);
 
         /* write extended timestamp extra field block (9 bytes) */
@@ -1071,7 +1478,7 @@ local void put_trailer(unsigned long ulen, unsigned long clen,
         PUT2L(tail + 2, 5);         /* number of data bytes in this block */
         tail[4] = 1;                /* flag presence of mod time */
         PUT4L(tail + 5, g.mtime);   /* mod time */
-        writen(g.outd, tail, 9);    /* write extra field block */
+        outn(tail, 9);              /* write extra field block */
         cent += 9;
 
         /* write end of central directory record */
@@ -1083,25 +1490,313 @@ local void put_trailer(unsigned long ulen, unsigned long clen,
         PUT4L(tail + 12, cent);     /* size of central directory */
         PUT4L(tail + 16, head + clen + 16); /* offset of central directory */
         PUT2L(tail + 20, 0);        /* no zip file comment */
-        writen(g.outd, tail, 22);   /* write end of central directory record */
+        outn(tail, 22);             /* write end of central directory record */
+        len = 16 + cent + 22;
     }
-    else if (g.form) {              /* zlib */
+    else if (form) {                /* zlib */
         PUT4M(tail, check);
-        writen(g.outd, tail, 4);
+        outn(tail, 4);
+        len = 4;
     }
     else {                          /* gzip */
         PUT4L(tail, check);
         PUT4L(tail + 4, ulen);
-        writen(g.outd, tail, 8);
+        outn(tail, 8);
+        len = 8;
     }
+    return len;
 }
 
 /* compute check value depending on format */
 #define CHECK(a,b,c) (g.form == 1 ? adler32(a,b,c) : crc32(a,b,c))
 
+/* -- following a growing input file -- */
+
+/* With --follow, reaching the end of a regular input file does not end the
+   input.  Instead pigz waits for the file to grow, using inotify where
+   available, or else checking every FOLLOWPOLL milliseconds.  The input ends
+   when the file is rotated (the name now refers to a different file or to
+   none), or when it is truncated.  After a rotation, what was appended to the
+   file before the rotation is read first.  The input file is not deleted,
+   since its name may now be someone else's.
+
+   When compressing, the input read so far is flushed after the
+   --flush-interval, or FOLLOWINT milliseconds if that isn't given, so that the
+   output can be decompressed up to there as it is written, and SIGINT or
+   SIGTERM also end the input, completing the compressed stream with its
+   trailer.  When decompressing, inflate() is used instead of inflateBack() so
+   that the output is written as soon as it can be decoded, and the input ends
+   after the first complete gzip or zlib stream, whose trailer is checked as
+   usual -- that is when the writer is done. */
+
+#define FOLLOWPOLL 250          /* milliseconds between checks of the file */
+#define FOLLOWINT 1000          /* default milliseconds to hold input */
+
+/* follow state */
+local struct {
+    int on;                     /* true if following this input */
+    int watch;                  /* inotify descriptor, or -1 to poll */
+    int ended;                  /* true if the input will not grow any more */
+    int sigs;                   /* true if SIGINT and SIGTERM are caught */
+    volatile sig_atomic_t stop; /* set by a signal to end the input */
+    void (*intr)(int);          /* SIGINT handler to restore */
+    void (*term)(int);          /* SIGTERM handler to restore */
+} flw = {0, -1, 0, 0, 0, NULL, NULL};
+
+/* end the followed input at the next read on a signal */
+local void flw_stop(int sig)
+{
+    (void)sig;
+    flw.stop = 1;
+}
+
+/* stop following the input */
+local void flw_close(void)
+{
+    if (flw.sigs) {
+        signal(SIGINT, flw.intr);
+        signal(SIGTERM, flw.term);
+        flw.sigs = 0;
+    }
+    if (flw.watch != -1) {
+        close(flw.watch);
+        flw.watch = -1;
+    }
+    flw.on = 0;
+}
+
+/* start following the input if requested and it's a regular file */
+local void flw_open(void)
+{
+    struct stat st;
+
+    flw_close();
+    flw.on = g.follow && g.ind != IOFUNC && fstat(g.ind, &st) == 0 &&
+             S_ISREG(st.st_mode);
+    if (!flw.on)
+        return;
+    flw.ended = 0;
+    flw.stop = 0;
+#ifdef __linux__
+    if (g.ind != 0) {
+        flw.watch = inotify_init();
+        if (flw.watch != -1 &&
+            inotify_add_watch(flw.watch, g.inf, IN_MODIFY | IN_ATTRIB |
+                              IN_MOVE_SELF | IN_DELETE_SELF) == -1) {
+            close(flw.watch);
+            flw.watch = -1;
+        }
+    }
+#endif
+    if (!g.decode) {
+        flw.intr = signal(SIGINT, flw_stop);
+        flw.term = signal(SIGTERM, flw_stop);
+        flw.sigs = 1;
+    }
+}
+
+/* at the end of the followed input, wait up to ms milliseconds for it to grow
+   -- return true to read again, false if the input has ended */
+local int flw_wait(long ms)
+{
+    struct stat st, now;
+    struct pollfd fds;
+    char events[4096];
+
+    if (flw.ended || flw.stop)
+        return 0;
+
+    /* wait for a change to the file, or the time to check it */
+    if (ms > FOLLOWPOLL)
+        ms = FOLLOWPOLL;
+    if (flw.watch != -1) {
+        fds.fd = flw.watch;
+        fds.events = POLLIN;
+        if (poll(&fds, 1, (int)ms) > 0)
+            (void)!read(flw.watch, events, sizeof(events));
+    }
+    else
+        (void)poll(NULL, 0, (int)ms);
+    if (flw.stop)
+        return 0;
+
+    /* end the input after one more read if it was rotated or truncated */
+    if (fstat(g.ind, &st) == 0 &&
+        (st.st_size < lseek(g.ind, 0, SEEK_CUR) ||
+         (g.ind != 0 && (stat(g.inf, &now) || now.st_ino != st.st_ino ||
+                         now.st_dev != st.st_dev))))
+        flw.ended = 1;
+    return 1;
+}
+
+/* read up to len bytes of a followed input into buf, returning as soon as
+   there is some, waiting at the end of the file for more -- return zero when
+   the input has ended */
+local size_t readf(unsigned char *buf, size_t len)
+{
+    ssize_t ret;
+
+    for (;;) {
+        ret = read(g.ind, buf, len);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            throw(errno, "read error on %s (%s)", g.inf, strerror(errno));
+        if (ret > 0 || !flw_wait(FOLLOWPOLL))
+            return (size_t)ret;
+    }
+}
+
+/* return the time of day in seconds */
+local double seconds(void)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return now.tv_sec + now.tv_usec / 1e6;
+}
+
+/* write the len bytes at str to out escaped for a JSON string (without the
+   quotes) */
+local void json_str(FILE *out, char *str, size_t len)
+{
+    int ch;
+
+    while (len--) {
+        ch = *(unsigned char *)str++;
+        if (ch == '"' || ch == '\\')
+            fprintf(out, "\\%c", ch);
+        else if (ch < 0x20)
+            fprintf(out, "\\u%04x", ch);
+        else
+            putc(ch, out);
+    }
+}
+
 #ifndef NOTHREAD
 /* -- threaded portions of pigz -- */
 
+/* -- SHA-256 message digest (FIPS 180-4) for content keys -- */
+
+/* digest state */
+typedef struct {
+    uint32_t state[8];          /* intermediate hash value */
+    uint64_t count;             /* number of bytes processed so far */
+    unsigned char buf[64];      /* pending partial block */
+} sha256_t;
+
+local const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+#define ROR32(x,n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/* process one 64-byte block */
+local void sha256_block(sha256_t *sha, const unsigned char *p)
+{
+    int n;
+    uint32_t w[64], v[8], t1, t2;
+
+    for (n = 0; n < 16; n++, p += 4)
+        w[n] = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+               ((uint32_t)p[2] << 8) | p[3];
+    for (; n < 64; n++)
+        w[n] = w[n - 16] + w[n - 7] +
+               (ROR32(w[n - 15], 7) ^ ROR32(w[n - 15], 18) ^
+                (w[n - 15] >> 3)) +
+               (ROR32(w[n - 2], 17) ^ ROR32(w[n - 2], 19) ^ (w[n - 2] >> 10));
+    memcpy(v, sha->state, sizeof(v));
+    for (n = 0; n < 64; n++) {
+        t1 = v[7] + (ROR32(v[4], 6) ^ ROR32(v[4], 11) ^ ROR32(v[4], 25)) +
+             ((v[4] & v[5]) ^ (~v[4] & v[6])) + sha256_k[n] + w[n];
+        t2 = (ROR32(v[0], 2) ^ ROR32(v[0], 13) ^ ROR32(v[0], 22)) +
+             ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+        v[7] = v[6];
+        v[6] = v[5];
+        v[5] = v[4];
+        v[4] = v[3] + t1;
+        v[3] = v[2];
+        v[2] = v[1];
+        v[1] = v[0];
+        v[0] = t1 + t2;
+    }
+    for (n = 0; n < 8; n++)
+        sha->state[n] += v[n];
+}
+
+/* initialize a digest */
+local void sha256_init(sha256_t *sha)
+{
+    sha->state[0] = 0x6a09e667;
+    sha->state[1] = 0xbb67ae85;
+    sha->state[2] = 0x3c6ef372;
+    sha->state[3] = 0xa54ff53a;
+    sha->state[4] = 0x510e527f;
+    sha->state[5] = 0x9b05688c;
+    sha->state[6] = 0x1f83d9ab;
+    sha->state[7] = 0x5be0cd19;
+    sha->count = 0;
+}
+
+/* add len bytes at buf to the digest */
+local void sha256_update(sha256_t *sha, const void *buf, size_t len)
+{
+    size_t have, fill;
+    const unsigned char *next = buf;
+
+    have = (size_t)(sha->count & 63);
+    sha->count += len;
+    if (have) {
+        fill = 64 - have;
+        if (len < fill) {
+            memcpy(sha->buf + have, next, len);
+            return;
+        }
+        memcpy(sha->buf + have, next, fill);
+        sha256_block(sha, sha->buf);
+        next += fill;
+        len -= fill;
+    }
+    while (len >= 64) {
+        sha256_block(sha, next);
+        next += 64;
+        len -= 64;
+    }
+    memcpy(sha->buf, next, len);
+}
+
+/* complete the digest and return the 32-byte result in dig[] */
+local void sha256_final(sha256_t *sha, unsigned char *dig)
+{
+    int n;
+    size_t have;
+    uint64_t bits;
+
+    bits = sha->count << 3;
+    have = (size_t)(sha->count & 63);
+    sha->buf[have++] = 0x80;
+    if (have > 56) {
+        memset(sha->buf + have, 0, 64 - have);
+        sha256_block(sha, sha->buf);
+        have = 0;
+    }
+    memset(sha->buf + have, 0, 56 - have);
+    for (n = 0; n < 8; n++)
+        sha->buf[56 + n] = (unsigned char)(bits >> (56 - (n << 3)));
+    sha256_block(sha, sha->buf);
+    for (n = 0; n < 32; n++)
+        dig[n] = (unsigned char)(sha->state[n >> 2] >> (24 - ((n & 3) << 3)));
+}
+
 /* -- check value combination routines for parallel calculation -- */
 
 #define COMB(a,b,c) (g.form == 1 ? adler32_comb(a,b,c) : crc32_comb(a,b,c))
@@ -1209,46 +1904,616 @@ local unsigned long adler32_comb(unsigned long adler1, unsigned long adler2,
     return sum1 | (sum2 << 16);
 }
 
-/* -- pool of spaces for buffer management -- */
+/* -- pipeline statistics and timeline trace -- */
+
+/* With --stats, the time spent working in each stage of the pipeline, and the
+   time spent waiting on each of the yarn locks that connect the stages, are
+   accumulated over all of the files, along with the bytes in and out, the
+   number of compression jobs and their latency from being read to being
+   written, and the CPU time from getrusage().  A summary is written to stderr
+   at exit, naming as the bottleneck the stage that was busy for the largest
+   fraction of the time available to its threads.  For decompression, the
+   inflate stage is the time in infchk() not spent in the other stages or
+   waiting for them.
+
+   With --trace-json file, the same work and wait intervals are written to file
+   as they end, as complete events in the Chrome Trace Event format, for
+   viewing in Perfetto or chrome://tracing.  Each thread is given a track,
+   named after the stage of its first work, and the compression work events
+   have the job sequence number as an argument.  The inflate events on the
+   main thread enclose the read and wait events done within them.
+
+   With --perf, each thread also reads its own group of performance counters
+   from perf_event_open() at the start and end of each work interval, and adds
+   the differences to its stage: the CPU cycles, instructions, cache misses,
+   and branch misses in user mode, or if the hardware counters are not
+   available, the task clock.  The summary then has the instructions per cycle
+   and the misses per uncompressed byte of each stage.  At -11 the zopfli
+   compression is all within the compress stage.  The counters between the
+   stages on the main thread while decompressing are added to inflate. */
+
+/* stages */
+#define S_READ 0
+#define S_COMPRESS 1
+#define S_CHECK 2
+#define S_WRITE 3
+#define S_INFLATE 4
+#define STAGES 5
+local char *stage_name[] = {"read", "compress", "check", "write", "inflate"};
+
+/* where waits are done: the lock, the stage that waits on it, and whether
+   that is on the main thread (for decompression) */
+#define W_POOL 0
+#define W_COMPRESS 1
+#define W_WRITE 2
+#define W_CALC 3
+#define W_LOAD 4
+#define W_LOAD_MAIN 5
+#define W_OUTB_WRITE 6
+#define W_OUTB_CHECK 7
+#define W_OUTB_MAIN 8
+#define WAITS 9
+local struct {
+    char *lock;
+    int stage;
+    int main;
+} wait_site[] = {
+    {"pool->have", S_READ, 0}, {"compress_have", S_COMPRESS, 0},
+    {"write_first", S_WRITE, 0}, {"job->calc", S_WRITE, 0},
+    {"load_state", S_READ, 0}, {"load_state", S_INFLATE, 1},
+    {"outb_write_more", S_WRITE, 0}, {"outb_check_more", S_CHECK, 0},
+    {"outb_*_more", S_INFLATE, 1}};
+
+/* statistics */
+local struct {
+    int on;                     /* true if collecting statistics */
+    lock *lock;                 /* for updating the statistics */
+    double start;               /* when the collection started */
+    struct rusage use;          /* resource use at the start */
+    double work[STAGES];        /* seconds working in each stage */
+    int threads[STAGES];        /* most threads used for each stage */
+    double wait[WAITS];         /* seconds waiting at each wait site */
+    double main;                /* seconds in stages or waits on main thread */
+    unsigned long jobs;         /* number of compression jobs */
+    double latency;             /* total seconds from read to write of jobs */
+    double most;                /* longest latency */
+    unsigned long long in;      /* bytes in */
+    unsigned long long out;     /* bytes out */
+} stats;
+
+/* performance counters -- the kind is PERF_HW for cycles, instructions, cache
+   misses, and branch misses, or PERF_SW for the task clock in nanoseconds */
+#define PERF_OFF 0
+#define PERF_HW 1
+#define PERF_SW 2
+#define PERFS 4
+local struct {
+    int kind;                   /* kind of counters, or PERF_OFF */
+    uint64_t count[STAGES][PERFS];  /* counts for each stage */
+} perf;
+
+/* this thread's counter descriptors (-1 if none), whether it has tried to open
+   them, the counts at the end of its last interval, and the stage to add the
+   counts between intervals to, or -1 to drop them -- without ATOMIC these
+   would be shared by the threads, so the counters are not used */
+local MINE int perf_fd[PERFS] = {-1, -1, -1, -1};
+local MINE int perf_tried;
+local MINE uint64_t perf_mark[PERFS];
+local MINE int perf_home = -1;
+
+/* open this thread's counters of kind perf.kind, return false on failure */
+local int perf_open(void)
+{
+#ifdef __linux__
+    struct perf_event_attr pe;
+    int k, n;
+    static const uint64_t hw[PERFS] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+
+    perf_tried = 1;
+    n = perf.kind == PERF_HW ? PERFS : 1;
+    for (k = 0; k < n; k++) {
+        memset(&pe, 0, sizeof(pe));
+        pe.size = sizeof(pe);
+        pe.type = perf.kind == PERF_HW ? PERF_TYPE_HARDWARE :
+                                         PERF_TYPE_SOFTWARE;
+        pe.config = perf.kind == PERF_HW ? hw[k] : PERF_COUNT_SW_TASK_CLOCK;
+        pe.exclude_kernel = 1;
+        pe.exclude_hv = 1;
+        pe.read_format = PERF_FORMAT_GROUP;
+        perf_fd[k] = (int)syscall(SYS_perf_event_open, &pe, 0, -1,
+                                  k ? perf_fd[0] : -1, 0);
+        if (perf_fd[k] == -1) {
+            while (k)
+                close(perf_fd[--k]);
+            perf_fd[0] = -1;
+            return 0;
+        }
+    }
+    return 1;
+#else
+    perf_tried = 1;
+    return 0;
+#endif
+}
 
-/* These routines manage a pool of spaces.  Each pool specifies a fixed size
-   buffer to be contained in each space.  Each space has a use count, which
-   when decremented to zero returns the space to the pool.  If a space is
-   requested from the pool and the pool is empty, a space is immediately
-   created unless a specified limit on the number of spaces has been reached.
-   Only if the limit is reached will it wait for a space to be returned to the
-   pool.  Each space knows what pool it belongs to, so that it can be returned.
- */
+/* close this thread's counters (call before the thread returns) */
+local void perf_close(void)
+{
+    int k;
 
-/* a space (one buffer for each space) */
-struct space {
-    lock *use;              /* use count -- return to pool when zero */
-    unsigned char *buf;     /* buffer of size size */
-    size_t size;            /* current size of this buffer */
-    size_t len;             /* for application usage (initially zero) */
-    struct pool *pool;      /* pool to return to */
-    struct space *next;     /* for pool linked list */
-};
+    if (!perf_tried)
+        return;
+    for (k = 0; k < PERFS; k++)
+        if (perf_fd[k] != -1) {
+            close(perf_fd[k]);
+            perf_fd[k] = -1;
+        }
+    perf_tried = 0;
+}
 
-/* pool of spaces (one pool for each type needed) */
-struct pool {
-    lock *have;             /* unused spaces available, lock for list */
-    struct space *head;     /* linked list of available buffers */
-    size_t size;            /* size of new buffers in this pool */
-    int limit;              /* number of new spaces allowed, or -1 */
-    int made;               /* number of buffers made */
-};
+/* choose the kind of counters from what this thread can open */
+local void perf_init(void)
+{
+#ifdef ATOMIC
+    perf.kind = PERF_HW;
+    if (perf_open())
+        return;
+    perf.kind = PERF_SW;
+    if (perf_open()) {
+        complain("warning: no hardware counters -- using the task clock");
+        return;
+    }
+    perf.kind = PERF_OFF;
+    complain("warning: no performance counters available (%s)",
+             strerror(errno));
+#else
+    perf.kind = PERF_OFF;
+    complain("warning: no performance counters without thread-local storage");
+#endif
+}
 
-/* initialize a pool (pool structure itself provided, not allocated) -- the
-   limit is the maximum number of spaces in the pool, or -1 to indicate no
-   limit, i.e., to never wait for a buffer to return to the pool */
-local void new_pool(struct pool *pool, size_t size, int limit)
+/* set the stage to add this thread's counts between stages to */
+local void perf_at(int stage)
 {
-    pool->have = new_lock(0);
-    pool->head = NULL;
-    pool->size = size;
-    pool->limit = limit;
-    pool->made = 0;
+    if (perf.kind != PERF_OFF)
+        perf_home = stage;
+}
+
+/* put the counts since the last mark in diff and mark now -- return false if
+   not counting */
+local int perf_take(uint64_t *diff)
+{
+    uint64_t now[PERFS + 1];
+    int k, n;
+
+    if (perf.kind == PERF_OFF)
+        return 0;
+    if (!perf_tried)
+        perf_open();
+    if (perf_fd[0] == -1)
+        return 0;
+    n = perf.kind == PERF_HW ? PERFS : 1;
+    if (read(perf_fd[0], now, (n + 1) * sizeof(uint64_t)) !=
+        (ssize_t)((n + 1) * sizeof(uint64_t)))
+        return 0;
+    for (k = 0; k < n; k++) {
+        diff[k] = now[k + 1] - perf_mark[k];
+        perf_mark[k] = now[k + 1];
+    }
+    return 1;
+}
+
+/* add the counts since the last mark to stage (if not -1) and mark now */
+local void perf_add(int stage)
+{
+    uint64_t diff[PERFS];
+    int k;
+
+    if (!perf_take(diff) || stage == -1)
+        return;
+    possess(stats.lock);
+    for (k = 0; k < PERFS; k++)
+        perf.count[stage][k] += diff[k];
+    release(stats.lock);
+}
+
+/* timeline trace */
+local struct {
+    FILE *out;                  /* trace file, or NULL if not tracing */
+    char *path;                 /* name of the trace file */
+    lock *lock;                 /* for writing events and naming threads */
+    double start;               /* time zero of the trace */
+    int threads;                /* number of thread tracks */
+    unsigned long events;       /* number of events written */
+    int run;                    /* number of traces started */
+    int named[STAGES];          /* stage tracks named, without ATOMIC */
+} tl;
+
+/* this thread's track in the trace, or 0 if none yet, true if named, and the
+   trace they are for -- without thread-local storage, there is instead a
+   track for each stage */
+#ifdef ATOMIC
+local __thread int tl_tid;
+local __thread int tl_named;
+local __thread int tl_run;
+#endif
+
+/* start writing the trace to path */
+local void trace_open(char *path)
+{
+    tl.out = fopen(path, "w");
+    if (tl.out == NULL)
+        throw(errno, "cannot write %s (%s)", path, strerror(errno));
+    tl.path = path;
+    tl.lock = new_lock(0);
+    label_lock(tl.lock, "tl", "lock");
+    tl.start = seconds();
+    tl.threads = 0;
+    tl.events = 0;
+    tl.run++;
+    memset(tl.named, 0, sizeof(tl.named));
+    fputs("[\n", tl.out);
+}
+
+/* write an event for the interval start..end on this thread, in stage, waiting
+   on the lock name if name is not NULL, for job seq if seq is not -1 */
+local void trace_span(int stage, char *name, double start, double end,
+                      long seq)
+{
+    int tid, *named;
+
+    if (tl.out == NULL)
+        return;
+    possess(tl.lock);
+#ifdef ATOMIC
+    if (tl_run != tl.run) {
+        /* a thread kept from an earlier trace in the daemon */
+        tl_run = tl.run;
+        tl_tid = 0;
+        tl_named = 0;
+    }
+    if (tl_tid == 0)
+        tl_tid = ++tl.threads;
+    tid = tl_tid;
+    named = &tl_named;
+#else
+    tid = stage + 1;
+    named = tl.named + stage;
+#endif
+    if (!*named && name == NULL) {
+        *named = 1;
+        fprintf(tl.out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                "\"tid\":%d,\"args\":{\"name\":\"%s %d\"}}",
+                tl.events++ ? ",\n" : "", tid, stage_name[stage], tid);
+    }
+    fprintf(tl.out, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+            "\"ts\":%.1f,\"dur\":%.1f,\"pid\":1,\"tid\":%d",
+            tl.events++ ? ",\n" : "", name == NULL ? stage_name[stage] : name,
+            name == NULL ? "work" : "wait", 1e6 * (start - tl.start),
+            1e6 * (end - start), tid);
+    if (seq != -1)
+        fprintf(tl.out, ",\"args\":{\"seq\":%ld}", seq);
+    fputs("}", tl.out);
+    release(tl.lock);
+}
+
+/* end the trace and close the trace file */
+local void trace_close(void)
+{
+    int bad;
+
+    if (tl.out == NULL)
+        return;
+    fputs("\n]\n", tl.out);
+    bad = ferror(tl.out);
+    bad |= fclose(tl.out);
+    tl.out = NULL;
+    free_lock(tl.lock);
+    if (bad)
+        throw(EIO, "write error on %s", tl.path);
+}
+
+/* start collecting statistics */
+local void stat_init(void)
+{
+    int k;
+
+    stats.lock = new_lock(0);
+    label_lock(stats.lock, "stats", "lock");
+    stats.start = seconds();
+    getrusage(RUSAGE_SELF, &stats.use);
+    for (k = 0; k < STAGES; k++)
+        stats.threads[k] = 1;
+    stats.on = 1;
+    if (g.perf)
+        perf_init();
+}
+
+/* return the time to pass to stat_work(), or 0 if not collecting or tracing */
+local double stat_start(void)
+{
+    if (!stats.on && tl.out == NULL)
+        return 0;
+    perf_add(perf_home);
+    return seconds();
+}
+
+/* add the time since start to the work of stage for job seq (or -1), and to
+   stats.main if main is true -- return the current time, or 0 if not
+   collecting or tracing */
+local double stat_work(int stage, double start, int main, long seq)
+{
+    double now;
+
+    if (!stats.on && tl.out == NULL)
+        return 0;
+    now = seconds();
+    trace_span(stage, NULL, start, now, seq);
+    if (!stats.on)
+        return now;
+    perf_add(stage);
+    possess(stats.lock);
+    stats.work[stage] += now - start;
+    if (main)
+        stats.main += now - start;
+    release(stats.lock);
+    return now;
+}
+
+/* wait_for() on bolt, adding the time waited to wait site k */
+local void stat_wait(lock *bolt, enum wait_op op, long val, int k)
+{
+    double start, now, took;
+
+    if (!stats.on && tl.out == NULL) {
+        wait_for(bolt, op, val);
+        return;
+    }
+    perf_add(perf_home);
+    start = seconds();
+    wait_for(bolt, op, val);
+    now = seconds();
+    perf_add(-1);
+    trace_span(wait_site[k].stage, wait_site[k].lock, start, now, -1);
+    if (!stats.on)
+        return;
+    took = now - start;
+    possess(stats.lock);
+    stats.wait[k] += took;
+    if (wait_site[k].main)
+        stats.main += took;
+    release(stats.lock);
+}
+
+/* add the time since start to the inflate stage, less the time spent on the
+   main thread in other stages or waiting since stats.main was main */
+local void stat_inflate(double start, double main)
+{
+    double now;
+
+    if (!stats.on && tl.out == NULL)
+        return;
+    now = seconds();
+    trace_span(S_INFLATE, NULL, start, now, -1);
+    if (!stats.on)
+        return;
+    perf_add(S_INFLATE);
+    perf_at(-1);
+    possess(stats.lock);
+    stats.work[S_INFLATE] += now - start - (stats.main - main);
+    release(stats.lock);
+}
+
+/* count bytes in and out, and a compression job made at made if not zero */
+local void stat_data(size_t in, size_t out, double made)
+{
+    double took;
+
+    if (!stats.on)
+        return;
+    took = made ? seconds() - made : 0;
+    possess(stats.lock);
+    stats.in += in;
+    stats.out += out;
+    if (made) {
+        stats.jobs++;
+        stats.latency += took;
+        if (took > stats.most)
+            stats.most = took;
+    }
+    release(stats.lock);
+}
+
+/* return the uncompressed bytes for the per byte counts */
+local double perf_bytes(void)
+{
+    unsigned long long bytes;
+
+    bytes = g.decode ? stats.out : stats.in;
+    return bytes ? (double)bytes : 1;
+}
+
+/* write the performance counts of each stage to stderr */
+local void perf_show(void)
+{
+    int k;
+    uint64_t *c;
+
+    if (perf.kind == PERF_HW)
+        fprintf(stderr, "%-14s %-9s %13s %13s %5s %12s %12s\n", "stage", "",
+                "cycles", "instructions", "IPC", "cache miss/B",
+                "brnch miss/B");
+    else
+        fprintf(stderr, "%-14s %-9s %10s %10s\n", "stage", "", "cpu s",
+                "cpu ns/B");
+    for (k = 0; k < STAGES; k++) {
+        c = perf.count[k];
+        if (c[0] == 0)
+            continue;
+        if (perf.kind == PERF_HW)
+            fprintf(stderr, "%-14s %-9s %13llu %13llu %5.2f %12.4f %12.4f\n",
+                    stage_name[k], "", (unsigned long long)c[0],
+                    (unsigned long long)c[1], (double)c[1] / c[0],
+                    c[2] / perf_bytes(), c[3] / perf_bytes());
+        else
+            fprintf(stderr, "%-14s %-9s %10.3f %10.3f\n", stage_name[k], "",
+                    c[0] / 1e9, c[0] / perf_bytes());
+    }
+}
+
+/* write the statistics summary to stderr as one line of JSON, with the times
+   in seconds and the ratio of compressed to uncompressed bytes */
+local void stat_json(double wall, struct rusage *use)
+{
+    int k, top = -1, any;
+    double util, most = -1;
+    uint64_t *c;
+
+    fprintf(stderr, "{\"elapsed\":%.6f,\"user\":%.6f,\"system\":%.6f,"
+            "\"in\":%llu,\"out\":%llu,\"ratio\":", wall,
+            use->ru_utime.tv_sec - stats.use.ru_utime.tv_sec +
+            (use->ru_utime.tv_usec - stats.use.ru_utime.tv_usec) / 1e6,
+            use->ru_stime.tv_sec - stats.use.ru_stime.tv_sec +
+            (use->ru_stime.tv_usec - stats.use.ru_stime.tv_usec) / 1e6,
+            stats.in, stats.out);
+    if (stats.in && stats.out)
+        fprintf(stderr, "%.4f", g.decode ? (double)stats.in / stats.out :
+                                           (double)stats.out / stats.in);
+    else
+        fputs("null", stderr);
+    fprintf(stderr, ",\"jobs\":%lu,\"latency\":%.6f,\"most\":%.6f,"
+            "\"stages\":[", stats.jobs,
+            stats.jobs ? stats.latency / stats.jobs : 0, stats.most);
+    any = 0;
+    for (k = 0; k < STAGES; k++) {
+        if (stats.work[k] == 0)
+            continue;
+        util = wall > 0 ? stats.work[k] / (wall * stats.threads[k]) : 0;
+        if (util > most) {
+            most = util;
+            top = k;
+        }
+        fprintf(stderr, "%s{\"stage\":\"%s\",\"threads\":%d,\"busy\":%.6f,"
+                "\"util\":%.4f", any++ ? "," : "", stage_name[k],
+                stats.threads[k], stats.work[k], util);
+        c = perf.count[k];
+        if (perf.kind == PERF_HW && c[0])
+            fprintf(stderr, ",\"cycles\":%llu,\"instructions\":%llu,"
+                    "\"ipc\":%.4f,\"cache_misses\":%llu,"
+                    "\"branch_misses\":%llu,\"cache_misses_per_byte\":%.6f,"
+                    "\"branch_misses_per_byte\":%.6f",
+                    (unsigned long long)c[0], (unsigned long long)c[1],
+                    (double)c[1] / c[0], (unsigned long long)c[2],
+                    (unsigned long long)c[3], c[2] / perf_bytes(),
+                    c[3] / perf_bytes());
+        else if (perf.kind == PERF_SW)
+            fprintf(stderr, ",\"cpu\":%.6f", c[0] / 1e9);
+        fputs("}", stderr);
+    }
+    fputs("],\"waits\":[", stderr);
+    any = 0;
+    for (k = 0; k < WAITS; k++)
+        if (stats.wait[k] != 0)
+            fprintf(stderr, "%s{\"lock\":\"%s\",\"waiter\":\"%s\","
+                    "\"seconds\":%.6f}", any++ ? "," : "", wait_site[k].lock,
+                    stage_name[wait_site[k].stage], stats.wait[k]);
+    fprintf(stderr, "],\"bottleneck\":");
+    if (top != -1)
+        fprintf(stderr, "\"%s\"}\n", stage_name[top]);
+    else
+        fputs("null}\n", stderr);
+}
+
+/* write the statistics to stderr, as a table or as one JSON object */
+local void stat_show(void)
+{
+    int k, top = -1;
+    double wall, util, most = -1;
+    struct rusage use;
+
+    if (!stats.on || !g.stats)
+        return;
+    wall = seconds() - stats.start;
+    getrusage(RUSAGE_SELF, &use);
+    if (g.json) {
+        stat_json(wall, &use);
+        return;
+    }
+    fprintf(stderr, "%s: %.3f s elapsed, %.3f s user, %.3f s system\n", g.prog,
+            wall,
+            use.ru_utime.tv_sec - stats.use.ru_utime.tv_sec +
+            (use.ru_utime.tv_usec - stats.use.ru_utime.tv_usec) / 1e6,
+            use.ru_stime.tv_sec - stats.use.ru_stime.tv_sec +
+            (use.ru_stime.tv_usec - stats.use.ru_stime.tv_usec) / 1e6);
+    fprintf(stderr, "%s: %llu bytes in, %llu bytes out",
+            g.prog, stats.in, stats.out);
+    if (stats.jobs)
+        fprintf(stderr, ", %lu jobs, %.3f ms average latency, %.3f ms most",
+                stats.jobs, 1e3 * stats.latency / stats.jobs,
+                1e3 * stats.most);
+    fputs("\n", stderr);
+    fprintf(stderr, "%-14s %-9s %7s %10s %6s\n", "stage", "", "threads",
+            "busy s", "util");
+    for (k = 0; k < STAGES; k++) {
+        if (stats.work[k] == 0)
+            continue;
+        util = wall > 0 ? stats.work[k] / (wall * stats.threads[k]) : 0;
+        if (util > most) {
+            most = util;
+            top = k;
+        }
+        fprintf(stderr, "%-14s %-9s %7d %10.3f %5.1f%%\n", stage_name[k], "",
+                stats.threads[k], stats.work[k], 100 * util);
+    }
+    if (perf.kind != PERF_OFF)
+        perf_show();
+    fprintf(stderr, "%-14s %-9s %7s %10s\n", "lock", "waiter", "", "wait s");
+    for (k = 0; k < WAITS; k++)
+        if (stats.wait[k] != 0)
+            fprintf(stderr, "%-14s %-9s %7s %10.3f\n", wait_site[k].lock,
+                    stage_name[wait_site[k].stage], "", stats.wait[k]);
+    if (top != -1)
+        fprintf(stderr, "%s: bottleneck: %s\n", g.prog, stage_name[top]);
+}
+
+/* stop collecting statistics, and clear them for another run in the daemon */
+local void stat_end(void)
+{
+    if (!stats.on)
+        return;
+    perf_close();
+    free_lock(stats.lock);
+    memset(&stats, 0, sizeof(stats));
+    memset(&perf, 0, sizeof(perf));
+}
+
+/* -- pool of spaces for buffer management -- */
+
+/* These routines manage a pool of spaces.  Each pool specifies a fixed size
+   buffer to be contained in each space.  Each space has a use count, which
+   when decremented to zero returns the space to the pool.  If a space is
+   requested from the pool and the pool is empty, a space is immediately
+   created unless a specified limit on the number of spaces has been reached.
+   Only if the limit is reached will it wait for a space to be returned to the
+   pool.  Each space knows what pool it belongs to, so that it can be returned.
+ */
+
+/* initialize a pool (pool structure itself provided, not allocated) -- the
+   name labels the locks of the pool and its spaces for --lock-stats, and the
+   limit is the maximum number of spaces in the pool, or -1 to indicate no
+   limit, i.e., to never wait for a buffer to return to the pool */
+local void new_pool(struct pool *pool, char *name, size_t size, int limit)
+{
+    pool->name = name;
+    pool->have = new_lock(0);
+    label_lock(pool->have, name, "have");
+    pool->head = NULL;
+    pool->size = size;
+    pool->limit = limit;
+    pool->made = 0;
+    pool->bytes = 0;
 }
 
 /* get a space from a pool -- the use count is initially set to one, so there
@@ -1260,7 +2525,7 @@ local struct space *get_space(struct pool *pool)
     /* if can't create any more, wait for a space to show up */
     possess(pool->have);
     if (pool->limit == 0)
-        wait_for(pool->have, NOT_TO_BE, 0);
+        stat_wait(pool->have, NOT_TO_BE, 0, W_POOL);
 
     /* if a space is available, pull it from the list and return it */
     if (pool->head != NULL) {
@@ -1278,9 +2543,11 @@ local struct space *get_space(struct pool *pool)
     if (pool->limit > 0)
         pool->limit--;
     pool->made++;
+    pool->bytes += pool->size;
     release(pool->have);
     space = alloc(NULL, sizeof(struct space));
     space->use = new_lock(1);           /* initially one user */
+    label_lock(space->use, pool->name, "use");
     space->buf = alloc(NULL, pool->size);
     space->size = pool->size;
     space->len = 0;
@@ -1300,6 +2567,9 @@ local void grow_space(struct space *space)
 
     /* reallocate the buffer */
     space->buf = alloc(space->buf, more);
+    possess(space->pool->have);
+    space->pool->bytes += more - space->size;
+    release(space->pool->have);
     space->size = more;
 }
 
@@ -1354,25 +2624,38 @@ local int free_pool(struct pool *pool)
     return count;
 }
 
-/* input and output buffer pools */
-local struct pool in_pool;
-local struct pool out_pool;
-local struct pool dict_pool;
-local struct pool lens_pool;
-
 /* -- parallel compression -- */
 
 /* compress or write job (passed from compress list to write list) -- if seq is
    equal to -1, compress_thread is instructed to return; if more is false then
    this is the last chunk, which after writing tells write_thread to return */
+#ifdef PIGZ_LIB
+/* a batch of independent buffers for the library, each compressed or
+   decompressed whole by one compress thread with work() */
+struct job;
+struct batch {
+    pigz_batch *items;          /* the buffers and their results */
+    lock *left;                 /* number of buffers not done yet */
+    void (*work)(struct job *, z_stream *, void **);    /* do one buffer */
+};
+#endif
+
 struct job {
-    long seq;                   /* sequence number */
+    long seq;                   /* sequence number (item number for batch) */
     int more;                   /* true if this is not the last chunk */
     struct space *in;           /* input data to compress */
     struct space *out;          /* dictionary or resulting compressed data */
     struct space *lens;         /* coded list of flush block lengths */
     unsigned long check;        /* check value for input data */
     lock *calc;                 /* released when check calculation complete */
+    unsigned char key[32];      /* content key for --index and --reuse */
+    int reused;                 /* true if out was copied from old output */
+    struct globals *ctx;        /* stream this job belongs to */
+    double made;                /* when the input was read, for --stats */
+#ifdef PIGZ_LIB
+    struct batch *batch;        /* batch this job belongs to, or NULL */
+    int fail;                   /* error compressing this job, or 0 */
+#endif
     struct job *next;           /* next job in the list (either list) */
 };
 
@@ -1380,37 +2663,271 @@ struct job {
 local lock *compress_have = NULL;   /* number of compress jobs waiting */
 local struct job *compress_head, **compress_tail;
 
-/* list of write jobs */
-local lock *write_first;            /* lowest sequence number in list */
-local struct job *write_head;
-
-/* number of compression threads running */
+/* number of compression threads running -- changed with ATOM_ADD() and
+   ATOM_SET(), since --metrics-file reads it from another thread */
 local int cthreads = 0;
 
-/* write thread if running */
-local thread *writeth = NULL;
+/* set up the compress list shared by all streams, only once */
+local void setup_compress(void)
+{
+    if (compress_have == NULL) {
+        compress_have = new_lock(0);
+        label_lock(compress_have, "compress_have", NULL);
+        compress_head = NULL;
+        compress_tail = &compress_head;
+    }
+}
+
+/* -- metrics file for monitoring -- */
+
+/* With --metrics-file path, the totals of the bytes in and out, the inputs
+   opened and skipped, the busy seconds of each pipeline stage, the most spaces
+   and buffer bytes of each pool, and the number of compression threads are
+   written to path in the Prometheus text format every METRICSINT seconds and
+   at exit, for the node_exporter textfile collector.  Each write is to path
+   with ".tmp" appended, then renamed to path, so that a reader never sees a
+   partial file.  The bytes and stage times are from the --stats collection,
+   which --metrics-file turns on. */
+
+#define METRICSINT 10.0
+#define POOLS 4
+
+local struct {
+    char *path;                 /* metrics file, or NULL if not writing */
+    char *temp;                 /* name to write to before renaming to path */
+    lock *lock;                 /* for writing and for the pool values */
+    thread *th;                 /* periodic writing thread */
+    int stop;                   /* set to stop the thread */
+    int aborted;                /* set by the first met_abort() */
+    int warned;                 /* true if a failed write was reported */
+    int pools;                  /* true if the pools exist */
+    int made[POOLS];            /* most spaces made by each pool */
+    size_t bytes[POOLS];        /* most buffer bytes of each pool */
+} met;
+
+/* pool labels for the metrics, in the order of met.made[] */
+local char *met_pool[POOLS] = {"in", "out", "dict", "lens"};
+
+/* update the most spaces and bytes from the pools if they exist -- met.lock
+   must be possessed */
+local void met_snap(void)
+{
+    struct pool *pool[POOLS];
+    int k;
+
+    if (!met.pools)
+        return;
+    pool[0] = &g.in_pool;
+    pool[1] = &g.out_pool;
+    pool[2] = &g.dict_pool;
+    pool[3] = &g.lens_pool;
+    for (k = 0; k < POOLS; k++) {
+        possess(pool[k]->have);
+        if (pool[k]->made > met.made[k])
+            met.made[k] = pool[k]->made;
+        if (pool[k]->bytes > met.bytes[k])
+            met.bytes[k] = pool[k]->bytes;
+        release(pool[k]->have);
+    }
+}
+
+/* note whether the pools exist, saving their values before they are freed */
+local void met_pools(int live)
+{
+    if (met.lock == NULL)
+        return;
+    possess(met.lock);
+    met_snap();
+    met.pools = live;
+    release(met.lock);
+}
+
+/* write the help and type lines for metric name to out */
+local void met_head(FILE *out, char *name, char *type, char *help)
+{
+    fprintf(out, "# HELP pigz_%s %s\n# TYPE pigz_%s %s\n",
+            name, help, name, type);
+}
+
+/* write the metrics file */
+local void met_write(void)
+{
+    unsigned long long in, out;
+    unsigned long files, errors;
+    double work[STAGES];
+    FILE *file;
+    int k, threads, bad = 1;
+
+    possess(stats.lock);
+    in = stats.in;
+    out = stats.out;
+    memcpy(work, stats.work, sizeof(work));
+    release(stats.lock);
+    ATOM_GET(files, g.files);
+    ATOM_GET(errors, g.errors);
+    ATOM_GET(threads, cthreads);
+
+    possess(met.lock);
+    met_snap();
+    file = fopen(met.temp, "w");
+    if (file != NULL) {
+        met_head(file, "bytes_in_total", "counter",
+                 "Bytes read from the inputs.");
+        fprintf(file, "pigz_bytes_in_total %llu\n", in);
+        met_head(file, "bytes_out_total", "counter",
+                 "Bytes written to the outputs.");
+        fprintf(file, "pigz_bytes_out_total %llu\n", out);
+        met_head(file, "files_total", "counter", "Inputs opened.");
+        fprintf(file, "pigz_files_total %lu\n", files);
+        met_head(file, "errors_total", "counter",
+                 "Inputs skipped or failed.");
+        fprintf(file, "pigz_errors_total %lu\n", errors);
+        met_head(file, "stage_busy_seconds_total", "counter",
+                 "Seconds working in each pipeline stage.");
+        for (k = 0; k < STAGES; k++)
+            fprintf(file, "pigz_stage_busy_seconds_total{stage=\"%s\"} %.6f\n",
+                    stage_name[k], work[k]);
+        met_head(file, "pool_spaces", "gauge",
+                 "Most buffers made by each pool.");
+        for (k = 0; k < POOLS; k++)
+            fprintf(file, "pigz_pool_spaces{pool=\"%s\"} %d\n",
+                    met_pool[k], met.made[k]);
+        met_head(file, "pool_bytes", "gauge",
+                 "Most bytes in the buffers of each pool.");
+        for (k = 0; k < POOLS; k++)
+            fprintf(file, "pigz_pool_bytes{pool=\"%s\"} %zu\n",
+                    met_pool[k], met.bytes[k]);
+        met_head(file, "compress_threads", "gauge",
+                 "Compression threads running.");
+        fprintf(file, "pigz_compress_threads %d\n", threads);
+        bad = ferror(file);
+        bad |= fclose(file);
+        if (!bad)
+            bad = rename(met.temp, met.path);
+    }
+    if (bad && !met.warned) {
+        complain("warning: cannot write metrics to %s", met.path);
+        met.warned = 1;
+    }
+    release(met.lock);
+}
+
+/* metrics thread: write the metrics file every METRICSINT seconds until
+   stopped */
+local void met_thread(void *ctx)
+{
+    int stop;
+    double next;
+
+    BIND(ctx);
+    next = seconds() + METRICSINT;
+    for (;;) {
+        ATOM_GET(stop, met.stop);
+        if (stop)
+            break;
+        poll(NULL, 0, 100);
+        if (seconds() >= next) {
+            met_write();
+            next += METRICSINT;
+        }
+    }
+}
+
+/* on a fatal error, count it and write the metrics a last time -- the pools
+   are left as last seen, since the thread ending may be holding their
+   locks */
+local void met_abort(void)
+{
+    int was;
+
+    ATOM_SWAP(was, met.aborted, 1);
+    if (was)
+        return;
+    FAILED();
+    ATOM_SET(met.stop, 1);
+    join(met.th);
+    possess(met.lock);
+    met.pools = 0;
+    release(met.lock);
+    met_write();
+}
+
+/* start writing metrics to path */
+local void met_open(char *path)
+{
+    size_t len;
+
+    len = strlen(path);
+    met.temp = alloc(NULL, len + 5);
+    memcpy(met.temp, path, len);
+    strcpy(met.temp + len, ".tmp");
+    met.path = path;
+    met.lock = new_lock(0);
+    label_lock(met.lock, "met", "lock");
+    met.stop = 0;
+    met.aborted = 0;
+    met.warned = 0;
+    met.th = launch(met_thread, gp);
+    on_abort = met_abort;
+}
+
+/* stop the metrics thread, write the metrics a last time, and free the
+   resources */
+local void met_close(void)
+{
+    if (met.path == NULL)
+        return;
+    on_abort = NULL;
+    ATOM_SET(met.stop, 1);
+    join(met.th);
+    met_write();
+    free_lock(met.lock);
+    met.lock = NULL;
+    FREE(met.temp);
+    met.path = NULL;
+}
 
 /* setup job lists (call from main thread) */
 local void setup_jobs(void)
 {
-    /* set up only if not already set up*/
-    if (compress_have != NULL)
-        return;
+    setup_compress();
 
-    /* allocate locks and initialize lists */
-    compress_have = new_lock(0);
-    compress_head = NULL;
-    compress_tail = &compress_head;
-    write_first = new_lock(-1);
-    write_head = NULL;
+    /* set up the write list and pools for this stream only once */
+    if (g.write_first != NULL)
+        return;
+    g.write_first = new_lock(-1);
+    label_lock(g.write_first, "write_first", NULL);
+    g.write_head = NULL;
 
     /* initialize buffer pools (initial size for out_pool not critical, since
        buffers will be grown in size if needed -- initial size chosen to make
        this unlikely -- same for lens_pool) */
-    new_pool(&in_pool, g.block, INBUFS(g.procs));
-    new_pool(&out_pool, OUTPOOL(g.block), -1);
-    new_pool(&dict_pool, DICT, -1);
-    new_pool(&lens_pool, g.block >> (RSYNCBITS - 1), -1);
+    new_pool(&g.in_pool, "in_pool", g.block, INBUFS(g.procs));
+    new_pool(&g.out_pool, "out_pool", OUTPOOL(g.block), -1);
+    new_pool(&g.dict_pool, "dict_pool", DICT, -1);
+    new_pool(&g.lens_pool, "lens_pool", g.block >> (RSYNCBITS - 1), -1);
+    met_pools(1);
+}
+
+/* free the write list and pools for this stream */
+local void finish_pools(void)
+{
+    int caught;
+
+    if (g.write_first == NULL)
+        return;
+    met_pools(0);
+    caught = free_pool(&g.lens_pool);
+    Trace(("-- freed %d block lengths buffers", caught));
+    caught = free_pool(&g.dict_pool);
+    Trace(("-- freed %d dictionary buffers", caught));
+    caught = free_pool(&g.out_pool);
+    Trace(("-- freed %d output buffers", caught));
+    caught = free_pool(&g.in_pool);
+    Trace(("-- freed %d input buffers", caught));
+    (void)caught;                   /* only used for tracing */
+    free_lock(g.write_first);
+    g.write_first = NULL;
 }
 
 /* command the compress threads to all return, then join them all (call from
@@ -1436,18 +2953,10 @@ local void finish_jobs(void)
     caught = join_all();
     Trace(("-- joined %d compress threads", caught));
     assert(caught == cthreads);
-    cthreads = 0;
+    ATOM_SET(cthreads, 0);
 
     /* free the resources */
-    caught = free_pool(&lens_pool);
-    Trace(("-- freed %d block lengths buffers", caught));
-    caught = free_pool(&dict_pool);
-    Trace(("-- freed %d dictionary buffers", caught));
-    caught = free_pool(&out_pool);
-    Trace(("-- freed %d output buffers", caught));
-    caught = free_pool(&in_pool);
-    Trace(("-- freed %d input buffers", caught));
-    free_lock(write_first);
+    finish_pools();
     free_lock(compress_have);
     compress_have = NULL;
 }
@@ -1474,2591 +2983,6346 @@ local void deflate_engine(z_stream *strm, struct space *out, int flush)
     assert(strm->avail_in == 0);
 }
 
-/* get the next compression job from the head of the list, compress and compute
-   the check value on the input, and put a job in the write list with the
-   results -- keep looking for more jobs, returning when a job is found with a
-   sequence number of -1 (leave that job in the list for other incarnations to
-   find) */
-local void compress_thread(void *dummy)
+/* -- block index and reuse of unchanged compressed blocks -- */
+
+/* With --index, the write thread records a content key for each compressed
+   block, which is a SHA-256 digest of everything that determines the
+   compressed data for that block: the zlib version, the compression
+   parameters, whether it is the last block, the dictionary, the rsyncable
+   block lengths, the check type, and the uncompressed data.  With the key are
+   the offset and length of the compressed data in the output, and the check
+   value of the uncompressed data.  With --reuse, a previous output and its
+   index are loaded, and any block whose key is found in that index is copied
+   from the previous output instead of being compressed.  With -R or -i, most
+   blocks of a slightly changed input will be found there.
+
+   The index file is an eight-byte signature followed by 64-byte records.  Each
+   record is the 32-byte key, the eight-byte offset and length of the
+   compressed data, the eight-byte uncompressed length, the four-byte check
+   value, and a four-byte record type, all in little-endian order.  The last
+   record has type 1, and has the total length of the compressed output as its
+   offset, in order to verify that the previous output is the one indexed. */
+
+#define IDXSIG "pigzidx\001"    /* signature at the start of an index file */
+#define IDXREC 64               /* length of an index record */
+
+/* put and pull eight-byte integers in LSB order */
+#define PUT8L(a,b) (PUT4L(a,(b)&0xffffffffUL),PUT4L((a)+4,(b)>>32))
+#define PULL8L(p) (PULL4L(p) + ((uint64_t)(PULL4L((p) + 4)) << 32))
+
+/* a block in the previous output */
+struct ref {
+    unsigned char key[32];      /* content key */
+    off_t off;                  /* offset of compressed data in old output */
+    size_t len;                 /* length of compressed data */
+    unsigned long check;        /* check value of uncompressed data */
+    int full;                   /* true if this table entry is in use */
+};
+
+/* block index being written, and previous output with its blocks */
+local struct {
+    int outd;                   /* block index output descriptor, or -1 */
+    int oldd;                   /* previous output descriptor, or -1 */
+    struct ref *table;          /* hash table of blocks in previous output */
+    size_t mask;                /* table size minus one (a power of two) */
+    long hits;                  /* number of blocks reused */
+} idx = {-1, -1, NULL, 0, 0};
+
+/* compute the content key for a job with the dictionary dict[0..len-1] */
+local void job_key(struct job *job, unsigned char *dict, size_t len)
 {
-    struct job *job;                /* job pulled and working on */
-    struct job *here, **prior;      /* pointers for inserting in write list */
-    unsigned long check;            /* check value of input */
-    unsigned char *next;            /* pointer for blocks, check value data */
-    size_t left;                    /* input left to process */
-    size_t len;                     /* remaining bytes to compress/check */
-#if ZLIB_VERNUM >= 0x1260
-    int bits;                       /* deflate pending bits */
-#endif
-    struct space *temp = NULL;      /* temporary space for zopfli input */
-    int ret;                        /* zlib return code */
-    z_stream strm;                  /* deflate stream */
-    ball_t err;                     /* error information from throw() */
+    unsigned char parm[28];
+    sha256_t sha;
+
+    sha256_init(&sha);
+    sha256_update(&sha, zlibVersion(), strlen(zlibVersion()) + 1);
+    PUT4L(parm, (unsigned long)g.level);
+    PUT4L(parm + 4, (unsigned long)job->more);
+    PUT4L(parm + 8, g.level > 9 ? (unsigned long)g.zopts.numiterations : 0);
+    PUT4L(parm + 12, g.level > 9 ? (unsigned long)g.zopts.blocksplitting : 0);
+    PUT4L(parm + 16, g.level > 9 ?
+                     (unsigned long)g.zopts.blocksplittinglast : 0);
+    PUT4L(parm + 20, g.level > 9 ?
+                     (unsigned long)g.zopts.blocksplittingmax : 0);
+    PUT4L(parm + 24, g.form == 1 ? 1UL : 0UL);  /* adler-32 or crc-32 */
+    sha256_update(&sha, parm, sizeof(parm));
+    PUT8L(parm, (uint64_t)len);
+    sha256_update(&sha, parm, 8);
+    sha256_update(&sha, dict, len);
+    PUT8L(parm, (uint64_t)(job->lens == NULL ? 0 : job->lens->len));
+    sha256_update(&sha, parm, 8);
+    if (job->lens != NULL)
+        sha256_update(&sha, job->lens->buf, job->lens->len);
+    sha256_update(&sha, job->in->buf, job->in->len);
+    sha256_final(&sha, job->key);
+}
 
-    (void)dummy;
+/* write a record to the block index */
+local void index_add(unsigned char *key, uint64_t off, uint64_t len,
+                     uint64_t ulen, unsigned long check, unsigned long type)
+{
+    unsigned char rec[IDXREC];
 
-    try {
-        /* initialize the deflate stream for this thread */
-        strm.zfree = ZFREE;
-        strm.zalloc = ZALLOC;
-        strm.opaque = OPAQUE;
-        ret = deflateInit2(&strm, 6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
-        if (ret == Z_MEM_ERROR)
-            throw(ENOMEM, "not enough memory");
-        if (ret != Z_OK)
-            throw(EINVAL, "internal error");
+    if (key == NULL)
+        memset(rec, 0, 32);
+    else
+        memcpy(rec, key, 32);
+    PUT8L(rec + 32, off);
+    PUT8L(rec + 40, len);
+    PUT8L(rec + 48, ulen);
+    PUT4L(rec + 56, check);
+    PUT4L(rec + 60, type);
+    writen(idx.outd, rec, IDXREC);
+}
 
-        /* keep looking for work */
-        for (;;) {
-            /* get a job (like I tell my son) */
-            possess(compress_have);
-            wait_for(compress_have, NOT_TO_BE, 0);
-            job = compress_head;
-            assert(job != NULL);
-            if (job->seq == -1)
-                break;
-            compress_head = job->next;
-            if (job->next == NULL)
-                compress_tail = &compress_head;
-            twist(compress_have, BY, -1);
+/* load the index of the previous output for --reuse into a hash table -- if
+   the index or the previous output is not usable, warn and don't reuse */
+local void reuse_load(void)
+{
+    size_t num, n, k;
+    char *name;
+    FILE *in;
+    struct stat st;
+    struct ref *ref;
+    uint64_t total = 0;
+    int type = 0;
+    unsigned char rec[IDXREC];
+
+    /* open the previous output, unless reuse_keep() already did, and its
+       index */
+    if (idx.oldd == -1)
+        idx.oldd = open(g.reuse, O_RDONLY, 0);
+    if (idx.oldd < 0) {
+        complain("warning: cannot open %s -- not reusing", g.reuse);
+        return;
+    }
+    name = alloc(NULL, strlen(g.reuse) + 5);
+    strcpy(name, g.reuse);
+    strcat(name, ".idx");
+    in = fopen(name, "rb");
+    if (in == NULL || fread(rec, 1, 8, in) != 8 ||
+            memcmp(rec, IDXSIG, 8) != 0 || fstat(idx.oldd, &st) ||
+            fseeko(in, 0, SEEK_END) || (num = ftello(in) / IDXREC) == 0 ||
+            num > (MAXP2 >> 1) / sizeof(struct ref) ||
+            fseeko(in, 8, SEEK_SET)) {
+        complain("warning: %s missing or not an index -- not reusing", name);
+        if (in != NULL)
+            fclose(in);
+        FREE(name);
+        close(idx.oldd);
+        idx.oldd = -1;
+        return;
+    }
 
-            /* got a job -- initialize and set the compression level (note that
-               if deflateParams() is called immediately after deflateReset(),
-               there is no need to initialize input/output for the stream) */
-            Trace(("-- compressing #%ld", job->seq));
-            if (g.level <= 9) {
-                (void)deflateReset(&strm);
-                (void)deflateParams(&strm, g.level, Z_DEFAULT_STRATEGY);
-            }
-            else {
-                if (temp == NULL)
-                    temp = get_space(&out_pool);
-                temp->len = 0;
-            }
+    /* make a hash table with at most half of the entries used, and load it
+       using the first eight bytes of each key (already random) for the hash */
+    for (n = 1; n < (num << 1); n <<= 1)
+        ;
+    idx.mask = n - 1;
+    idx.table = alloc(NULL, n * sizeof(struct ref));
+    memset(idx.table, 0, n * sizeof(struct ref));
+    for (k = 0; k < num && fread(rec, 1, IDXREC, in) == IDXREC; k++) {
+        type = (int)PULL4L(rec + 60);
+        if (type == 1) {
+            total = PULL8L(rec + 32);
+            break;
+        }
+        n = (size_t)PULL8L(rec) & idx.mask;
+        while (idx.table[n].full)
+            n = (n + 1) & idx.mask;
+        ref = idx.table + n;
+        memcpy(ref->key, rec, 32);
+        ref->off = (off_t)PULL8L(rec + 32);
+        ref->len = (size_t)PULL8L(rec + 40);
+        ref->check = PULL4L(rec + 56);
+        ref->full = 1;
+    }
+    fclose(in);
+
+    /* verify that the index is complete and goes with the previous output */
+    if (type != 1 || total != (uint64_t)st.st_size) {
+        complain("warning: %s does not match %s -- not reusing",
+                 name, g.reuse);
+        RELEASE(idx.table);
+        close(idx.oldd);
+        idx.oldd = -1;
+    }
+    FREE(name);
+}
 
-            /* set dictionary if provided, release that input or dictionary
-               buffer (not NULL if g.setdict is true and if this is not the
-               first work unit) */
-            if (job->out != NULL) {
-                len = job->out->len;
-                left = len < DICT ? len : DICT;
-                if (g.level <= 9)
-                    deflateSetDictionary(&strm, job->out->buf + (len - left),
-                                         left);
-                else {
-                    memcpy(temp->buf, job->out->buf + (len - left), left);
-                    temp->len = left;
-                }
-                drop_space(job->out);
-            }
+/* if the block for job is in the previous output, copy its compressed data
+   to out, set the job check value, and return true -- pread() permits use by
+   several threads at once */
+local int reuse_get(struct job *job, struct space *out)
+{
+    size_t n, got;
+    ssize_t ret;
+    struct ref *ref;
 
-            /* set up input and output */
-            job->out = get_space(&out_pool);
-            if (g.level <= 9) {
-                strm.next_in = job->in->buf;
-                strm.next_out = job->out->buf;
-            }
-            else
-                memcpy(temp->buf + temp->len, job->in->buf, job->in->len);
+    /* look up the job key in the blocks of the previous output */
+    if (idx.table == NULL)
+        return 0;
+    n = (size_t)PULL8L(job->key) & idx.mask;
+    for (;;) {
+        ref = idx.table + n;
+        if (!ref->full)
+            return 0;
+        if (memcmp(ref->key, job->key, 32) == 0)
+            break;
+        n = (n + 1) & idx.mask;
+    }
 
-            /* compress each block, either flushing or finishing */
-            next = job->lens == NULL ? NULL : job->lens->buf;
-            left = job->in->len;
-            job->out->len = 0;
-            do {
-                /* decode next block length from blocks list */
-                len = next == NULL ? 128 : *next++;
-                if (len < 128)                  /* 64..32831 */
-                    len = (len << 8) + (*next++) + 64;
-                else if (len == 128)            /* end of list */
-                    len = left;
-                else if (len < 192)             /* 1..63 */
-                    len &= 0x3f;
-                else if (len < 224){            /* 32832..2129983 */
-                    len = ((len & 0x1f) << 16) + (*next++ << 8);
-                    len += *next++ + 32832U;
-                }
-                else {                          /* 2129984..539000895 */
-                    len = ((len & 0x1f) << 24) + (*next++ << 16);
-                    len += *next++ << 8;
-                    len += *next++ + 2129984UL;
-                }
-                left -= len;
-
-                if (g.level <= 9) {
-                    /* run MAXP2-sized amounts of input through deflate -- this
-                       loop is needed for those cases where the unsigned type
-                       is smaller than the size_t type, or when len is close to
-                       the limit of the size_t type */
-                    while (len > MAXP2) {
-                        strm.avail_in = MAXP2;
-                        deflate_engine(&strm, job->out, Z_NO_FLUSH);
-                        len -= MAXP2;
-                    }
+    /* copy the compressed data */
+    if (out->size < ref->len) {
+        out->buf = alloc(out->buf, ref->len);
+        out->size = ref->len;
+    }
+    for (got = 0; got < ref->len; got += ret) {
+        ret = pread(idx.oldd, out->buf + got, ref->len - got,
+                    ref->off + (off_t)got);
+        if (ret < 1)
+            return 0;
+    }
+    out->len = ref->len;
+    job->check = ref->check;
+    return 1;
+}
 
-                    /* run the last piece through deflate -- end on a byte
-                       boundary, using a sync marker if necessary, or finish
-                       the deflate stream if this is the last block */
-                    strm.avail_in = (unsigned)len;
-                    if (left || job->more) {
-#if ZLIB_VERNUM >= 0x1260
-                        deflate_engine(&strm, job->out, Z_BLOCK);
-
-                        /* add enough empty blocks to get to a byte boundary */
-                        (void)deflatePending(&strm, Z_NULL, &bits);
-                        if (bits & 1)
-                            deflate_engine(&strm, job->out, Z_SYNC_FLUSH);
-                        else if (bits & 7) {
-                            do {        /* add static empty blocks */
-                                bits = deflatePrime(&strm, 10, 2);
-                                assert(bits == Z_OK);
-                                (void)deflatePending(&strm, Z_NULL, &bits);
-                            } while (bits & 7);
-                            deflate_engine(&strm, job->out, Z_BLOCK);
-                        }
-#else
-                        deflate_engine(&strm, job->out, Z_SYNC_FLUSH);
-#endif
-                    }
-                    else
-                        deflate_engine(&strm, job->out, Z_FINISH);
-                }
-                else {
-                    /* compress len bytes using zopfli, end at byte boundary */
-                    unsigned char bits, *out;
-                    size_t outsize;
-
-                    out = NULL;
-                    outsize = 0;
-                    bits = 0;
-                    ZopfliDeflatePart(&g.zopts, 2, !(left || job->more),
-                                      temp->buf, temp->len, temp->len + len,
-                                      &bits, &out, &outsize);
-                    assert(job->out->len + outsize + 5 <= job->out->size);
-                    memcpy(job->out->buf + job->out->len, out, outsize);
-                    free(out);
-                    job->out->len += outsize;
-                    if (left || job->more) {
-                        bits &= 7;
-                        if (bits & 1) {
-                            if (bits == 7)
-                                job->out->buf[job->out->len++] = 0;
-                            job->out->buf[job->out->len++] = 0;
-                            job->out->buf[job->out->len++] = 0;
-                            job->out->buf[job->out->len++] = 0xff;
-                            job->out->buf[job->out->len++] = 0xff;
-                        }
-                        else if (bits) {
-                            do {
-                                job->out->buf[job->out->len - 1] += 2 << bits;
-                                job->out->buf[job->out->len++] = 0;
-                                bits += 2;
-                            } while (bits < 8);
-                        }
-                    }
-                    temp->len += len;
-                }
-            } while (left);
-            drop_space(job->lens);
-            job->lens = NULL;
-            Trace(("-- compressed #%ld%s", job->seq,
-                   job->more ? "" : " (last)"));
+/* open the block index and load the previous output index, as requested */
+local void index_open(void)
+{
+    if (g.reuse != NULL) {
+        idx.hits = 0;
+        reuse_load();
+    }
+    if (g.index != NULL) {
+        idx.outd = open(g.index, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+        if (idx.outd < 0)
+            throw(errno, "write error on %s (%s)", g.index, strerror(errno));
+        writen(idx.outd, (unsigned char *)IDXSIG, 8);
+    }
+}
 
-            /* reserve input buffer until check value has been calculated */
-            use_space(job->in);
+/* close the block index and release the previous output */
+local void index_close(void)
+{
+    if (idx.outd != -1) {
+        close(idx.outd);
+        idx.outd = -1;
+    }
+    if (idx.oldd != -1) {
+        close(idx.oldd);
+        idx.oldd = -1;
+    }
+    RELEASE(idx.table);
+}
 
-            /* insert write job in list in sorted order, alert write thread */
-            possess(write_first);
-            prior = &write_head;
-            while ((here = *prior) != NULL) {
-                if (here->seq > job->seq)
-                    break;
-                prior = &(here->next);
-            }
-            job->next = here;
-            *prior = job;
-            twist(write_first, TO, write_head->seq);
+/* -- cache of compressed blocks by content key -- */
+
+/* With --block-cache dir, the compressed data for each block is saved by its
+   content key (see job_key()), both in memory for the current input, and as a
+   file in dir for later runs.  A block whose key is already in the cache is
+   copied from there instead of being compressed, which pays off for inputs
+   with repeated content, such as tar files of container layers.  Each cache
+   file is named with the key in hexadecimal, and contains the four-byte check
+   value in little-endian order followed by the compressed data.  Cache files
+   are written to a temporary name and then renamed, so that other instances
+   of pigz using the same directory only see complete files.  Errors reading
+   or writing the cache directory are ignored -- the block is then simply
+   compressed. */
+
+#define CACHEMEM 67108864UL     /* maximum compressed bytes cached in memory */
+#define CACHEHASH 4096          /* number of in-memory hash table buckets */
+
+/* a compressed block cached in memory */
+struct cached {
+    unsigned char key[32];      /* content key */
+    unsigned long check;        /* check value of uncompressed data */
+    size_t len;                 /* length of compressed data */
+    unsigned char *data;        /* compressed data */
+    struct cached *next;        /* next entry in hash bucket */
+};
 
-            /* calculate the check value in parallel with writing, alert the
-               write thread that the calculation is complete, and drop this
-               usage of the input buffer */
-            len = job->in->len;
-            next = job->in->buf;
-            check = CHECK(0L, Z_NULL, 0);
-            while (len > MAXP2) {
-                check = CHECK(check, next, MAXP2);
-                len -= MAXP2;
-                next += MAXP2;
-            }
-            check = CHECK(check, next, (unsigned)len);
-            drop_space(job->in);
-            job->check = check;
-            Trace(("-- checked #%ld%s", job->seq, job->more ? "" : " (last)"));
-            possess(job->calc);
-            twist(job->calc, TO, 1);
+/* in-memory block cache and its statistics */
+local struct {
+    lock *use;                  /* lock for the table and counts */
+    struct cached **table;      /* hash table of cached blocks */
+    size_t mem;                 /* compressed bytes in table */
+    long tries;                 /* number of blocks looked up */
+    long hits;                  /* number of blocks found */
+    uint64_t saved;             /* uncompressed bytes not compressed */
+    long temp;                  /* count for unique temporary file names */
+} cache;
+
+/* return the allocated path of the cache file for key, or of a temporary file
+   for writing that cache file if temp is not zero */
+local char *cache_path(unsigned char *key, long temp)
+{
+    int n;
+    size_t len;
+    char *path;
+
+    len = strlen(g.cache);
+    path = alloc(NULL, len + 112);
+    memcpy(path, g.cache, len);
+    path[len++] = '/';
+    for (n = 0; n < 32; n++) {
+        path[len++] = "0123456789abcdef"[key[n] >> 4];
+        path[len++] = "0123456789abcdef"[key[n] & 0xf];
+    }
+    if (temp)
+        sprintf(path + len, ".%ld-%ld.tmp", (long)getpid(), temp);
+    else
+        path[len] = 0;
+    return path;
+}
 
-            /* done with that one -- go find another job */
+/* if the block for job is in the cache, copy its compressed data to out, set
+   the job check value, and return true */
+local int cache_get(struct job *job, struct space *out)
+{
+    int fd, hit;
+    size_t got;
+    ssize_t ret;
+    char *path;
+    struct stat st;
+    struct cached *entry;
+    unsigned char head[4];
+
+    /* look in memory */
+    possess(cache.use);
+    cache.tries++;
+    entry = cache.table[PULL4L(job->key) & (CACHEHASH - 1)];
+    while (entry != NULL && memcmp(entry->key, job->key, 32) != 0)
+        entry = entry->next;
+    hit = entry != NULL;
+    if (hit) {
+        if (out->size < entry->len) {
+            out->buf = alloc(out->buf, entry->len);
+            out->size = entry->len;
+        }
+        memcpy(out->buf, entry->data, entry->len);
+        out->len = entry->len;
+        job->check = entry->check;
+    }
+    release(cache.use);
+
+    /* look in the cache directory */
+    if (!hit) {
+        path = cache_path(job->key, 0);
+        fd = open(path, O_RDONLY, 0);
+        FREE(path);
+        if (fd < 0)
+            return 0;
+        if (fstat(fd, &st) == 0 && st.st_size > 4 &&
+                (size_t)(st.st_size - 4) == (uint64_t)(st.st_size - 4) &&
+                read(fd, head, 4) == 4) {
+            out->len = (size_t)(st.st_size - 4);
+            if (out->size < out->len) {
+                out->buf = alloc(out->buf, out->len);
+                out->size = out->len;
+            }
+            for (got = 0; got < out->len; got += ret) {
+                ret = read(fd, out->buf + got, out->len - got);
+                if (ret < 1)
+                    break;
+            }
+            hit = got == out->len;
+            job->check = PULL4L(head);
         }
+        close(fd);
+        if (!hit)
+            return 0;
+    }
 
-        /* found job with seq == -1 -- return to join */
-        drop_space(temp);
-        release(compress_have);
-        (void)deflateEnd(&strm);
+    /* count the hit */
+    possess(cache.use);
+    cache.hits++;
+    cache.saved += job->in->len;
+    release(cache.use);
+    return 1;
+}
+
+/* save the compressed data in out for job in the cache */
+local void cache_put(struct job *job, struct space *out)
+{
+    int fd, ok;
+    long temp;
+    size_t got;
+    ssize_t ret;
+    char *path, *name;
+    struct cached *entry, **head;
+    unsigned char check[4];
+
+    /* save in memory if there's room, and if another thread hasn't already */
+    possess(cache.use);
+    head = cache.table + (PULL4L(job->key) & (CACHEHASH - 1));
+    entry = *head;
+    while (entry != NULL && memcmp(entry->key, job->key, 32) != 0)
+        entry = entry->next;
+    if (entry == NULL && out->len <= CACHEMEM - cache.mem) {
+        entry = alloc(NULL, sizeof(struct cached));
+        entry->data = alloc(NULL, out->len);
+        memcpy(entry->key, job->key, 32);
+        entry->check = job->check;
+        entry->len = out->len;
+        memcpy(entry->data, out->buf, out->len);
+        entry->next = *head;
+        *head = entry;
+        cache.mem += out->len;
     }
-    catch (err) {
-        THREADABORT(err);
+    temp = ++cache.temp;
+    release(cache.use);
+
+    /* save in the cache directory if it's not there already */
+    path = cache_path(job->key, 0);
+    if (access(path, F_OK) != 0) {
+        name = cache_path(job->key, temp);
+        fd = open(name, O_CREAT | O_EXCL | O_WRONLY, 0644);
+        if (fd >= 0) {
+            PUT4L(check, job->check);
+            ok = write(fd, check, 4) == 4;
+            for (got = 0; ok && got < out->len; got += ret) {
+                ret = write(fd, out->buf + got, out->len - got);
+                ok = ret > 0;
+            }
+            if (close(fd) || !ok || rename(name, path))
+                unlink(name);
+        }
+        FREE(name);
     }
+    FREE(path);
 }
 
-/* collect the write jobs off of the list in sequence order and write out the
-   compressed data until the last chunk is written -- also write the header and
-   trailer and combine the individual check values of the input buffers */
-local void write_thread(void *dummy)
+/* set up the block cache if requested */
+local void cache_open(void)
 {
-    long seq;                       /* next sequence number looking for */
-    struct job *job;                /* job pulled and working on */
-    size_t len;                     /* input length */
-    int more;                       /* true if more chunks to write */
-    unsigned long head;             /* header length */
-    unsigned long ulen;             /* total uncompressed size (overflow ok) */
-    unsigned long clen;             /* total compressed size (overflow ok) */
-    unsigned long check;            /* check value of uncompressed data */
-    ball_t err;                     /* error information from throw() */
+    if (g.cache == NULL)
+        return;
+    (void)mkdir(g.cache, 0755);
+    cache.use = new_lock(0);
+    label_lock(cache.use, "cache", "use");
+    cache.table = alloc(NULL, CACHEHASH * sizeof(struct cached *));
+    memset(cache.table, 0, CACHEHASH * sizeof(struct cached *));
+    cache.mem = 0;
+    cache.tries = 0;
+    cache.hits = 0;
+    cache.saved = 0;
+}
 
-    (void)dummy;
+/* release the in-memory block cache */
+local void cache_close(void)
+{
+    int n;
+    struct cached *entry;
 
-    try {
-        /* build and write header */
-        Trace(("-- write thread running"));
-        head = put_header();
+    if (cache.table == NULL)
+        return;
+    for (n = 0; n < CACHEHASH; n++)
+        while ((entry = cache.table[n]) != NULL) {
+            cache.table[n] = entry->next;
+            FREE(entry->data);
+            FREE(entry);
+        }
+    RELEASE(cache.table);
+    free_lock(cache.use);
+    cache.use = NULL;
+}
 
-        /* process output of compress threads until end of input */
-        ulen = clen = 0;
-        check = CHECK(0L, Z_NULL, 0);
-        seq = 0;
-        do {
-            /* get next write job in order */
-            possess(write_first);
-            wait_for(write_first, TO_BE, seq);
-            job = write_head;
-            write_head = job->next;
-            twist(write_first, TO, write_head == NULL ? -1 : write_head->seq);
+/* return true if the input is to be compressed by parallel_compress(), which
+   even with one thread writes different bytes than single_compress() */
+local int use_parallel(void)
+{
+    return g.procs > 1 || g.index != NULL || g.reuse != NULL ||
+           g.cache != NULL || g.align || g.resume || g.flushint ||
+           g.follow || g.tees || g.digest || g.stats ||
+           g.tracejson != NULL || g.progress || g.metrics != NULL;
+}
 
-            /* update lengths, save uncompressed length for COMB */
-            more = job->more;
-            len = job->in->len;
-            drop_space(job->in);
-            ulen += (unsigned long)len;
-            clen += (unsigned long)(job->out->len);
+/* hash the zlib version, the options that affect the compressed output, and
+   the header contents */
+local void opts_key(sha256_t *sha)
+{
+    unsigned char parm[60];
+
+    sha256_update(sha, zlibVersion(), strlen(zlibVersion()) + 1);
+    PUT4L(parm, (unsigned long)g.form);
+    PUT4L(parm + 4, (unsigned long)g.level);
+    PUT4L(parm + 8, (unsigned long)g.rsync);
+    PUT4L(parm + 12, (unsigned long)g.setdict);
+    PUT8L(parm + 16, (uint64_t)g.block);
+    PUT4L(parm + 24, g.level > 9 ? (unsigned long)g.zopts.numiterations : 0);
+    PUT4L(parm + 28, g.level > 9 ? (unsigned long)g.zopts.blocksplitting : 0);
+    PUT4L(parm + 32, g.level > 9 ?
+                     (unsigned long)g.zopts.blocksplittinglast : 0);
+    PUT4L(parm + 36, g.level > 9 ?
+                     (unsigned long)g.zopts.blocksplittingmax : 0);
+    PUT8L(parm + 40, (uint64_t)g.mtime);
+    PUT8L(parm + 48, (uint64_t)g.align);
+    PUT4L(parm + 56, (unsigned long)use_parallel());
+    sha256_update(sha, parm, sizeof(parm));
+    if (g.name != NULL)
+        sha256_update(sha, g.name, strlen(g.name) + 1);
+    else
+        sha256_update(sha, "", 1);
+}
 
-            /* write the compressed data and drop the output buffer */
-            Trace(("-- writing #%ld", seq));
-            writen(g.outd, job->out->buf, job->out->len);
-            drop_space(job->out);
-            Trace(("-- wrote #%ld%s", seq, more ? "" : " (last)"));
+/* -- checkpoint journal for resuming an interrupted compression -- */
+
+/* With --resume, the write thread keeps a journal in the output file name
+   with ".journal" appended.  About once a second, after the compressed data
+   for a job is written, the output is synced to storage, and then a
+   checkpoint is written to the journal and synced.  The checkpoint has the
+   output and input offsets after that job, the check value of the input up
+   to there, the header length, and the last 32K of input, which is the
+   dictionary for the next job.  When pigz is run again on the same input and
+   output with --resume and the same options, the output is truncated to the
+   last checkpoint, and compression continues from there with the same
+   dictionary and check value.  The journal is deleted when compression
+   completes.  The resulting output is identical to that of an uninterrupted
+   run, except possibly for -R block boundaries after the resume point.
+
+   The journal has a 64-byte header with an eight-byte signature, the size and
+   modification time of the input, and a SHA-256 digest of the options (see
+   opts_key()), followed by two checkpoint slots that are written alternately,
+   so that a crash while writing one leaves the other intact.  Each slot has
+   an eight-byte checkpoint number, the eight-byte output and input offsets,
+   the four-byte check value and header length, the 32K dictionary, and a
+   crc-32 of the preceding slot contents, all in little-endian order. */
+
+#define JNLSIG "pigzjnl\001"    /* signature at the start of a journal */
+#define JNLHEAD 64              /* length of journal header */
+#define JNLSLOT (32 + DICT + 4) /* length of a checkpoint slot */
+
+/* journal state */
+local struct {
+    int fd;                     /* journal descriptor, or -1 if none */
+    char *path;                 /* journal path */
+    unsigned char *slot;        /* checkpoint being built, with dictionary */
+    size_t have;                /* amount of dictionary in slot (<= DICT) */
+    int next;                   /* slot to write next (0 or 1) */
+    uint64_t num;               /* number of the last checkpoint */
+    time_t last;                /* time of the last checkpoint */
+    int resumed;                /* true if resuming from a checkpoint */
+    uint64_t out;               /* resumed output offset */
+    uint64_t in;                /* resumed input offset */
+    unsigned long check;        /* resumed check value */
+    unsigned long head;         /* resumed header length */
+} jnl = {-1, NULL, NULL, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+/* return the allocated journal path for the output */
+local char *jnl_name(void)
+{
+    char *path;
 
-            /* wait for check calculation to complete, then combine, once
-               the compress thread is done with the input, release it */
-            possess(job->calc);
-            wait_for(job->calc, TO_BE, 1);
-            release(job->calc);
-            check = COMB(check, job->check, len);
+    path = alloc(NULL, strlen(g.outf) + 9);
+    strcpy(path, g.outf);
+    strcat(path, ".journal");
+    return path;
+}
 
-            /* free the job */
-            free_lock(job->calc);
-            FREE(job);
+/* return true if there is a journal to resume from for the output */
+local int jnl_found(void)
+{
+    int ret;
+    char *path;
 
-            /* get the next buffer in sequence */
-            seq++;
-        } while (more);
+    path = jnl_name();
+    ret = access(path, F_OK) == 0;
+    FREE(path);
+    return ret;
+}
 
-        /* write trailer */
-        put_trailer(ulen, clen, check, head);
+/* if the output g.outf about to be truncated is the previous output to reuse,
+   open it for reuse_load() and unlink it, so that the new output is written
+   to a new file while the previous one can still be read */
+local void reuse_keep(void)
+{
+    struct stat old, out;
 
-        /* verify no more jobs, prepare for next use */
-        possess(compress_have);
-        assert(compress_head == NULL && peek_lock(compress_have) == 0);
-        release(compress_have);
-        possess(write_first);
-        assert(write_head == NULL);
-        twist(write_first, TO, -1);
-    }
-    catch (err) {
-        THREADABORT(err);
-    }
+    if (g.reuse == NULL || g.decode || idx.oldd != -1 ||
+            (g.resume && jnl_found()) ||
+            stat(g.reuse, &old) || stat(g.outf, &out) ||
+            old.st_dev != out.st_dev || old.st_ino != out.st_ino)
+        return;
+    idx.oldd = open(g.reuse, O_RDONLY, 0);
+    if (idx.oldd != -1)
+        unlink(g.outf);
 }
 
-/* encode a hash hit to the block lengths list -- hit == 0 ends the list */
-local void append_len(struct job *job, size_t len)
+/* open or create the journal if --resume, and if it has a valid checkpoint
+   for this input and options, truncate the output and position the input to
+   resume from that checkpoint */
+local void jnl_open(void)
 {
-    struct space *lens;
+    int k;
+    size_t got;
+    struct stat st;
+    sha256_t sha;
+    unsigned char head[JNLHEAD], old[JNLHEAD];
+    uint64_t num;
 
-    assert(len < 539000896UL);
-    if (job->lens == NULL)
-        job->lens = get_space(&lens_pool);
-    lens = job->lens;
-    if (lens->size < lens->len + 3)
-        grow_space(lens);
-    if (len < 64)
-        lens->buf[lens->len++] = len + 128;
-    else if (len < 32832U) {
-        len -= 64;
-        lens->buf[lens->len++] = len >> 8;
-        lens->buf[lens->len++] = len;
-    }
-    else if (len < 2129984UL) {
-        len -= 32832U;
-        lens->buf[lens->len++] = (len >> 16) + 192;
-        lens->buf[lens->len++] = len >> 8;
-        lens->buf[lens->len++] = len;
+    if (!g.resume)
+        return;
+    if (g.outd == 1 || fstat(g.ind, &st) ||
+            (st.st_mode & S_IFMT) != S_IFREG) {
+        complain("warning: --resume needs an input and an output file"
+                 " -- not journaling %s", g.inf);
+        return;
     }
+
+    /* build the journal header for this input and these options */
+    memset(head, 0, JNLHEAD);
+    memcpy(head, JNLSIG, 8);
+    PUT8L(head + 8, (uint64_t)st.st_size);
+    PUT8L(head + 16, (uint64_t)st.st_mtime);
+    sha256_init(&sha);
+    opts_key(&sha);
+    sha256_final(&sha, head + 24);
+
+    /* open the journal, and look for the latest valid checkpoint */
+    jnl.path = jnl_name();
+    jnl.fd = open(jnl.path, O_RDWR | O_CREAT, 0644);
+    if (jnl.fd < 0)
+        throw(errno, "write error on %s (%s)", jnl.path, strerror(errno));
+    jnl.slot = alloc(NULL, JNLSLOT);
+    jnl.num = 0;
+    if (pread(jnl.fd, old, JNLHEAD, 0) == JNLHEAD &&
+            memcmp(old, head, JNLHEAD) == 0)
+        for (k = 0; k < 2; k++) {
+            got = pread(jnl.fd, jnl.slot, JNLSLOT, JNLHEAD + k * JNLSLOT);
+            if (got != JNLSLOT ||
+                    crc32(crc32(0L, Z_NULL, 0), jnl.slot, JNLSLOT - 4) !=
+                    PULL4L(jnl.slot + JNLSLOT - 4))
+                continue;
+            num = PULL8L(jnl.slot);
+            if (num <= jnl.num)
+                continue;
+            jnl.num = num;
+            jnl.next = 1 - k;
+            jnl.out = PULL8L(jnl.slot + 8);
+            jnl.in = PULL8L(jnl.slot + 16);
+            jnl.check = PULL4L(jnl.slot + 24);
+            jnl.head = PULL4L(jnl.slot + 28);
+            jnl.resumed = 1;
+        }
+
+    /* reload the chosen checkpoint, truncate the output to its offset, and
+       position the input to continue from there */
+    if (jnl.resumed &&
+            (pread(jnl.fd, jnl.slot, JNLSLOT, JNLHEAD + (1 - jnl.next) *
+                   JNLSLOT) != JNLSLOT ||
+             ftruncate(g.outd, (off_t)jnl.out) ||
+             lseek(g.outd, (off_t)jnl.out, SEEK_SET) != (off_t)jnl.out ||
+             lseek(g.ind, (off_t)jnl.in, SEEK_SET) != (off_t)jnl.in))
+        throw(errno, "cannot resume %s from %s (%s)", g.outf, jnl.path,
+              strerror(errno));
+
+    /* if not resuming, start the output and the journal over */
+    if (jnl.resumed)
+        jnl.have = DICT;
     else {
-        len -= 2129984UL;
-        lens->buf[lens->len++] = (len >> 24) + 224;
-        lens->buf[lens->len++] = len >> 16;
-        lens->buf[lens->len++] = len >> 8;
-        lens->buf[lens->len++] = len;
+        if (ftruncate(g.outd, 0) || lseek(g.outd, 0, SEEK_SET) != 0 ||
+                ftruncate(jnl.fd, 0))
+            throw(errno, "write error on %s (%s)", g.outf, strerror(errno));
+        if (pwrite(jnl.fd, head, JNLHEAD, 0) != JNLHEAD)
+            throw(errno, "write error on %s (%s)", jnl.path, strerror(errno));
+        jnl.have = 0;
+        jnl.next = 0;
     }
+    jnl.last = time(NULL);
 }
 
-/* compress ind to outd, using multiple threads for the compression and check
-   value calculations and one other thread for writing the output -- compress
-   threads will be launched and left running (waiting actually) to support
-   subsequent calls of parallel_compress() */
-local void parallel_compress(void)
+/* update the dictionary in the checkpoint with the input in buf[0..len-1] */
+local void jnl_add(unsigned char *buf, size_t len)
 {
-    long seq;                       /* sequence number */
-    struct space *curr;             /* input data to compress */
-    struct space *next;             /* input data that follows curr */
-    struct space *hold;             /* input data that follows next */
-    struct space *dict;             /* dictionary for next compression */
-    struct job *job;                /* job for compress, then write */
-    int more;                       /* true if more input to read */
-    unsigned hash;                  /* hash for rsyncable */
-    unsigned char *scan;            /* next byte to compute hash on */
-    unsigned char *end;             /* after end of data to compute hash on */
-    unsigned char *last;            /* position after last hit */
-    size_t left;                    /* last hit in curr to end of curr */
-    size_t len;                     /* for various length computations */
+    unsigned char *dict = jnl.slot + 32;
 
-    /* if first time or after an option change, setup the job lists */
-    setup_jobs();
+    if (len >= DICT) {
+        memcpy(dict, buf + len - DICT, DICT);
+        jnl.have = DICT;
+        return;
+    }
+    memmove(dict, dict + len, DICT - len);
+    memcpy(dict + DICT - len, buf, len);
+    jnl.have = jnl.have + len < DICT ? jnl.have + len : DICT;
+}
 
-    /* start write thread */
-    writeth = launch(write_thread, NULL);
+/* if a second has passed since the last checkpoint, write one for having
+   written out bytes of output for in bytes of input, with the given check
+   value and header length, after making sure the output is on storage */
+local void jnl_save(uint64_t out, uint64_t in, unsigned long check,
+                    unsigned long head)
+{
+    time_t now;
 
-    /* read from input and start compress threads (write thread will pick up
-       the output of the compress threads) */
-    seq = 0;
-    next = get_space(&in_pool);
-    next->len = readn(g.ind, next->buf, next->size);
-    hold = NULL;
-    dict = NULL;
-    scan = next->buf;
-    hash = RSYNCHIT;
-    left = 0;
-    do {
-        /* create a new job */
-        job = alloc(NULL, sizeof(struct job));
-        job->calc = new_lock(0);
+    now = time(NULL);
+    if (jnl.have < DICT || now == jnl.last)
+        return;
+    jnl.last = now;
+    if (fsync(g.outd))
+        throw(errno, "write error on %s (%s)", g.outf, strerror(errno));
+    PUT8L(jnl.slot, ++jnl.num);
+    PUT8L(jnl.slot + 8, out);
+    PUT8L(jnl.slot + 16, in);
+    PUT4L(jnl.slot + 24, check);
+    PUT4L(jnl.slot + 28, head);
+    PUT4L(jnl.slot + JNLSLOT - 4,
+          crc32(crc32(0L, Z_NULL, 0), jnl.slot, JNLSLOT - 4));
+    if (pwrite(jnl.fd, jnl.slot, JNLSLOT, JNLHEAD + jnl.next * JNLSLOT) !=
+            JNLSLOT || fsync(jnl.fd))
+        throw(errno, "write error on %s (%s)", jnl.path, strerror(errno));
+    jnl.next = 1 - jnl.next;
+    Trace(("-- checkpoint %llu at %llu", (unsigned long long)jnl.num,
+           (unsigned long long)in));
+}
 
-        /* update input spaces */
-        curr = next;
-        next = hold;
-        hold = NULL;
+/* close the journal, deleting it if compression completed */
+local void jnl_close(int done)
+{
+    if (jnl.fd != -1) {
+        close(jnl.fd);
+        jnl.fd = -1;
+        if (done)
+            unlink(jnl.path);
+        jnl.resumed = 0;
+    }
+    RELEASE(jnl.path);
+    RELEASE(jnl.slot);
+}
 
-        /* get more input if we don't already have some */
-        if (next == NULL) {
-            next = get_space(&in_pool);
-            next->len = readn(g.ind, next->buf, next->size);
+/* -- copies of the compressed output to more destinations -- */
+
+/* With --tee path, which can be given up to TEES times, the compressed output
+   is also written to each path, each by its own thread, so that the
+   destinations are written concurrently.  The write thread queues each
+   compressed block for each tee thread by adding a use to the block's output
+   space, and each tee thread drops the space once it has written it, so the
+   buffer returns to the out pool when every destination has it.  That way the
+   slowest destination sets the pace, by holding up the out pool, with no
+   compression repeated.  The header, padding, and trailer are queued as
+   copies through outn().  A write error on a destination is reported after
+   the others are done.
+
+   With --also path, the destination gets the same compressed data, but in a
+   gzip container, or a zip container if path ends in .zip, regardless of the
+   format of the main output.  Since the CRC-32 is the check value for both
+   gzip and zip, only the header and trailer differ, so those are written
+   separately for the destinations with the other format, with outn() writing
+   to them alone.  A zlib main output can't be used with --also, since it has
+   a different check value.
+
+   The destinations are opened by the first input compressed, and stay open
+   until all of the inputs have been processed, so each input is appended to
+   them as another member, as for a concatenated main output with -c.  As for
+   -K -c, a zip destination then gets concatenated zip files, which is warned
+   about. */
+
+/* a piece of output queued for a tee thread */
+struct tee_item {
+    struct space *space;        /* output space to drop, or NULL */
+    unsigned char *buf;         /* data to write, or NULL to end the thread */
+    size_t len;                 /* length of data */
+    struct tee_item *next;      /* next item in the queue */
+};
+
+/* tee state */
+local struct {
+    int n;                      /* number of destinations */
+    int ins;                    /* number of inputs appended to them */
+    int alt;                    /* the other format of some outputs, or -1 */
+    int frame;                  /* format of the header or trailer, or -1 */
+    unsigned long head;         /* header length for the alt format */
+    struct tee_out {
+        char *path;             /* destination path */
+        int form;               /* destination format (as for g.form) */
+        int fd;                 /* destination descriptor */
+        int err;                /* errno of the first write error, or 0 */
+        lock *have;             /* number of items in the queue */
+        struct tee_item *head;  /* queue of items to write */
+        struct tee_item **tail; /* where to put the next item */
+        thread *th;             /* the thread writing to fd */
+    } out[TEES];
+} tee;
+
+/* write the queued items for one destination until the end item */
+local void tee_thread(void *arg)
+{
+    struct tee_out *out = arg;
+    struct tee_item *item;
+    unsigned char *buf;
+    size_t len;
+    ssize_t ret;
+
+    for (;;) {
+        /* get the next item */
+        possess(out->have);
+        wait_for(out->have, NOT_TO_BE, 0);
+        item = out->head;
+        out->head = item->next;
+        if (out->head == NULL)
+            out->tail = &out->head;
+        twist(out->have, BY, -1);
+        if (item->buf == NULL)
+            break;
+
+        /* write it, discarding the rest after an error */
+        buf = item->buf;
+        len = item->len;
+        while (len && out->err == 0) {
+            ret = write(out->fd, buf, len);
+            if (ret < 1)
+                out->err = ret < 0 ? errno : EIO;
+            else {
+                buf += ret;
+                len -= ret;
+            }
         }
+        drop_space(item->space);
+        free(item);
+    }
+    free(item);
+}
 
-        /* if rsyncable, generate block lengths and prepare curr for job to
-           likely have less than size bytes (up to the last hash hit) */
-        job->lens = NULL;
-        if (g.rsync && curr->len) {
-            /* compute the hash function starting where we last left off to
-               cover either size bytes or to EOF, whichever is less, through
-               the data in curr (and in the next loop, through next) -- save
-               the block lengths resulting from the hash hits in the job->lens
-               list */
-            if (left == 0) {
-                /* scan is in curr */
-                last = curr->buf;
-                end = curr->buf + curr->len;
-                while (scan < end) {
-                    hash = ((hash << 1) ^ *scan++) & RSYNCMASK;
-                    if (hash == RSYNCHIT) {
-                        len = scan - last;
-                        append_len(job, len);
-                        last = scan;
-                    }
-                }
+/* put item in the queue for destination k */
+local void tee_queue(int k, struct tee_item *item)
+{
+    struct tee_out *out = tee.out + k;
 
-                /* continue scan in next */
-                left = scan - last;
-                scan = next->buf;
-            }
+    item->next = NULL;
+    possess(out->have);
+    *out->tail = item;
+    out->tail = &item->next;
+    twist(out->have, BY, +1);
+}
 
-            /* scan in next for enough bytes to fill curr, or what is available
-               in next, whichever is less (if next isn't full, then we're at
-               the end of the file) -- the bytes in curr since the last hit,
-               stored in left, counts towards the size of the first block */
-            last = next->buf;
-            len = curr->size - curr->len;
-            if (len > next->len)
-                len = next->len;
-            end = next->buf + len;
-            while (scan < end) {
-                hash = ((hash << 1) ^ *scan++) & RSYNCMASK;
-                if (hash == RSYNCHIT) {
-                    len = (scan - last) + left;
-                    left = 0;
-                    append_len(job, len);
-                    last = scan;
-                }
-            }
-            append_len(job, 0);
+/* queue the compressed data in space for every destination */
+local void tee_space(struct space *space)
+{
+    int k;
+    struct tee_item *item;
+
+    for (k = 0; k < tee.n; k++) {
+        item = alloc(NULL, sizeof(struct tee_item));
+        use_space(space);
+        item->space = space;
+        item->buf = space->buf;
+        item->len = space->len;
+        tee_queue(k, item);
+    }
+}
 
-            /* create input in curr for job up to last hit or entire buffer if
-               no hits at all -- save remainder in next and possibly hold */
-            len = (job->lens->len == 1 ? scan : last) - next->buf;
-            if (len) {
-                /* got hits in next, or no hits in either -- copy to curr */
-                memcpy(curr->buf + curr->len, next->buf, len);
-                curr->len += len;
-                memmove(next->buf, next->buf + len, next->len - len);
-                next->len -= len;
-                scan -= len;
-                left = 0;
-            }
-            else if (job->lens->len != 1 && left && next->len) {
-                /* had hits in curr, but none in next, and last hit in curr
-                   wasn't right at the end, so we have input there to save --
-                   use curr up to the last hit, save the rest, moving next to
-                   hold */
-                hold = next;
-                next = get_space(&in_pool);
-                memcpy(next->buf, curr->buf + (curr->len - left), left);
-                next->len = left;
-                curr->len -= left;
-            }
-            else {
-                /* else, last match happened to be right at the end of curr,
-                   or we're at the end of the input compressing the rest */
-                left = 0;
-            }
+/* queue a copy of buf[0..len-1] for every destination, or only for those
+   with the format tee.frame while writing a header or trailer */
+local void tee_copy(unsigned char *buf, size_t len)
+{
+    int k;
+    struct tee_item *item;
+
+    for (k = 0; k < tee.n; k++) {
+        if (tee.frame != -1 && tee.out[k].form != tee.frame)
+            continue;
+        item = alloc(NULL, sizeof(struct tee_item) + len);
+        item->space = NULL;
+        item->buf = (unsigned char *)(item + 1);
+        memcpy(item->buf, buf, len);
+        item->len = len;
+        tee_queue(k, item);
+    }
+}
+
+/* set up the tee destinations for this input, opening any not yet open and
+   starting their threads */
+local void tee_open(void)
+{
+    int k;
+    struct tee_out *out;
+
+    if (g.tees && jnl.resumed)
+        throw(EINVAL, "cannot resume with --tee"
+                      " (the copies would be partial)");
+    tee.alt = -1;
+    tee.frame = -1;
+    for (k = 0; k < g.tees; k++) {
+        out = tee.out + k;
+        out->form = g.teeform[k] == -1 ? g.form : g.teeform[k];
+        if (out->form != g.form) {
+            if (g.form == 1)
+                throw(EINVAL, "cannot use --also with zlib output: %s",
+                      g.tee[k]);
+            tee.alt = out->form;
         }
+        if (tee.ins == 1 && out->form == 2)
+            complain("warning: %s will be concatenated zip files"
+                     " -- %s will not be able to extract", g.tee[k], g.prog);
+    }
+    tee.ins++;
+    for (; tee.n < g.tees; tee.n++) {
+        out = tee.out + tee.n;
+        out->path = g.tee[tee.n];
+        out->fd = open(out->path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+        if (out->fd < 0)
+            throw(errno, "write error on %s (%s)", out->path, strerror(errno));
+        out->err = 0;
+        out->have = new_lock(0);
+        label_lock(out->have, "tee", "have");
+        out->head = NULL;
+        out->tail = &out->head;
+        out->th = launch(tee_thread, out);
+    }
+    if (tee.n)
+        out_tee = tee_copy;
+}
 
-        /* compress curr->buf to curr->len -- compress thread will drop curr */
-        job->in = curr;
+/* wait for the tee threads to finish writing, and close the destinations --
+   called once all of the inputs have been processed */
+local void tee_close(void)
+{
+    int k, err = 0;
+    char *path = NULL;
+    struct tee_out *out;
+    struct tee_item *item;
+
+    out_tee = NULL;
+    for (k = 0; k < tee.n; k++) {
+        out = tee.out + k;
+        item = alloc(NULL, sizeof(struct tee_item));
+        item->space = NULL;
+        item->buf = NULL;
+        tee_queue(k, item);
+        join(out->th);
+        free_lock(out->have);
+        if (close(out->fd) && out->err == 0)
+            out->err = errno;
+        if (out->err && err == 0) {
+            err = out->err;
+            path = out->path;
+        }
+    }
+    tee.n = 0;
+    tee.ins = 0;
+    if (err)
+        throw(err, "write error on %s (%s)", path, strerror(err));
+}
 
-        /* set job->more if there is more to compress after curr */
-        more = next->len != 0;
-        job->more = more;
+/* write the header to the output and the destinations with the same format,
+   and the header for the other format to the rest -- return the length of the
+   output header */
+local unsigned long tee_header(void)
+{
+    unsigned long head;
+
+    if (tee.alt == -1)
+        return put_header(g.form);
+    tee.frame = g.form;
+    head = put_header(g.form);
+    tee.frame = tee.alt;
+    out_main = 0;
+    tee.head = put_header(tee.alt);
+    out_main = 1;
+    tee.frame = -1;
+    return head;
+}
 
-        /* provide dictionary for this job, prepare dictionary for next job */
-        job->out = dict;
-        if (more && g.setdict) {
-            if (curr->len >= DICT || job->out == NULL) {
-                dict = curr;
-                use_space(dict);
-            }
-            else {
-                dict = get_space(&dict_pool);
-                len = DICT - curr->len;
-                memcpy(dict->buf, job->out->buf + (job->out->len - len), len);
-                memcpy(dict->buf + len, curr->buf, curr->len);
-                dict->len = DICT;
-            }
-        }
+/* write the trailers as for tee_header() -- return the length of the output
+   trailer */
+local unsigned long tee_trailer(unsigned long ulen, unsigned long clen,
+                                unsigned long check, unsigned long head)
+{
+    unsigned long tail;
+
+    if (tee.alt == -1)
+        return put_trailer(ulen, clen, check, head, g.form);
+    tee.frame = g.form;
+    tail = put_trailer(ulen, clen, check, head, g.form);
+    tee.frame = tee.alt;
+    out_main = 0;
+    put_trailer(ulen, clen, check, tee.head, tee.alt);
+    out_main = 1;
+    tee.frame = -1;
+    return tail;
+}
 
-        /* preparation of job is complete */
-        job->seq = seq;
-        Trace(("-- read #%ld%s", seq, more ? "" : " (last)"));
-        if (++seq < 1)
-            throw(EOVERFLOW, "overflow");
+/* -- digest of the uncompressed data -- */
+
+/* With --digest file, a SHA-256 digest of the uncompressed data is computed
+   in the same pass as the compression or decompression, and a line in the
+   format of sha256sum is appended to file (which can be /dev/stdout when
+   testing), so that the data need not be read again for an audit.  When
+   compressing, the write thread queues each input block in order for a digest
+   thread, adding a use to the block's input space, which the digest thread
+   drops when done.  That way the digest runs alongside the compression and
+   writing, with no copy.  When decompressing, the digest is updated along
+   with the check value, in the check thread for -p 2 or more.  The line names
+   the uncompressed file, or the input file if the uncompressed data went to
+   stdout or was only tested. */
+
+/* digest state */
+local struct {
+    int on;                     /* true if computing a digest */
+    sha256_t sha;               /* digest of the data so far */
+    lock *have;                 /* number of items in the queue */
+    struct tee_item *head;      /* queue of input blocks to digest */
+    struct tee_item **tail;     /* where to put the next item */
+    thread *th;                 /* the digest thread, or NULL */
+} dig;
+
+/* start a digest of the uncompressed data, if requested */
+local void dig_start(void)
+{
+    dig.on = g.digest != NULL;
+    if (!dig.on)
+        return;
+    if (jnl.resumed)
+        throw(EINVAL, "cannot resume with --digest (the input is partial)");
+    sha256_init(&dig.sha);
+}
 
-        /* start another compress thread if needed */
-        if (cthreads < seq && cthreads < g.procs) {
-            (void)launch(compress_thread, NULL);
-            cthreads++;
-        }
+/* digest the queued input blocks until the end item */
+local void dig_thread(void *dummy)
+{
+    struct tee_item *item;
 
-        /* put job at end of compress list, let all the compressors know */
-        possess(compress_have);
-        job->next = NULL;
-        *compress_tail = job;
-        compress_tail = &(job->next);
-        twist(compress_have, BY, +1);
-    } while (more);
-    drop_space(next);
+    (void)dummy;
+    for (;;) {
+        possess(dig.have);
+        wait_for(dig.have, NOT_TO_BE, 0);
+        item = dig.head;
+        dig.head = item->next;
+        if (dig.head == NULL)
+            dig.tail = &dig.head;
+        twist(dig.have, BY, -1);
+        if (item->buf == NULL)
+            break;
+        sha256_update(&dig.sha, item->buf, item->len);
+        drop_space(item->space);
+        free(item);
+    }
+    free(item);
+}
 
-    /* wait for the write thread to complete (we leave the compress threads out
-       there and waiting in case there is another stream to compress) */
-    join(writeth);
-    writeth = NULL;
-    Trace(("-- write thread joined"));
+/* queue the input in space for the digest thread, or end it if NULL */
+local void dig_space(struct space *space)
+{
+    struct tee_item *item;
+
+    item = alloc(NULL, sizeof(struct tee_item));
+    if (space != NULL)
+        use_space(space);
+    item->space = space;
+    item->buf = space == NULL ? NULL : space->buf;
+    item->len = space == NULL ? 0 : space->len;
+    item->next = NULL;
+    possess(dig.have);
+    *dig.tail = item;
+    dig.tail = &item->next;
+    twist(dig.have, BY, +1);
 }
 
-#endif
+/* start the digest thread for compression, if requested */
+local void dig_open(void)
+{
+    dig.th = NULL;
+    dig_start();
+    if (!dig.on)
+        return;
+    dig.have = new_lock(0);
+    label_lock(dig.have, "dig", "have");
+    dig.head = NULL;
+    dig.tail = &dig.head;
+    dig.th = launch(dig_thread, NULL);
+}
 
-/* repeated code in single_compress to compress available input and write it */
-#define DEFLATE_WRITE(flush) \
+/* wait for the digest thread to finish */
+local void dig_close(void)
+{
+    if (dig.th == NULL)
+        return;
+    dig_space(NULL);
+    join(dig.th);
+    dig.th = NULL;
+    free_lock(dig.have);
+}
+
+/* write the digest line for the data named name */
+local void dig_put(char *name)
+{
+    int fd, k;
+    size_t len;
+    unsigned char sum[32];
+    char *line;
+
+    if (!dig.on)
+        return;
+    dig.on = 0;
+    sha256_final(&dig.sha, sum);
+    fd = open(g.digest, O_CREAT | O_APPEND | O_WRONLY, 0644);
+    if (fd < 0)
+        throw(errno, "write error on %s (%s)", g.digest, strerror(errno));
+    if (strcmp(name, "<stdin>") == 0)
+        name = "-";
+    len = strlen(name);
+    line = alloc(NULL, 64 + 2 + len + 2);
+    for (k = 0; k < 32; k++)
+        sprintf(line + (k << 1), "%02x", sum[k]);
+    line[64] = line[65] = ' ';
+    memcpy(line + 66, name, len);
+    line[66 + len] = '\n';
+    writen(fd, (unsigned char *)line, 67 + len);
+    free(line);
+    if (close(fd))
+        throw(errno, "write error on %s (%s)", g.digest, strerror(errno));
+}
+
+/* -- progress and throughput reporting -- */
+
+/* With --progress, a monitor thread writes a line to stderr every PROGINT
+   seconds with the input and output bytes so far, the compression ratio, the
+   average input throughput, the number of compression threads busy, and, when
+   the input is a regular file of known size, the percent done and an estimate
+   of the time left.  The pipeline only adds to the counters with ATOM_ADD(),
+   and the monitor only reads them, so where there are atomic operations no
+   locks are taken for this.  On a terminal the line is rewritten in place. */
+
+#define PROGINT 1.0
+
+local struct {
+    int on;                     /* true if counting */
+    thread *th;                 /* monitor thread, or NULL if none */
+    int stop;                   /* set to stop the monitor thread */
+    int tty;                    /* true if stderr is a terminal */
+    uint64_t size;              /* input size, or 0 if unknown */
+    uint64_t in;                /* bytes read */
+    uint64_t out;               /* bytes written */
+    int busy;                   /* compression threads working on a job */
+    int procs;                  /* compression threads, or 0 */
+    double start;               /* when the file started */
+} prog;
+
+/* count read, written, and busy if reporting progress */
+#define PROG(field, n) \
     do { \
-        do { \
-            strm->avail_out = out_size; \
-            strm->next_out = out; \
-            (void)deflate(strm, flush); \
-            writen(g.outd, out, out_size - strm->avail_out); \
-            clen += out_size - strm->avail_out; \
-        } while (strm->avail_out == 0); \
-        assert(strm->avail_in == 0); \
+        if (prog.on) \
+            ATOM_ADD(prog.field, n); \
     } while (0)
 
-/* do a simple compression in a single thread from ind to outd -- if reset is
-   true, instead free the memory that was allocated and retained for input,
-   output, and deflate */
-local void single_compress(int reset)
+/* write n bytes to buf as a short human-readable amount */
+local char *prog_bytes(char *buf, uint64_t n)
 {
-    size_t got;                     /* amount of data in in[] */
-    size_t more;                    /* amount of data in next[] (0 if eof) */
-    size_t start;                   /* start of data in next[] */
-    size_t have;                    /* bytes in current block for -i */
-    size_t hist;                    /* offset of permitted history */
-    int fresh;                      /* if true, reset compression history */
-    unsigned hash;                  /* hash for rsyncable */
-    unsigned char *scan;            /* pointer for hash computation */
-    size_t left;                    /* bytes left to compress after hash hit */
-    unsigned long head;             /* header length */
-    unsigned long ulen;             /* total uncompressed size (overflow ok) */
-    unsigned long clen;             /* total compressed size (overflow ok) */
-    unsigned long check;            /* check value of uncompressed data */
-    static unsigned out_size;       /* size of output buffer */
-    static unsigned char *in, *next, *out;  /* reused i/o buffers */
-    static z_stream *strm = NULL;   /* reused deflate structure */
+    if (n < 10000)
+        sprintf(buf, "%u B", (unsigned)n);
+    else if (n < 10000000)
+        sprintf(buf, "%.1f kB", n / 1e3);
+    else if (n < 10000000000ULL)
+        sprintf(buf, "%.1f MB", n / 1e6);
+    else
+        sprintf(buf, "%.1f GB", n / 1e9);
+    return buf;
+}
 
-    /* if requested, just release the allocations and return */
-    if (reset) {
-        if (strm != NULL) {
-            (void)deflateEnd(strm);
-            FREE(strm);
-            FREE(out);
-            FREE(next);
-            FREE(in);
-            strm = NULL;
+/* write a progress line, ending it if last is true */
+local void prog_line(int last)
+{
+    uint64_t in, out;
+    int busy;
+    double took, rate;
+    long left;
+    char a[16], b[16];
+
+    ATOM_GET(in, prog.in);
+    ATOM_GET(out, prog.out);
+    ATOM_GET(busy, prog.busy);
+    took = seconds() - prog.start;
+    rate = took > 0 ? in / took : 0;
+    fprintf(stderr, "%s%s: ", prog.tty ? "\r" : "", g.inf);
+    if (prog.size)
+        fprintf(stderr, "%5.1f%% ", in < prog.size ? 100. * in / prog.size :
+                                    100.);
+    fprintf(stderr, "%s in, %s out", prog_bytes(a, in), prog_bytes(b, out));
+    if (in && out)
+        fprintf(stderr, " (%.1f%%)", 100. * out / in);
+    fprintf(stderr, ", %s/s", prog_bytes(a, (uint64_t)rate));
+    if (prog.procs && !last)
+        fprintf(stderr, ", %d of %d busy", busy, prog.procs);
+    if (prog.size && rate > 0 && in < prog.size && !last) {
+        left = (long)((prog.size - in) / rate + 0.5);
+        fprintf(stderr, ", %ld:%02ld left", left / 60, left % 60);
+    }
+    fputs(prog.tty && !last ? "\033[K" : prog.tty ? "\033[K\n" : "\n",
+          stderr);
+    fflush(stderr);
+}
+
+/* monitor thread: write a progress line every PROGINT seconds until stopped */
+local void prog_thread(void *ctx)
+{
+    int stop;
+    double next;
+
+    BIND(ctx);
+    next = prog.start + PROGINT;
+    for (;;) {
+        ATOM_GET(stop, prog.stop);
+        if (stop)
+            break;
+        poll(NULL, 0, 100);
+        if (seconds() >= next) {
+            prog_line(0);
+            next += PROGINT;
         }
+    }
+}
+
+/* stop the monitor thread and write the last line for the file */
+local void prog_stop(void)
+{
+    if (prog.th == NULL)
+        return;
+    ATOM_SET(prog.stop, 1);
+    join(prog.th);
+    prog.th = NULL;
+    prog.on = 0;
+    prog_line(1);
+}
+
+/* start reporting the progress of processing g.ind */
+local void prog_start(void)
+{
+    struct stat st;
+
+    if (!g.progress)
         return;
+    prog_stop();
+    prog.size = fstat(g.ind, &st) == 0 && S_ISREG(st.st_mode) ?
+                (uint64_t)st.st_size : 0;
+    prog.in = g.decode ? (uint64_t)g.in_tot : 0;    /* header read */
+    prog.out = 0;
+    prog.busy = 0;
+    prog.procs = g.decode ? 0 : g.procs;
+    prog.tty = isatty(2);
+    prog.stop = 0;
+    prog.start = seconds();
+    prog.on = 1;
+    prog.th = launch(prog_thread, gp);
+}
+
+/* insert write job in list in sorted order, alert write thread */
+local void write_job(struct job *job)
+{
+    struct job *here, **prior;      /* pointers for inserting in write list */
+
+    possess(g.write_first);
+    prior = &g.write_head;
+    while ((here = *prior) != NULL) {
+        if (here->seq > job->seq)
+            break;
+        prior = &(here->next);
     }
+    job->next = here;
+    *prior = job;
+    twist(g.write_first, TO, g.write_head->seq);
+}
 
-    /* initialize the deflate structure if this is the first time */
-    if (strm == NULL) {
-        int ret;                    /* zlib return code */
+/* decode the next block length from the block lengths list at *next written by
+   append_len(), and update *next -- return left at the end of the list, or if
+   *next is NULL (no list) */
+local size_t next_len(unsigned char **next, size_t left)
+{
+    unsigned char *p = *next;
+    size_t len;
 
-        out_size = g.block > MAXP2 ? MAXP2 : (unsigned)g.block;
-        in = alloc(NULL, g.block + DICT);
-        next = alloc(NULL, g.block + DICT);
-        out = alloc(NULL, out_size);
-        strm = alloc(NULL, sizeof(z_stream));
-        strm->zfree = ZFREE;
-        strm->zalloc = ZALLOC;
-        strm->opaque = OPAQUE;
-        ret = deflateInit2(strm, 6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
-        if (ret == Z_MEM_ERROR)
-            throw(ENOMEM, "not enough memory");
-        if (ret != Z_OK)
-            throw(EINVAL, "internal error");
+    len = p == NULL ? 128 : *p++;
+    if (len < 128)                  /* 64..32831 */
+        len = (len << 8) + (*p++) + 64;
+    else if (len == 128)            /* end of list */
+        len = left;
+    else if (len < 192)             /* 1..63 */
+        len &= 0x3f;
+    else if (len < 224){            /* 32832..2129983 */
+        len = ((len & 0x1f) << 16) + (*p++ << 8);
+        len += *p++ + 32832U;
     }
+    else {                          /* 2129984..539000895 */
+        len = ((len & 0x1f) << 24) + (*p++ << 16);
+        len += *p++ << 8;
+        len += *p++ + 2129984UL;
+    }
+    *next = p;
+    return len;
+}
 
-    /* write header */
-    head = put_header();
+/* compress the input of job to job->out using strm, or *temp for zopfli
+   input, which is returned to the pool and set to NULL when done -- return
+   true if instead the compressed data and check value were copied from the
+   previous output or the block cache */
+local int compress_job(struct job *job, z_stream *strm,
+                       struct space *volatile *temp)
+{
+    struct space *found;            /* block from previous output or cache */
+    unsigned char *next;            /* pointer for blocks */
+    size_t left;                    /* input left to process */
+    size_t len;                     /* remaining bytes to compress */
+#if ZLIB_VERNUM >= 0x1260
+    int bits;                       /* deflate pending bits */
+#endif
 
-    /* set compression level in case it changed */
+    /* if writing or using a block index or a block cache, compute the
+       content key for the job, and if the block is in the previous output or
+       in the cache, copy its compressed data from there with the check value
+       saved with it */
+    Trace(("-- compressing #%ld", job->seq));
+    job->reused = 0;
+    if (g.index != NULL || idx.table != NULL || g.cache != NULL) {
+        if (job->out == NULL)
+            job_key(job, NULL, 0);
+        else {
+            len = job->out->len;
+            left = len < DICT ? len : DICT;
+            job_key(job, job->out->buf + (len - left), left);
+        }
+        found = get_space(&g.out_pool);
+        job->reused = reuse_get(job, found);
+        if (job->reused || (g.cache != NULL && cache_get(job, found))) {
+            drop_space(job->out);
+            job->out = found;
+            drop_space(job->lens);
+            job->lens = NULL;
+            Trace(("-- %s #%ld%s", job->reused ? "reused" : "cached",
+                   job->seq, job->more ? "" : " (last)"));
+            return 1;
+        }
+        drop_space(found);
+    }
+
+    /* initialize and set the compression level (note that if
+       deflateParams() is called immediately after deflateReset(),
+       there is no need to initialize input/output for the stream) */
     if (g.level <= 9) {
         (void)deflateReset(strm);
         (void)deflateParams(strm, g.level, Z_DEFAULT_STRATEGY);
     }
+    else {
+        if (*temp == NULL)
+            *temp = get_space(&g.out_pool);
+        (*temp)->len = 0;
+    }
 
-    /* do raw deflate and calculate check value */
-    got = 0;
-    more = readn(g.ind, next, g.block);
-    ulen = (unsigned long)more;
-    start = 0;
-    hist = 0;
-    clen = 0;
-    have = 0;
-    check = CHECK(0L, Z_NULL, 0);
-    hash = RSYNCHIT;
-    do {
-        /* get data to compress, see if there is any more input */
-        if (got == 0) {
-            scan = in;  in = next;  next = scan;
-            strm->next_in = in + start;
-            got = more;
-            if (g.level > 9) {
-                left = start + more - hist;
-                if (left > DICT)
-                    left = DICT;
-                memcpy(next, in + ((start + more) - left), left);
-                start = left;
-                hist = 0;
-            }
-            else
-                start = 0;
-            more = readn(g.ind, next + start, g.block);
-            ulen += (unsigned long)more;
+    /* set dictionary if provided, release that input or dictionary
+       buffer (not NULL if g.setdict is true and if this is not the
+       first work unit) */
+    if (job->out != NULL) {
+        len = job->out->len;
+        left = len < DICT ? len : DICT;
+        if (g.level <= 9)
+            deflateSetDictionary(strm, job->out->buf + (len - left),
+                                 left);
+        else {
+            memcpy((*temp)->buf, job->out->buf + (len - left), left);
+            (*temp)->len = left;
         }
+        drop_space(job->out);
+        job->out = NULL;
+    }
 
-        /* if rsyncable, compute hash until a hit or the end of the block */
-        left = 0;
-        if (g.rsync && got) {
-            scan = strm->next_in;
-            left = got;
-            do {
-                if (left == 0) {
-                    /* went to the end -- if no more or no hit in size bytes,
-                       then proceed to do a flush or finish with got bytes */
-                    if (more == 0 || got == g.block)
-                        break;
-
-                    /* fill in[] with what's left there and as much as possible
-                       from next[] -- set up to continue hash hit search */
-                    if (g.level > 9) {
-                        left = (strm->next_in - in) - hist;
-                        if (left > DICT)
-                            left = DICT;
-                    }
-                    memmove(in, strm->next_in - left, left + got);
-                    hist = 0;
-                    strm->next_in = in + left;
-                    scan = in + left + got;
-                    left = more > g.block - got ? g.block - got : more;
-                    memcpy(scan, next + start, left);
-                    got += left;
-                    more -= left;
-                    start += left;
-
-                    /* if that emptied the next buffer, try to refill it */
-                    if (more == 0) {
-                        more = readn(g.ind, next, g.block);
-                        ulen += (unsigned long)more;
-                        start = 0;
-                    }
-                }
-                left--;
-                hash = ((hash << 1) ^ *scan++) & RSYNCMASK;
-            } while (hash != RSYNCHIT);
-            got -= left;
-        }
+    /* set up input and output */
+    job->out = get_space(&g.out_pool);
+    if (g.level <= 9) {
+        strm->next_in = job->in->buf;
+        strm->next_out = job->out->buf;
+    }
+    else
+        memcpy((*temp)->buf + (*temp)->len, job->in->buf, job->in->len);
 
-        /* clear history for --independent option */
-        fresh = 0;
-        if (!g.setdict) {
-            have += got;
-            if (have > g.block) {
-                fresh = 1;
-                have = got;
-            }
-        }
+    /* compress each block, either flushing or finishing */
+    next = job->lens == NULL ? NULL : job->lens->buf;
+    left = job->in->len;
+    job->out->len = 0;
+    do {
+        /* decode next block length from blocks list */
+        len = next_len(&next, left);
+        left -= len;
 
         if (g.level <= 9) {
-            /* clear history if requested */
-            if (fresh)
-                (void)deflateReset(strm);
-
-            /* compress MAXP2-size chunks in case unsigned type is small */
-            while (got > MAXP2) {
+            /* run MAXP2-sized amounts of input through deflate -- this
+               loop is needed for those cases where the unsigned type
+               is smaller than the size_t type, or when len is close to
+               the limit of the size_t type */
+            while (len > MAXP2) {
                 strm->avail_in = MAXP2;
-                check = CHECK(check, strm->next_in, strm->avail_in);
-                DEFLATE_WRITE(Z_NO_FLUSH);
-                got -= MAXP2;
+                deflate_engine(strm, job->out, Z_NO_FLUSH);
+                len -= MAXP2;
             }
 
-            /* compress the remainder, emit a block, finish if end of input */
-            strm->avail_in = (unsigned)got;
-            got = left;
-            check = CHECK(check, strm->next_in, strm->avail_in);
-            if (more || got) {
+            /* run the last piece through deflate -- end on a byte
+               boundary, using a sync marker if necessary, or finish
+               the deflate stream if this is the last block */
+            strm->avail_in = (unsigned)len;
+            if (left || job->more) {
 #if ZLIB_VERNUM >= 0x1260
-                int bits;
+                deflate_engine(strm, job->out, Z_BLOCK);
 
-                DEFLATE_WRITE(Z_BLOCK);
+                /* add enough empty blocks to get to a byte boundary */
                 (void)deflatePending(strm, Z_NULL, &bits);
                 if (bits & 1)
-                    DEFLATE_WRITE(Z_SYNC_FLUSH);
+                    deflate_engine(strm, job->out, Z_SYNC_FLUSH);
                 else if (bits & 7) {
-                    do {
+                    do {        /* add static empty blocks */
                         bits = deflatePrime(strm, 10, 2);
                         assert(bits == Z_OK);
                         (void)deflatePending(strm, Z_NULL, &bits);
                     } while (bits & 7);
-                    DEFLATE_WRITE(Z_NO_FLUSH);
+                    deflate_engine(strm, job->out, Z_BLOCK);
                 }
 #else
-                DEFLATE_WRITE(Z_SYNC_FLUSH);
+                deflate_engine(strm, job->out, Z_SYNC_FLUSH);
 #endif
             }
             else
-                DEFLATE_WRITE(Z_FINISH);
+                deflate_engine(strm, job->out, Z_FINISH);
         }
         else {
-            /* compress got bytes using zopfli, bring to byte boundary */
+            /* compress len bytes using zopfli, end at byte boundary */
             unsigned char bits, *out;
-            size_t outsize, off;
-
-            /* discard history if requested */
-            off = strm->next_in - in;
-            if (fresh)
-                hist = off;
+            size_t outsize;
 
             out = NULL;
             outsize = 0;
             bits = 0;
-            ZopfliDeflatePart(&g.zopts, 2, !(more || left),
-                              in + hist, off - hist, (off - hist) + got,
+            ZopfliDeflatePart(&g.zopts, 2, !(left || job->more),
+                              (*temp)->buf, (*temp)->len, (*temp)->len + len,
                               &bits, &out, &outsize);
-            bits &= 7;
-            if ((more || left) && bits) {
+            assert(job->out->len + outsize + 5 <= job->out->size);
+            memcpy(job->out->buf + job->out->len, out, outsize);
+            free(out);
+            job->out->len += outsize;
+            if (left || job->more) {
+                bits &= 7;
                 if (bits & 1) {
-                    writen(g.outd, out, outsize);
                     if (bits == 7)
-                        writen(g.outd, (unsigned char *)"\0", 1);
-                    writen(g.outd, (unsigned char *)"\0\0\xff\xff", 4);
+                        job->out->buf[job->out->len++] = 0;
+                    job->out->buf[job->out->len++] = 0;
+                    job->out->buf[job->out->len++] = 0;
+                    job->out->buf[job->out->len++] = 0xff;
+                    job->out->buf[job->out->len++] = 0xff;
                 }
-                else {
-                    assert(outsize > 0);
-                    writen(g.outd, out, outsize - 1);
+                else if (bits) {
                     do {
-                        out[outsize - 1] += 2 << bits;
-                        writen(g.outd, out + outsize - 1, 1);
-                        out[outsize - 1] = 0;
+                        job->out->buf[job->out->len - 1] += 2 << bits;
+                        job->out->buf[job->out->len++] = 0;
                         bits += 2;
                     } while (bits < 8);
-                    writen(g.outd, out + outsize - 1, 1);
                 }
             }
-            else
-                writen(g.outd, out, outsize);
-            free(out);
-            while (got > MAXP2) {
-                check = CHECK(check, strm->next_in, MAXP2);
-                strm->next_in += MAXP2;
-                got -= MAXP2;
-            }
-            check = CHECK(check, strm->next_in, (unsigned)got);
-            strm->next_in += got;
-            got = left;
+            (*temp)->len += len;
         }
-
-        /* do until no more input */
-    } while (more || got);
-
-    /* write trailer */
-    put_trailer(ulen, clen, check, head);
+    } while (left);
+    drop_space(*temp);          /* return to this stream's pool */
+    *temp = NULL;
+    drop_space(job->lens);
+    job->lens = NULL;
+    Trace(("-- compressed #%ld%s", job->seq, job->more ? "" : " (last)"));
+    return 0;
 }
 
-/* --- decompression --- */
-
-#ifndef NOTHREAD
-/* parallel read thread */
-local void load_read(void *dummy)
+/* get the next compression job from the head of the list, compress and compute
+   the check value on the input, and put a job in the write list with the
+   results -- keep looking for more jobs, returning when a job is found with a
+   sequence number of -1 (leave that job in the list for other incarnations to
+   find) */
+local void compress_thread(void *dummy)
 {
-    size_t len;
+    struct job *job;                /* job pulled and working on */
+    volatile int copied;            /* true if copied, not compressed */
+    unsigned long check;            /* check value of input */
+    unsigned char *next;            /* pointer for check value data */
+    size_t len;                     /* remaining bytes to check */
+    struct space *volatile temp = NULL; /* temporary space for zopfli input */
+    int ret;                        /* zlib return code */
+    z_stream strm;                  /* deflate stream */
+    volatile double start;          /* start of work for --stats */
+#ifdef PIGZ_LIB
+    void *own = NULL;               /* batch work state for this thread */
+#endif
     ball_t err;                     /* error information from throw() */
 
     (void)dummy;
 
-    Trace(("-- launched decompress read thread"));
     try {
-        do {
-            possess(g.load_state);
-            wait_for(g.load_state, TO_BE, 1);
-            g.in_len = len = readn(g.ind, g.in_which ? g.in_buf : g.in_buf2,
-                                   BUF);
-            Trace(("-- decompress read thread read %lu bytes", len));
-            twist(g.load_state, TO, 0);
-        } while (len == BUF);
+        /* initialize the deflate stream for this thread */
+        strm.zfree = ZFREE;
+        strm.zalloc = ZALLOC;
+        strm.opaque = OPAQUE;
+        ret = deflateInit2(&strm, 6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+        if (ret == Z_MEM_ERROR)
+            throw(ENOMEM, "not enough memory");
+        if (ret != Z_OK)
+            throw(EINVAL, "internal error");
+
+        /* keep looking for work */
+        for (;;) {
+            /* get a job (like I tell my son) */
+            possess(compress_have);
+            stat_wait(compress_have, NOT_TO_BE, 0, W_COMPRESS);
+            job = compress_head;
+            assert(job != NULL);
+            if (job->seq == -1)
+                break;
+            BIND(job->ctx);
+            compress_head = job->next;
+            if (job->next == NULL)
+                compress_tail = &compress_head;
+            twist(compress_have, BY, -1);
+            start = stat_start();
+            PROG(busy, 1);
+
+#ifdef PIGZ_LIB
+            /* a batch job is a whole, independent buffer */
+            if (job->batch != NULL) {
+                job->batch->work(job, &strm, &own);
+                continue;
+            }
+#endif
+
+            /* compress the job, or copy it from the previous output or the
+               block cache -- in the library, an error in a stream's job is
+               noted in the job for the write thread to end the stream with,
+               instead of ending the process, and the job's input stands in
+               for its output so that the stream can still run to its end */
+#ifdef PIGZ_LIB
+            try {
+                copied = compress_job(job, &strm, &temp);
+            }
+            catch (err) {
+                if (g.outd != IOFUNC)
+                    punt(err);
+                job->fail = err.code;
+                drop(err);
+                drop_space(temp);
+                temp = NULL;
+                drop_space(job->lens);
+                job->lens = NULL;
+                drop_space(job->out);
+                use_space(job->in);
+                job->out = job->in;
+                copied = 0;
+            }
+#else
+            copied = compress_job(job, &strm, &temp);
+#endif
+            if (copied) {
+                /* pass it on to the write thread */
+                stat_work(S_COMPRESS, start, 0, job->seq);
+                PROG(busy, -1);
+                write_job(job);
+                possess(job->calc);
+                twist(job->calc, TO, 1);
+                continue;
+            }
+
+            /* reserve input buffer until check value has been calculated,
+               and the output buffer until it has been cached */
+            use_space(job->in);
+            if (g.cache != NULL)
+                use_space(job->out);
+
+            /* put job in the write list, alert write thread */
+            start = stat_work(S_COMPRESS, start, 0, job->seq);
+            write_job(job);
+
+            /* calculate the check value in parallel with writing, alert the
+               write thread that the calculation is complete, and drop this
+               usage of the input buffer */
+            len = job->in->len;
+            next = job->in->buf;
+            check = CHECK(0L, Z_NULL, 0);
+            while (len > MAXP2) {
+                check = CHECK(check, next, MAXP2);
+                len -= MAXP2;
+                next += MAXP2;
+            }
+            check = CHECK(check, next, (unsigned)len);
+            drop_space(job->in);
+            job->check = check;
+            stat_work(S_CHECK, start, 0, job->seq);
+            Trace(("-- checked #%ld%s", job->seq, job->more ? "" : " (last)"));
+            if (g.cache != NULL) {
+                cache_put(job, job->out);
+                drop_space(job->out);
+            }
+            PROG(busy, -1);
+            possess(job->calc);
+            twist(job->calc, TO, 1);
+
+            /* done with that one -- go find another job */
+        }
+
+        /* found job with seq == -1 -- return to join */
+        drop_space(temp);
+        release(compress_have);
+        (void)deflateEnd(&strm);
+#ifdef PIGZ_LIB
+        free(own);
+#endif
+        perf_close();
     }
     catch (err) {
         THREADABORT(err);
     }
-    Trace(("-- exited decompress read thread"));
 }
-#endif
 
-/* load() is called when the input has been consumed in order to provide more
-   input data: load the input buffer with BUF or fewer bytes (fewer if at end
-   of file) from the file g.ind, set g.in_next to point to the g.in_left bytes
-   read, update g.in_tot, and return g.in_left -- g.in_eof is set to true when
-   g.in_left has gone to zero and there is no more data left to read */
-local size_t load(void)
+/* write empty deflate blocks to advance the output from offset at to the next
+   multiple of g.align, adding g.align to the padding if needed to make it
+   possible, and return the number of bytes written -- each unit of padding is
+   k empty fixed blocks (ten bits each) followed by an empty stored block,
+   which is 5, 6, 7, 9, 10, 11, or 12 bytes for k = 0..6 (eight bytes is not
+   possible with a single unit) -- since the preceding compressed data ended on
+   a byte boundary, the padding does too */
+local size_t align_pad(uint64_t at)
 {
-    /* if already detected end of file, do nothing */
-    if (g.in_short) {
-        g.in_eof = 1;
-        g.in_left = 0;
-        return 0;
+    size_t pad, left, unit, bit, k;
+    unsigned char buf[16];
+
+    pad = (size_t)((g.align - at % g.align) % g.align);
+    if ((pad > 0 && pad < 5) || pad == 8)
+        pad += g.align;
+    left = pad;
+    while (left) {
+        /* use five-byte units while leaving a length that one or two units
+           can make, where 13 is made with 6 + 7 */
+        unit = left >= 10 && left != 13 ? 5 : (left == 13 ? 6 : left);
+        k = unit < 8 ? unit - 5 : unit - 6;
+        memset(buf, 0, unit);
+        for (bit = 0; bit < k; bit++)
+            buf[(bit * 10 + 1) >> 3] |= 1 << ((bit * 10 + 1) & 7);
+        buf[unit - 2] = 0xff;
+        buf[unit - 1] = 0xff;
+        outn(buf, unit);
+        left -= unit;
     }
+    return pad;
+}
 
-#ifndef NOTHREAD
-    /* if first time in or procs == 1, read a buffer to have something to
-       return, otherwise wait for the previous read job to complete */
-    if (g.procs > 1) {
-        /* if first time, fire up the read thread, ask for a read */
-        if (g.in_which == -1) {
-            g.in_which = 1;
-            g.load_state = new_lock(1);
-            g.load_thread = launch(load_read, NULL);
-        }
-
-        /* wait for the previously requested read to complete */
-        possess(g.load_state);
-        wait_for(g.load_state, TO_BE, 0);
-        release(g.load_state);
+/* collect the write jobs off of the list in sequence order and write out the
+   compressed data until the last chunk is written -- also write the header and
+   trailer and combine the individual check values of the input buffers */
+local void write_thread(void *ctx)
+{
+    long seq;                       /* next sequence number looking for */
+    struct job *job;                /* job pulled and working on */
+    size_t len;                     /* input length */
+    int more;                       /* true if more chunks to write */
+    unsigned long head;             /* header length */
+    unsigned long ulen;             /* total uncompressed size (overflow ok) */
+    unsigned long clen;             /* total compressed size (overflow ok) */
+    unsigned long check;            /* check value of uncompressed data */
+    uint64_t at;                    /* offset in output for block index */
+    uint64_t in;                    /* offset in input for journal */
+    size_t olen;                    /* compressed length for block index */
+    double start;                   /* start of write for --stats */
+    ball_t err;                     /* error information from throw() */
 
-        /* set up input buffer with the data just read */
-        g.in_next = g.in_which ? g.in_buf : g.in_buf2;
-        g.in_left = g.in_len;
+    BIND(ctx);
 
-        /* if not at end of file, alert read thread to load next buffer,
-           alternate between g.in_buf and g.in_buf2 */
-        if (g.in_len == BUF) {
-            g.in_which = 1 - g.in_which;
-            possess(g.load_state);
-            twist(g.load_state, TO, 1);
+    try {
+        /* build and write header, or pick up where the journal left off */
+        Trace(("-- write thread running"));
+        if (jnl.resumed) {
+            head = jnl.head;
+            at = jnl.out;
+            in = jnl.in;
+            ulen = (unsigned long)in;
+            clen = (unsigned long)(at - head);
+            check = jnl.check;
         }
-
-        /* at end of file -- join read thread (already exited), clean up */
         else {
-            join(g.load_thread);
-            free_lock(g.load_state);
-            g.in_which = -1;
+            head = tee.n ? tee_header() : put_header(g.form);
+            at = head;
+            in = 0;
+            ulen = clen = 0;
+            check = CHECK(0L, Z_NULL, 0);
         }
-    }
-    else
+
+        /* process output of compress threads until end of input */
+        seq = 0;
+        do {
+            /* get next write job in order */
+            possess(g.write_first);
+            stat_wait(g.write_first, TO_BE, seq, W_WRITE);
+            job = g.write_head;
+            g.write_head = job->next;
+#ifdef PIGZ_LIB
+            if (job->fail && g.fail == 0)
+                g.fail = job->fail;     /* lib_put() delivers no more */
 #endif
-    {
-        /* don't use threads -- simply read a buffer into g.in_buf */
-        g.in_left = readn(g.ind, g.in_next = g.in_buf, BUF);
-    }
+            twist(g.write_first, TO,
+                  g.write_head == NULL ? -1 : g.write_head->seq);
 
-    /* note end of file */
-    if (g.in_left < BUF) {
-        g.in_short = 1;
+            /* update lengths, save uncompressed length for COMB */
+            more = job->more;
+            len = job->in->len;
+            if (jnl.fd != -1)
+                jnl_add(job->in->buf, len);
+            if (dig.th != NULL)
+                dig_space(job->in);
+            drop_space(job->in);
+            ulen += (unsigned long)len;
+            in += len;
+            clen += (unsigned long)(job->out->len);
 
-        /* if we got bupkis, now is the time to mark eof */
-        if (g.in_left == 0)
-            g.in_eof = 1;
-    }
+            /* pad with empty blocks to start the block on an alignment
+               boundary if requested */
+            if (g.align) {
+                olen = align_pad(at);
+                clen += (unsigned long)olen;
+                at += olen;
+            }
 
-    /* update the total and return the available bytes */
-    g.in_tot += g.in_left;
-    return g.in_left;
-}
+            /* write the compressed data and drop the output buffer */
+            Trace(("-- writing #%ld", seq));
+            start = stat_start();
+            writen(g.outd, job->out->buf, job->out->len);
+            stat_work(S_WRITE, start, 0, seq);
+            if (tee.n)
+                tee_space(job->out);
+            olen = job->out->len;
+            drop_space(job->out);
+            stat_data(len, olen, job->made);
+            PROG(out, olen);
+            Trace(("-- wrote #%ld%s", seq, more ? "" : " (last)"));
 
-/* initialize for reading new input */
-local void in_init(void)
-{
-    g.in_left = 0;
-    g.in_eof = 0;
-    g.in_short = 0;
-    g.in_tot = 0;
-#ifndef NOTHREAD
-    g.in_which = -1;
-#endif
-}
+            /* wait for check calculation to complete, then combine, once
+               the compress thread is done with the input, release it */
+            possess(job->calc);
+            stat_wait(job->calc, TO_BE, 1, W_CALC);
+            release(job->calc);
+            check = COMB(check, job->check, len);
 
-/* buffered reading macros for decompression and listing */
-#define GET() (g.in_left == 0 && (g.in_eof || load() == 0) ? 0 : \
-               (g.in_left--, *g.in_next++))
-#define GET2() (tmp2 = GET(), tmp2 + ((unsigned)(GET()) << 8))
-#define GET4() (tmp4 = GET2(), tmp4 + ((unsigned long)(GET2()) << 16))
-#define SKIP(dist) \
-    do { \
-        size_t togo = (dist); \
-        while (togo > g.in_left) { \
-            togo -= g.in_left; \
-            if (load() == 0) \
-                return -3; \
-        } \
-        g.in_left -= togo; \
-        g.in_next += togo; \
-    } while (0)
+            /* add the block to the index, count reused blocks */
+            if (idx.outd != -1)
+                index_add(job->key, at, olen, len, job->check, 0);
+            at += olen;
+            if (job->reused)
+                idx.hits++;
+
+            /* checkpoint the output if journaling */
+            if (jnl.fd != -1 && more)
+                jnl_save(at, in, check, head);
+
+            /* report progress if requested (for a flush to wait on) */
+            if (g.wrote != NULL) {
+                possess(g.wrote);
+                twist(g.wrote, TO, (long)(in & 0x7fffffff));
+            }
 
-/* GET(), GET2(), GET4() and SKIP() equivalents, with crc update */
-#define GETC() (g.in_left == 0 && (g.in_eof || load() == 0) ? 0 : \
-                (g.in_left--, crc = crc32(crc, g.in_next, 1), *g.in_next++))
-#define GET2C() (tmp2 = GETC(), tmp2 + ((unsigned)(GETC()) << 8))
-#define GET4C() (tmp4 = GET2C(), tmp4 + ((unsigned long)(GET2C()) << 16))
-#define SKIPC(dist) \
-    do { \
-        size_t togo = (dist); \
-        while (togo > g.in_left) { \
-            crc = crc32(crc, g.in_next, g.in_left); \
-            togo -= g.in_left; \
-            if (load() == 0) \
-                return -3; \
-        } \
-        crc = crc32(crc, g.in_next, togo); \
-        g.in_left -= togo; \
-        g.in_next += togo; \
-    } while (0)
+            /* free the job */
+            free_lock(job->calc);
+            FREE(job);
 
-/* pull LSB order or MSB order integers from an unsigned char buffer */
-#define PULL2L(p) ((p)[0] + ((unsigned)((p)[1]) << 8))
-#define PULL4L(p) (PULL2L(p) + ((unsigned long)(PULL2L((p) + 2)) << 16))
-#define PULL2M(p) (((unsigned)((p)[0]) << 8) + (p)[1])
-#define PULL4M(p) (((unsigned long)(PULL2M(p)) << 16) + PULL2M((p) + 2))
+            /* get the next buffer in sequence */
+            seq++;
+        } while (more);
 
-/* convert MS-DOS date and time to a Unix time, assuming current timezone
-   (you got a better idea?) */
-local time_t dos2time(unsigned long dos)
-{
-    struct tm tm;
+        /* write trailer, end the index with the total output length */
+        at += tee.n ? tee_trailer(ulen, clen, check, head) :
+                      put_trailer(ulen, clen, check, head, g.form);
+        if (idx.outd != -1)
+            index_add(NULL, at, 0, 0, 0, 1);
 
-    if (dos == 0)
-        return time(NULL);
-    tm.tm_year = ((int)(dos >> 25) & 0x7f) + 80;
-    tm.tm_mon  = ((int)(dos >> 21) & 0xf) - 1;
-    tm.tm_mday = (int)(dos >> 16) & 0x1f;
-    tm.tm_hour = (int)(dos >> 11) & 0x1f;
-    tm.tm_min  = (int)(dos >> 5) & 0x3f;
-    tm.tm_sec  = (int)(dos << 1) & 0x3e;
-    tm.tm_isdst = -1;           /* figure out if DST or not */
-    return mktime(&tm);
+        /* verify no more jobs, prepare for next use (in the library, other
+           streams can have jobs in the compress list) */
+#ifndef PIGZ_LIB
+        possess(compress_have);
+        assert(compress_head == NULL && peek_lock(compress_have) == 0);
+        release(compress_have);
+#endif
+        possess(g.write_first);
+        assert(g.write_head == NULL);
+        twist(g.write_first, TO, -1);
+        perf_close();
+    }
+    catch (err) {
+        THREADABORT(err);
+    }
 }
 
-/* convert an unsigned 32-bit integer to signed, even if long > 32 bits */
-local long tolong(unsigned long val)
+/* encode a hash hit to the block lengths list -- hit == 0 ends the list */
+local void append_len(struct job *job, size_t len)
 {
-    return (long)(val & 0x7fffffffUL) - (long)(val & 0x80000000UL);
-}
+    struct space *lens;
 
-#define LOW32 0xffffffffUL
+    assert(len < 539000896UL);
+    if (job->lens == NULL)
+        job->lens = get_space(&g.lens_pool);
+    lens = job->lens;
+    if (lens->size < lens->len + 3)
+        grow_space(lens);
+    if (len < 64)
+        lens->buf[lens->len++] = len + 128;
+    else if (len < 32832U) {
+        len -= 64;
+        lens->buf[lens->len++] = len >> 8;
+        lens->buf[lens->len++] = len;
+    }
+    else if (len < 2129984UL) {
+        len -= 32832U;
+        lens->buf[lens->len++] = (len >> 16) + 192;
+        lens->buf[lens->len++] = len >> 8;
+        lens->buf[lens->len++] = len;
+    }
+    else {
+        len -= 2129984UL;
+        lens->buf[lens->len++] = (len >> 24) + 224;
+        lens->buf[lens->len++] = len >> 16;
+        lens->buf[lens->len++] = len >> 8;
+        lens->buf[lens->len++] = len;
+    }
+}
 
-/* process zip extra field to extract zip64 lengths and Unix mod time */
-local int read_extra(unsigned len, int save)
+/* read up to len bytes of input to compress into buf, as readn() does -- with
+   --flush-interval or --follow, if the input read since the last flush has
+   been waiting for the flush interval for more input, return early with
+   g.flushed set, as g.get() does for a library flush, so that what has been
+   read so far is compressed and written now (poll() is only consulted while
+   there is unflushed input, and returns at once when input is streaming in)
+   -- with --follow, wait at the end of the file for more */
+local size_t readi(unsigned char *buf, size_t len)
 {
-    unsigned id, size, tmp2;
-    unsigned long tmp4;
+    ssize_t ret;
+    size_t got;
+    long ms, wait;
+    struct timeval now;
+    struct pollfd fds;
 
-    /* process extra blocks */
-    while (len >= 4) {
-        id = GET2();
-        size = GET2();
-        if (g.in_eof)
-            return -1;
-        len -= 4;
-        if (size > len)
-            break;
-        len -= size;
-        if (id == 0x0001) {
-            /* Zip64 Extended Information Extra Field */
-            if (g.zip_ulen == LOW32 && size >= 8) {
-                g.zip_ulen = GET4();
-                SKIP(4);
-                size -= 8;
-            }
-            if (g.zip_clen == LOW32 && size >= 8) {
-                g.zip_clen = GET4();
-                SKIP(4);
-                size -= 8;
+    ms = g.flushint ? g.flushint : flw.on ? FOLLOWINT : 0;
+    if (ms == 0 || g.ind == IOFUNC)
+        return readn(g.ind, buf, len);
+    fds.fd = g.ind;
+    fds.events = POLLIN;
+    got = 0;
+    while (len && !flw.stop) {
+        /* if holding unflushed input, wait for more no longer than what is
+           left of the interval */
+        wait = FOLLOWPOLL;
+        if (g.unflushed) {
+            gettimeofday(&now, NULL);
+            wait = ms - ((now.tv_sec - g.since.tv_sec) * 1000L +
+                         (now.tv_usec - g.since.tv_usec) / 1000);
+            ret = wait > 0 ? poll(&fds, 1, (int)wait) : 0;
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret == 0) {
+                g.flushed = 1;
+                g.unflushed = 0;
+                break;
             }
         }
-        if (save) {
-            if ((id == 0x000d || id == 0x5855) && size >= 8) {
-                /* PKWare Unix or Info-ZIP Type 1 Unix block */
-                SKIP(4);
-                g.stamp = tolong(GET4());
-                size -= 8;
-            }
-            if (id == 0x5455 && size >= 5) {
-                /* Extended Timestamp block */
-                size--;
-                if (GET() & 1) {
-                    g.stamp = tolong(GET4());
-                    size -= 4;
-                }
-            }
+
+        /* read what is there, or wait for more if following */
+        ret = read(g.ind, buf, len);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            throw(errno, "read error on %s (%s)", g.inf, strerror(errno));
+        if (ret == 0) {
+            if (flw.on && flw_wait(wait))
+                continue;
+            break;
         }
-        SKIP(size);
+        if (!g.unflushed) {
+            gettimeofday(&g.since, NULL);
+            g.unflushed = 1;
+        }
+        buf += ret;
+        len -= ret;
+        got += ret;
     }
-    SKIP(len);
-    return 0;
+    return got;
 }
 
-/* read a gzip, zip, zlib, or lzw header from ind and return the method in the
-   range 0..256 (256 implies a zip method greater than 255), or on error return
-   negative: -1 is immediate EOF, -2 is not a recognized compressed format, -3
-   is premature EOF within the header, -4 is unexpected header flag values, -5
-   is the zip central directory, -6 is a failed gzip header crc check; a method
-   of 257 is lzw -- if the return value is not negative, then get_header() sets
-   g.form to indicate gzip (0), zlib (1), or zip (2, or 3 if the entry is
-   followed by a data descriptor) */
-local int get_header(int save)
-{
-    unsigned magic;             /* magic header */
-    int method;                 /* compression method */
-    int flags;                  /* header flags */
+/* compress ind to outd, using multiple threads for the compression and check
+   value calculations and one other thread for writing the output -- compress
+   threads will be launched and left running (waiting actually) to support
+   subsequent calls of parallel_compress() */
+local void parallel_compress(void)
+{
+    long seq;                       /* sequence number */
+    struct space *curr;             /* input data to compress */
+    struct space *next;             /* input data that follows curr */
+    struct space *hold;             /* input data that follows next */
+    struct space *dict;             /* dictionary for next compression */
+    struct job *job;                /* job for compress, then write */
+    int more;                       /* true if more input to read */
+    int cut;                        /* true if curr was ended by a flush */
+    int ncut;                       /* true if next was ended by a flush */
+    unsigned hash;                  /* hash for rsyncable */
+    unsigned char *scan;            /* next byte to compute hash on */
+    unsigned char *end;             /* after end of data to compute hash on */
+    unsigned char *last;            /* position after last hit */
+    size_t left;                    /* last hit in curr to end of curr */
+    size_t len;                     /* for various length computations */
+    double start;                   /* start of read for --stats */
+    double made = 0;                /* when next was read for --stats */
+
+    /* if first time or after an option change, setup the job lists */
+    setup_jobs();
+    if (stats.on && stats.threads[S_COMPRESS] < g.procs)
+        stats.threads[S_COMPRESS] = stats.threads[S_CHECK] = g.procs;
+
+    /* open the block index, the previous output, the block cache, and the
+       journal, follow the input, open the tee destinations, and start the
+       digest, if requested */
+    index_open();
+    cache_open();
+    jnl_open();
+    flw_open();
+    tee_open();
+    dig_open();
+
+    /* start write thread */
+    g.writeth = launch(write_thread, gp);
+
+    /* read from input and start compress threads (write thread will pick up
+       the output of the compress threads) */
+    seq = 0;
+    g.flushed = 0;
+    g.unflushed = 0;
+    next = get_space(&g.in_pool);
+    start = stat_start();
+    next->len = readi(next->buf, next->size);
+    made = stat_work(S_READ, start, 0, 0);
+    PROG(in, next->len);
+    ncut = g.flushed;
+    hold = NULL;
+    dict = NULL;
+    if (jnl.resumed && g.setdict) {
+        dict = get_space(&g.dict_pool);
+        memcpy(dict->buf, jnl.slot + 32, DICT);
+        dict->len = DICT;
+    }
+    scan = next->buf;
+    hash = RSYNCHIT;
+    left = 0;
+    do {
+        /* create a new job */
+        job = alloc(NULL, sizeof(struct job));
+        job->calc = new_lock(0);
+        label_lock(job->calc, "job", "calc");
+        job->made = made;
+
+        /* update input spaces */
+        curr = next;
+        next = hold;
+        hold = NULL;
+
+        /* get more input if we don't already have some -- if the input for
+           curr was ended by a flush of a g.get() input or by the flush
+           interval, then compress curr now instead of waiting for more
+           input */
+        if (next == NULL) {
+            cut = ncut;
+            next = get_space(&g.in_pool);
+            g.flushed = 0;
+            start = stat_start();
+            next->len = cut ? 0 : readi(next->buf, next->size);
+            made = stat_work(S_READ, start, 0, seq + 1);
+            PROG(in, next->len);
+            ncut = g.flushed;
+        }
+        else
+            cut = 0;
+
+        /* if rsyncable, generate block lengths and prepare curr for job to
+           likely have less than size bytes (up to the last hash hit) */
+        job->lens = NULL;
+        if (g.rsync && curr->len) {
+            /* compute the hash function starting where we last left off to
+               cover either size bytes or to EOF, whichever is less, through
+               the data in curr (and in the next loop, through next) -- save
+               the block lengths resulting from the hash hits in the job->lens
+               list */
+            if (left == 0) {
+                /* scan is in curr */
+                last = curr->buf;
+                end = curr->buf + curr->len;
+                while (scan < end) {
+                    hash = ((hash << 1) ^ *scan++) & RSYNCMASK;
+                    if (hash == RSYNCHIT) {
+                        len = scan - last;
+                        append_len(job, len);
+                        last = scan;
+                    }
+                }
+
+                /* continue scan in next */
+                left = scan - last;
+                scan = next->buf;
+            }
+
+            /* scan in next for enough bytes to fill curr, or what is available
+               in next, whichever is less (if next isn't full, then we're at
+               the end of the file) -- the bytes in curr since the last hit,
+               stored in left, counts towards the size of the first block */
+            last = next->buf;
+            len = curr->size - curr->len;
+            if (len > next->len)
+                len = next->len;
+            end = next->buf + len;
+            while (scan < end) {
+                hash = ((hash << 1) ^ *scan++) & RSYNCMASK;
+                if (hash == RSYNCHIT) {
+                    len = (scan - last) + left;
+                    left = 0;
+                    append_len(job, len);
+                    last = scan;
+                }
+            }
+            append_len(job, 0);
+
+            /* create input in curr for job up to last hit or entire buffer if
+               no hits at all -- save remainder in next and possibly hold */
+            len = (job->lens->len == 1 ? scan : last) - next->buf;
+            if (len) {
+                /* got hits in next, or no hits in either -- copy to curr */
+                memcpy(curr->buf + curr->len, next->buf, len);
+                curr->len += len;
+                memmove(next->buf, next->buf + len, next->len - len);
+                next->len -= len;
+                scan -= len;
+                left = 0;
+            }
+            else if (job->lens->len != 1 && left && next->len) {
+                /* had hits in curr, but none in next, and last hit in curr
+                   wasn't right at the end, so we have input there to save --
+                   use curr up to the last hit, save the rest, moving next to
+                   hold */
+                hold = next;
+                next = get_space(&g.in_pool);
+                memcpy(next->buf, curr->buf + (curr->len - left), left);
+                next->len = left;
+                curr->len -= left;
+            }
+            else {
+                /* else, last match happened to be right at the end of curr,
+                   or we're at the end of the input compressing the rest */
+                left = 0;
+            }
+        }
+        else if (g.rsync) {
+            /* curr is empty after a flush, continue the scan in next */
+            scan = next->buf;
+            left = 0;
+        }
+
+        /* compress curr->buf to curr->len -- compress thread will drop curr */
+        job->in = curr;
+
+        /* set job->more if there is more to compress after curr (an empty next
+           ended by a flush may still be followed by more input) */
+        more = next->len != 0 || cut || ncut;
+        job->more = more;
+
+        /* provide dictionary for this job, prepare dictionary for next job */
+        job->out = dict;
+        if (more && g.setdict) {
+            if (curr->len >= DICT || job->out == NULL) {
+                dict = curr;
+                use_space(dict);
+            }
+            else {
+                dict = get_space(&g.dict_pool);
+                len = DICT - curr->len;
+                if (len > job->out->len)
+                    len = job->out->len;
+                memcpy(dict->buf, job->out->buf + (job->out->len - len), len);
+                memcpy(dict->buf + len, curr->buf, curr->len);
+                dict->len = len + curr->len;
+            }
+        }
+
+        /* preparation of job is complete */
+        job->seq = seq;
+        job->ctx = gp;
+#ifdef PIGZ_LIB
+        job->batch = NULL;
+        job->fail = 0;
+#endif
+        Trace(("-- read #%ld%s", seq, more ? "" : " (last)"));
+        if (++seq < 1)
+            throw(EOVERFLOW, "overflow");
+
+        /* start another compress thread if needed (the compress threads are
+           shared by all streams), put job at end of compress list, let all
+           the compressors know */
+        possess(compress_have);
+        if (cthreads < seq && cthreads < g.procs) {
+            (void)launch(compress_thread, NULL);
+            ATOM_ADD(cthreads, 1);
+        }
+        job->next = NULL;
+        *compress_tail = job;
+        compress_tail = &(job->next);
+        twist(compress_have, BY, +1);
+    } while (more);
+    drop_space(next);
+
+    /* wait for the write thread to complete (we leave the compress threads out
+       there and waiting in case there is another stream to compress) */
+    join(g.writeth);
+    g.writeth = NULL;
+    Trace(("-- write thread joined"));
+    if (g.reuse != NULL && g.verbosity > 1)
+        fprintf(stderr, "(reused %ld of %ld blocks) ", idx.hits, seq);
+    if (g.cache != NULL && g.verbosity > 1)
+        fprintf(stderr, "(cached %ld of %ld blocks, %llu bytes) ",
+                cache.hits, cache.tries, (unsigned long long)cache.saved);
+    if (jnl.resumed && g.verbosity > 1)
+        fprintf(stderr, "(resumed at %llu) ", (unsigned long long)jnl.in);
+    index_close();
+    cache_close();
+    jnl_close(1);
+    flw_close();
+    out_tee = NULL;                 /* keep the tee destinations open */
+    dig_close();
+}
+
+/* -- cache of whole compressed files by content and options -- */
+
+/* With --cache-dir dir, the compressed output for a regular input file is
+   saved in dir, named by a SHA-256 digest of the input data, the options that
+   affect the output, and the header contents.  When an input with the same
+   digest is compressed later, the saved output is copied instead, cloning it
+   (sharing the same storage) if the file system permits.  The digest is
+   computed while the input is being read by another thread.  Outputs are only
+   saved when written to a file, since the output is read back from there to
+   save it.  With --cache-size, the least recently used saved outputs are
+   deleted to keep the total size of dir under that limit, where use is
+   tracked using the modification time of each saved output. */
+
+#define WHOLEBUF 131072         /* input buffer size for computing digest */
+
+/* whole file cache state */
+local struct {
+    lock *ready;                /* number of filled buffers (0..2) */
+    unsigned char *buf[2];      /* alternating input buffers */
+    size_t len[2];              /* amount of input in each buffer */
+    char *path;                 /* path for this input in the cache, or NULL */
+} whole;
+
+/* read the input into alternating buffers for whole_key(), ending with an
+   empty buffer */
+local void whole_read(void *ctx)
+{
+    int k;
+    size_t len;
+    ball_t err;
+
+    BIND(ctx);
+    try {
+        k = 0;
+        do {
+            possess(whole.ready);
+            wait_for(whole.ready, TO_BE_LESS_THAN, 2);
+            release(whole.ready);
+            len = readn(g.ind, whole.buf[k], WHOLEBUF);
+            whole.len[k] = len;
+            possess(whole.ready);
+            twist(whole.ready, BY, +1);
+            k ^= 1;
+        } while (len);
+    }
+    catch (err) {
+        THREADABORT(err);
+    }
+}
+
+/* compute the cache path for the input, reading the input in another thread
+   while computing the digest, and then rewind the input -- return false if
+   the input is not a regular file */
+local int whole_key(void)
+{
+    int k;
+    size_t len;
+    thread *reader;
+    struct stat st;
+    sha256_t sha;
+    unsigned char dig[32];
+
+    /* only regular files can be rewound */
+    if (fstat(g.ind, &st) || (st.st_mode & S_IFMT) != S_IFREG ||
+            lseek(g.ind, 0, SEEK_SET) != 0)
+        return 0;
+
+    /* hash the options that affect the output and the header contents */
+    sha256_init(&sha);
+    opts_key(&sha);
+
+    /* hash the input data as it is read */
+    whole.buf[0] = alloc(NULL, WHOLEBUF);
+    whole.buf[1] = alloc(NULL, WHOLEBUF);
+    whole.ready = new_lock(0);
+    label_lock(whole.ready, "whole", "ready");
+    reader = launch(whole_read, gp);
+    k = 0;
+    do {
+        possess(whole.ready);
+        wait_for(whole.ready, NOT_TO_BE, 0);
+        release(whole.ready);
+        len = whole.len[k];
+        sha256_update(&sha, whole.buf[k], len);
+        possess(whole.ready);
+        twist(whole.ready, BY, -1);
+        k ^= 1;
+    } while (len);
+    join(reader);
+    free_lock(whole.ready);
+    FREE(whole.buf[1]);
+    FREE(whole.buf[0]);
+    sha256_final(&sha, dig);
+    if (lseek(g.ind, 0, SEEK_SET) != 0)
+        throw(errno, "read error on %s (%s)", g.inf, strerror(errno));
+
+    /* make the path from the digest */
+    len = strlen(g.cachedir);
+    whole.path = alloc(NULL, len + 68);
+    memcpy(whole.path, g.cachedir, len);
+    whole.path[len++] = '/';
+    for (k = 0; k < 32; k++) {
+        whole.path[len++] = "0123456789abcdef"[dig[k] >> 4];
+        whole.path[len++] = "0123456789abcdef"[dig[k] & 0xf];
+    }
+    strcpy(whole.path + len, ".gz");
+    return 1;
+}
+
+/* copy from descriptor from to descriptor to, cloning the data if possible
+   when clone is true -- return zero on success or an errno value on failure */
+local int whole_copy(int from, int to, int clone)
+{
+    int err;
+    ssize_t got, ret;
+    unsigned char *buf;
+    size_t n;
+
+#ifdef FICLONE
+    if (clone && ioctl(to, FICLONE, from) == 0)
+        return 0;
+#else
+    (void)clone;
+#endif
+    buf = alloc(NULL, WHOLEBUF);
+    while ((got = read(from, buf, WHOLEBUF)) > 0)
+        for (n = 0; n < (size_t)got; n += ret) {
+            ret = write(to, buf + n, got - n);
+            if (ret < 1) {
+                err = ret < 0 && errno ? errno : EIO;
+                FREE(buf);
+                return err;
+            }
+        }
+    err = got < 0 ? (errno ? errno : EIO) : 0;
+    FREE(buf);
+    return err;
+}
+
+/* if the compressed output for the input is in the cache, copy it to the
+   output and return true -- else return false, leaving whole.path set to save
+   the output after compression */
+local int whole_get(void)
+{
+    int fd, ret;
+
+    whole.path = NULL;
+    if (!whole_key())
+        return 0;
+    fd = open(whole.path, O_RDONLY, 0);
+    if (fd < 0) {
+        if (g.outd == 1)
+            RELEASE(whole.path);    /* can't read back stdout to save it */
+        return 0;
+    }
+    ret = whole_copy(fd, g.outd, g.outd != 1);
+    close(fd);
+    if (ret)
+        throw(ret, "write error on %s (%s)", g.outf, strerror(ret));
+    (void)utimes(whole.path, NULL);     /* mark as recently used */
+    RELEASE(whole.path);
+    if (g.verbosity > 1)
+        fputs("(cached) ", stderr);
+    return 1;
+}
+
+/* a saved output in the cache directory */
+struct saved {
+    time_t when;                /* last use */
+    off_t size;                 /* size in bytes */
+    char *path;                 /* allocated path */
+};
+
+/* compare saved outputs for qsort(), putting the most recently used first */
+local int whole_newer(const void *a, const void *b)
+{
+    time_t x = ((const struct saved *)a)->when;
+    time_t y = ((const struct saved *)b)->when;
+
+    return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+/* delete the least recently used entries in the cache to bring its total size
+   down to g.cachemax */
+local void whole_trim(void)
+{
+    size_t len, num, max, n;
+    uint64_t total;
+    char *path;
+    DIR *dir;
+    struct dirent *ent;
+    struct stat st;
+    struct saved *list;
+
+    /* list the saved outputs with their sizes and last use */
+    dir = opendir(g.cachedir);
+    if (dir == NULL)
+        return;
+    len = strlen(g.cachedir);
+    list = NULL;
+    num = max = 0;
+    total = 0;
+    while ((ent = readdir(dir)) != NULL) {
+        n = strlen(ent->d_name);
+        if (n != 67 || strcmp(ent->d_name + 64, ".gz"))
+            continue;
+        path = alloc(NULL, len + n + 2);
+        memcpy(path, g.cachedir, len);
+        path[len] = '/';
+        strcpy(path + len + 1, ent->d_name);
+        if (stat(path, &st) || (st.st_mode & S_IFMT) != S_IFREG) {
+            FREE(path);
+            continue;
+        }
+        if (num == max) {
+            max = max ? max << 1 : 64;
+            list = alloc(list, max * sizeof(struct saved));
+        }
+        list[num].when = st.st_mtime;
+        list[num].size = st.st_size;
+        list[num].path = path;
+        num++;
+        total += st.st_size;
+    }
+    closedir(dir);
+
+    /* sort by last use, and delete the oldest until under the limit */
+    if (num)
+        qsort(list, num, sizeof(struct saved), whole_newer);
+    while (num && total > g.cachemax) {
+        num--;
+        if (unlink(list[num].path) == 0)
+            total -= list[num].size;
+        FREE(list[num].path);
+    }
+    while (num)
+        FREE(list[--num].path);
+    RELEASE(list);
+}
+
+/* save the output just written to g.outf in the cache, if whole.path is set
+   -- errors are ignored, resulting only in not saving the output */
+local void whole_put(void)
+{
+    int from, to;
+    char *temp;
+
+    if (whole.path == NULL)
+        return;
+    (void)mkdir(g.cachedir, 0755);
+    temp = alloc(NULL, strlen(whole.path) + 32);
+    sprintf(temp, "%s.%ld.tmp", whole.path, (long)getpid());
+    from = open(g.outf, O_RDONLY, 0);
+    to = open(temp, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (from >= 0 && to >= 0 && whole_copy(from, to, 1) == 0) {
+        if (close(to) || rename(temp, whole.path))
+            unlink(temp);
+        to = -1;
+    }
+    else if (to >= 0)
+        unlink(temp);
+    if (to >= 0)
+        close(to);
+    if (from >= 0)
+        close(from);
+    FREE(temp);
+    RELEASE(whole.path);
+    if (g.cachemax)
+        whole_trim();
+}
+
+#endif
+
+/* repeated code in single_compress to compress available input and write it */
+#define DEFLATE_WRITE(flush) \
+    do { \
+        do { \
+            strm->avail_out = out_size; \
+            strm->next_out = out; \
+            (void)deflate(strm, flush); \
+            writen(g.outd, out, out_size - strm->avail_out); \
+            clen += out_size - strm->avail_out; \
+        } while (strm->avail_out == 0); \
+        assert(strm->avail_in == 0); \
+    } while (0)
+
+/* do a simple compression in a single thread from ind to outd -- if reset is
+   true, instead free the memory that was allocated and retained for input,
+   output, and deflate */
+local void single_compress(int reset)
+{
+    size_t got;                     /* amount of data in in[] */
+    size_t more;                    /* amount of data in next[] (0 if eof) */
+    size_t start;                   /* start of data in next[] */
+    size_t have;                    /* bytes in current block for -i */
+    size_t hist;                    /* offset of permitted history */
+    int fresh;                      /* if true, reset compression history */
+    unsigned hash;                  /* hash for rsyncable */
+    unsigned char *scan;            /* pointer for hash computation */
+    size_t left;                    /* bytes left to compress after hash hit */
+    unsigned long head;             /* header length */
+    unsigned long ulen;             /* total uncompressed size (overflow ok) */
+    unsigned long clen;             /* total compressed size (overflow ok) */
+    unsigned long check;            /* check value of uncompressed data */
+    static unsigned out_size;       /* size of output buffer */
+    static unsigned char *in, *next, *out;  /* reused i/o buffers */
+    static z_stream *strm = NULL;   /* reused deflate structure */
+
+    /* if requested, just release the allocations and return */
+    if (reset) {
+        if (strm != NULL) {
+            (void)deflateEnd(strm);
+            FREE(strm);
+            FREE(out);
+            FREE(next);
+            FREE(in);
+            strm = NULL;
+        }
+        return;
+    }
+
+    /* initialize the deflate structure if this is the first time */
+    if (strm == NULL) {
+        int ret;                    /* zlib return code */
+
+        out_size = g.block > MAXP2 ? MAXP2 : (unsigned)g.block;
+        in = alloc(NULL, g.block + DICT);
+        next = alloc(NULL, g.block + DICT);
+        out = alloc(NULL, out_size);
+        strm = alloc(NULL, sizeof(z_stream));
+        strm->zfree = ZFREE;
+        strm->zalloc = ZALLOC;
+        strm->opaque = OPAQUE;
+        ret = deflateInit2(strm, 6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+        if (ret == Z_MEM_ERROR)
+            throw(ENOMEM, "not enough memory");
+        if (ret != Z_OK)
+            throw(EINVAL, "internal error");
+    }
+
+    /* write header */
+    head = put_header(g.form);
+
+    /* set compression level in case it changed */
+    if (g.level <= 9) {
+        (void)deflateReset(strm);
+        (void)deflateParams(strm, g.level, Z_DEFAULT_STRATEGY);
+    }
+
+    /* do raw deflate and calculate check value */
+    got = 0;
+    more = readn(g.ind, next, g.block);
+    ulen = (unsigned long)more;
+    start = 0;
+    hist = 0;
+    clen = 0;
+    have = 0;
+    check = CHECK(0L, Z_NULL, 0);
+    hash = RSYNCHIT;
+    do {
+        /* get data to compress, see if there is any more input */
+        if (got == 0) {
+            scan = in;  in = next;  next = scan;
+            strm->next_in = in + start;
+            got = more;
+            if (g.level > 9) {
+                left = start + more - hist;
+                if (left > DICT)
+                    left = DICT;
+                memcpy(next, in + ((start + more) - left), left);
+                start = left;
+                hist = 0;
+            }
+            else
+                start = 0;
+            more = readn(g.ind, next + start, g.block);
+            ulen += (unsigned long)more;
+        }
+
+        /* if rsyncable, compute hash until a hit or the end of the block */
+        left = 0;
+        if (g.rsync && got) {
+            scan = strm->next_in;
+            left = got;
+            do {
+                if (left == 0) {
+                    /* went to the end -- if no more or no hit in size bytes,
+                       then proceed to do a flush or finish with got bytes */
+                    if (more == 0 || got == g.block)
+                        break;
+
+                    /* fill in[] with what's left there and as much as possible
+                       from next[] -- set up to continue hash hit search */
+                    if (g.level > 9) {
+                        left = (strm->next_in - in) - hist;
+                        if (left > DICT)
+                            left = DICT;
+                    }
+                    memmove(in, strm->next_in - left, left + got);
+                    hist = 0;
+                    strm->next_in = in + left;
+                    scan = in + left + got;
+                    left = more > g.block - got ? g.block - got : more;
+                    memcpy(scan, next + start, left);
+                    got += left;
+                    more -= left;
+                    start += left;
+
+                    /* if that emptied the next buffer, try to refill it */
+                    if (more == 0) {
+                        more = readn(g.ind, next, g.block);
+                        ulen += (unsigned long)more;
+                        start = 0;
+                    }
+                }
+                left--;
+                hash = ((hash << 1) ^ *scan++) & RSYNCMASK;
+            } while (hash != RSYNCHIT);
+            got -= left;
+        }
+
+        /* clear history for --independent option */
+        fresh = 0;
+        if (!g.setdict) {
+            have += got;
+            if (have > g.block) {
+                fresh = 1;
+                have = got;
+            }
+        }
+
+        if (g.level <= 9) {
+            /* clear history if requested */
+            if (fresh)
+                (void)deflateReset(strm);
+
+            /* compress MAXP2-size chunks in case unsigned type is small */
+            while (got > MAXP2) {
+                strm->avail_in = MAXP2;
+                check = CHECK(check, strm->next_in, strm->avail_in);
+                DEFLATE_WRITE(Z_NO_FLUSH);
+                got -= MAXP2;
+            }
+
+            /* compress the remainder, emit a block, finish if end of input */
+            strm->avail_in = (unsigned)got;
+            got = left;
+            check = CHECK(check, strm->next_in, strm->avail_in);
+            if (more || got) {
+#if ZLIB_VERNUM >= 0x1260
+                int bits;
+
+                DEFLATE_WRITE(Z_BLOCK);
+                (void)deflatePending(strm, Z_NULL, &bits);
+                if (bits & 1)
+                    DEFLATE_WRITE(Z_SYNC_FLUSH);
+                else if (bits & 7) {
+                    do {
+                        bits = deflatePrime(strm, 10, 2);
+                        assert(bits == Z_OK);
+                        (void)deflatePending(strm, Z_NULL, &bits);
+                    } while (bits & 7);
+                    DEFLATE_WRITE(Z_NO_FLUSH);
+                }
+#else
+                DEFLATE_WRITE(Z_SYNC_FLUSH);
+#endif
+            }
+            else
+                DEFLATE_WRITE(Z_FINISH);
+        }
+        else {
+            /* compress got bytes using zopfli, bring to byte boundary */
+            unsigned char bits, *out;
+            size_t outsize, off;
+
+            /* discard history if requested */
+            off = strm->next_in - in;
+            if (fresh)
+                hist = off;
+
+            out = NULL;
+            outsize = 0;
+            bits = 0;
+            ZopfliDeflatePart(&g.zopts, 2, !(more || left),
+                              in + hist, off - hist, (off - hist) + got,
+                              &bits, &out, &outsize);
+            bits &= 7;
+            if ((more || left) && bits) {
+                if (bits & 1) {
+                    writen(g.outd, out, outsize);
+                    if (bits == 7)
+                        writen(g.outd, (unsigned char *)"\0", 1);
+                    writen(g.outd, (unsigned char *)"\0\0\xff\xff", 4);
+                }
+                else {
+                    assert(outsize > 0);
+                    writen(g.outd, out, outsize - 1);
+                    do {
+                        out[outsize - 1] += 2 << bits;
+                        writen(g.outd, out + outsize - 1, 1);
+                        out[outsize - 1] = 0;
+                        bits += 2;
+                    } while (bits < 8);
+                    writen(g.outd, out + outsize - 1, 1);
+                }
+            }
+            else
+                writen(g.outd, out, outsize);
+            free(out);
+            while (got > MAXP2) {
+                check = CHECK(check, strm->next_in, MAXP2);
+                strm->next_in += MAXP2;
+                got -= MAXP2;
+            }
+            check = CHECK(check, strm->next_in, (unsigned)got);
+            strm->next_in += got;
+            got = left;
+        }
+
+        /* do until no more input */
+    } while (more || got);
+
+    /* write trailer */
+    put_trailer(ulen, clen, check, head, g.form);
+}
+
+/* --- decompression --- */
+
+#ifndef NOTHREAD
+/* parallel read thread */
+local void load_read(void *ctx)
+{
+    size_t len;
+    double start;                   /* start of read for --stats */
+    ball_t err;                     /* error information from throw() */
+
+    BIND(ctx);
+
+    Trace(("-- launched decompress read thread"));
+    try {
+        do {
+            possess(g.load_state);
+            stat_wait(g.load_state, TO_BE, 1, W_LOAD);
+            start = stat_start();
+            g.in_len = len = readn(g.ind, g.in_which ? g.in_buf : g.in_buf2,
+                                   BUF);
+            stat_work(S_READ, start, 0, -1);
+            Trace(("-- decompress read thread read %lu bytes", len));
+            twist(g.load_state, TO, 0);
+        } while (len == BUF);
+        perf_close();
+    }
+    catch (err) {
+        THREADABORT(err);
+    }
+    Trace(("-- exited decompress read thread"));
+}
+#endif
+
+/* load() is called when the input has been consumed in order to provide more
+   input data: load the input buffer with BUF or fewer bytes (fewer if at end
+   of file) from the file g.ind, set g.in_next to point to the g.in_left bytes
+   read, update g.in_tot, and return g.in_left -- g.in_eof is set to true when
+   g.in_left has gone to zero and there is no more data left to read */
+local size_t load(void)
+{
+    /* if already detected end of file, do nothing */
+    if (g.in_short) {
+        g.in_eof = 1;
+        g.in_left = 0;
+        return 0;
+    }
+
+#ifndef NOTHREAD
+    /* if first time in or procs == 1, read a buffer to have something to
+       return, otherwise wait for the previous read job to complete (a followed
+       input is read without the read thread, to use what is there) */
+    if (g.procs > 1 && !flw.on) {
+        /* if first time, fire up the read thread, ask for a read */
+        if (g.in_which == -1) {
+            g.in_which = 1;
+            g.load_state = new_lock(1);
+            label_lock(g.load_state, "load_state", NULL);
+            g.load_thread = launch(load_read, gp);
+        }
+
+        /* wait for the previously requested read to complete */
+        possess(g.load_state);
+        stat_wait(g.load_state, TO_BE, 0, W_LOAD_MAIN);
+        release(g.load_state);
+
+        /* set up input buffer with the data just read */
+        g.in_next = g.in_which ? g.in_buf : g.in_buf2;
+        g.in_left = g.in_len;
+
+        /* if not at end of file, alert read thread to load next buffer,
+           alternate between g.in_buf and g.in_buf2 */
+        if (g.in_len == BUF) {
+            g.in_which = 1 - g.in_which;
+            possess(g.load_state);
+            twist(g.load_state, TO, 1);
+        }
+
+        /* at end of file -- join read thread (already exited), clean up */
+        else {
+            join(g.load_thread);
+            free_lock(g.load_state);
+            g.in_which = -1;
+        }
+    }
+    else
+#endif
+    {
+        /* don't use threads -- simply read a buffer into g.in_buf */
+#ifndef NOTHREAD
+        double start = stat_start();
+#endif
+        g.in_left = flw.on ? readf(g.in_next = g.in_buf, BUF) :
+                             readn(g.ind, g.in_next = g.in_buf, BUF);
+#ifndef NOTHREAD
+        stat_work(S_READ, start, 1, -1);
+#endif
+    }
+
+    /* note end of file (a short read of a followed input is not the end) */
+    if (flw.on ? g.in_left == 0 : g.in_left < BUF) {
+        g.in_short = 1;
+
+        /* if we got bupkis, now is the time to mark eof */
+        if (g.in_left == 0)
+            g.in_eof = 1;
+    }
+
+    /* update the total and return the available bytes */
+    g.in_tot += g.in_left;
+#ifndef NOTHREAD
+    PROG(in, g.in_left);
+#endif
+    return g.in_left;
+}
+
+/* initialize for reading new input */
+local void in_init(void)
+{
+    g.in_left = 0;
+    g.in_eof = 0;
+    g.in_short = 0;
+    g.in_tot = 0;
+#ifndef NOTHREAD
+    g.in_which = -1;
+#endif
+}
+
+/* buffered reading macros for decompression and listing */
+#define GET() (g.in_left == 0 && (g.in_eof || load() == 0) ? 0 : \
+               (g.in_left--, *g.in_next++))
+#define GET2() (tmp2 = GET(), tmp2 + ((unsigned)(GET()) << 8))
+#define GET4() (tmp4 = GET2(), tmp4 + ((unsigned long)(GET2()) << 16))
+#define SKIP(dist) \
+    do { \
+        size_t togo = (dist); \
+        while (togo > g.in_left) { \
+            togo -= g.in_left; \
+            if (load() == 0) \
+                return -3; \
+        } \
+        g.in_left -= togo; \
+        g.in_next += togo; \
+    } while (0)
+
+/* GET(), GET2(), GET4() and SKIP() equivalents, with crc update */
+#define GETC() (g.in_left == 0 && (g.in_eof || load() == 0) ? 0 : \
+                (g.in_left--, crc = crc32(crc, g.in_next, 1), *g.in_next++))
+#define GET2C() (tmp2 = GETC(), tmp2 + ((unsigned)(GETC()) << 8))
+#define GET4C() (tmp4 = GET2C(), tmp4 + ((unsigned long)(GET2C()) << 16))
+#define SKIPC(dist) \
+    do { \
+        size_t togo = (dist); \
+        while (togo > g.in_left) { \
+            crc = crc32(crc, g.in_next, g.in_left); \
+            togo -= g.in_left; \
+            if (load() == 0) \
+                return -3; \
+        } \
+        crc = crc32(crc, g.in_next, togo); \
+        g.in_left -= togo; \
+        g.in_next += togo; \
+    } while (0)
+
+/* convert MS-DOS date and time to a Unix time, assuming current timezone
+   (you got a better idea?) */
+local time_t dos2time(unsigned long dos)
+{
+    struct tm tm;
+
+    if (dos == 0)
+        return time(NULL);
+    tm.tm_year = ((int)(dos >> 25) & 0x7f) + 80;
+    tm.tm_mon  = ((int)(dos >> 21) & 0xf) - 1;
+    tm.tm_mday = (int)(dos >> 16) & 0x1f;
+    tm.tm_hour = (int)(dos >> 11) & 0x1f;
+    tm.tm_min  = (int)(dos >> 5) & 0x3f;
+    tm.tm_sec  = (int)(dos << 1) & 0x3e;
+    tm.tm_isdst = -1;           /* figure out if DST or not */
+    return mktime(&tm);
+}
+
+/* convert an unsigned 32-bit integer to signed, even if long > 32 bits */
+local long tolong(unsigned long val)
+{
+    return (long)(val & 0x7fffffffUL) - (long)(val & 0x80000000UL);
+}
+
+#define LOW32 0xffffffffUL
+
+/* process zip extra field to extract zip64 lengths and Unix mod time */
+local int read_extra(unsigned len, int save)
+{
+    unsigned id, size, tmp2;
+    unsigned long tmp4;
+
+    /* process extra blocks */
+    while (len >= 4) {
+        id = GET2();
+        size = GET2();
+        if (g.in_eof)
+            return -1;
+        len -= 4;
+        if (size > len)
+            break;
+        len -= size;
+        if (id == 0x0001) {
+            /* Zip64 Extended Information Extra Field */
+            if (g.zip_ulen == LOW32 && size >= 8) {
+                g.zip_ulen = GET4();
+                SKIP(4);
+                size -= 8;
+            }
+            if (g.zip_clen == LOW32 && size >= 8) {
+                g.zip_clen = GET4();
+                SKIP(4);
+                size -= 8;
+            }
+        }
+        if (save) {
+            if ((id == 0x000d || id == 0x5855) && size >= 8) {
+                /* PKWare Unix or Info-ZIP Type 1 Unix block */
+                SKIP(4);
+                g.stamp = tolong(GET4());
+                size -= 8;
+            }
+            if (id == 0x5455 && size >= 5) {
+                /* Extended Timestamp block */
+                size--;
+                if (GET() & 1) {
+                    g.stamp = tolong(GET4());
+                    size -= 4;
+                }
+            }
+        }
+        SKIP(size);
+    }
+    SKIP(len);
+    return 0;
+}
+
+/* read a gzip, zip, zlib, or lzw header from ind and return the method in the
+   range 0..256 (256 implies a zip method greater than 255), or on error return
+   negative: -1 is immediate EOF, -2 is not a recognized compressed format, -3
+   is premature EOF within the header, -4 is unexpected header flag values, -5
+   is the zip central directory, -6 is a failed gzip header crc check; a method
+   of 257 is lzw -- if the return value is not negative, then get_header() sets
+   g.form to indicate gzip (0), zlib (1), or zip (2, or 3 if the entry is
+   followed by a data descriptor) */
+local int get_header(int save)
+{
+    unsigned magic;             /* magic header */
+    int method;                 /* compression method */
+    int flags;                  /* header flags */
     unsigned fname, extra;      /* name and extra field lengths */
     unsigned tmp2;              /* for macro */
     unsigned long tmp4;         /* for macro */
     unsigned long crc;          /* gzip header crc */
 
-    /* clear return information */
-    if (save) {
-        g.stamp = 0;
-        RELEASE(g.hname);
-    }
+    /* clear return information */
+    if (save) {
+        g.stamp = 0;
+        RELEASE(g.hname);
+    }
+
+    /* see if it's a gzip, zlib, or lzw file */
+    g.form = -1;
+    g.magic1 = GET();
+    if (g.in_eof)
+        return -1;
+    magic = g.magic1 << 8;
+    magic += GET();
+    if (g.in_eof)
+        return -2;
+    if (magic % 31 == 0 && (magic & 0x8f20) == 0x0800) {
+        /* it's zlib */
+        g.form = 1;
+        return 8;
+    }
+    if (magic == 0x1f9d)            /* it's lzw */
+        return 257;
+    if (magic == 0x504b) {          /* it's zip */
+        magic = GET2();             /* the rest of the signature */
+        if (g.in_eof)
+            return -3;
+        if (magic == 0x0201 || magic == 0x0806)
+            return -5;              /* central header or archive extra */
+        if (magic != 0x0403)
+            return -4;              /* not a local header */
+        SKIP(2);
+        flags = GET2();
+        if (flags & 0xfff0)
+            return -4;
+        method = GET();             /* return low byte of method or 256 */
+        if (GET() != 0 || flags & 1)
+            method = 256;           /* unknown or encrypted */
+        if (save)
+            g.stamp = dos2time(GET4());
+        else
+            SKIP(4);
+        g.zip_crc = GET4();
+        g.zip_clen = GET4();
+        g.zip_ulen = GET4();
+        fname = GET2();
+        extra = GET2();
+        if (save) {
+            char *next;
+
+            if (g.in_eof)
+                return -3;
+            next = g.hname = alloc(NULL, fname + 1);
+            while (fname > g.in_left) {
+                memcpy(next, g.in_next, g.in_left);
+                fname -= g.in_left;
+                next += g.in_left;
+                if (load() == 0)
+                    return -3;
+            }
+            memcpy(next, g.in_next, fname);
+            g.in_left -= fname;
+            g.in_next += fname;
+            next += fname;
+            *next = 0;
+        }
+        else
+            SKIP(fname);
+        read_extra(extra, save);
+        g.form = 2 + ((flags & 8) >> 3);
+        return g.in_eof ? -3 : method;
+    }
+    if (magic != 0x1f8b) {          /* not gzip */
+        g.in_left++;    /* unget second magic byte */
+        g.in_next--;
+        return -2;
+    }
+
+    /* it's gzip -- get method and flags */
+    crc = 0xf6e946c9;       /* crc of 0x1f 0x8b */
+    method = GETC();
+    flags = GETC();
+    if (flags & 0xe0)
+        return -4;
+
+    /* get time stamp */
+    if (save)
+        g.stamp = tolong(GET4C());
+    else
+        SKIPC(4);
+
+    /* skip extra field and OS */
+    SKIPC(2);
+
+    /* skip extra field, if present */
+    if (flags & 4)
+        SKIPC(GET2C());
+
+    /* read file name, if present, into allocated memory */
+    if ((flags & 8) && save) {
+        unsigned char *end;
+        size_t copy, have, size = 0;
+        have = 0;
+        do {
+            if (g.in_left == 0 && load() == 0)
+                return -3;
+            end = memchr(g.in_next, 0, g.in_left);
+            copy = end == NULL ? g.in_left : (size_t)(end - g.in_next) + 1;
+            have = vmemcpy(&g.hname, &size, have, g.in_next, copy);
+            g.in_left -= copy;
+            g.in_next += copy;
+        } while (end == NULL);
+        crc = crc32(crc, (unsigned char *)g.hname, have);
+    }
+    else if (flags & 8)
+        while (GETC() != 0)
+            ;
+
+    /* skip comment */
+    if (flags & 16)
+        while (GETC() != 0)
+            ;
+
+    /* check header crc */
+    if ((flags & 2) && GET2() != (crc & 0xffff))
+        return -6;
+
+    /* return gzip compression method */
+    g.form = 0;
+    return g.in_eof ? -3 : method;
+}
+
+/* --- list contents of compressed input (gzip, zlib, or lzw) */
+
+/* find standard compressed file suffix, return length of suffix */
+local size_t compressed_suffix(char *nm)
+{
+    size_t len;
+
+    len = strlen(nm);
+    if (len > 4) {
+        nm += len - 4;
+        len = 4;
+        if (strcmp(nm, ".zip") == 0 || strcmp(nm, ".ZIP") == 0 ||
+            strcmp(nm, ".tgz") == 0)
+            return 4;
+    }
+    if (len > 3) {
+        nm += len - 3;
+        len = 3;
+        if (strcmp(nm, ".gz") == 0 || strcmp(nm, "-gz") == 0 ||
+            strcmp(nm, ".zz") == 0 || strcmp(nm, "-zz") == 0)
+            return 3;
+    }
+    if (len > 2) {
+        nm += len - 2;
+        if (strcmp(nm, ".z") == 0 || strcmp(nm, "-z") == 0 ||
+            strcmp(nm, "_z") == 0 || strcmp(nm, ".Z") == 0)
+            return 2;
+    }
+    return 0;
+}
+
+/* listing file name lengths for -l and -lv */
+#define NAMEMAX1 48     /* name display limit at verbosity 1 */
+#define NAMEMAX2 16     /* name display limit at verbosity 2 */
+
+/* return true if the uncompressed length len from the trailer cannot be the
+   whole length, given the compressed length g.in_tot */
+local int len_unknown(int method, off_t len)
+{
+    return (g.form == 3 && !g.decode) ||
+           (method == 8 && g.in_tot > (len + (len >> 10) + 12)) ||
+           (method == 257 && g.in_tot > len + (len >> 1) + 3);
+}
+
+/* write the --format=json line for the current input to stdout -- method,
+   check, and len are as for show_info(), members is the number of members if
+   tested or else zero, and secs is the time taken to test, or -1 if not */
+local void show_json(int method, unsigned long check, off_t len, long members,
+                     double secs)
+{
+    size_t n;
+
+    fputs("{\"file\":\"", stdout);
+    json_str(stdout, g.inf, strlen(g.inf));
+    fputs("\",\"name\":\"", stdout);
+    if (g.hname != NULL)
+        json_str(stdout, g.hname, strlen(g.hname));
+    else {
+        n = strlen(g.inf) - compressed_suffix(g.inf);
+        json_str(stdout, g.inf, n);
+        if (strcmp(g.inf + n, ".tgz") == 0)
+            fputs(".tar", stdout);
+    }
+    printf("\",\"format\":\"%s\",\"method\":%d,\"check\":",
+           g.form == 3 ? "zip" : g.form == 1 ? "zlib" :
+           method == 257 ? "lzw" : "gzip", method);
+    if ((g.form == 3 && !g.decode) || method == 257)
+        fputs("null", stdout);
+    else
+        printf("\"%08lx\"", check);
+    printf(",\"compressed\":%lld,\"uncompressed\":", (long long)g.in_tot);
+    if (len_unknown(method, len))
+        fputs("null,\"ratio\":null", stdout);
+    else if (len == 0)
+        fputs("0,\"ratio\":null", stdout);
+    else
+        printf("%lld,\"ratio\":%.4f", (long long)len,
+               g.in_tot / (double)len);
+    if (g.stamp)
+        printf(",\"mtime\":%lld", (long long)g.stamp);
+    else
+        fputs(",\"mtime\":null", stdout);
+    if (members)
+        printf(",\"members\":%ld", members);
+    else
+        fputs(",\"members\":null", stdout);
+    if (secs >= 0)
+        printf(",\"ok\":true,\"seconds\":%.6f", secs);
+    puts("}");
+}
+
+/* write the --format=json line for a failed test of the current input */
+local void show_json_error(char *why)
+{
+    fputs("{\"file\":\"", stdout);
+    json_str(stdout, g.inf, strlen(g.inf));
+    fputs("\",\"ok\":false,\"error\":\"", stdout);
+    json_str(stdout, why, strlen(why));
+    puts("\"}");
+}
+
+/* count the current input as failed for why, in which %s is the input name,
+   and report it -- on stderr if loud, and as the input's JSON line with
+   --format=json for -l or -t */
+local void bad_input(char *why, int loud)
+{
+    char *msg;
+
+    FAILED();
+    msg = alloc(NULL, strlen(why) + strlen(g.inf) + 1);
+    sprintf(msg, why, g.inf);
+    if (g.json && (g.list || g.decode == 2))
+        show_json_error(msg);
+    if (loud)
+        complain("skipping: %s", msg);
+    FREE(msg);
+}
+
+/* print gzip or lzw file information */
+local void show_info(int method, unsigned long check, off_t len, int cont)
+{
+    size_t max;             /* maximum name length for current verbosity */
+    size_t n;               /* name length without suffix */
+    time_t now;             /* for getting current year */
+    char mod[26];           /* modification time in text */
+    char tag[NAMEMAX1+1];   /* header or file name, possibly truncated */
+
+    /* one line of JSON instead of a table if requested */
+    if (g.json) {
+        show_json(method, check, len, 0, -1);
+        return;
+    }
+
+    /* create abbreviated name from header file name or actual file name */
+    max = g.verbosity > 1 ? NAMEMAX2 : NAMEMAX1;
+    memset(tag, 0, max + 1);
+    if (cont)
+        strncpy(tag, "<...>", max + 1);
+    else if (g.hname == NULL) {
+        n = strlen(g.inf) - compressed_suffix(g.inf);
+        strncpy(tag, g.inf, n > max + 1 ? max + 1 : n);
+        if (strcmp(g.inf + n, ".tgz") == 0 && n < max + 1)
+            strncpy(tag + n, ".tar", max + 1 - n);
+    }
+    else
+        strncpy(tag, g.hname, max + 1);
+    if (tag[max])
+        strcpy(tag + max - 3, "...");
+
+    /* convert time stamp to text */
+    if (g.stamp) {
+        strcpy(mod, ctime(&g.stamp));
+        now = time(NULL);
+        if (strcmp(mod + 20, ctime(&now) + 20) != 0)
+            strcpy(mod + 11, mod + 19);
+    }
+    else
+        strcpy(mod + 4, "------ -----");
+    mod[16] = 0;
+
+    /* if first time, print header */
+    if (g.first) {
+        if (g.verbosity > 1)
+            fputs("method    check    timestamp    ", stdout);
+        if (g.verbosity > 0)
+            puts("compressed   original reduced  name");
+        g.first = 0;
+    }
+
+    /* print information */
+    if (g.verbosity > 1) {
+        if (g.form == 3 && !g.decode)
+            printf("zip%3d  --------  %s  ", method, mod + 4);
+        else if (g.form > 1)
+            printf("zip%3d  %08lx  %s  ", method, check, mod + 4);
+        else if (g.form == 1)
+            printf("zlib%2d  %08lx  %s  ", method, check, mod + 4);
+        else if (method == 257)
+            printf("lzw     --------  %s  ", mod + 4);
+        else
+            printf("gzip%2d  %08lx  %s  ", method, check, mod + 4);
+    }
+    if (g.verbosity > 0) {
+        if (len_unknown(method, len))
+#if __STDC_VERSION__-0 >= 199901L || __GNUC__-0 >= 3
+            printf("%10jd %10jd?  unk    %s\n",
+                   (intmax_t)g.in_tot, (intmax_t)len, tag);
+        else
+            printf("%10jd %10jd %6.1f%%  %s\n",
+                   (intmax_t)g.in_tot, (intmax_t)len,
+                   len == 0 ? 0 : 100 * (len - g.in_tot)/(double)len,
+                   tag);
+#else
+            printf(sizeof(off_t) == sizeof(long) ?
+                   "%10ld %10ld?  unk    %s\n" : "%10lld %10lld?  unk    %s\n",
+                   g.in_tot, len, tag);
+        else
+            printf(sizeof(off_t) == sizeof(long) ?
+                   "%10ld %10ld %6.1f%%  %s\n" : "%10lld %10lld %6.1f%%  %s\n",
+                   g.in_tot, len,
+                   len == 0 ? 0 : 100 * (len - g.in_tot)/(double)len,
+                   tag);
+#endif
+    }
+}
+
+/* list content information about the gzip file at ind (only works if the gzip
+   file contains a single gzip stream with no junk at the end, and only works
+   well if the uncompressed length is less than 4 GB) */
+local void list_info(void)
+{
+    int method;             /* get_header() return value */
+    size_t n;               /* available trailer bytes */
+    off_t at;               /* used to calculate compressed length */
+    unsigned char tail[8];  /* trailer containing check and length */
+    unsigned long check, len;   /* check value and length from trailer */
+
+    /* initialize input buffer */
+    in_init();
+
+    /* read header information and position input after header */
+    method = get_header(1);
+    if (method < 0) {
+        RELEASE(g.hname);
+        if (method != -1)
+            bad_input(method != -6 ? "%s not compressed" :
+                      "%s corrupted: invalid header crc", g.verbosity > 1);
+        return;
+    }
+
+    /* list zip file */
+    if (g.form > 1) {
+        g.in_tot = g.zip_clen;
+        show_info(method, g.zip_crc, g.zip_ulen, 0);
+        return;
+    }
+
+    /* list zlib file */
+    if (g.form == 1) {
+        at = lseek(g.ind, 0, SEEK_END);
+        if (at == -1) {
+            check = 0;
+            do {
+                len = g.in_left < 4 ? g.in_left : 4;
+                g.in_next += g.in_left - len;
+                while (len--)
+                    check = (check << 8) + *g.in_next++;
+            } while (load() != 0);
+            check &= LOW32;
+        }
+        else {
+            g.in_tot = at;
+            lseek(g.ind, -4, SEEK_END);
+            readn(g.ind, tail, 4);
+            check = PULL4M(tail);
+        }
+        g.in_tot -= 6;
+        show_info(method, check, 0, 0);
+        return;
+    }
+
+    /* list lzw file */
+    if (method == 257) {
+        at = lseek(g.ind, 0, SEEK_END);
+        if (at == -1)
+            while (load() != 0)
+                ;
+        else
+            g.in_tot = at;
+        g.in_tot -= 3;
+        show_info(method, 0, 0, 0);
+        return;
+    }
+
+    /* skip to end to get trailer (8 bytes), compute compressed length */
+    if (g.in_short) {                   /* whole thing already read */
+        if (g.in_left < 8) {
+            bad_input("%s not a valid gzip file", 1);
+            return;
+        }
+        g.in_tot = g.in_left - 8;       /* compressed size */
+        memcpy(tail, g.in_next + (g.in_left - 8), 8);
+    }
+    else if ((at = lseek(g.ind, -8, SEEK_END)) != -1) {
+        g.in_tot = at - g.in_tot + g.in_left;   /* compressed size */
+        readn(g.ind, tail, 8);          /* get trailer */
+    }
+    else {                              /* can't seek */
+        at = g.in_tot - g.in_left;      /* save header size */
+        do {
+            n = g.in_left < 8 ? g.in_left : 8;
+            memcpy(tail, g.in_next + (g.in_left - n), n);
+            load();
+        } while (g.in_left == BUF);     /* read until end */
+        if (g.in_left < 8) {
+            if (n + g.in_left < 8) {
+                bad_input("%s not a valid gzip file", 1);
+                return;
+            }
+            if (g.in_left) {
+                if (n + g.in_left > 8)
+                    memcpy(tail, tail + n - (8 - g.in_left), 8 - g.in_left);
+                memcpy(tail + 8 - g.in_left, g.in_next, g.in_left);
+            }
+        }
+        else
+            memcpy(tail, g.in_next + (g.in_left - 8), 8);
+        g.in_tot -= at + 8;
+    }
+    if (g.in_tot < 2) {
+        bad_input("%s not a valid gzip file", 1);
+        return;
+    }
+
+    /* convert trailer to check and uncompressed length (modulo 2^32) */
+    check = PULL4L(tail);
+    len = PULL4L(tail + 4);
+
+    /* list information about contents */
+    show_info(method, check, len, 0);
+    RELEASE(g.hname);
+}
+
+/* --- copy input to output (when acting like cat) --- */
+
+local void cat(void)
+{
+    /* write first magic byte (if we're here, there's at least one byte) */
+    writen(g.outd, &g.magic1, 1);
+    g.out_tot = 1;
+
+    /* copy the remainder of the input to the output (if there were any more
+       bytes of input, then g.in_left is non-zero and g.in_next is pointing to
+       the second magic byte) */
+    while (g.in_left) {
+        writen(g.outd, g.in_next, g.in_left);
+        g.out_tot += g.in_left;
+        g.in_left = 0;
+        load();
+    }
+}
+
+/* --- decompress deflate input --- */
+
+/* call-back input function for inflateBack() */
+local unsigned inb(void *desc, unsigned char **buf)
+{
+    (void)desc;
+    load();
+    *buf = g.in_next;
+    return g.in_left;
+}
+
+/* output buffers and window for infchk() and unlzw() */
+#define OUTSIZE 32768U      /* must be at least 32K for inflateBack() window */
+local unsigned char out_buf[OUTSIZE];
+
+#ifndef NOTHREAD
+/* output data for parallel write and check */
+local unsigned char out_copy[OUTSIZE];
+local size_t out_len;
+
+/* outb threads states */
+local lock *outb_write_more = NULL;
+local lock *outb_check_more;
+
+/* output write thread */
+local void outb_write(void *ctx)
+{
+    size_t len;
+    double start;                   /* start of write for --stats */
+    ball_t err;                     /* error information from throw() */
+
+    BIND(ctx);
+
+    Trace(("-- launched decompress write thread"));
+    try {
+        do {
+            possess(outb_write_more);
+            stat_wait(outb_write_more, TO_BE, 1, W_OUTB_WRITE);
+            len = out_len;
+            start = stat_start();
+            if (len && g.decode == 1)
+                writen(g.outd, out_copy, len);
+            stat_work(S_WRITE, start, 0, -1);
+            Trace(("-- decompress wrote %lu bytes", len));
+            twist(outb_write_more, TO, 0);
+        } while (len);
+        perf_close();
+    }
+    catch (err) {
+        THREADABORT(err);
+    }
+    Trace(("-- exited decompress write thread"));
+}
+
+/* output check thread */
+local void outb_check(void *ctx)
+{
+    size_t len;
+    double start;                   /* start of check for --stats */
+    ball_t err;                     /* error information from throw() */
+
+    BIND(ctx);
+
+    Trace(("-- launched decompress check thread"));
+    try {
+        do {
+            possess(outb_check_more);
+            stat_wait(outb_check_more, TO_BE, 1, W_OUTB_CHECK);
+            len = out_len;
+            start = stat_start();
+            g.out_check = CHECK(g.out_check, out_copy, len);
+            if (dig.on)
+                sha256_update(&dig.sha, out_copy, len);
+            stat_work(S_CHECK, start, 0, -1);
+            Trace(("-- decompress checked %lu bytes", len));
+            twist(outb_check_more, TO, 0);
+        } while (len);
+        perf_close();
+    }
+    catch (err) {
+        THREADABORT(err);
+    }
+    Trace(("-- exited decompress check thread"));
+}
+#endif
+
+/* call-back output function for inflateBack() -- wait for the last write and
+   check calculation to complete, copy the write buffer, and then alert the
+   write and check threads and return for more decompression while that's
+   going on (or just write and check if no threads or if proc == 1) */
+local int outb(void *desc, unsigned char *buf, unsigned len)
+{
+#ifndef NOTHREAD
+    static thread *wr, *ch;
+
+    if (g.procs > 1) {
+        /* if first time, initialize state and launch threads */
+        if (outb_write_more == NULL) {
+            outb_write_more = new_lock(0);
+            outb_check_more = new_lock(0);
+            label_lock(outb_write_more, "outb_write_more", NULL);
+            label_lock(outb_check_more, "outb_check_more", NULL);
+            wr = launch(outb_write, gp);
+            ch = launch(outb_check, gp);
+        }
 
-    /* see if it's a gzip, zlib, or lzw file */
-    g.form = -1;
-    g.magic1 = GET();
-    if (g.in_eof)
-        return -1;
-    magic = g.magic1 << 8;
-    magic += GET();
-    if (g.in_eof)
-        return -2;
-    if (magic % 31 == 0 && (magic & 0x8f20) == 0x0800) {
-        /* it's zlib */
-        g.form = 1;
-        return 8;
-    }
-    if (magic == 0x1f9d)            /* it's lzw */
-        return 257;
-    if (magic == 0x504b) {          /* it's zip */
-        magic = GET2();             /* the rest of the signature */
-        if (g.in_eof)
-            return -3;
-        if (magic == 0x0201 || magic == 0x0806)
-            return -5;              /* central header or archive extra */
-        if (magic != 0x0403)
-            return -4;              /* not a local header */
-        SKIP(2);
-        flags = GET2();
-        if (flags & 0xfff0)
-            return -4;
-        method = GET();             /* return low byte of method or 256 */
-        if (GET() != 0 || flags & 1)
-            method = 256;           /* unknown or encrypted */
-        if (save)
-            g.stamp = dos2time(GET4());
-        else
-            SKIP(4);
-        g.zip_crc = GET4();
-        g.zip_clen = GET4();
-        g.zip_ulen = GET4();
-        fname = GET2();
-        extra = GET2();
-        if (save) {
-            char *next;
+        /* wait for previous write and check threads to complete */
+        possess(outb_check_more);
+        stat_wait(outb_check_more, TO_BE, 0, W_OUTB_MAIN);
+        possess(outb_write_more);
+        stat_wait(outb_write_more, TO_BE, 0, W_OUTB_MAIN);
 
-            if (g.in_eof)
-                return -3;
-            next = g.hname = alloc(NULL, fname + 1);
-            while (fname > g.in_left) {
-                memcpy(next, g.in_next, g.in_left);
-                fname -= g.in_left;
-                next += g.in_left;
-                if (load() == 0)
-                    return -3;
+        /* copy the output and alert the worker bees */
+        out_len = len;
+        g.out_tot += len;
+        PROG(out, len);
+        memcpy(out_copy, buf, len);
+        twist(outb_write_more, TO, 1);
+        twist(outb_check_more, TO, 1);
+
+        /* if requested with len == 0, clean up -- terminate and join write and
+           check threads, free lock */
+        if (len == 0 && outb_write_more != NULL) {
+            if (desc != NULL) {
+                destruct(ch);
+                destruct(wr);
             }
-            memcpy(next, g.in_next, fname);
-            g.in_left -= fname;
-            g.in_next += fname;
-            next += fname;
-            *next = 0;
+            else {
+                join(ch);
+                join(wr);
+            }
+            free_lock(outb_check_more);
+            free_lock(outb_write_more);
+            outb_write_more = NULL;
         }
-        else
-            SKIP(fname);
-        read_extra(extra, save);
-        g.form = 2 + ((flags & 8) >> 3);
-        return g.in_eof ? -3 : method;
+
+        /* return for more decompression while last buffer is being written
+           and having its check value calculated -- we wait for those to finish
+           the next time this function is called */
+        return 0;
     }
-    if (magic != 0x1f8b) {          /* not gzip */
-        g.in_left++;    /* unget second magic byte */
-        g.in_next--;
-        return -2;
+#endif
+
+    (void)desc;
+
+    /* if just one process or no threads, then do it without threads */
+    if (len) {
+#ifndef NOTHREAD
+        double start = stat_start();
+#endif
+        if (g.decode == 1)
+            writen(g.outd, buf, len);
+#ifndef NOTHREAD
+        start = stat_work(S_WRITE, start, 1, -1);
+#endif
+        g.out_check = CHECK(g.out_check, buf, len);
+#ifndef NOTHREAD
+        if (dig.on)
+            sha256_update(&dig.sha, buf, len);
+        stat_work(S_CHECK, start, 1, -1);
+        PROG(out, len);
+#endif
+        g.out_tot += len;
     }
+    return 0;
+}
 
-    /* it's gzip -- get method and flags */
-    crc = 0xf6e946c9;       /* crc of 0x1f 0x8b */
-    method = GETC();
-    flags = GETC();
-    if (flags & 0xe0)
-        return -4;
+/* decompress a followed input with inflate() instead of inflateBack(), so that
+   the output is written as soon as it is decoded instead of when the window
+   fills -- return as inflateBack() does */
+local int inflate_follow(z_stream *strm)
+{
+    int ret;
+    unsigned have;
 
-    /* get time stamp */
-    if (save)
-        g.stamp = tolong(GET4C());
-    else
-        SKIPC(4);
+    ret = inflateInit2(strm, -15);
+    if (ret == Z_MEM_ERROR)
+        throw(ENOMEM, "not enough memory");
+    if (ret != Z_OK)
+        throw(EINVAL, "internal error");
+    do {
+        if (strm->avail_in == 0) {
+            strm->avail_in = inb(NULL, &strm->next_in);
+            if (strm->avail_in == 0) {
+                ret = Z_BUF_ERROR;
+                break;
+            }
+        }
+        strm->next_out = out_buf;
+        strm->avail_out = OUTSIZE;
+        ret = inflate(strm, Z_NO_FLUSH);
+        have = OUTSIZE - strm->avail_out;
+        if (have)
+            outb(NULL, out_buf, have);
+    } while (ret == Z_OK);
+    inflateEnd(strm);
+    return ret == Z_NEED_DICT ? Z_DATA_ERROR : ret;
+}
 
-    /* skip extra field and OS */
-    SKIPC(2);
+/* inflate for decompression or testing -- decompress from ind to outd unless
+   decode != 1, in which case just test ind, and then also list if list != 0;
+   look for and decode multiple, concatenated gzip and/or zlib streams;
+   read and check the gzip, zlib, or zip trailer */
+local void infchk(void)
+{
+    int ret, cont, was;
+    unsigned long check, len;
+    z_stream strm;
+    unsigned tmp2;
+    unsigned long tmp4;
+    off_t clen;
+    long members;                   /* for --format=json */
+    off_t ctot, utot;
+    double began;
+#ifndef NOTHREAD
+    double start, main;             /* start of inflate for --stats */
+#endif
 
-    /* skip extra field, if present */
-    if (flags & 4)
-        SKIPC(GET2C());
+    cont = 0;
+    members = 0;
+    ctot = utot = 0;
+    began = seconds();
+    do {
+        /* header already read -- set up for decompression */
+#ifndef NOTHREAD
+        start = stat_start();
+        main = stats.main;
+        perf_at(S_INFLATE);         /* main thread counts between stages */
+#endif
+        g.in_tot = g.in_left;       /* track compressed data length */
+        g.out_tot = 0;
+        g.out_check = CHECK(0L, Z_NULL, 0);
+        strm.zalloc = ZALLOC;
+        strm.zfree = ZFREE;
+        strm.opaque = OPAQUE;
+        strm.avail_in = g.in_left;
+        strm.next_in = g.in_next;
+        if (flw.on)
+            ret = inflate_follow(&strm);
+        else {
+            ret = inflateBackInit(&strm, 15,
+                                  g.window == NULL ? out_buf : g.window);
+            if (ret == Z_MEM_ERROR)
+                throw(ENOMEM, "not enough memory");
+            if (ret != Z_OK)
+                throw(EINVAL, "internal error");
+
+            /* decompress, compute lengths and check value */
+            ret = inflateBack(&strm, inb, NULL, outb, NULL);
+            inflateBackEnd(&strm);
+        }
+        if (ret == Z_DATA_ERROR)
+            throw(EDOM, "%s: corrupted -- invalid deflate data (%s)",
+                  g.inf, strm.msg);
+        if (ret == Z_BUF_ERROR)
+            throw(EDOM, "%s: corrupted -- incomplete deflate data", g.inf);
+        if (ret != Z_STREAM_END)
+            throw(EINVAL, "internal error");
+        g.in_left = strm.avail_in;
+        g.in_next = strm.next_in;
+        outb(NULL, NULL, 0);        /* finish off final write and check */
 
-    /* read file name, if present, into allocated memory */
-    if ((flags & 8) && save) {
-        unsigned char *end;
-        size_t copy, have, size = 0;
-        have = 0;
-        do {
-            if (g.in_left == 0 && load() == 0)
-                return -3;
-            end = memchr(g.in_next, 0, g.in_left);
-            copy = end == NULL ? g.in_left : (size_t)(end - g.in_next) + 1;
-            have = vmemcpy(&g.hname, &size, have, g.in_next, copy);
-            g.in_left -= copy;
-            g.in_next += copy;
-        } while (end == NULL);
-        crc = crc32(crc, (unsigned char *)g.hname, have);
-    }
-    else if (flags & 8)
-        while (GETC() != 0)
-            ;
+        /* compute compressed data length */
+        clen = g.in_tot - g.in_left;
+#ifndef NOTHREAD
+        stat_inflate(start, main);
+        stat_data((size_t)clen, (size_t)g.out_tot, 0);
+#endif
 
-    /* skip comment */
-    if (flags & 16)
-        while (GETC() != 0)
-            ;
+        /* read and check trailer */
+        if (g.form > 1) {           /* zip local trailer (if any) */
+            if (g.form == 3) {      /* data descriptor follows */
+                /* read original version of data descriptor */
+                g.zip_crc = GET4();
+                g.zip_clen = GET4();
+                g.zip_ulen = GET4();
+                if (g.in_eof)
+                    throw(EDOM, "%s: corrupted entry -- missing trailer",
+                          g.inf);
+
+                /* if crc doesn't match, try info-zip variant with sig */
+                if (g.zip_crc != g.out_check) {
+                    if (g.zip_crc != 0x08074b50UL || g.zip_clen != g.out_check)
+                        throw(EDOM, "%s: corrupted entry -- crc32 mismatch",
+                              g.inf);
+                    g.zip_crc = g.zip_clen;
+                    g.zip_clen = g.zip_ulen;
+                    g.zip_ulen = GET4();
+                }
+
+                /* handle incredibly rare cases where crc equals signature */
+                else if (g.zip_crc == 0x08074b50UL &&
+                         g.zip_clen == g.zip_crc &&
+                         ((clen & LOW32) != g.zip_crc ||
+                          g.zip_ulen == g.zip_crc)) {
+                    g.zip_crc = g.zip_clen;
+                    g.zip_clen = g.zip_ulen;
+                    g.zip_ulen = GET4();
+                }
+
+                /* if second length doesn't match, try 64-bit lengths */
+                if (g.zip_ulen != (g.out_tot & LOW32)) {
+                    g.zip_ulen = GET4();
+                    (void)GET4();
+                }
+                if (g.in_eof)
+                    throw(EDOM, "%s: corrupted entry -- missing trailer",
+                          g.inf);
+            }
+            if (g.zip_clen != (clen & LOW32) ||
+                g.zip_ulen != (g.out_tot & LOW32))
+                throw(EDOM, "%s: corrupted entry -- length mismatch",
+                      g.inf);
+            check = g.zip_crc;
+        }
+        else if (g.form == 1) {     /* zlib (big-endian) trailer */
+            check = (unsigned long)(GET()) << 24;
+            check += (unsigned long)(GET()) << 16;
+            check += (unsigned)(GET()) << 8;
+            check += GET();
+            if (g.in_eof)
+                throw(EDOM, "%s: corrupted -- missing trailer", g.inf);
+            if (check != g.out_check)
+                throw(EDOM, "%s: corrupted -- adler32 mismatch", g.inf);
+        }
+        else {                      /* gzip trailer */
+            check = GET4();
+            len = GET4();
+            if (g.in_eof)
+                throw(EDOM, "%s: corrupted -- missing trailer", g.inf);
+            if (check != g.out_check)
+                throw(EDOM, "%s: corrupted -- crc32 mismatch", g.inf);
+            if (len != (g.out_tot & LOW32))
+                throw(EDOM, "%s: corrupted -- length mismatch", g.inf);
+        }
 
-    /* check header crc */
-    if ((flags & 2) && GET2() != (crc & 0xffff))
-        return -6;
+        /* a followed input ends after a complete stream */
+        flw.ended = 1;
 
-    /* return gzip compression method */
-    g.form = 0;
-    return g.in_eof ? -3 : method;
-}
+        /* show file information if requested */
+        if (g.list && !g.json) {
+            g.in_tot = clen;
+            show_info(8, check, g.out_tot, cont);
+            cont = 1;
+        }
+        members++;
+        ctot += clen;
+        utot += g.out_tot;
 
-/* --- list contents of compressed input (gzip, zlib, or lzw) */
+        /* if a gzip entry follows a gzip entry, decompress it (don't replace
+           saved header information from first entry) */
+        was = g.form;
+    } while (was == 0 && (ret = get_header(0)) == 8 && g.form == 0);
 
-/* find standard compressed file suffix, return length of suffix */
-local size_t compressed_suffix(char *nm)
-{
-    size_t len;
+    /* gzip -cdf copies junk after gzip stream directly to output */
+    if (was == 0 && ret == -2 && g.force && g.pipeout && g.decode != 2 &&
+        !g.list)
+        cat();
+    else if (was > 1 && get_header(0) != -5)
+        complain("warning: %s: entries after the first were ignored", g.inf);
+    else if ((was == 0 && ret != -1) || (was == 1 && (GET(), !g.in_eof)))
+        complain("warning: %s: trailing junk was ignored", g.inf);
 
-    len = strlen(nm);
-    if (len > 4) {
-        nm += len - 4;
-        len = 4;
-        if (strcmp(nm, ".zip") == 0 || strcmp(nm, ".ZIP") == 0 ||
-            strcmp(nm, ".tgz") == 0)
-            return 4;
+    /* with --format=json, a test shows one line for all of the members */
+    if (g.json && g.decode == 2) {
+        g.in_tot = ctot;
+        show_json(8, check, utot, members, seconds() - began);
     }
-    if (len > 3) {
-        nm += len - 3;
-        len = 3;
-        if (strcmp(nm, ".gz") == 0 || strcmp(nm, "-gz") == 0 ||
-            strcmp(nm, ".zz") == 0 || strcmp(nm, "-zz") == 0)
-            return 3;
-    }
-    if (len > 2) {
-        nm += len - 2;
-        if (strcmp(nm, ".z") == 0 || strcmp(nm, "-z") == 0 ||
-            strcmp(nm, "_z") == 0 || strcmp(nm, ".Z") == 0)
-            return 2;
-    }
-    return 0;
 }
 
-/* listing file name lengths for -l and -lv */
-#define NAMEMAX1 48     /* name display limit at verbosity 1 */
-#define NAMEMAX2 16     /* name display limit at verbosity 2 */
-
-/* print gzip or lzw file information */
-local void show_info(int method, unsigned long check, off_t len, int cont)
-{
-    size_t max;             /* maximum name length for current verbosity */
-    size_t n;               /* name length without suffix */
-    time_t now;             /* for getting current year */
-    char mod[26];           /* modification time in text */
-    char tag[NAMEMAX1+1];   /* header or file name, possibly truncated */
+/* --- decompress Unix compress (LZW) input --- */
 
-    /* create abbreviated name from header file name or actual file name */
-    max = g.verbosity > 1 ? NAMEMAX2 : NAMEMAX1;
-    memset(tag, 0, max + 1);
-    if (cont)
-        strncpy(tag, "<...>", max + 1);
-    else if (g.hname == NULL) {
-        n = strlen(g.inf) - compressed_suffix(g.inf);
-        strncpy(tag, g.inf, n > max + 1 ? max + 1 : n);
-        if (strcmp(g.inf + n, ".tgz") == 0 && n < max + 1)
-            strncpy(tag + n, ".tar", max + 1 - n);
-    }
-    else
-        strncpy(tag, g.hname, max + 1);
-    if (tag[max])
-        strcpy(tag + max - 3, "...");
+/* Type for accumulating bits.  23 bits will be used to accumulate up to 16-bit
+   symbols. */
+typedef uint32_t bits_t;
 
-    /* convert time stamp to text */
-    if (g.stamp) {
-        strcpy(mod, ctime(&g.stamp));
-        now = time(NULL);
-        if (strcmp(mod + 20, ctime(&now) + 20) != 0)
-            strcpy(mod + 11, mod + 19);
-    }
-    else
-        strcpy(mod + 4, "------ -----");
-    mod[16] = 0;
+#define NOMORE() (g.in_left == 0 && (g.in_eof || load() == 0))
+#define NEXT() (g.in_left--, *g.in_next++)
 
-    /* if first time, print header */
-    if (g.first) {
-        if (g.verbosity > 1)
-            fputs("method    check    timestamp    ", stdout);
-        if (g.verbosity > 0)
-            puts("compressed   original reduced  name");
-        g.first = 0;
-    }
+/* Decompress a compress (LZW) file from ind to outd.  The compress magic
+   header (two bytes) has already been read and verified. */
+local void unlzw(void)
+{
+    unsigned bits;              /* current bits per code (9..16) */
+    unsigned mask;              /* mask for current bits codes = (1<<bits)-1 */
+    bits_t buf;                 /* bit buffer (need 23 bits) */
+    unsigned left;              /* bits left in buf (0..7 after code pulled) */
+    off_t mark;                 /* offset where last change in bits began */
+    unsigned code;              /* code, table traversal index */
+    unsigned max;               /* maximum bits per code for this stream */
+    unsigned flags;             /* compress flags, then block compress flag */
+    unsigned end;               /* last valid entry in prefix/suffix tables */
+    unsigned prev;              /* previous code */
+    unsigned final;             /* last character written for previous code */
+    unsigned stack;             /* next position for reversed string */
+    unsigned outcnt;            /* bytes in output buffer */
+    /* memory for unlzw() -- the first 256 entries of prefix[] and suffix[] are
+       never used, so could have offset the index but it's faster to waste a
+       little memory */
+    uint_least16_t prefix[65536];       /* index to LZW prefix string */
+    unsigned char suffix[65536];        /* one-character LZW suffix */
+    unsigned char match[65280 + 2];     /* buffer for reversed match */
 
-    /* print information */
-    if (g.verbosity > 1) {
-        if (g.form == 3 && !g.decode)
-            printf("zip%3d  --------  %s  ", method, mod + 4);
-        else if (g.form > 1)
-            printf("zip%3d  %08lx  %s  ", method, check, mod + 4);
-        else if (g.form == 1)
-            printf("zlib%2d  %08lx  %s  ", method, check, mod + 4);
-        else if (method == 257)
-            printf("lzw     --------  %s  ", mod + 4);
-        else
-            printf("gzip%2d  %08lx  %s  ", method, check, mod + 4);
-    }
-    if (g.verbosity > 0) {
-        if ((g.form == 3 && !g.decode) ||
-            (method == 8 && g.in_tot > (len + (len >> 10) + 12)) ||
-            (method == 257 && g.in_tot > len + (len >> 1) + 3))
-#if __STDC_VERSION__-0 >= 199901L || __GNUC__-0 >= 3
-            printf("%10jd %10jd?  unk    %s\n",
-                   (intmax_t)g.in_tot, (intmax_t)len, tag);
-        else
-            printf("%10jd %10jd %6.1f%%  %s\n",
-                   (intmax_t)g.in_tot, (intmax_t)len,
-                   len == 0 ? 0 : 100 * (len - g.in_tot)/(double)len,
-                   tag);
-#else
-            printf(sizeof(off_t) == sizeof(long) ?
-                   "%10ld %10ld?  unk    %s\n" : "%10lld %10lld?  unk    %s\n",
-                   g.in_tot, len, tag);
-        else
-            printf(sizeof(off_t) == sizeof(long) ?
-                   "%10ld %10ld %6.1f%%  %s\n" : "%10lld %10lld %6.1f%%  %s\n",
-                   g.in_tot, len,
-                   len == 0 ? 0 : 100 * (len - g.in_tot)/(double)len,
-                   tag);
-#endif
-    }
-}
+    /* process remainder of compress header -- a flags byte */
+    g.out_tot = 0;
+    if (NOMORE())
+        throw(EDOM, "%s: lzw premature end", g.inf);
+    flags = NEXT();
+    if (flags & 0x60)
+        throw(EDOM, "%s: unknown lzw flags set", g.inf);
+    max = flags & 0x1f;
+    if (max < 9 || max > 16)
+        throw(EDOM, "%s: lzw bits out of range", g.inf);
+    if (max == 9)                           /* 9 doesn't really mean 9 */
+        max = 10;
+    flags &= 0x80;                          /* true if block compress */
 
-/* list content information about the gzip file at ind (only works if the gzip
-   file contains a single gzip stream with no junk at the end, and only works
-   well if the uncompressed length is less than 4 GB) */
-local void list_info(void)
-{
-    int method;             /* get_header() return value */
-    size_t n;               /* available trailer bytes */
-    off_t at;               /* used to calculate compressed length */
-    unsigned char tail[8];  /* trailer containing check and length */
-    unsigned long check, len;   /* check value and length from trailer */
+    /* mark the start of the compressed data for computing the first flush */
+    mark = g.in_tot - g.in_left;
 
-    /* initialize input buffer */
-    in_init();
+    /* clear table, start at nine bits per symbol */
+    bits = 9;
+    mask = 0x1ff;
+    end = flags ? 256 : 255;
 
-    /* read header information and position input after header */
-    method = get_header(1);
-    if (method < 0) {
-        RELEASE(g.hname);
-        if (method != -1 && g.verbosity > 1)
-            complain(method != -6 ? "skipping: %s not compressed" :
-                     "skipping: %s corrupted: invalid header crc", g.inf);
+    /* set up: get first 9-bit code, which is the first decompressed byte, but
+       don't create a table entry until the next code */
+    if (NOMORE())                           /* no compressed data is ok */
         return;
-    }
+    buf = NEXT();
+    if (NOMORE())
+        throw(EDOM, "%s: lzw premature end", g.inf);  /* need nine bits */
+    buf += NEXT() << 8;
+    final = prev = buf & mask;              /* code */
+    buf >>= bits;
+    left = 16 - bits;
+    if (prev > 255)
+        throw(EDOM, "%s: invalid lzw code", g.inf);
+    out_buf[0] = final;                     /* write first decompressed byte */
+    outcnt = 1;
+
+    /* decode codes */
+    stack = 0;
+    for (;;) {
+        /* if the table will be full after this, increment the code size */
+        if (end >= mask && bits < max) {
+            /* flush unused input bits and bytes to next 8*bits bit boundary
+               (this is a vestigial aspect of the compressed data format
+               derived from an implementation that made use of a special VAX
+               machine instruction!) */
+            {
+                unsigned rem = ((g.in_tot - g.in_left) - mark) % bits;
+                if (rem)
+                    rem = bits - rem;
+                while (rem > g.in_left) {
+                    rem -= g.in_left;
+                    if (load() == 0)
+                        break;
+                }
+                g.in_left -= rem;
+                g.in_next += rem;
+            }
+            buf = 0;
+            left = 0;
 
-    /* list zip file */
-    if (g.form > 1) {
-        g.in_tot = g.zip_clen;
-        show_info(method, g.zip_crc, g.zip_ulen, 0);
-        return;
-    }
+            /* mark this new location for computing the next flush */
+            mark = g.in_tot - g.in_left;
 
-    /* list zlib file */
-    if (g.form == 1) {
-        at = lseek(g.ind, 0, SEEK_END);
-        if (at == -1) {
-            check = 0;
-            do {
-                len = g.in_left < 4 ? g.in_left : 4;
-                g.in_next += g.in_left - len;
-                while (len--)
-                    check = (check << 8) + *g.in_next++;
-            } while (load() != 0);
-            check &= LOW32;
+            /* go to the next number of bits per symbol */
+            bits++;
+            mask <<= 1;
+            mask++;
         }
-        else {
-            g.in_tot = at;
-            lseek(g.ind, -4, SEEK_END);
-            readn(g.ind, tail, 4);
-            check = PULL4M(tail);
+
+        /* get a code of bits bits */
+        if (NOMORE())
+            break;                          /* end of compressed data */
+        buf += (bits_t)(NEXT()) << left;
+        left += 8;
+        if (left < bits) {
+            if (NOMORE())
+                throw(EDOM, "%s: lzw premature end", g.inf);
+            buf += (bits_t)(NEXT()) << left;
+            left += 8;
         }
-        g.in_tot -= 6;
-        show_info(method, check, 0, 0);
-        return;
-    }
+        code = buf & mask;
+        buf >>= bits;
+        left -= bits;
 
-    /* list lzw file */
-    if (method == 257) {
-        at = lseek(g.ind, 0, SEEK_END);
-        if (at == -1)
-            while (load() != 0)
-                ;
-        else
-            g.in_tot = at;
-        g.in_tot -= 3;
-        show_info(method, 0, 0, 0);
-        return;
-    }
+        /* process clear code (256) */
+        if (code == 256 && flags) {
+            /* flush unused input bits and bytes to next 8*bits bit boundary */
+            {
+                unsigned rem = ((g.in_tot - g.in_left) - mark) % bits;
+                if (rem)
+                    rem = bits - rem;
+                while (rem > g.in_left) {
+                    rem -= g.in_left;
+                    if (load() == 0)
+                        break;
+                }
+                g.in_left -= rem;
+                g.in_next += rem;
+            }
+            buf = 0;
+            left = 0;
 
-    /* skip to end to get trailer (8 bytes), compute compressed length */
-    if (g.in_short) {                   /* whole thing already read */
-        if (g.in_left < 8) {
-            complain("skipping: %s not a valid gzip file", g.inf);
-            return;
+            /* mark this new location for computing the next flush */
+            mark = g.in_tot - g.in_left;
+
+            /* go back to nine bits per symbol */
+            bits = 9;                       /* initialize bits and mask */
+            mask = 0x1ff;
+            end = 255;                      /* empty table */
+            continue;                       /* get next code */
         }
-        g.in_tot = g.in_left - 8;       /* compressed size */
-        memcpy(tail, g.in_next + (g.in_left - 8), 8);
-    }
-    else if ((at = lseek(g.ind, -8, SEEK_END)) != -1) {
-        g.in_tot = at - g.in_tot + g.in_left;   /* compressed size */
-        readn(g.ind, tail, 8);          /* get trailer */
-    }
-    else {                              /* can't seek */
-        at = g.in_tot - g.in_left;      /* save header size */
-        do {
-            n = g.in_left < 8 ? g.in_left : 8;
-            memcpy(tail, g.in_next + (g.in_left - n), n);
-            load();
-        } while (g.in_left == BUF);     /* read until end */
-        if (g.in_left < 8) {
-            if (n + g.in_left < 8) {
-                complain("skipping: %s not a valid gzip file", g.inf);
-                return;
+
+        /* special code to reuse last match */
+        {
+            unsigned temp = code;           /* save the current code */
+            if (code > end) {
+                /* Be picky on the allowed code here, and make sure that the
+                   code we drop through (prev) will be a valid index so that
+                   random input does not cause an exception. */
+                if (code != end + 1 || prev > end)
+                    throw(EDOM, "%s: invalid lzw code", g.inf);
+                match[stack++] = final;
+                code = prev;
             }
-            if (g.in_left) {
-                if (n + g.in_left > 8)
-                    memcpy(tail, tail + n - (8 - g.in_left), 8 - g.in_left);
-                memcpy(tail + 8 - g.in_left, g.in_next, g.in_left);
+
+            /* walk through linked list to generate output in reverse order */
+            while (code >= 256) {
+                match[stack++] = suffix[code];
+                code = prefix[code];
+            }
+            match[stack++] = code;
+            final = code;
+
+            /* link new table entry */
+            if (end < mask) {
+                end++;
+                prefix[end] = prev;
+                suffix[end] = final;
             }
+
+            /* set previous code for next iteration */
+            prev = temp;
         }
-        else
-            memcpy(tail, g.in_next + (g.in_left - 8), 8);
-        g.in_tot -= at + 8;
-    }
-    if (g.in_tot < 2) {
-        complain("skipping: %s not a valid gzip file", g.inf);
-        return;
-    }
 
-    /* convert trailer to check and uncompressed length (modulo 2^32) */
-    check = PULL4L(tail);
-    len = PULL4L(tail + 4);
+        /* write output in forward order */
+        while (stack > OUTSIZE - outcnt) {
+            while (outcnt < OUTSIZE)
+                out_buf[outcnt++] = match[--stack];
+            g.out_tot += outcnt;
+#ifndef NOTHREAD
+            if (dig.on)
+                sha256_update(&dig.sha, out_buf, outcnt);
+#endif
+            if (g.decode == 1)
+                writen(g.outd, out_buf, outcnt);
+            outcnt = 0;
+        }
+        do {
+            out_buf[outcnt++] = match[--stack];
+        } while (stack);
+    }
 
-    /* list information about contents */
-    show_info(method, check, len, 0);
-    RELEASE(g.hname);
+    /* write any remaining buffered output */
+    g.out_tot += outcnt;
+#ifndef NOTHREAD
+    if (dig.on)
+        sha256_update(&dig.sha, out_buf, outcnt);
+#endif
+    if (outcnt && g.decode == 1)
+        writen(g.outd, out_buf, outcnt);
 }
 
-/* --- copy input to output (when acting like cat) --- */
+/* --- file processing --- */
 
-local void cat(void)
+/* extract file name from path */
+local char *justname(char *path)
 {
-    /* write first magic byte (if we're here, there's at least one byte) */
-    writen(g.outd, &g.magic1, 1);
-    g.out_tot = 1;
+    char *p;
 
-    /* copy the remainder of the input to the output (if there were any more
-       bytes of input, then g.in_left is non-zero and g.in_next is pointing to
-       the second magic byte) */
-    while (g.in_left) {
-        writen(g.outd, g.in_next, g.in_left);
-        g.out_tot += g.in_left;
-        g.in_left = 0;
-        load();
-    }
+    p = strrchr(path, '/');
+    return p == NULL ? path : p + 1;
 }
 
-/* --- decompress deflate input --- */
-
-/* call-back input function for inflateBack() */
-local unsigned inb(void *desc, unsigned char **buf)
+/* Copy file attributes, from -> to, as best we can.  This is best effort, so
+   no errors are reported.  The mode bits, including suid, sgid, and the sticky
+   bit are copied (if allowed), the owner's user id and group id are copied
+   (again if allowed), and the access and modify times are copied. */
+local void copymeta(char *from, char *to)
 {
-    (void)desc;
-    load();
-    *buf = g.in_next;
-    return g.in_left;
-}
+    struct stat st;
+    struct timeval times[2];
 
-/* output buffers and window for infchk() and unlzw() */
-#define OUTSIZE 32768U      /* must be at least 32K for inflateBack() window */
-local unsigned char out_buf[OUTSIZE];
+    /* get all of from's Unix meta data, return if not a regular file */
+    if (stat(from, &st) != 0 || (st.st_mode & S_IFMT) != S_IFREG)
+        return;
 
-#ifndef NOTHREAD
-/* output data for parallel write and check */
-local unsigned char out_copy[OUTSIZE];
-local size_t out_len;
+    /* set to's mode bits, ignore errors */
+    (void)chmod(to, st.st_mode & 07777);
 
-/* outb threads states */
-local lock *outb_write_more = NULL;
-local lock *outb_check_more;
+    /* copy owner's user and group, ignore errors */
+    (void)chown(to, st.st_uid, st.st_gid);
 
-/* output write thread */
-local void outb_write(void *dummy)
+    /* copy access and modify times, ignore errors */
+    times[0].tv_sec = st.st_atime;
+    times[0].tv_usec = 0;
+    times[1].tv_sec = st.st_mtime;
+    times[1].tv_usec = 0;
+    (void)utimes(to, times);
+}
+
+/* set the access and modify times of fd to t */
+local void touch(char *path, time_t t)
 {
-    size_t len;
-    ball_t err;                     /* error information from throw() */
+    struct timeval times[2];
+
+    times[0].tv_sec = t;
+    times[0].tv_usec = 0;
+    times[1].tv_sec = t;
+    times[1].tv_usec = 0;
+    (void)utimes(path, times);
+}
+
+#ifndef NOTHREAD
+
+/* -- benchmark of compression and decompression settings -- */
+
+/* With --bench, the files named on the command line, or if none, generated
+   corpora of text, binary records, a tar-like archive, zeros, and random
+   bytes, are loaded into memory.  Each corpus is then compressed with
+   parallel_compress() and decompressed with infchk(), with readn() and
+   writen() connected to memory through IOFUNC, for each combination of the
+   levels in bench_levels[], the block sizes in bench_blocks[], and the numbers
+   of threads 1, 2, 4, ... up to -p.  The decompressed data is compared to the
+   original.  A line is written for each combination with the compressed size
+   as a percentage of the original, the compression and decompression speeds
+   in MB/s, the compression CPU time (all threads), and the parallel
+   efficiency: the speedup over one thread divided by the number of threads.
+   The output format (-z, -K) and other options are used as given. */
+
+/* size of each generated corpus */
+#define BENCHLEN (16UL << 20)
+
+/* compression levels and block sizes for each corpus */
+local const int bench_levels[] = {1, 6, 9};
+local const size_t bench_blocks[] = {131072, 1048576};
+
+/* loaded or generated corpora */
+local struct {
+    int n;                      /* number of corpora */
+    struct bench_corpus {
+        char *name;             /* file name, or type of generated data */
+        unsigned char *buf;     /* the data */
+        size_t len;             /* length of the data */
+    } *corp;
+} bench;
+
+/* memory input and output for one compression or decompression */
+struct bench_io {
+    unsigned char *in;          /* next input */
+    size_t left;                /* input remaining */
+    unsigned char *out;         /* compressed output */
+    size_t len;                 /* length of compressed output */
+    size_t size;                /* allocated size of out */
+    unsigned char *ref;         /* expected output if not NULL */
+    size_t at;                  /* amount of ref[] matched so far */
+};
 
-    (void)dummy;
+/* provide input for readn() from memory */
+local ssize_t bench_get(void *ptr, unsigned char *buf, size_t len)
+{
+    struct bench_io *io = ptr;
 
-    Trace(("-- launched decompress write thread"));
-    try {
-        do {
-            possess(outb_write_more);
-            wait_for(outb_write_more, TO_BE, 1);
-            len = out_len;
-            if (len && g.decode == 1)
-                writen(g.outd, out_copy, len);
-            Trace(("-- decompress wrote %lu bytes", len));
-            twist(outb_write_more, TO, 0);
-        } while (len);
-    }
-    catch (err) {
-        THREADABORT(err);
-    }
-    Trace(("-- exited decompress write thread"));
+    if (len > io->left)
+        len = io->left;
+    memcpy(buf, io->in, len);
+    io->in += len;
+    io->left -= len;
+    return len;
 }
 
-/* output check thread */
-local void outb_check(void *dummy)
+/* save compressed output from writen() in memory, or compare decompressed
+   output to the original */
+local ssize_t bench_put(void *ptr, unsigned char *buf, size_t len)
 {
-    size_t len;
-    ball_t err;                     /* error information from throw() */
-
-    (void)dummy;
+    struct bench_io *io = ptr;
 
-    Trace(("-- launched decompress check thread"));
-    try {
-        do {
-            possess(outb_check_more);
-            wait_for(outb_check_more, TO_BE, 1);
-            len = out_len;
-            g.out_check = CHECK(g.out_check, out_copy, len);
-            Trace(("-- decompress checked %lu bytes", len));
-            twist(outb_check_more, TO, 0);
-        } while (len);
+    if (io->ref != NULL) {
+        if (memcmp(io->ref + io->at, buf, len))
+            throw(EINVAL, "%s: benchmark decompression mismatch", g.inf);
+        io->at += len;
+        return len;
     }
-    catch (err) {
-        THREADABORT(err);
+    if (io->len + len > io->size) {
+        io->size = (io->len + len) << 1;
+        io->out = alloc(io->out, io->size);
     }
-    Trace(("-- exited decompress check thread"));
+    memcpy(io->out + io->len, buf, len);
+    io->len += len;
+    return len;
 }
-#endif
 
-/* call-back output function for inflateBack() -- wait for the last write and
-   check calculation to complete, copy the write buffer, and then alert the
-   write and check threads and return for more decompression while that's
-   going on (or just write and check if no threads or if proc == 1) */
-local int outb(void *desc, unsigned char *buf, unsigned len)
+/* add a corpus named name with the len bytes at buf (allocated) */
+local void bench_add(char *name, unsigned char *buf, size_t len)
 {
-#ifndef NOTHREAD
-    static thread *wr, *ch;
-
-    if (g.procs > 1) {
-        /* if first time, initialize state and launch threads */
-        if (outb_write_more == NULL) {
-            outb_write_more = new_lock(0);
-            outb_check_more = new_lock(0);
-            wr = launch(outb_write, NULL);
-            ch = launch(outb_check, NULL);
-        }
+    struct bench_corpus *c;
+
+    bench.corp = alloc(bench.corp, (bench.n + 1) * sizeof(*bench.corp));
+    c = bench.corp + bench.n++;
+    c->name = alloc(NULL, strlen(name) + 1);
+    strcpy(c->name, name);
+    c->buf = buf;
+    c->len = len;
+}
 
-        /* wait for previous write and check threads to complete */
-        possess(outb_check_more);
-        wait_for(outb_check_more, TO_BE, 0);
-        possess(outb_write_more);
-        wait_for(outb_write_more, TO_BE, 0);
+/* load the file at path, or stdin if NULL, as a corpus */
+local void bench_load(char *path)
+{
+    int fd;
+    size_t len, size, got;
+    unsigned char *buf;
+
+    fd = path == NULL ? 0 : open(path, O_RDONLY, 0);
+    if (fd < 0)
+        throw(errno, "read error on %s (%s)", path, strerror(errno));
+    len = 0;
+    size = 65536;
+    buf = alloc(NULL, size);
+    while ((got = readn(fd, buf + len, size - len)) != 0)
+        if ((len += got) == size)
+            buf = alloc(buf, size <<= 1);
+    if (fd != 0)
+        close(fd);
+    bench_add(path == NULL ? "<stdin>" : path, buf, len);
+}
 
-        /* copy the output and alert the worker bees */
-        out_len = len;
-        g.out_tot += len;
-        memcpy(out_copy, buf, len);
-        twist(outb_write_more, TO, 1);
-        twist(outb_check_more, TO, 1);
+/* return the next pseudo-random number for the generated corpora */
+local uint64_t bench_rand(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
 
-        /* if requested with len == 0, clean up -- terminate and join write and
-           check threads, free lock */
-        if (len == 0 && outb_write_more != NULL) {
-            if (desc != NULL) {
-                destruct(ch);
-                destruct(wr);
-            }
-            else {
-                join(ch);
-                join(wr);
-            }
-            free_lock(outb_check_more);
-            free_lock(outb_write_more);
-            outb_write_more = NULL;
+/* generate the corpora */
+local void bench_make(void)
+{
+    static char *words[] = {
+        "the", "of", "and", "to", "in", "a", "is", "that", "for", "it", "as",
+        "was", "with", "be", "by", "on", "not", "he", "this", "are", "or",
+        "his", "from", "at", "which", "but", "have", "an", "had", "they",
+        "you", "were", "their", "one", "all", "we", "can", "her", "has",
+        "there", "been", "if", "more", "when", "will", "would", "who", "so",
+        "no", "data", "block", "thread", "output", "input", "compress",
+        "buffer", "window", "stream", "check", "header", "level", "deflate",
+        "match", "length"};
+    uint64_t state = 0x9e3779b97f4a7c15ULL, r;
+    unsigned char *text, *buf, *end;
+    size_t at, len, col, sum, k;
+    unsigned long n;
+    char *word;
+
+    /* text: words with a skewed distribution in lines of about 72 */
+    text = alloc(NULL, BENCHLEN);
+    at = col = 0;
+    while (at < BENCHLEN) {
+        r = bench_rand(&state);
+        word = words[((r & 63) * ((r >> 6) & 63)) >> 6];
+        len = strlen(word);
+        while (len && at < BENCHLEN) {
+            text[at++] = *word++;
+            len--;
+            col++;
         }
-
-        /* return for more decompression while last buffer is being written
-           and having its check value calculated -- we wait for those to finish
-           the next time this function is called */
-        return 0;
+        if (at < BENCHLEN)
+            text[at++] = col > 72 ? '\n' : (r >> 12) % 11 ? ' ' : ',';
+        col = col > 72 ? 0 : col + 1;
     }
-#endif
-
-    (void)desc;
-
-    /* if just one process or no threads, then do it without threads */
-    if (len) {
-        if (g.decode == 1)
-            writen(g.outd, buf, len);
-        g.out_check = CHECK(g.out_check, buf, len);
-        g.out_tot += len;
+    bench_add("text", text, BENCHLEN);
+
+    /* binary: 16-byte records with a count, a time stamp, and some values */
+    buf = alloc(NULL, BENCHLEN);
+    sum = 1400000000;
+    for (n = 0; n < BENCHLEN >> 4; n++) {
+        r = bench_rand(&state);
+        sum += r & 255;
+        PUT4L(buf + (n << 4), n);
+        PUT4L(buf + (n << 4) + 4, sum & 0xffffffffUL);
+        PUT2L(buf + (n << 4) + 8, (r >> 8) & 1023);
+        PUT2L(buf + (n << 4) + 10, (r >> 18) & 3);
+        PUT4L(buf + (n << 4) + 12, (r >> 32) & 0xffffffffUL);
     }
-    return 0;
+    bench_add("binary", buf, BENCHLEN);
+
+    /* tar: 512-byte headers, each followed by a piece of the text padded to
+       a multiple of 512, ending with zeros */
+    buf = alloc(NULL, BENCHLEN);
+    memset(buf, 0, BENCHLEN);
+    at = 0;
+    n = 0;
+    for (;;) {
+        r = bench_rand(&state);
+        len = 64 + (r & 16383);
+        if (at + 512 + len + 1024 > BENCHLEN)
+            break;
+        end = buf + at;
+        sprintf((char *)end, "bench/file%05lu.txt", n++);
+        strcpy((char *)end + 100, "0000644");
+        strcpy((char *)end + 108, "0001750");
+        strcpy((char *)end + 116, "0001750");
+        sprintf((char *)end + 124, "%011lo", (unsigned long)len);
+        sprintf((char *)end + 136, "%011lo", 1400000000UL + n * 60);
+        memset(end + 148, ' ', 8);
+        end[156] = '0';
+        memcpy(end + 257, "ustar  ", 8);
+        for (sum = 0, k = 0; k < 512; k++)
+            sum += end[k];
+        sprintf((char *)end + 148, "%06lo", (unsigned long)sum);
+        memcpy(end + 512, text + ((r >> 14) % (BENCHLEN - len)), len);
+        at += 512 + ((len + 511) & ~(size_t)511);
+    }
+    bench_add("tar", buf, BENCHLEN);
+
+    /* zeros */
+    buf = alloc(NULL, BENCHLEN);
+    memset(buf, 0, BENCHLEN);
+    bench_add("zeros", buf, BENCHLEN);
+
+    /* random */
+    buf = alloc(NULL, BENCHLEN);
+    for (at = 0; at < BENCHLEN; at += 8) {
+        r = bench_rand(&state);
+        memcpy(buf + at, &r, 8);
+    }
+    bench_add("random", buf, BENCHLEN);
 }
 
-/* inflate for decompression or testing -- decompress from ind to outd unless
-   decode != 1, in which case just test ind, and then also list if list != 0;
-   look for and decode multiple, concatenated gzip and/or zlib streams;
-   read and check the gzip, zlib, or zip trailer */
-local void infchk(void)
+/* return the CPU time used by all of the threads in seconds */
+local double bench_cpu(void)
 {
-    int ret, cont, was;
-    unsigned long check, len;
-    z_stream strm;
-    unsigned tmp2;
-    unsigned long tmp4;
-    off_t clen;
+    struct rusage use;
 
-    cont = 0;
-    do {
-        /* header already read -- set up for decompression */
-        g.in_tot = g.in_left;       /* track compressed data length */
-        g.out_tot = 0;
-        g.out_check = CHECK(0L, Z_NULL, 0);
-        strm.zalloc = ZALLOC;
-        strm.zfree = ZFREE;
-        strm.opaque = OPAQUE;
-        ret = inflateBackInit(&strm, 15, out_buf);
-        if (ret == Z_MEM_ERROR)
-            throw(ENOMEM, "not enough memory");
-        if (ret != Z_OK)
-            throw(EINVAL, "internal error");
+    getrusage(RUSAGE_SELF, &use);
+    return use.ru_utime.tv_sec + use.ru_utime.tv_usec / 1e6 +
+           use.ru_stime.tv_sec + use.ru_stime.tv_usec / 1e6;
+}
 
-        /* decompress, compute lengths and check value */
-        strm.avail_in = g.in_left;
-        strm.next_in = g.in_next;
-        ret = inflateBack(&strm, inb, NULL, outb, NULL);
-        inflateBackEnd(&strm);
-        if (ret == Z_DATA_ERROR)
-            throw(EDOM, "%s: corrupted -- invalid deflate data (%s)",
-                  g.inf, strm.msg);
-        if (ret == Z_BUF_ERROR)
-            throw(EDOM, "%s: corrupted -- incomplete deflate data", g.inf);
-        if (ret != Z_STREAM_END)
-            throw(EINVAL, "internal error");
-        g.in_left = strm.avail_in;
-        g.in_next = strm.next_in;
-        outb(NULL, NULL, 0);        /* finish off final write and check */
+/* run the benchmark on the loaded corpora, or on generated corpora if none
+   were loaded, and write the results to stdout */
+local void bench_run(void)
+{
+    int max = g.procs, form = g.form, lev, p, i, j, k;
+    double wall, cpu, comp, used, decomp, one = 0;
+    struct bench_corpus *c;
+    struct bench_io io;
+
+    if (bench.n == 0)
+        bench_make();
+    g.ind = g.outd = IOFUNC;
+    g.get = bench_get;
+    g.put = bench_put;
+    g.io = &io;
+    g.name = NULL;
+    g.mtime = 0;
+    g.outf = alloc(NULL, strlen("<bench>") + 1);
+    strcpy(g.outf, "<bench>");
+    io.out = NULL;
+    io.size = 0;
+    printf("%-12s %5s %7s %7s %7s %9s %9s %7s %7s\n", "corpus", "level",
+           "block", "threads", "size", "comp MB/s", "dec MB/s", "cpu s",
+           "effic");
+    for (k = 0; k < bench.n; k++) {
+        c = bench.corp + k;
+        vstrcpy(&g.inf, &g.inz, 0, c->name);
+        for (i = 0; i < (int)(sizeof(bench_levels) / sizeof(int)); i++)
+            for (j = 0; j < (int)(sizeof(bench_blocks) / sizeof(size_t));
+                 j++)
+                for (p = 1;; p = p << 1 < max ? p << 1 : max) {
+                    /* compress with new pools and threads for the settings */
+                    lev = bench_levels[i];
+                    g.level = lev;
+                    g.block = bench_blocks[j];
+                    g.procs = p;
+                    finish_jobs();
+                    io.in = c->buf;
+                    io.left = c->len;
+                    io.len = 0;
+                    io.ref = NULL;
+                    wall = seconds();
+                    cpu = bench_cpu();
+                    parallel_compress();
+                    comp = seconds() - wall;
+                    used = bench_cpu() - cpu;
+                    if (p == 1)
+                        one = comp;
+
+                    /* decompress and compare to the original */
+                    io.in = io.out;
+                    io.left = io.len;
+                    io.ref = c->buf;
+                    io.at = 0;
+                    g.decode = 1;
+                    wall = seconds();
+                    in_init();
+                    if (get_header(0) != 8)
+                        throw(EINVAL, "internal error");
+                    infchk();
+                    decomp = seconds() - wall;
+                    g.decode = 0;
+                    g.form = form;
+                    RELEASE(g.hname);
+                    if (io.at != c->len)
+                        throw(EINVAL, "%s: benchmark decompression mismatch",
+                              g.inf);
 
-        /* compute compressed data length */
-        clen = g.in_tot - g.in_left;
+                    /* report */
+                    printf("%-12s %5d %6luK %7d %6.2f%% %9.1f %9.1f %7.2f "
+                           "%6.0f%%\n", c->name, lev,
+                           (unsigned long)(g.block >> 10), p,
+                           c->len ? 100. * io.len / c->len : 0.,
+                           c->len / 1e6 / (comp > 1e-6 ? comp : 1e-6),
+                           c->len / 1e6 / (decomp > 1e-6 ? decomp : 1e-6),
+                           used, 100. * one / ((comp > 1e-6 ? comp : 1e-6) *
+                                               p));
+                    fflush(stdout);
+                    if (p == max)
+                        break;
+                }
+        free(c->buf);
+        free(c->name);
+    }
+    RELEASE(io.out);
+    RELEASE(g.outf);
+    RELEASE(bench.corp);
+    bench.n = 0;
+}
+#endif
 
-        /* read and check trailer */
-        if (g.form > 1) {           /* zip local trailer (if any) */
-            if (g.form == 3) {      /* data descriptor follows */
-                /* read original version of data descriptor */
-                g.zip_crc = GET4();
-                g.zip_clen = GET4();
-                g.zip_ulen = GET4();
-                if (g.in_eof)
-                    throw(EDOM, "%s: corrupted entry -- missing trailer",
-                          g.inf);
+/* process provided input file, or stdin if path is NULL -- process() can
+   call itself for recursive directory processing */
+local void process(char *path)
+{
+    volatile int method = -1;       /* get_header() return value */
+    size_t len;                     /* length of base name (minus suffix) */
+    struct stat st;                 /* to get file type and mod time */
+    ball_t err;                     /* error information from throw() */
+    double began;                   /* start of LZW test for --format=json */
+    /* all compressed suffixes for decoding search, in length order */
+    static char *sufs[] = {".z", "-z", "_z", ".Z", ".gz", "-gz", ".zz", "-zz",
+                           ".zip", ".ZIP", ".tgz", NULL};
 
-                /* if crc doesn't match, try info-zip variant with sig */
-                if (g.zip_crc != g.out_check) {
-                    if (g.zip_crc != 0x08074b50UL || g.zip_clen != g.out_check)
-                        throw(EDOM, "%s: corrupted entry -- crc32 mismatch",
-                              g.inf);
-                    g.zip_crc = g.zip_clen;
-                    g.zip_clen = g.zip_ulen;
-                    g.zip_ulen = GET4();
-                }
+#ifndef NOTHREAD
+    /* for --bench, just load the input as a corpus */
+    if (g.bench) {
+        bench_load(path);
+        return;
+    }
 
-                /* handle incredibly rare cases where crc equals signature */
-                else if (g.zip_crc == 0x08074b50UL &&
-                         g.zip_clen == g.zip_crc &&
-                         ((clen & LOW32) != g.zip_crc ||
-                          g.zip_ulen == g.zip_crc)) {
-                    g.zip_crc = g.zip_clen;
-                    g.zip_clen = g.zip_ulen;
-                    g.zip_ulen = GET4();
-                }
+    /* start collecting statistics and tracing with the first file */
+    if (g.lockstats && g.daemon)
+        throw(EINVAL, "--lock-stats cannot be used with --daemon"
+                      " (the counts are for the whole process)");
+    if (g.lockstats)
+        yarn_count(1);
+    if (g.perf)
+        g.stats = 1;
+    if ((g.stats || g.metrics != NULL) && !stats.on)
+        stat_init();
+    if (g.tracejson != NULL && tl.out == NULL)
+        trace_open(g.tracejson);
+    if (g.metrics != NULL && met.path == NULL)
+        met_open(g.metrics);
+#endif
 
-                /* if second length doesn't match, try 64-bit lengths */
-                if (g.zip_ulen != (g.out_tot & LOW32)) {
-                    g.zip_ulen = GET4();
-                    (void)GET4();
-                }
-                if (g.in_eof)
-                    throw(EDOM, "%s: corrupted entry -- missing trailer",
-                          g.inf);
+    /* open input file with name in, descriptor ind -- set name and mtime */
+    if (path == NULL) {
+        vstrcpy(&g.inf, &g.inz, 0, "<stdin>");
+        g.ind = 0;
+        g.name = NULL;
+        g.mtime = g.headis & 2 ?
+                  (fstat(g.ind, &st) ? time(NULL) : st.st_mtime) : 0;
+        len = 0;
+    }
+    else {
+        /* set input file name (already set if recursed here) */
+        if (path != g.inf)
+            vstrcpy(&g.inf, &g.inz, 0, path);
+        len = strlen(g.inf);
+
+        /* try to stat input file -- if not there and decoding, look for that
+           name with compressed suffixes */
+        if (lstat(g.inf, &st)) {
+            if (errno == ENOENT && (g.list || g.decode)) {
+                char **sufx = sufs;
+                do {
+                    if (*sufx == NULL)
+                        break;
+                    vstrcpy(&g.inf, &g.inz, len, *sufx++);
+                    errno = 0;
+                } while (lstat(g.inf, &st) && errno == ENOENT);
             }
-            if (g.zip_clen != (clen & LOW32) ||
-                g.zip_ulen != (g.out_tot & LOW32))
-                throw(EDOM, "%s: corrupted entry -- length mismatch",
-                      g.inf);
-            check = g.zip_crc;
-        }
-        else if (g.form == 1) {     /* zlib (big-endian) trailer */
-            check = (unsigned long)(GET()) << 24;
-            check += (unsigned long)(GET()) << 16;
-            check += (unsigned)(GET()) << 8;
-            check += GET();
-            if (g.in_eof)
-                throw(EDOM, "%s: corrupted -- missing trailer", g.inf);
-            if (check != g.out_check)
-                throw(EDOM, "%s: corrupted -- adler32 mismatch", g.inf);
-        }
-        else {                      /* gzip trailer */
-            check = GET4();
-            len = GET4();
-            if (g.in_eof)
-                throw(EDOM, "%s: corrupted -- missing trailer", g.inf);
-            if (check != g.out_check)
-                throw(EDOM, "%s: corrupted -- crc32 mismatch", g.inf);
-            if (len != (g.out_tot & LOW32))
-                throw(EDOM, "%s: corrupted -- length mismatch", g.inf);
+#ifdef EOVERFLOW
+            if (errno == EOVERFLOW || errno == EFBIG)
+                throw(EDOM, "%s too large -- "
+                      "not compiled with large file support", g.inf);
+#endif
+            if (errno) {
+                g.inf[len] = 0;
+                FAILED();
+                complain("skipping: %s does not exist", g.inf);
+                return;
+            }
+            len = strlen(g.inf);
         }
 
-        /* show file information if requested */
-        if (g.list) {
-            g.in_tot = clen;
-            show_info(8, check, g.out_tot, cont);
-            cont = 1;
+        /* only process regular files, but allow symbolic links if -f,
+           recurse into directory if -r */
+        if ((st.st_mode & S_IFMT) != S_IFREG &&
+            (st.st_mode & S_IFMT) != S_IFLNK &&
+            (st.st_mode & S_IFMT) != S_IFDIR) {
+            FAILED();
+            complain("skipping: %s is a special file or device", g.inf);
+            return;
+        }
+        if ((st.st_mode & S_IFMT) == S_IFLNK && !g.force && !g.pipeout) {
+            FAILED();
+            complain("skipping: %s is a symbolic link", g.inf);
+            return;
+        }
+        if ((st.st_mode & S_IFMT) == S_IFDIR && !g.recurse) {
+            FAILED();
+            complain("skipping: %s is a directory", g.inf);
+            return;
         }
 
-        /* if a gzip entry follows a gzip entry, decompress it (don't replace
-           saved header information from first entry) */
-        was = g.form;
-    } while (was == 0 && (ret = get_header(0)) == 8 && g.form == 0);
-
-    /* gzip -cdf copies junk after gzip stream directly to output */
-    if (was == 0 && ret == -2 && g.force && g.pipeout && g.decode != 2 &&
-        !g.list)
-        cat();
-    else if (was > 1 && get_header(0) != -5)
-        complain("warning: %s: entries after the first were ignored", g.inf);
-    else if ((was == 0 && ret != -1) || (was == 1 && (GET(), !g.in_eof)))
-        complain("warning: %s: trailing junk was ignored", g.inf);
-}
+        /* recurse into directory (assumes Unix) */
+        if ((st.st_mode & S_IFMT) == S_IFDIR) {
+            char *roll = NULL;
+            size_t size = 0, off = 0, base;
+            DIR *here;
+            struct dirent *next;
 
-/* --- decompress Unix compress (LZW) input --- */
+            /* accumulate list of entries (need to do this, since readdir()
+               behavior not defined if directory modified between calls) */
+            here = opendir(g.inf);
+            if (here == NULL)
+                return;
+            while ((next = readdir(here)) != NULL) {
+                if (next->d_name[0] == 0 ||
+                    (next->d_name[0] == '.' && (next->d_name[1] == 0 ||
+                     (next->d_name[1] == '.' && next->d_name[2] == 0))))
+                    continue;
+                off = vstrcpy(&roll, &size, off, next->d_name);
+            }
+            closedir(here);
+            vstrcpy(&roll, &size, off, "");
 
-/* Type for accumulating bits.  23 bits will be used to accumulate up to 16-bit
-   symbols. */
-typedef uint32_t bits_t;
+            /* run process() for each entry in the directory */
+            base = len && g.inf[len - 1] != (unsigned char)'/' ?
+                   vstrcpy(&g.inf, &g.inz, len, "/") : len;
+            for (off = 0; roll[off]; off += strlen(roll + off) + 1) {
+                vstrcpy(&g.inf, &g.inz, base, roll + off);
+                process(g.inf);
+            }
+            g.inf[len] = 0;
 
-#define NOMORE() (g.in_left == 0 && (g.in_eof || load() == 0))
-#define NEXT() (g.in_left--, *g.in_next++)
+            /* release list of entries */
+            FREE(roll);
+            return;
+        }
 
-/* Decompress a compress (LZW) file from ind to outd.  The compress magic
-   header (two bytes) has already been read and verified. */
-local void unlzw(void)
-{
-    unsigned bits;              /* current bits per code (9..16) */
-    unsigned mask;              /* mask for current bits codes = (1<<bits)-1 */
-    bits_t buf;                 /* bit buffer (need 23 bits) */
-    unsigned left;              /* bits left in buf (0..7 after code pulled) */
-    off_t mark;                 /* offset where last change in bits began */
-    unsigned code;              /* code, table traversal index */
-    unsigned max;               /* maximum bits per code for this stream */
-    unsigned flags;             /* compress flags, then block compress flag */
-    unsigned end;               /* last valid entry in prefix/suffix tables */
-    unsigned prev;              /* previous code */
-    unsigned final;             /* last character written for previous code */
-    unsigned stack;             /* next position for reversed string */
-    unsigned outcnt;            /* bytes in output buffer */
-    /* memory for unlzw() -- the first 256 entries of prefix[] and suffix[] are
-       never used, so could have offset the index but it's faster to waste a
-       little memory */
-    uint_least16_t prefix[65536];       /* index to LZW prefix string */
-    unsigned char suffix[65536];        /* one-character LZW suffix */
-    unsigned char match[65280 + 2];     /* buffer for reversed match */
+        /* don't compress .gz (or provided suffix) files, unless -f */
+        if (!(g.force || g.list || g.decode) && len >= strlen(g.sufx) &&
+                strcmp(g.inf + len - strlen(g.sufx), g.sufx) == 0) {
+            FAILED();
+            complain("skipping: %s ends with %s", g.inf, g.sufx);
+            return;
+        }
 
-    /* process remainder of compress header -- a flags byte */
-    g.out_tot = 0;
-    if (NOMORE())
-        throw(EDOM, "%s: lzw premature end", g.inf);
-    flags = NEXT();
-    if (flags & 0x60)
-        throw(EDOM, "%s: unknown lzw flags set", g.inf);
-    max = flags & 0x1f;
-    if (max < 9 || max > 16)
-        throw(EDOM, "%s: lzw bits out of range", g.inf);
-    if (max == 9)                           /* 9 doesn't really mean 9 */
-        max = 10;
-    flags &= 0x80;                          /* true if block compress */
+        /* create output file only if input file has compressed suffix */
+        if (g.decode == 1 && !g.pipeout && !g.list) {
+            int suf = compressed_suffix(g.inf);
+            if (suf == 0) {
+                FAILED();
+                complain("skipping: %s does not have compressed suffix",
+                         g.inf);
+                return;
+            }
+            len -= suf;
+        }
 
-    /* mark the start of the compressed data for computing the first flush */
-    mark = g.in_tot - g.in_left;
+        /* open input file */
+        g.ind = open(g.inf, O_RDONLY, 0);
+        if (g.ind < 0)
+            throw(errno, "read error on %s (%s)", g.inf, strerror(errno));
 
-    /* clear table, start at nine bits per symbol */
-    bits = 9;
-    mask = 0x1ff;
-    end = flags ? 256 : 255;
+        /* prepare gzip header information for compression */
+        g.name = g.headis & 1 ? justname(g.inf) : NULL;
+        g.mtime = g.headis & 2 ? st.st_mtime : 0;
+    }
+    SET_BINARY_MODE(g.ind);
+    ATOM_ADD(g.files, 1);
 
-    /* set up: get first 9-bit code, which is the first decompressed byte, but
-       don't create a table entry until the next code */
-    if (NOMORE())                           /* no compressed data is ok */
-        return;
-    buf = NEXT();
-    if (NOMORE())
-        throw(EDOM, "%s: lzw premature end", g.inf);  /* need nine bits */
-    buf += NEXT() << 8;
-    final = prev = buf & mask;              /* code */
-    buf >>= bits;
-    left = 16 - bits;
-    if (prev > 255)
-        throw(EDOM, "%s: invalid lzw code", g.inf);
-    out_buf[0] = final;                     /* write first decompressed byte */
-    outcnt = 1;
+    /* if decoding or testing, try to read gzip header */
+    RELEASE(g.hname);
+    if (g.decode) {
+        flw_open();
+        in_init();
+        method = get_header(1);
+        if (method != 8 && method != 257 &&
+                /* gzip -cdf acts like cat on uncompressed input */
+                !(method == -2 && g.force && g.pipeout && g.decode != 2 &&
+                  !g.list)) {
+            RELEASE(g.hname);
+            flw_close();
+            if (g.ind != 0)
+                close(g.ind);
+            if (method != -1)
+                bad_input(method < 0 ?
+                            method != -6 ? "%s is not compressed" :
+                                "%s corrupted: invalid header crc" :
+                          "%s has unknown compression method", 1);
+            return;
+        }
 
-    /* decode codes */
-    stack = 0;
-    for (;;) {
-        /* if the table will be full after this, increment the code size */
-        if (end >= mask && bits < max) {
-            /* flush unused input bits and bytes to next 8*bits bit boundary
-               (this is a vestigial aspect of the compressed data format
-               derived from an implementation that made use of a special VAX
-               machine instruction!) */
-            {
-                unsigned rem = ((g.in_tot - g.in_left) - mark) % bits;
-                if (rem)
-                    rem = bits - rem;
-                while (rem > g.in_left) {
-                    rem -= g.in_left;
-                    if (load() == 0)
-                        break;
+        /* if requested, test input file (possibly a test list) */
+        if (g.decode == 2) {
+            try {
+#ifndef NOTHREAD
+                dig_start();
+#endif
+                if (method == 8)
+                    infchk();
+                else {
+                    began = seconds();
+                    unlzw();
+                    if (g.json) {
+                        g.in_tot -= 3;
+                        show_json(method, 0, g.out_tot, 1, seconds() - began);
+                    }
+                    else if (g.list) {
+                        g.in_tot -= 3;
+                        show_info(method, 0, g.out_tot, 0);
+                    }
                 }
-                g.in_left -= rem;
-                g.in_next += rem;
+#ifndef NOTHREAD
+                dig_put(g.inf);
+#endif
             }
-            buf = 0;
-            left = 0;
-
-            /* mark this new location for computing the next flush */
-            mark = g.in_tot - g.in_left;
-
-            /* go to the next number of bits per symbol */
-            bits++;
-            mask <<= 1;
-            mask++;
+            catch (err) {
+                if (err.code != EDOM)
+                    punt(err);
+                if (g.json)
+                    show_json_error(err.why);
+                FAILED();
+                complain("skipping: %s", err.why);
+                drop(err);
+                outb(&g, NULL, 0);
+            }
+            RELEASE(g.hname);
+            flw_close();
+            if (g.ind != 0)
+                close(g.ind);
+            return;
         }
+    }
 
-        /* get a code of bits bits */
-        if (NOMORE())
-            break;                          /* end of compressed data */
-        buf += (bits_t)(NEXT()) << left;
-        left += 8;
-        if (left < bits) {
-            if (NOMORE())
-                throw(EDOM, "%s: lzw premature end", g.inf);
-            buf += (bits_t)(NEXT()) << left;
-            left += 8;
-        }
-        code = buf & mask;
-        buf >>= bits;
-        left -= bits;
+    /* if requested, just list information about input file */
+    if (g.list) {
+        list_info();
+        RELEASE(g.hname);
+        flw_close();
+        if (g.ind != 0)
+            close(g.ind);
+        return;
+    }
+
+    /* create output file out, descriptor outd */
+    if (path == NULL || g.pipeout) {
+        /* write to stdout */
+        g.outf = alloc(NULL, strlen("<stdout>") + 1);
+        strcpy(g.outf, "<stdout>");
+        g.outd = 1;
+        if (!g.decode && !g.force && isatty(g.outd))
+            throw(EINVAL, "trying to write compressed data to a terminal"
+                          " (use -f to force)");
+    }
+    else {
+        char *to = g.inf, *sufx = "";
+        size_t pre = 0;
 
-        /* process clear code (256) */
-        if (code == 256 && flags) {
-            /* flush unused input bits and bytes to next 8*bits bit boundary */
-            {
-                unsigned rem = ((g.in_tot - g.in_left) - mark) % bits;
-                if (rem)
-                    rem = bits - rem;
-                while (rem > g.in_left) {
-                    rem -= g.in_left;
-                    if (load() == 0)
-                        break;
-                }
-                g.in_left -= rem;
-                g.in_next += rem;
+        /* select parts of the output file name */
+        if (g.decode) {
+            /* for -dN or -dNT, use the path from the input file and the name
+               from the header, stripping any path in the header name */
+            if ((g.headis & 1) != 0 && g.hname != NULL) {
+                pre = justname(g.inf) - g.inf;
+                to = justname(g.hname);
+                len = strlen(to);
             }
-            buf = 0;
-            left = 0;
+            /* for -d or -dNn, replace abbreviated suffixes */
+            else if (strcmp(to + len, ".tgz") == 0)
+                sufx = ".tar";
+        }
+        else
+            /* add appropriate suffix when compressing */
+            sufx = g.sufx;
 
-            /* mark this new location for computing the next flush */
-            mark = g.in_tot - g.in_left;
+        /* create output file and open to write */
+        g.outf = alloc(NULL, pre + len + strlen(sufx) + 1);
+        memcpy(g.outf, g.inf, pre);
+        memcpy(g.outf + pre, to, len);
+        strcpy(g.outf + pre + len, sufx);
+#ifndef NOTHREAD
+        if (g.force)
+            reuse_keep();
+        /* when resuming, keep the output for jnl_open() to truncate */
+        if (g.resume && !g.decode && jnl_found())
+            g.outd = open(g.outf, O_WRONLY, 0600);
+        else
+#endif
+        g.outd = open(g.outf, O_CREAT | O_TRUNC | O_WRONLY |
+                              (g.force ? 0 : O_EXCL), 0600);
 
-            /* go back to nine bits per symbol */
-            bits = 9;                       /* initialize bits and mask */
-            mask = 0x1ff;
-            end = 255;                      /* empty table */
-            continue;                       /* get next code */
-        }
+        /* if exists and not -f, give user a chance to overwrite */
+        if (g.outd < 0 && errno == EEXIST && isatty(0) && g.verbosity) {
+            int ch, reply;
 
-        /* special code to reuse last match */
-        {
-            unsigned temp = code;           /* save the current code */
-            if (code > end) {
-                /* Be picky on the allowed code here, and make sure that the
-                   code we drop through (prev) will be a valid index so that
-                   random input does not cause an exception. */
-                if (code != end + 1 || prev > end)
-                    throw(EDOM, "%s: invalid lzw code", g.inf);
-                match[stack++] = final;
-                code = prev;
+            fprintf(stderr, "%s exists -- overwrite (y/n)? ", g.outf);
+            fflush(stderr);
+            reply = -1;
+            do {
+                ch = getchar();
+                if (reply < 0 && ch != ' ' && ch != '\t')
+                    reply = ch == 'y' || ch == 'Y' ? 1 : 0;
+            } while (ch != EOF && ch != '\n' && ch != '\r');
+            if (reply == 1) {
+#ifndef NOTHREAD
+                reuse_keep();
+#endif
+                g.outd = open(g.outf, O_CREAT | O_TRUNC | O_WRONLY,
+                              0600);
             }
+        }
 
-            /* walk through linked list to generate output in reverse order */
-            while (code >= 256) {
-                match[stack++] = suffix[code];
-                code = prefix[code];
-            }
-            match[stack++] = code;
-            final = code;
+        /* if exists and no overwrite, report and go on to next */
+        if (g.outd < 0 && errno == EEXIST) {
+            FAILED();
+            complain("skipping: %s exists", g.outf);
+            RELEASE(g.outf);
+            RELEASE(g.hname);
+            if (g.ind != 0)
+                close(g.ind);
+            return;
+        }
 
-            /* link new table entry */
-            if (end < mask) {
-                end++;
-                prefix[end] = prev;
-                suffix[end] = final;
-            }
+        /* if some other error, give up */
+        if (g.outd < 0)
+            throw(errno, "write error on %s (%s)", g.outf, strerror(errno));
+    }
+    SET_BINARY_MODE(g.outd);
+    RELEASE(g.hname);
 
-            /* set previous code for next iteration */
-            prev = temp;
+    /* process ind to outd */
+    if (g.verbosity > 1)
+        fprintf(stderr, "%s to %s ", g.inf, g.outf);
+#ifndef NOTHREAD
+    prog_start();
+#endif
+    if (g.decode) {
+        try {
+#ifndef NOTHREAD
+            dig_start();
+#endif
+            if (method == 8)
+                infchk();
+            else if (method == 257)
+                unlzw();
+            else
+                cat();
+#ifndef NOTHREAD
+            dig_put(g.outd == 1 ? g.inf : g.outf);
+#endif
+        }
+        catch (err) {
+            if (err.code != EDOM)
+                punt(err);
+            FAILED();
+            complain("skipping: %s", err.why);
+            drop(err);
+            outb(g.outf, NULL, 0);
+            if (g.outd != -1 && g.outd != 1) {
+                close(g.outd);
+                g.outd = -1;
+                unlink(g.outf);
+                RELEASE(g.outf);
+            }
         }
+    }
+#ifndef NOTHREAD
+    else if (g.cachedir != NULL && !g.follow && !g.tees && !g.digest &&
+             g.index == NULL && !g.stats && g.tracejson == NULL &&
+             g.metrics == NULL && whole_get())
+        ;
+    else if (use_parallel()) {
+        parallel_compress();
+        dig_put(g.inf);
+    }
+#endif
+    else
+        single_compress(0);
+#ifndef NOTHREAD
+    prog_stop();
+#endif
+    if (g.werr)
+        throw(g.werr, "write error on %s (%s)", g.outf, strerror(g.werr));
+    if (g.verbosity > 1) {
+        putc('\n', stderr);
+        fflush(stderr);
+    }
 
-        /* write output in forward order */
-        while (stack > OUTSIZE - outcnt) {
-            while (outcnt < OUTSIZE)
-                out_buf[outcnt++] = match[--stack];
-            g.out_tot += outcnt;
-            if (g.decode == 1)
-                writen(g.outd, out_buf, outcnt);
-            outcnt = 0;
+    /* finish up, copy attributes, set times, delete original */
+    flw_close();
+    if (g.ind != 0)
+        close(g.ind);
+    if (g.outd != -1 && g.outd != 1) {
+        if (close(g.outd))
+            throw(errno, "write error on %s (%s)", g.outf, strerror(errno));
+        g.outd = -1;            /* now prevent deletion on interrupt */
+#ifndef NOTHREAD
+        if (g.cachedir != NULL && !g.decode)
+            whole_put();        /* save compressed output in cache */
+#endif
+        if (g.ind != 0) {
+            copymeta(g.inf, g.outf);
+            if (!g.keep && !g.follow)   /* a followed name may be new */
+                unlink(g.inf);
         }
-        do {
-            out_buf[outcnt++] = match[--stack];
-        } while (stack);
+        if (g.decode && (g.headis & 2) != 0 && g.stamp)
+            touch(g.outf, g.stamp);
     }
+    RELEASE(g.outf);
+}
 
-    /* write any remaining buffered output */
-    g.out_tot += outcnt;
-    if (outcnt && g.decode == 1)
-        writen(g.outd, out_buf, outcnt);
+local char *helptext[] = {
+"Usage: pigz [options] [files ...]",
+"  will compress files in place, adding the suffix '.gz'.  If no files are",
+#ifdef NOTHREAD
+"  specified, stdin will be compressed to stdout.  pigz does what gzip does.",
+#else
+"  specified, stdin will be compressed to stdout.  pigz does what gzip does,",
+"  but spreads the work over multiple processors and cores when compressing.",
+#endif
+"",
+"Options:",
+"  -0 to -9, -11        Compression level (11 is much slower, a few % better)",
+"  --fast, --best       Compression levels 1 and 9 respectively",
+"  -b, --blocksize mmm  Set compression block size to mmmK (default 128K)",
+"  -c, --stdout         Write all processed output to stdout (won't delete)",
+"  -d, --decompress     Decompress the compressed input",
+"  -f, --force          Force overwrite, compress .gz, links, and to terminal",
+"  -F  --first          Do iterations first, before block split for -11",
+"  -h, --help           Display a help screen and quit",
+"  -i, --independent    Compress blocks independently for damage recovery",
+"  -I, --iterations n   Number of iterations for -11 optimization",
+"  -k, --keep           Do not delete original file after processing",
+"  -K, --zip            Compress to PKWare zip (.zip) single entry format",
+"  -l, --list           List the contents of the compressed input",
+"  -L, --license        Display the pigz license and quit",
+"  -M, --maxsplits n    Maximum number of split blocks for -11",
+"  -n, --no-name        Do not store or restore file name in/from header",
+"  -N, --name           Store/restore file name and mod time in/from header",
+"  -O  --oneblock       Do not split into smaller blocks for -11",
+#ifndef NOTHREAD
+"  -p, --processes n    Allow up to n compression threads (default is the",
+"                       number of online processors, or 8 if unknown)",
+#endif
+"  -q, --quiet          Print no messages, even on error",
+"  -r, --recursive      Process the contents of all subdirectories",
+"  -R, --rsyncable      Input-determined block locations for rsync",
+"  -S, --suffix .sss    Use suffix .sss instead of .gz (for compression)",
+"  -t, --test           Test the integrity of the compressed input",
+"  -T, --no-time        Do not store or restore mod time in/from header",
+#ifdef DEBUG
+"  -v, --verbose        Provide more verbose output (-vv to debug)",
+#else
+"  -v, --verbose        Provide more verbose output",
+#endif
+"  -V  --version        Show the version of pigz",
+"  -z, --zlib           Compress to zlib (.zz) instead of gzip format",
+#ifndef NOTHREAD
+"  --align n            Start each compressed block at a multiple of n bytes",
+"  --also path          Also write the output to path as .zip or else gzip",
+"  --bench              Measure levels, block sizes, and threads on the files",
+"  --block-cache dir    Copy repeated blocks from a cache kept in dir",
+"  --cache-dir dir      Copy outputs for repeated inputs from a cache in dir",
+"  --cache-size n       Keep the --cache-dir total size under n bytes",
+"  --daemon path        Serve pigz --socket path commands, keeping threads",
+"  --digest file        Append a SHA-256 of the uncompressed data to file",
+"  --flush-interval ms  Flush input that has waited ms milliseconds",
+"  --follow             Keep reading a file as it grows, until rotated",
+"  --format json        Write -l, -t, and --stats results as JSON",
+"  --index file         Write an index of the compressed blocks to file",
+"  --lock-stats         Report the use and contention of each kind of lock",
+"  --metrics-file path  Save Prometheus metrics to path every 10 s and at exit",
+"  --perf               Add CPU performance counters to --stats (implies it)",
+"  --progress           Report progress, throughput, and time left on stderr",
+"  --resume             Keep a journal to resume an interrupted compression",
+"  --reuse file.gz      Copy unchanged blocks from file.gz using file.gz.idx",
+"  --socket path        Have the pigz --daemon at path do this command",
+"  --stats              Report where the time went and the bottleneck stage",
+"  --tee path           Also write the compressed output to path",
+"  --trace-json file    Write a timeline of the threads' work to file",
+#endif
+"  --                   All arguments after \"--\" are treated as files"
+};
+
+/* exit after -h, -L, or -V -- when serving a daemon request, end just the
+   request with a throw(0), which leaves its try block without a catch */
+local void quit(void)
+{
+    if (g.daemon)
+        throw(0);
+    exit(0);
+}
+
+/* display the help text above */
+local void help(void)
+{
+    int n;
+
+    if (g.verbosity == 0)
+        return;
+    for (n = 0; n < (int)(sizeof(helptext) / sizeof(char *)); n++)
+        fprintf(stderr, "%s\n", helptext[n]);
+    fflush(stderr);
+    quit();
 }
 
-/* --- file processing --- */
+#ifndef NOTHREAD
 
-/* extract file name from path */
-local char *justname(char *path)
+/* try to determine the number of processors */
+local int nprocs(int n)
 {
-    char *p;
+#  ifdef _SC_NPROCESSORS_ONLN
+    n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#  else
+#    ifdef _SC_NPROC_ONLN
+    n = (int)sysconf(_SC_NPROC_ONLN);
+#    else
+#      ifdef __hpux
+    struct pst_dynamic psd;
 
-    p = strrchr(path, '/');
-    return p == NULL ? path : p + 1;
+    if (pstat_getdynamic(&psd, sizeof(psd), (size_t)1, 0) != -1)
+        n = psd.psd_proc_cnt;
+#      endif
+#    endif
+#  endif
+    return n;
 }
 
-/* Copy file attributes, from -> to, as best we can.  This is best effort, so
-   no errors are reported.  The mode bits, including suid, sgid, and the sticky
-   bit are copied (if allowed), the owner's user id and group id are copied
-   (again if allowed), and the access and modify times are copied. */
-local void copymeta(char *from, char *to)
-{
-    struct stat st;
-    struct timeval times[2];
+#endif
 
-    /* get all of from's Unix meta data, return if not a regular file */
-    if (stat(from, &st) != 0 || (st.st_mode & S_IFMT) != S_IFREG)
-        return;
+/* set option defaults */
+local void defaults(void)
+{
+    g.level = Z_DEFAULT_COMPRESSION;
+    /* default zopfli options as set by ZopfliInitOptions():
+        verbose = 0
+        numiterations = 15
+        blocksplitting = 1
+        blocksplittinglast = 0
+        blocksplittingmax = 15
+     */
+    ZopfliInitOptions(&g.zopts);
+#ifdef NOTHREAD
+    g.procs = 1;
+#else
+    g.procs = nprocs(8);
+#endif
+    g.block = 131072UL;             /* 128K */
+    g.rsync = 0;                    /* don't do rsync blocking */
+    g.setdict = 1;                  /* initialize dictionary each thread */
+    g.index = NULL;                 /* don't write a block index */
+    g.reuse = NULL;                 /* don't reuse previous output */
+    g.cache = NULL;                 /* don't cache compressed blocks */
+    g.cachedir = NULL;              /* don't cache compressed files */
+    g.cachemax = 0;                 /* no limit on cache size */
+    g.align = 0;                    /* don't align blocks */
+    g.resume = 0;                   /* don't journal compression */
+    g.flushint = 0;                 /* only flush at the end */
+    g.follow = 0;                   /* input ends at end of file */
+    g.tees = 0;                     /* only write to the output file */
+    g.digest = NULL;                /* no digest */
+    g.bench = 0;                    /* process files */
+    g.sock = NULL;                  /* no daemon or client */
+    g.stats = 0;                    /* no statistics */
+    g.lockstats = 0;                /* no lock use counts */
+    g.progress = 0;                 /* no progress reports */
+    g.perf = 0;                     /* no performance counters */
+    g.tracejson = NULL;             /* no timeline trace */
+    g.json = 0;                     /* text listings and statistics */
+    g.metrics = NULL;               /* no metrics file */
+    g.files = 0;                    /* no inputs yet */
+    g.errors = 0;
+    g.verbosity = 1;                /* normal message level */
+    g.headis = 3;                   /* store/restore name and timestamp */
+    g.pipeout = 0;                  /* don't force output to stdout */
+    g.sufx = ".gz";                 /* compressed file suffix */
+    g.decode = 0;                   /* compress */
+    g.list = 0;                     /* compress */
+    g.keep = 0;                     /* delete input file once compressed */
+    g.force = 0;                    /* don't overwrite, don't compress links */
+    g.recurse = 0;                  /* don't go into directories */
+    g.form = 0;                     /* use gzip format */
+}
 
-    /* set to's mode bits, ignore errors */
-    (void)chmod(to, st.st_mode & 07777);
+/* long options conversion to short options */
+local char *longopts[][2] = {
+    {"LZW", "Z"}, {"ascii", "a"}, {"best", "9"}, {"bits", "Z"},
+    {"blocksize", "b"}, {"decompress", "d"}, {"fast", "1"}, {"first", "F"},
+    {"force", "f"}, {"help", "h"}, {"independent", "i"}, {"iterations", "I"},
+    {"keep", "k"}, {"license", "L"}, {"list", "l"}, {"maxsplits", "M"},
+    {"name", "N"}, {"no-name", "n"}, {"no-time", "T"}, {"oneblock", "O"},
+    {"processes", "p"}, {"quiet", "q"}, {"recursive", "r"}, {"rsyncable", "R"},
+    {"silent", "q"}, {"stdout", "c"}, {"suffix", "S"}, {"test", "t"},
+    {"to-stdout", "c"}, {"uncompress", "d"}, {"verbose", "v"},
+    {"version", "V"}, {"zip", "K"}, {"zlib", "z"}};
+#define NLOPTS (sizeof(longopts) / (sizeof(char *) << 1))
 
-    /* copy owner's user and group, ignore errors */
-    (void)chown(to, st.st_uid, st.st_gid);
+/* long options with no short option equivalent, and either the value of get in
+   option() for the parameter that follows, or the offset of the flag in g to
+   set (an offset, since g can be a different struct in each thread) */
+#define FLAG(f) offsetof(struct globals, f)
+local struct {
+    char *name;
+    int get;
+    size_t flag;
+} longonly[] = {
+    {"align", 11, 0}, {"also", 16, 0}, {"bench", 0, FLAG(bench)},
+    {"block-cache", 8, 0}, {"cache-dir", 9, 0}, {"cache-size", 10, 0},
+    {"daemon", 12, 0}, {"digest", 17, 0}, {"flush-interval", 14, 0},
+    {"follow", 0, FLAG(follow)}, {"format", 19, 0}, {"index", 6, 0},
+    {"lock-stats", 0, FLAG(lockstats)}, {"metrics-file", 20, 0},
+    {"perf", 0, FLAG(perf)}, {"progress", 0, FLAG(progress)},
+    {"resume", 0, FLAG(resume)}, {"reuse", 7, 0}, {"socket", 13, 0},
+    {"stats", 0, FLAG(stats)}, {"tee", 15, 0}, {"trace-json", 18, 0}};
+#define NLONLY (sizeof(longonly) / sizeof(longonly[0]))
 
-    /* copy access and modify times, ignore errors */
-    times[0].tv_sec = st.st_atime;
-    times[0].tv_usec = 0;
-    times[1].tv_sec = st.st_mtime;
-    times[1].tv_usec = 0;
-    (void)utimes(to, times);
+/* either new buffer size, new compression level, or new number of processes --
+   get rid of old buffers and threads to force the creation of new ones with
+   the new settings */
+local void new_opts(void)
+{
+#ifdef PIGZ_LIB
+    if (gp != &gs)
+        return;         /* library stream: nothing to get rid of yet */
+#endif
+    if (g.daemon)
+        return;         /* daemon checks buffer sizes for each request */
+    single_compress(1);
+#ifndef NOTHREAD
+    finish_jobs();
+#endif
 }
 
-/* set the access and modify times of fd to t */
-local void touch(char *path, time_t t)
+/* verify that arg is only digits, and if so, return the decimal value */
+local size_t num(char *arg)
 {
-    struct timeval times[2];
+    char *str = arg;
+    size_t val = 0;
 
-    times[0].tv_sec = t;
-    times[0].tv_usec = 0;
-    times[1].tv_sec = t;
-    times[1].tv_usec = 0;
-    (void)utimes(path, times);
+    if (*str == 0)
+        throw(EINVAL, "internal error: empty parameter");
+    do {
+        if (*str < '0' || *str > '9' ||
+            (val && ((~(size_t)0) - (*str - '0')) / val < 10))
+            throw(EINVAL, "invalid numeric parameter: %s", arg);
+        val = val * 10 + (*str - '0');
+    } while (*++str);
+    return val;
 }
 
-/* process provided input file, or stdin if path is NULL -- process() can
-   call itself for recursive directory processing */
-local void process(char *path)
+/* process an option, return true if a file name and not an option */
+local int option(char *arg)
 {
-    volatile int method = -1;       /* get_header() return value */
-    size_t len;                     /* length of base name (minus suffix) */
-    struct stat st;                 /* to get file type and mod time */
-    ball_t err;                     /* error information from throw() */
-    /* all compressed suffixes for decoding search, in length order */
-    static char *sufs[] = {".z", "-z", "_z", ".Z", ".gz", "-gz", ".zz", "-zz",
-                           ".zip", ".ZIP", ".tgz", NULL};
+    static int get = 0;     /* if not zero, look for option parameter */
+    char bad[3] = "-X";     /* for error messages (X is replaced) */
 
-    /* open input file with name in, descriptor ind -- set name and mtime */
-    if (path == NULL) {
-        vstrcpy(&g.inf, &g.inz, 0, "<stdin>");
-        g.ind = 0;
-        g.name = NULL;
-        g.mtime = g.headis & 2 ?
-                  (fstat(g.ind, &st) ? time(NULL) : st.st_mtime) : 0;
-        len = 0;
+    /* if no argument or dash option, check status of get */
+    if (get && (arg == NULL || *arg == '-')) {
+        int j, opt = get;
+
+        get = 0;
+        if (opt <= 5) {
+            bad[1] = "bpSIM"[opt - 1];
+            throw(EINVAL, "missing parameter after %s", bad);
+        }
+        for (j = 0; longonly[j].get != opt; j++)
+            ;
+        throw(EINVAL, "missing parameter after --%s", longonly[j].name);
     }
-    else {
-        /* set input file name (already set if recursed here) */
-        if (path != g.inf)
-            vstrcpy(&g.inf, &g.inz, 0, path);
-        len = strlen(g.inf);
+    if (arg == NULL)
+        return 0;
 
-        /* try to stat input file -- if not there and decoding, look for that
-           name with compressed suffixes */
-        if (lstat(g.inf, &st)) {
-            if (errno == ENOENT && (g.list || g.decode)) {
-                char **sufx = sufs;
-                do {
-                    if (*sufx == NULL)
-                        break;
-                    vstrcpy(&g.inf, &g.inz, len, *sufx++);
-                    errno = 0;
-                } while (lstat(g.inf, &st) && errno == ENOENT);
-            }
-#ifdef EOVERFLOW
-            if (errno == EOVERFLOW || errno == EFBIG)
-                throw(EDOM, "%s too large -- "
-                      "not compiled with large file support", g.inf);
+    /* process long option or short options */
+    if (*arg == '-') {
+        /* a single dash will be interpreted as stdin */
+        if (*++arg == 0)
+            return 1;
+
+        /* process long option (fall through with equivalent short option) */
+        if (*arg == '-') {
+            int j;
+            char *eq;
+            size_t len;
+
+            /* a long-only option can be given its parameter as --name=value */
+            arg++;
+            eq = strchr(arg, '=');
+            len = eq == NULL ? strlen(arg) : (size_t)(eq - arg);
+            for (j = NLONLY - 1; j >= 0; j--)
+                if (strncmp(arg, longonly[j].name, len) == 0 &&
+                    longonly[j].name[len] == 0) {
+                    if (eq != NULL && longonly[j].get == 0)
+                        throw(EINVAL, "--%s does not take a parameter",
+                              longonly[j].name);
+                    if (longonly[j].flag) {
+#ifdef NOTHREAD
+                        throw(EINVAL, "compiled without threads");
 #endif
-            if (errno) {
-                g.inf[len] = 0;
-                complain("skipping: %s does not exist", g.inf);
-                return;
+                        *(int *)((char *)gp + longonly[j].flag) = 1;
+                    }
+                    get = longonly[j].get;
+                    return eq == NULL ? 0 : option(eq + 1);
+                }
+            for (j = NLOPTS - 1; j >= 0; j--)
+                if (strcmp(arg, longopts[j][0]) == 0) {
+                    arg = longopts[j][1];
+                    break;
+                }
+            if (j < 0)
+                throw(EINVAL, "invalid option: %s", arg - 2);
+        }
+
+        /* process short options (more than one allowed after dash) */
+        do {
+            /* if looking for a parameter, don't process more single character
+               options until we have the parameter */
+            if (get) {
+                if (get == 3)
+                    throw(EINVAL, "invalid usage: "
+                                  "-s must be followed by space");
+                break;      /* allow -pnnn and -bnnn, fall to parameter code */
+            }
+
+            /* process next single character option or compression level */
+            bad[1] = *arg;
+            switch (*arg) {
+            case '0': case '1': case '2': case '3': case '4':
+            case '5': case '6': case '7': case '8': case '9':
+                g.level = *arg - '0';
+                while (arg[1] >= '0' && arg[1] <= '9') {
+                    if (g.level && (INT_MAX - (arg[1] - '0')) / g.level < 10)
+                        throw(EINVAL, "only levels 0..9 and 11 are allowed");
+                    g.level = g.level * 10 + *++arg - '0';
+                }
+                if (g.level == 10 || g.level > 11)
+                    throw(EINVAL, "only levels 0..9 and 11 are allowed");
+                new_opts();
+                break;
+            case 'F':  g.zopts.blocksplittinglast = 1;  break;
+            case 'I':  get = 4;  break;
+            case 'K':  g.form = 2;  g.sufx = ".zip";  break;
+            case 'L':
+                fputs(VERSION, stderr);
+                fputs("Copyright (C) 2007-2015 Mark Adler\n", stderr);
+                fputs("Subject to the terms of the zlib license.\n",
+                      stderr);
+                fputs("No warranty is provided or implied.\n", stderr);
+                quit();
+                break;
+            case 'M':  get = 5;  break;
+            case 'N':  g.headis |= 0xf;  break;
+            case 'O':  g.zopts.blocksplitting = 0;  break;
+            case 'R':  g.rsync = 1;  break;
+            case 'S':  get = 3;  break;
+            case 'T':  g.headis &= ~0xa;  break;
+            case 'V':  fputs(VERSION, stderr);  quit();  break;
+            case 'Z':
+                throw(EINVAL, "invalid option: LZW output not supported: %s",
+                      bad);
+            case 'a':
+                throw(EINVAL, "invalid option: no ascii conversion: %s",
+                      bad);
+            case 'b':  get = 1;  break;
+            case 'c':  g.pipeout = 1;  break;
+            case 'd':  if (!g.decode) g.headis >>= 2;  g.decode = 1;  break;
+            case 'f':  g.force = 1;  break;
+            case 'h':  help();  break;
+            case 'i':  g.setdict = 0;  break;
+            case 'k':  g.keep = 1;  break;
+            case 'l':  g.list = 1;  break;
+            case 'n':  g.headis &= ~5;  break;
+            case 'p':  get = 2;  break;
+            case 'q':  g.verbosity = 0;  break;
+            case 'r':  g.recurse = 1;  break;
+            case 't':  g.decode = 2;  break;
+            case 'v':  g.verbosity++;  break;
+            case 'z':  g.form = 1;  g.sufx = ".zz";  break;
+            default:
+                throw(EINVAL, "invalid option: %s", bad);
             }
-            len = strlen(g.inf);
-        }
+        } while (*++arg);
+        if (*arg == 0)
+            return 0;
+    }
 
-        /* only process regular files, but allow symbolic links if -f,
-           recurse into directory if -r */
-        if ((st.st_mode & S_IFMT) != S_IFREG &&
-            (st.st_mode & S_IFMT) != S_IFLNK &&
-            (st.st_mode & S_IFMT) != S_IFDIR) {
-            complain("skipping: %s is a special file or device", g.inf);
-            return;
+    /* process option parameter for -b, -p, -S, -I, -M, or long-only option
+       (get is cleared first, so that an invalid parameter does not leave it
+       set for the next use of option()) */
+    if (get) {
+        int opt = get;
+        size_t n;
+
+        get = 0;
+        if (opt == 1) {
+            n = num(arg);
+            g.block = n << 10;                  /* chunk size */
+            if (g.block < DICT)
+                throw(EINVAL, "block size too small (must be >= 32K)");
+            if (n != g.block >> 10 ||
+                OUTPOOL(g.block) < g.block ||
+                (ssize_t)OUTPOOL(g.block) < 0 ||
+                g.block > (1UL << 29))          /* limited by append_len() */
+                throw(EINVAL, "block size too large: %s", arg);
+            new_opts();
         }
-        if ((st.st_mode & S_IFMT) == S_IFLNK && !g.force && !g.pipeout) {
-            complain("skipping: %s is a symbolic link", g.inf);
-            return;
+        else if (opt == 2) {
+            n = num(arg);
+            g.procs = (int)n;                   /* # processes */
+            if (g.procs < 1)
+                throw(EINVAL, "invalid number of processes: %s", arg);
+            if ((size_t)g.procs != n || INBUFS(g.procs) < 1)
+                throw(EINVAL, "too many processes: %s", arg);
+#ifdef NOTHREAD
+            if (g.procs > 1)
+                throw(EINVAL, "compiled without threads");
+#endif
+            new_opts();
         }
-        if ((st.st_mode & S_IFMT) == S_IFDIR && !g.recurse) {
-            complain("skipping: %s is a directory", g.inf);
-            return;
+        else if (opt == 3)
+            g.sufx = arg;                       /* gz suffix */
+        else if (opt == 4)
+            g.zopts.numiterations = num(arg);   /* optimization iterations */
+        else if (opt == 5)
+            g.zopts.blocksplittingmax = num(arg);   /* max block splits */
+        else if (opt == 19) {
+            if (strcmp(arg, "json") == 0)
+                g.json = 1;                     /* listing as JSON */
+            else if (strcmp(arg, "text") == 0)
+                g.json = 0;
+            else
+                throw(EINVAL, "invalid format: %s (must be text or json)",
+                      arg);
+        }
+        else if (opt >= 6) {
+#ifdef NOTHREAD
+            throw(EINVAL, "compiled without threads");
+#endif
+            if (opt == 6)
+                g.index = arg;                  /* block index to write */
+            else if (opt == 7)
+                g.reuse = arg;                  /* previous output */
+            else if (opt == 8)
+                g.cache = arg;                  /* block cache directory */
+            else if (opt == 9)
+                g.cachedir = arg;               /* whole file cache */
+            else if (opt == 10)
+                g.cachemax = num(arg);          /* whole file cache limit */
+            else if (opt == 12 || opt == 13) {
+                /* main() looks for these before the other options */
+                if (g.sock != NULL || g.daemon)
+                    throw(EINVAL, "--%s can only be on the command line,"
+                                  " once", opt == 12 ? "daemon" : "socket");
+                g.sock = arg;                   /* daemon socket */
+                g.serve = opt == 12;
+            }
+            else if (opt == 14) {
+                n = num(arg);
+                g.flushint = (int)n;            /* flush interval in ms */
+                if (g.flushint < 1 || (size_t)g.flushint != n)
+                    throw(EINVAL, "invalid flush interval: %s", arg);
+            }
+            else if (opt == 15 || opt == 16) {
+                if (g.tees == TEES)
+                    throw(EINVAL, "too many --%s destinations: %s",
+                          opt == 15 ? "tee" : "also", arg);
+                n = strlen(arg);
+                g.teeform[g.tees] = opt == 15 ? -1 :    /* zip or gzip */
+                    n > 4 && strcmp(arg + n - 4, ".zip") == 0 ? 2 : 0;
+                g.tee[g.tees++] = arg;          /* more output destinations */
+            }
+            else if (opt == 17)
+                g.digest = arg;                 /* where to write digests */
+            else if (opt == 18)
+                g.tracejson = arg;              /* where to write the trace */
+            else if (opt == 20)
+                g.metrics = arg;                /* where to write metrics */
+            else {
+                g.align = num(arg);             /* output block alignment */
+                if (g.align < 16)
+                    throw(EINVAL, "invalid alignment: %s", arg);
+            }
         }
+        return 0;
+    }
 
-        /* recurse into directory (assumes Unix) */
-        if ((st.st_mode & S_IFMT) == S_IFDIR) {
-            char *roll = NULL;
-            size_t size = 0, off = 0, base;
-            DIR *here;
-            struct dirent *next;
+    /* neither an option nor parameter */
+    return 1;
+}
 
-            /* accumulate list of entries (need to do this, since readdir()
-               behavior not defined if directory modified between calls) */
-            here = opendir(g.inf);
-            if (here == NULL)
-                return;
-            while ((next = readdir(here)) != NULL) {
-                if (next->d_name[0] == 0 ||
-                    (next->d_name[0] == '.' && (next->d_name[1] == 0 ||
-                     (next->d_name[1] == '.' && next->d_name[2] == 0))))
-                    continue;
-                off = vstrcpy(&roll, &size, off, next->d_name);
-            }
-            closedir(here);
-            vstrcpy(&roll, &size, off, "");
+/* process the arguments in argv[1..argc-1] after the options have been set
+   from the defaults and the environment -- compress or decompress the named
+   files, or stdin to stdout if none */
+local void process_args(int argc, char **argv)
+{
+    int n;                          /* general index */
+    int noop;                       /* true to suppress option decoding */
+    unsigned long done;             /* number of named files processed */
 
-            /* run process() for each entry in the directory */
-            base = len && g.inf[len - 1] != (unsigned char)'/' ?
-                   vstrcpy(&g.inf, &g.inz, len, "/") : len;
-            for (off = 0; roll[off]; off += strlen(roll + off) + 1) {
-                vstrcpy(&g.inf, &g.inz, base, roll + off);
-                process(g.inf);
-            }
-            g.inf[len] = 0;
+    /* decompress if named "unpigz" or "gunzip", to stdout if "*cat" */
+    if (strcmp(g.prog, "unpigz") == 0 || strcmp(g.prog, "gunzip") == 0) {
+        if (!g.decode)
+            g.headis >>= 2;
+        g.decode = 1;
+    }
+    if ((n = strlen(g.prog)) > 2 && strcmp(g.prog + n - 3, "cat") == 0) {
+        if (!g.decode)
+            g.headis >>= 2;
+        g.decode = 1;
+        g.pipeout = 1;
+    }
 
-            /* release list of entries */
-            FREE(roll);
-            return;
-        }
+    /* if no arguments and compressed data to/from terminal, show help */
+    if (argc < 2 && isatty(g.decode ? 0 : 1))
+        help();
 
-        /* don't compress .gz (or provided suffix) files, unless -f */
-        if (!(g.force || g.list || g.decode) && len >= strlen(g.sufx) &&
-                strcmp(g.inf + len - strlen(g.sufx), g.sufx) == 0) {
-            complain("skipping: %s ends with %s", g.inf, g.sufx);
-            return;
+    /* process command-line arguments */
+    done = noop = 0;
+    for (n = 1; n < argc; n++)
+        /* ignore options after "--" */
+        if (noop == 0 && strcmp(argv[n], "--") == 0) {
+            noop = 1;
+            option(NULL);
         }
-
-        /* create output file only if input file has compressed suffix */
-        if (g.decode == 1 && !g.pipeout && !g.list) {
-            int suf = compressed_suffix(g.inf);
-            if (suf == 0) {
-                complain("skipping: %s does not have compressed suffix",
-                         g.inf);
-                return;
-            }
-            len -= suf;
+        /* process argument, interpreting if option */
+        else if (noop || option(argv[n])) {
+            /* argv[n] is a name to process */
+            if (done == 1 && g.pipeout && !g.decode && !g.list &&
+                g.form > 1)
+                complain("warning: output will be concatenated zip files"
+                         " -- %s will not be able to extract", g.prog);
+            process(strcmp(argv[n], "-") ? argv[n] : NULL);
+            done++;
         }
+    option(NULL);
 
-        /* open input file */
-        g.ind = open(g.inf, O_RDONLY, 0);
-        if (g.ind < 0)
-            throw(errno, "read error on %s (%s)", g.inf, strerror(errno));
+    /* list stdin or compress stdin to stdout if no file names provided, or
+       run the benchmark on the named files or generated corpora */
+#ifndef NOTHREAD
+    if (g.bench)
+        bench_run();
+    else
+#endif
+    if (done == 0)
+        process(NULL);
+}
 
-        /* prepare gzip header information for compression */
-        g.name = g.headis & 1 ? justname(g.inf) : NULL;
-        g.mtime = g.headis & 2 ? st.st_mtime : 0;
-    }
-    SET_BINARY_MODE(g.ind);
+#ifndef NOTHREAD
+/* handle error received from yarn function */
+local void cut_yarn(int err)
+{
+    throw(err, err == ENOMEM ? "not enough memory" : "internal threads error");
+}
 
-    /* if decoding or testing, try to read gzip header */
-    RELEASE(g.hname);
-    if (g.decode) {
-        in_init();
-        method = get_header(1);
-        if (method != 8 && method != 257 &&
-                /* gzip -cdf acts like cat on uncompressed input */
-                !(method == -2 && g.force && g.pipeout && g.decode != 2 &&
-                  !g.list)) {
-            RELEASE(g.hname);
-            if (g.ind != 0)
-                close(g.ind);
-            if (method != -1)
-                complain(method < 0 ?
-                            method != -6 ? "skipping: %s is not compressed" :
-                                "skipping: %s corrupted: invalid header crc" :
-                         "skipping: %s has unknown compression method", g.inf);
-            return;
+/* end a run on the files: write the last progress line, the statistics, the
+   lock counts, and the metrics, and close the trace and the tee destinations
+   -- all are closed even if one has an error, ready for another run in the
+   daemon */
+local void run_end(void)
+{
+    ball_t err, moot;
+
+    prog_stop();
+    stat_show();
+    if (g.lockstats)
+        yarn_count_show();
+    met_close();
+    stat_end();
+    try {
+        tee_close();
+    }
+    catch (err) {
+        try {
+            trace_close();
         }
-
-        /* if requested, test input file (possibly a test list) */
-        if (g.decode == 2) {
-            try {
-                if (method == 8)
-                    infchk();
-                else {
-                    unlzw();
-                    if (g.list) {
-                        g.in_tot -= 3;
-                        show_info(method, 0, g.out_tot, 0);
-                    }
-                }
-            }
-            catch (err) {
-                if (err.code != EDOM)
-                    punt(err);
-                complain("skipping: %s", err.why);
-                drop(err);
-                outb(&g, NULL, 0);
-            }
-            RELEASE(g.hname);
-            if (g.ind != 0)
-                close(g.ind);
-            return;
+        catch (moot) {
+            drop(moot);
         }
+        punt(err);
     }
+    trace_close();
+}
+#endif
 
-    /* if requested, just list information about input file */
-    if (g.list) {
-        list_info();
-        RELEASE(g.hname);
-        if (g.ind != 0)
-            close(g.ind);
-        return;
-    }
+#ifndef NOTHREAD
 
-    /* create output file out, descriptor outd */
-    if (path == NULL || g.pipeout) {
-        /* write to stdout */
-        g.outf = alloc(NULL, strlen("<stdout>") + 1);
-        strcpy(g.outf, "<stdout>");
-        g.outd = 1;
-        if (!g.decode && !g.force && isatty(g.outd))
-            throw(EINVAL, "trying to write compressed data to a terminal"
-                          " (use -f to force)");
-    }
-    else {
-        char *to = g.inf, *sufx = "";
-        size_t pre = 0;
+/* -- daemon mode, serving commands over a Unix domain socket -- */
 
-        /* select parts of the output file name */
-        if (g.decode) {
-            /* for -dN or -dNT, use the path from the input file and the name
-               from the header, stripping any path in the header name */
-            if ((g.headis & 1) != 0 && g.hname != NULL) {
-                pre = justname(g.inf) - g.inf;
-                to = justname(g.hname);
-                len = strlen(to);
-            }
-            /* for -d or -dNn, replace abbreviated suffixes */
-            else if (strcmp(to + len, ".tgz") == 0)
-                sufx = ".tar";
-        }
-        else
-            /* add appropriate suffix when compressing */
-            sufx = g.sufx;
+/* pigz --daemon path listens on the Unix domain socket path and runs the
+   commands sent by pigz --socket path, one at a time, in the same process, so
+   that the compress threads and buffer pools stay ready between commands.  A
+   command is sent as the length of its arguments (four bytes, little-endian)
+   with the client's stdin, stdout, stderr, and current directory attached as
+   file descriptors (SCM_RIGHTS), then the arguments, each terminated by a
+   zero byte, starting with the program name.  The daemon puts the descriptors
+   in place of its own, runs the command with its own command-line options
+   applied first, and replies with the exit status (four bytes, little-endian).
+   Write errors in a command are deferred in writen() so that they fail the
+   command instead of ending the daemon. */
 
-        /* create output file and open to write */
-        g.outf = alloc(NULL, pre + len + strlen(sufx) + 1);
-        memcpy(g.outf, g.inf, pre);
-        memcpy(g.outf + pre, to, len);
-        strcpy(g.outf + pre + len, sufx);
-        g.outd = open(g.outf, O_CREAT | O_TRUNC | O_WRONLY |
-                              (g.force ? 0 : O_EXCL), 0600);
+#define DMNFDS 4                /* descriptors passed with a command */
+#define DMNMAX 65536            /* maximum length of command arguments */
 
-        /* if exists and not -f, give user a chance to overwrite */
-        if (g.outd < 0 && errno == EEXIST && isatty(0) && g.verbosity) {
-            int ch, reply;
+/* daemon state */
+local struct {
+    char *path;                 /* socket path, to remove on exit */
+    size_t block;               /* block size for the current buffers */
+    int procs;                  /* processes for the current buffers */
+} dmn;
 
-            fprintf(stderr, "%s exists -- overwrite (y/n)? ", g.outf);
-            fflush(stderr);
-            reply = -1;
-            do {
-                ch = getchar();
-                if (reply < 0 && ch != ' ' && ch != '\t')
-                    reply = ch == 'y' || ch == 'Y' ? 1 : 0;
-            } while (ch != EOF && ch != '\n' && ch != '\r');
-            if (reply == 1)
-                g.outd = open(g.outf, O_CREAT | O_TRUNC | O_WRONLY,
-                              0600);
+/* remove the socket and exit on a signal */
+local void dmn_stop(int sig)
+{
+    if (dmn.path != NULL)
+        unlink(dmn.path);
+    cut_short(sig);
+}
+
+/* set up a Unix domain socket address for path */
+local void dmn_addr(struct sockaddr_un *addr, char *path)
+{
+    if (strlen(path) >= sizeof(addr->sun_path))
+        throw(ENAMETOOLONG, "socket path too long: %s", path);
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+}
+
+/* return true if the process connected on conn is running as our effective
+   user -- only that user may have the daemon use its files */
+local int dmn_peer(int conn)
+{
+#ifdef __linux__
+    struct {                    /* struct ucred, without _GNU_SOURCE */
+        pid_t pid;
+        uid_t uid;
+        gid_t gid;
+    } cred;
+    socklen_t len = sizeof(cred);
+
+    return getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+           cred.uid == geteuid();
+#else
+    uid_t uid;
+    gid_t gid;
+
+    return getpeereid(conn, &uid, &gid) == 0 && uid == geteuid();
+#endif
+}
+
+/* send the command in argv[0..argc-1], less the --socket option in the skip
+   arguments at argv[at], to the daemon at path with our standard descriptors
+   and current directory, and return the exit status of the command */
+local int dmn_client(char *path, int argc, char **argv, int at, int skip)
+{
+    int sock, n, fds[DMNFDS];
+    size_t len, got;
+    unsigned char head[4], *args;
+    struct sockaddr_un addr;
+    struct msghdr msg;
+    struct iovec iov;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } ctl;
+
+    /* gather the arguments */
+    len = 0;
+    for (n = 0; n < argc; n++)
+        if (n < at || n >= at + skip)
+            len += strlen(argv[n]) + 1;
+    if (len > DMNMAX)
+        throw(E2BIG, "too many arguments for --socket");
+    args = alloc(NULL, len);
+    len = 0;
+    for (n = 0; n < argc; n++)
+        if (n < at || n >= at + skip) {
+            got = strlen(argv[n]) + 1;
+            memcpy(args + len, argv[n], got);
+            len += got;
         }
 
-        /* if exists and no overwrite, report and go on to next */
-        if (g.outd < 0 && errno == EEXIST) {
-            complain("skipping: %s exists", g.outf);
-            RELEASE(g.outf);
-            RELEASE(g.hname);
-            if (g.ind != 0)
-                close(g.ind);
-            return;
+    /* connect to the daemon */
+    dmn_addr(&addr, path);
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)))
+        throw(errno, "cannot connect to %s (%s)", path, strerror(errno));
+
+    /* send the length with the descriptors, then the arguments */
+    fds[0] = 0;
+    fds[1] = 1;
+    fds[2] = 2;
+    fds[3] = open(".", O_RDONLY);
+    if (fds[3] < 0)
+        throw(errno, "cannot open current directory (%s)", strerror(errno));
+    PUT4L(head, len);
+    iov.iov_base = head;
+    iov.iov_len = 4;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    ctl.hdr.cmsg_level = SOL_SOCKET;
+    ctl.hdr.cmsg_type = SCM_RIGHTS;
+    ctl.hdr.cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(&ctl.hdr), fds, sizeof(fds));
+    if (sendmsg(sock, &msg, 0) != 4)
+        throw(errno, "cannot send to %s (%s)", path, strerror(errno));
+    close(fds[3]);
+    writen(sock, args, len);
+    FREE(args);
+
+    /* get the exit status */
+    if (readn(sock, head, 4) != 4)
+        throw(EIO, "daemon at %s exited", path);
+    close(sock);
+    return (int)PULL4L(head);
+}
+
+/* receive a command on conn into a new allocation returned with its length in
+   *len, putting the descriptors in fds[] -- return NULL if it's not a valid
+   command */
+local char *dmn_receive(int conn, int *fds, size_t *len)
+{
+    int k;
+    char *args;
+    unsigned char head[4];
+    struct cmsghdr *hdr;
+    struct msghdr msg;
+    struct iovec iov;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(DMNFDS * sizeof(int))];
+    } ctl;
+
+    /* get the length and the descriptors */
+    iov.iov_base = head;
+    iov.iov_len = 4;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    if (recvmsg(conn, &msg, 0) != 4)
+        return NULL;
+    hdr = CMSG_FIRSTHDR(&msg);
+    if (hdr == NULL || hdr->cmsg_level != SOL_SOCKET ||
+        hdr->cmsg_type != SCM_RIGHTS)
+        return NULL;
+    if (hdr->cmsg_len != CMSG_LEN(DMNFDS * sizeof(int))) {
+        for (k = 0; k < (int)((hdr->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+             k++)
+            close(((int *)CMSG_DATA(hdr))[k]);
+        return NULL;
+    }
+    memcpy(fds, CMSG_DATA(hdr), DMNFDS * sizeof(int));
+
+    /* get the arguments, which must be zero-terminated strings */
+    *len = PULL4L(head);
+    args = *len > 1 && *len <= DMNMAX ? malloc(*len) : NULL;
+    if (args == NULL || readn(conn, (unsigned char *)args, *len) != *len ||
+        args[*len - 1] != 0) {
+        free(args);
+        for (k = 0; k < DMNFDS; k++)
+            close(fds[k]);
+        return NULL;
+    }
+    return args;
+}
+
+/* run the command in args[0..len-1], applying the daemon options in
+   opts[1..nopts-1] first, and return the exit status */
+local int dmn_command(char *args, size_t len, int nopts, char **opts)
+{
+    int n, argc;
+    char *p, **argv;
+    ball_t err, moot;
+
+    /* split the arguments */
+    argc = 0;
+    for (p = args; p < args + len; p += strlen(p) + 1)
+        argc++;
+    argv = alloc(NULL, (argc + 1) * sizeof(char *));
+    argc = 0;
+    for (p = args; p < args + len; p += strlen(p) + 1)
+        argv[argc++] = p;
+    argv[argc] = NULL;
+
+    try {
+        /* set the options, and get new buffers if the sizes changed */
+        g.first = 1;
+        g.werr = 0;
+        p = strrchr(argv[0], '/');
+        p = p == NULL ? argv[0] : p + 1;
+        g.prog = *p ? p : "pigz";
+        defaults();
+        for (n = 1; n < nopts; n++)
+            (void)option(opts[n]);
+        option(NULL);
+        if (g.block != dmn.block || g.procs != dmn.procs) {
+            single_compress(1);
+            finish_pools();
+            dmn.block = g.block;
+            dmn.procs = g.procs;
         }
 
-        /* if some other error, give up */
-        if (g.outd < 0)
-            throw(errno, "write error on %s (%s)", g.outf, strerror(errno));
+        /* run the command */
+        process_args(argc, argv);
+        run_end();
     }
-    SET_BINARY_MODE(g.outd);
-    RELEASE(g.hname);
+    catch (err) {
+        complain("abort: %s", err.why);
+        FAILED();
+
+        /* remove a partial output */
+        if (g.outd != -1 && g.outd != 1) {
+            close(g.outd);
+            unlink(g.outf);
+            g.outd = -1;
+        }
+        RELEASE(g.outf);
+        RELEASE(g.inf);
+        g.inz = 0;
+        FREE(argv);
 
-    /* process ind to outd */
-    if (g.verbosity > 1)
-        fprintf(stderr, "%s to %s ", g.inf, g.outf);
-    if (g.decode) {
+        /* if there are threads still working on the command, there is no
+           recovering -- end the daemon */
+        if (g.writeth != NULL || g.in_which != -1) {
+            complain("daemon exiting");
+            dmn_stop(-err.code);
+        }
+
+        /* end the run, ignoring its errors after this one */
         try {
-            if (method == 8)
-                infchk();
-            else if (method == 257)
-                unlzw();
-            else
-                cat();
+            run_end();
         }
-        catch (err) {
-            if (err.code != EDOM)
-                punt(err);
-            complain("skipping: %s", err.why);
-            drop(err);
-            outb(g.outf, NULL, 0);
-            if (g.outd != -1 && g.outd != 1) {
-                close(g.outd);
-                g.outd = -1;
-                unlink(g.outf);
-                RELEASE(g.outf);
-            }
+        catch (moot) {
+            drop(moot);
         }
+        drop(err);
+        return err.code;
     }
-#ifndef NOTHREAD
-    else if (g.procs > 1)
-        parallel_compress();
-#endif
-    else
-        single_compress(0);
-    if (g.verbosity > 1) {
-        putc('\n', stderr);
-        fflush(stderr);
-    }
+    RELEASE(g.inf);
+    g.inz = 0;
+    FREE(argv);
+    return 0;
+}
 
-    /* finish up, copy attributes, set times, delete original */
-    if (g.ind != 0)
-        close(g.ind);
-    if (g.outd != -1 && g.outd != 1) {
-        if (close(g.outd))
-            throw(errno, "write error on %s (%s)", g.outf, strerror(errno));
-        g.outd = -1;            /* now prevent deletion on interrupt */
-        if (g.ind != 0) {
-            copymeta(g.inf, g.outf);
-            if (!g.keep)
-                unlink(g.inf);
+/* serve commands on the socket path, using the options in argv[1..argc-1],
+   less the --daemon option in the skip arguments at argv[at] -- does not
+   return */
+local void dmn_serve(char *path, int argc, char **argv, int at, int skip)
+{
+    int sock, conn, k, status, fds[DMNFDS], std[3], home;
+    mode_t mask;
+    size_t len;
+    char *args, *prog = g.prog;
+    unsigned char reply[4];
+    struct sockaddr_un addr;
+
+    /* keep just the daemon options, and make sure they are valid */
+    for (k = at + skip; k < argc; k++)
+        argv[k - skip] = argv[k];
+    argc -= skip;
+    for (k = 1; k < argc; k++)
+        if (option(argv[k]))
+            throw(EINVAL, "the daemon cannot be given file names: %s",
+                  argv[k]);
+    option(NULL);
+    if (g.sock != NULL)
+        throw(EINVAL, "--daemon and --socket can only be given once");
+    if (g.lockstats)
+        throw(EINVAL, "--lock-stats cannot be used with --daemon"
+                      " (the counts are for the whole process)");
+
+    /* listen on the socket, which only this user can connect to */
+    dmn_addr(&addr, path);
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0)
+        throw(errno, "cannot create socket (%s)", strerror(errno));
+    unlink(path);
+    mask = umask(077);
+    status = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (status || listen(sock, 64))
+        throw(errno, "cannot listen on %s (%s)", path, strerror(errno));
+    dmn.path = path;
+    signal(SIGINT, dmn_stop);
+    signal(SIGTERM, dmn_stop);
+    signal(SIGPIPE, SIG_IGN);
+
+    /* save our standard descriptors and current directory to restore after
+       each command */
+    for (k = 0; k < 3; k++)
+        std[k] = dup(k);
+    home = open(".", O_RDONLY);
+    if (std[0] < 0 || std[1] < 0 || std[2] < 0 || home < 0)
+        throw(errno, "cannot save descriptors (%s)", strerror(errno));
+
+    /* serve commands one at a time, with no decompress read thread yet */
+    g.daemon = 1;
+    g.in_which = -1;
+    dmn.block = 0;
+    for (;;) {
+        conn = accept(sock, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            throw(errno, "cannot accept on %s (%s)", path, strerror(errno));
         }
-        if (g.decode && (g.headis & 2) != 0 && g.stamp)
-            touch(g.outf, g.stamp);
+        args = dmn_receive(conn, fds, &len);
+        if (args == NULL) {
+            close(conn);
+            continue;
+        }
+
+        /* refuse a command from another user, which would otherwise get our
+           access to the files */
+        if (!dmn_peer(conn)) {
+            complain("warning: refused a command from another user");
+            for (k = 0; k < DMNFDS; k++)
+                close(fds[k]);
+            free(args);
+            PUT4L(reply, (unsigned long)EACCES);
+            (void)send(conn, reply, 4, MSG_NOSIGNAL);
+            close(conn);
+            continue;
+        }
+
+        /* take on the client's descriptors and directory, run the command,
+           and then restore ours */
+        for (k = 0; k < 3; k++) {
+            dup2(fds[k], k);
+            close(fds[k]);
+        }
+        status = fchdir(fds[3]) ? errno : 0;
+        close(fds[3]);
+        if (status == 0)
+            status = dmn_command(args, len, argc, argv);
+        fflush(stdout);
+        fflush(stderr);
+        for (k = 0; k < 3; k++)
+            dup2(std[k], k);
+        g.prog = prog;
+        if (fchdir(home))
+            throw(errno, "cannot return to directory (%s)", strerror(errno));
+        free(args);
+
+        /* reply with the exit status */
+        PUT4L(reply, (unsigned long)status);
+        (void)send(conn, reply, 4, MSG_NOSIGNAL);
+        close(conn);
     }
-    RELEASE(g.outf);
 }
 
-local char *helptext[] = {
-"Usage: pigz [options] [files ...]",
-"  will compress files in place, adding the suffix '.gz'.  If no files are",
-#ifdef NOTHREAD
-"  specified, stdin will be compressed to stdout.  pigz does what gzip does.",
-#else
-"  specified, stdin will be compressed to stdout.  pigz does what gzip does,",
-"  but spreads the work over multiple processors and cores when compressing.",
-#endif
-"",
-"Options:",
-"  -0 to -9, -11        Compression level (11 is much slower, a few % better)",
-"  --fast, --best       Compression levels 1 and 9 respectively",
-"  -b, --blocksize mmm  Set compression block size to mmmK (default 128K)",
-"  -c, --stdout         Write all processed output to stdout (won't delete)",
-"  -d, --decompress     Decompress the compressed input",
-"  -f, --force          Force overwrite, compress .gz, links, and to terminal",
-"  -F  --first          Do iterations first, before block split for -11",
-"  -h, --help           Display a help screen and quit",
-"  -i, --independent    Compress blocks independently for damage recovery",
-"  -I, --iterations n   Number of iterations for -11 optimization",
-"  -k, --keep           Do not delete original file after processing",
-"  -K, --zip            Compress to PKWare zip (.zip) single entry format",
-"  -l, --list           List the contents of the compressed input",
-"  -L, --license        Display the pigz license and quit",
-"  -M, --maxsplits n    Maximum number of split blocks for -11",
-"  -n, --no-name        Do not store or restore file name in/from header",
-"  -N, --name           Store/restore file name and mod time in/from header",
-"  -O  --oneblock       Do not split into smaller blocks for -11",
-#ifndef NOTHREAD
-"  -p, --processes n    Allow up to n compression threads (default is the",
-"                       number of online processors, or 8 if unknown)",
-#endif
-"  -q, --quiet          Print no messages, even on error",
-"  -r, --recursive      Process the contents of all subdirectories",
-"  -R, --rsyncable      Input-determined block locations for rsync",
-"  -S, --suffix .sss    Use suffix .sss instead of .gz (for compression)",
-"  -t, --test           Test the integrity of the compressed input",
-"  -T, --no-time        Do not store or restore mod time in/from header",
-#ifdef DEBUG
-"  -v, --verbose        Provide more verbose output (-vv to debug)",
-#else
-"  -v, --verbose        Provide more verbose output",
 #endif
-"  -V  --version        Show the version of pigz",
-"  -z, --zlib           Compress to zlib (.zz) instead of gzip format",
-"  --                   All arguments after \"--\" are treated as files"
+
+#if defined(PIGZ_LIB) && !defined(NOTHREAD)
+
+/* -- libpigz, pigz as a library (see pigz.h) -- */
+
+/* Each compression stream has its own struct globals with its options and its
+   buffer pools and write thread, and a feeder thread that runs
+   parallel_compress() with g bound to that struct.  The input is handed to
+   parallel_compress() through readn() with lib_get(), and the output comes out
+   of writen() with lib_put().  The compress threads are shared by all of the
+   streams, and bind g to the stream of each job as they take it.  An error in
+   a stream's job is returned by the stream's functions, and no more output is
+   delivered for that stream.  The options that would have the write thread
+   write files are not supported, so that it has nothing to fail on.
+
+   The pigz command is not a client of these functions.  It calls
+   parallel_compress() and the threaded decompression of load() and outb()
+   directly, with its own files, so that the command pays nothing for the
+   library.  The library is the same code, compiled with PIGZ_LIB. */
+
+/* states of the feed lock, for handing input to the feeder thread */
+#define FEED_IDLE 0             /* waiting for the application */
+#define FEED_OFFER 1            /* input offered in next[0..left-1] */
+#define FEED_FLUSH 2            /* end the current block to flush */
+#define FEED_END 3              /* no more input */
+#define FEED_DEAD 4             /* feeder thread has exited */
+
+struct pigz_stream {
+    struct globals gl;          /* options and state for this stream */
+    pigz_sink sink;             /* where to deliver the output */
+    void *opaque;               /* first argument of sink() */
+    int err;                    /* error from the stream, or zero */
+    char *opts;                 /* copy of options (g.sufx can point here) */
+    lock *feed;                 /* state of input offered to feeder */
+    const unsigned char *next;  /* input offered */
+    size_t left;                /* amount of input offered */
+    unsigned long fed;          /* total input offered (low 31 bits) */
+    thread *feeder;             /* thread running parallel_compress() */
+    int inside;                 /* true if in a decompressed member */
+    z_stream inf;               /* inflate stream for decompression */
+    unsigned char *out;         /* inflate output buffer */
 };
 
-/* display the help text above */
-local void help(void)
+/* serialize the parsing of options, since option() keeps state */
+local pthread_mutex_t lib_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* get input for parallel_compress() from the application, returning 0 at the
+   end of the input or to flush */
+local ssize_t lib_get(void *io, unsigned char *buf, size_t len)
+{
+    pigz_stream *strm = io;
+    long state;
+
+    possess(strm->feed);
+    wait_for(strm->feed, NOT_TO_BE, FEED_IDLE);
+    state = peek_lock(strm->feed);
+    if (state == FEED_OFFER) {
+        if (len > strm->left)
+            len = strm->left;
+        memcpy(buf, strm->next, len);
+        strm->next += len;
+        strm->left -= len;
+        if (strm->left)
+            release(strm->feed);
+        else
+            twist(strm->feed, TO, FEED_IDLE);
+        return len;
+    }
+    if (state == FEED_FLUSH) {
+        g.flushed = 1;
+        twist(strm->feed, TO, FEED_IDLE);
+        return 0;
+    }
+    release(strm->feed);
+    return 0;
+}
+
+/* deliver output from the write thread to the application, unless a job
+   could not be compressed */
+local ssize_t lib_put(void *io, unsigned char *buf, size_t len)
+{
+    pigz_stream *strm = io;
+
+    if (strm->gl.fail == 0)
+        strm->sink(strm->opaque, buf, len);
+    return len;
+}
+
+/* return the error that ended the output of the stream, or zero */
+local int lib_fail(pigz_stream *strm)
+{
+    int ret;
+
+    possess(strm->gl.write_first);
+    ret = strm->gl.fail;
+    release(strm->gl.write_first);
+    return ret;
+}
+
+/* compress the stream, noting any error, then let the application know */
+local void lib_feed(void *arg)
+{
+    pigz_stream *strm = arg;
+    ball_t err;
+
+    BIND(&strm->gl);
+    try {
+        parallel_compress();
+        strm->err = g.fail;
+    }
+    catch (err) {
+        strm->err = err.code;
+        drop(err);
+    }
+    possess(strm->feed);
+    twist(strm->feed, TO, FEED_DEAD);
+}
+
+/* set the feed state to state, and wait for the feeder to take it -- return
+   false if the feeder has exited */
+local int lib_offer(pigz_stream *strm, long state)
+{
+    possess(strm->feed);
+    if (peek_lock(strm->feed) == FEED_DEAD) {
+        release(strm->feed);
+        return 0;
+    }
+    twist(strm->feed, TO, state);
+    possess(strm->feed);
+    wait_for(strm->feed, NOT_TO_BE, state);
+    state = peek_lock(strm->feed);
+    release(strm->feed);
+    return state != FEED_DEAD;
+}
+
+/* set g to the defaults and then the options in opts, saving the copy of opts
+   that g can point into in *copy (call with lib_lock held) */
+local void lib_options(const char *opts, char **copy)
 {
     int n;
+    char *p, *q;
+
+    defaults();
+    g.prog = "libpigz";
+    g.verbosity = 0;
+    if (opts != NULL) {
+        *copy = alloc(NULL, strlen(opts) + 1);
+        strcpy(*copy, opts);
+        p = *copy;
+        while (*p) {
+            while (*p == ' ' || *p == '\t')
+                p++;
+            q = p;
+            while (*q && *q != ' ' && *q != '\t')
+                q++;
+            n = *q;
+            *q = 0;
+            if (option(p))
+                throw(EINVAL, "cannot provide files in options");
+            p = q + (n ? 1 : 0);
+        }
+        option(NULL);
+    }
+    if (g.decode || g.list || g.index != NULL || g.reuse != NULL ||
+        g.cache != NULL || g.cachedir != NULL || g.resume || g.tees ||
+        g.digest)
+        throw(EINVAL, "option not supported by library");
+}
 
-    if (g.verbosity == 0)
-        return;
-    for (n = 0; n < (int)(sizeof(helptext) / sizeof(char *)); n++)
-        fprintf(stderr, "%s\n", helptext[n]);
-    fflush(stderr);
-    exit(0);
+pigz_stream *pigz_compress_init(const char *opts, pigz_sink sink,
+                                void *opaque)
+{
+    pigz_stream *volatile strm;     /* volatile for use in catch */
+    struct globals *was = gp;
+    ball_t err;
+
+    strm = calloc(1, sizeof(pigz_stream));
+    if (strm == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    strm->sink = sink;
+    strm->opaque = opaque;
+    pthread_mutex_lock(&lib_lock);
+    ATOM_INIT();
+    BIND(&strm->gl);
+    try {
+        /* set the options for this stream */
+        lib_options(opts, &strm->opts);
+
+        /* connect the input and output to the application */
+        g.inf = g.outf = "<libpigz>";
+        g.ind = g.outd = IOFUNC;
+        g.get = lib_get;
+        g.put = lib_put;
+        g.io = strm;
+        g.wrote = new_lock(0);
+        strm->feed = new_lock(FEED_IDLE);
+        label_lock(g.wrote, "wrote", NULL);
+        label_lock(strm->feed, "strm", "feed");
+
+        /* set up the shared compress list and this stream's pools, and start
+           compressing */
+        setup_jobs();
+        strm->feeder = launch(lib_feed, strm);
+    }
+    catch (err) {
+        finish_pools();
+        BIND(was);
+        pthread_mutex_unlock(&lib_lock);
+        if (strm->feed != NULL)
+            free_lock(strm->feed);
+        if (strm->gl.wrote != NULL)
+            free_lock(strm->gl.wrote);
+        RELEASE(strm->opts);
+        FREE(strm);
+        drop(err);
+        errno = err.code;
+        return NULL;
+    }
+    BIND(was);
+    pthread_mutex_unlock(&lib_lock);
+    return strm;
 }
 
-#ifndef NOTHREAD
+int pigz_compress_write(pigz_stream *strm, const void *buf, size_t len)
+{
+    int ret;
+
+    ret = lib_fail(strm);
+    if (ret || len == 0)
+        return ret ? ret : strm->err;
+    strm->next = buf;
+    strm->left = len;
+    strm->fed += len;
+    if (!lib_offer(strm, FEED_OFFER))
+        return strm->err ? strm->err : EINVAL;
+    return 0;
+}
 
-/* try to determine the number of processors */
-local int nprocs(int n)
+int pigz_compress_flush(pigz_stream *strm)
 {
-#  ifdef _SC_NPROCESSORS_ONLN
-    n = (int)sysconf(_SC_NPROCESSORS_ONLN);
-#  else
-#    ifdef _SC_NPROC_ONLN
-    n = (int)sysconf(_SC_NPROC_ONLN);
-#    else
-#      ifdef __hpux
-    struct pst_dynamic psd;
+    if (!lib_offer(strm, FEED_FLUSH))
+        return strm->err ? strm->err : EINVAL;
+    possess(strm->gl.wrote);
+    wait_for(strm->gl.wrote, TO_BE, (long)(strm->fed & 0x7fffffff));
+    release(strm->gl.wrote);
+    return lib_fail(strm);
+}
 
-    if (pstat_getdynamic(&psd, sizeof(psd), (size_t)1, 0) != -1)
-        n = psd.psd_proc_cnt;
-#      endif
-#    endif
-#  endif
-    return n;
+int pigz_compress_end(pigz_stream *strm)
+{
+    int ret;
+    struct globals *was = gp;
+
+    possess(strm->feed);
+    if (peek_lock(strm->feed) == FEED_DEAD)
+        release(strm->feed);
+    else
+        twist(strm->feed, TO, FEED_END);
+    join(strm->feeder);
+    ret = strm->err;
+    BIND(&strm->gl);
+    finish_pools();
+    BIND(was);
+    free_lock(strm->feed);
+    free_lock(strm->gl.wrote);
+    RELEASE(strm->opts);
+    FREE(strm);
+    return ret;
 }
 
-#endif
+pigz_stream *pigz_decompress_init(pigz_sink sink, void *opaque)
+{
+    int ret;
+    pigz_stream *strm;
+
+    strm = calloc(1, sizeof(pigz_stream));
+    if (strm != NULL)
+        strm->out = malloc(OUTSIZE);
+    if (strm == NULL || strm->out == NULL) {
+        free(strm);
+        errno = ENOMEM;
+        return NULL;
+    }
+    strm->sink = sink;
+    strm->opaque = opaque;
+    ret = inflateInit2(&strm->inf, 15 + 32);    /* gzip or zlib */
+    if (ret != Z_OK) {
+        free(strm->out);
+        free(strm);
+        errno = ret == Z_MEM_ERROR ? ENOMEM : EINVAL;
+        return NULL;
+    }
+    return strm;
+}
 
-/* set option defaults */
-local void defaults(void)
+int pigz_decompress_write(pigz_stream *strm, const void *buf, size_t len)
 {
-    g.level = Z_DEFAULT_COMPRESSION;
-    /* default zopfli options as set by ZopfliInitOptions():
-        verbose = 0
-        numiterations = 15
-        blocksplitting = 1
-        blocksplittinglast = 0
-        blocksplittingmax = 15
-     */
-    ZopfliInitOptions(&g.zopts);
-#ifdef NOTHREAD
-    g.procs = 1;
-#else
-    g.procs = nprocs(8);
-#endif
-    g.block = 131072UL;             /* 128K */
-    g.rsync = 0;                    /* don't do rsync blocking */
-    g.setdict = 1;                  /* initialize dictionary each thread */
-    g.verbosity = 1;                /* normal message level */
-    g.headis = 3;                   /* store/restore name and timestamp */
-    g.pipeout = 0;                  /* don't force output to stdout */
-    g.sufx = ".gz";                 /* compressed file suffix */
-    g.decode = 0;                   /* compress */
-    g.list = 0;                     /* compress */
-    g.keep = 0;                     /* delete input file once compressed */
-    g.force = 0;                    /* don't overwrite, don't compress links */
-    g.recurse = 0;                  /* don't go into directories */
-    g.form = 0;                     /* use gzip format */
+    int ret;
+    unsigned have;
+    const unsigned char *next = buf;
+
+    if (strm->err)
+        return strm->err;
+    for (;;) {
+        /* provide more input, up to what avail_in can hold */
+        if (strm->inf.avail_in == 0) {
+            if (len == 0)
+                break;
+            have = len > UINT_MAX ? UINT_MAX : (unsigned)len;
+            strm->inf.next_in = (unsigned char *)next;
+            strm->inf.avail_in = have;
+            next += have;
+            len -= have;
+        }
+
+        /* decompress until the output buffer is not filled, delivering the
+           output, and starting a new member after the end of each one */
+        do {
+            strm->inf.next_out = strm->out;
+            strm->inf.avail_out = OUTSIZE;
+            ret = inflate(&strm->inf, Z_NO_FLUSH);
+            if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR ||
+                ret == Z_MEM_ERROR || ret == Z_STREAM_ERROR) {
+                strm->err = ret == Z_MEM_ERROR ? ENOMEM : EINVAL;
+                return strm->err;
+            }
+            have = OUTSIZE - strm->inf.avail_out;
+            if (have)
+                strm->sink(strm->opaque, strm->out, have);
+            if (ret == Z_STREAM_END) {
+                inflateReset(&strm->inf);
+                strm->inside = 0;
+            }
+            else if (ret == Z_OK)
+                strm->inside = 1;
+        } while (strm->inf.avail_out == 0);
+    }
+    return 0;
 }
 
-/* long options conversion to short options */
-local char *longopts[][2] = {
-    {"LZW", "Z"}, {"ascii", "a"}, {"best", "9"}, {"bits", "Z"},
-    {"blocksize", "b"}, {"decompress", "d"}, {"fast", "1"}, {"first", "F"},
-    {"force", "f"}, {"help", "h"}, {"independent", "i"}, {"iterations", "I"},
-    {"keep", "k"}, {"license", "L"}, {"list", "l"}, {"maxsplits", "M"},
-    {"name", "N"}, {"no-name", "n"}, {"no-time", "T"}, {"oneblock", "O"},
-    {"processes", "p"}, {"quiet", "q"}, {"recursive", "r"}, {"rsyncable", "R"},
-    {"silent", "q"}, {"stdout", "c"}, {"suffix", "S"}, {"test", "t"},
-    {"to-stdout", "c"}, {"uncompress", "d"}, {"verbose", "v"},
-    {"version", "V"}, {"zip", "K"}, {"zlib", "z"}};
-#define NLOPTS (sizeof(longopts) / (sizeof(char *) << 1))
+int pigz_decompress_end(pigz_stream *strm)
+{
+    int ret;
 
-/* either new buffer size, new compression level, or new number of processes --
-   get rid of old buffers and threads to force the creation of new ones with
-   the new settings */
-local void new_opts(void)
+    ret = strm->err ? strm->err : (strm->inside ? EINVAL : 0);
+    inflateEnd(&strm->inf);
+    free(strm->out);
+    free(strm);
+    return ret;
+}
+
+
+/* -- libpigz batches of small independent buffers -- */
+
+/* A batch puts one job for each buffer in the compress list, where the
+   compress threads compress or decompress the whole buffer with the job's
+   batch->work(), using the deflate stream that each thread already has, or
+   for decompression, a struct globals and inflateBack() window that each
+   thread allocates the first time, so that infchk() can be used. */
+
+/* a compress thread's state for batch decompression */
+struct lib_inflate {
+    struct globals gl;          /* decompression state */
+    unsigned char window[OUTSIZE];  /* inflateBack() window */
+};
+
+/* input and output for one buffer of a batch decompression */
+struct lib_io {
+    const unsigned char *next;  /* input not yet read */
+    size_t left;                /* number of bytes at next */
+    struct space out;           /* output (only buf, size, and len used) */
+};
+
+/* read input for infchk() from the buffer */
+local ssize_t lib_batch_get(void *io, unsigned char *buf, size_t len)
 {
-    single_compress(1);
-#ifndef NOTHREAD
-    finish_jobs();
-#endif
+    struct lib_io *in = io;
+
+    if (len > in->left)
+        len = in->left;
+    memcpy(buf, in->next, len);
+    in->next += len;
+    in->left -= len;
+    return len;
 }
 
-/* verify that arg is only digits, and if so, return the decimal value */
-local size_t num(char *arg)
+/* append output from infchk() to the output space */
+local ssize_t lib_batch_put(void *io, unsigned char *buf, size_t len)
 {
-    char *str = arg;
-    size_t val = 0;
+    struct space *out = &((struct lib_io *)io)->out;
 
-    if (*str == 0)
-        throw(EINVAL, "internal error: empty parameter");
-    do {
-        if (*str < '0' || *str > '9' ||
-            (val && ((~(size_t)0) - (*str - '0')) / val < 10))
-            throw(EINVAL, "invalid numeric parameter: %s", arg);
-        val = val * 10 + (*str - '0');
-    } while (*++str);
-    return val;
+    while (out->size - out->len < len)
+        grow_space(out);
+    memcpy(out->buf + out->len, buf, len);
+    out->len += len;
+    return len;
 }
 
-/* process an option, return true if a file name and not an option */
-local int option(char *arg)
+/* mark the job's buffer as done, noting any error */
+local void lib_batch_done(struct job *job, struct space *out, int err)
 {
-    static int get = 0;     /* if not zero, look for option parameter */
-    char bad[3] = "-X";     /* for error messages (X is replaced) */
+    pigz_batch *item = job->batch->items + job->seq;
 
-    /* if no argument or dash option, check status of get */
-    if (get && (arg == NULL || *arg == '-')) {
-        bad[1] = "bpSIM"[get - 1];
-        throw(EINVAL, "missing parameter after %s", bad);
+    if (err) {
+        RELEASE(out->buf);
+        out->len = 0;
     }
-    if (arg == NULL)
-        return 0;
-
-    /* process long option or short options */
-    if (*arg == '-') {
-        /* a single dash will be interpreted as stdin */
-        if (*++arg == 0)
-            return 1;
+    item->out = out->buf;
+    item->out_len = out->len;
+    item->err = err == EDOM ? EINVAL : err;
+    possess(job->batch->left);
+    twist(job->batch->left, BY, -1);
+}
 
-        /* process long option (fall through with equivalent short option) */
-        if (*arg == '-') {
-            int j;
+/* compress item to out as a gzip or zlib stream with the deflate stream
+   strm, with the options in g */
+local void lib_deflate_item(pigz_batch *item, z_stream *strm,
+                            struct space *out)
+{
+    const unsigned char *next = item->in;
+    size_t left = item->in_len;
+    unsigned long check;
+    unsigned char bits, *zout;
+    size_t zlen;
+
+    /* allocate about enough output space, and write the header (as
+       put_header() does, with no name or time) */
+    if (g.level <= 9) {
+        (void)deflateReset(strm);
+        (void)deflateParams(strm, g.level, Z_DEFAULT_STRATEGY);
+        out->size = deflateBound(strm, left) + 18;
+    }
+    else
+        out->size = left + (left >> 3) + 64;
+    out->buf = alloc(NULL, out->size);
+    if (g.form) {
+        out->buf[0] = 0x78;
+        out->buf[1] = (g.level >= 9 ? 3 :
+                       (g.level == 1 ? 0 :
+                        (g.level >= 6 || g.level == Z_DEFAULT_COMPRESSION ?
+                            1 : 2))) << 6;
+        out->buf[1] += 31 - (((out->buf[0] << 8) + out->buf[1]) % 31);
+        out->len = 2;
+    }
+    else {
+        memcpy(out->buf, "\037\213\010\0\0\0\0\0\0\003", 10);
+        out->buf[8] = g.level >= 9 ? 2 : (g.level == 1 ? 4 : 0);
+        out->len = 10;
+    }
 
-            arg++;
-            for (j = NLOPTS - 1; j >= 0; j--)
-                if (strcmp(arg, longopts[j][0]) == 0) {
-                    arg = longopts[j][1];
-                    break;
-                }
-            if (j < 0)
-                throw(EINVAL, "invalid option: %s", arg - 2);
+    /* compress the whole buffer as one deflate stream */
+    if (g.level <= 9) {
+        strm->next_in = (unsigned char *)next;
+        while (left > MAXP2) {
+            strm->avail_in = MAXP2;
+            deflate_engine(strm, out, Z_NO_FLUSH);
+            left -= MAXP2;
         }
+        strm->avail_in = (unsigned)left;
+        deflate_engine(strm, out, Z_FINISH);
+    }
+    else {
+        zout = NULL;
+        zlen = 0;
+        bits = 0;
+        ZopfliDeflate(&g.zopts, 2, 1, next, left, &bits, &zout, &zlen);
+        while (out->size - out->len < zlen)
+            grow_space(out);
+        memcpy(out->buf + out->len, zout, zlen);
+        free(zout);
+        out->len += zlen;
+    }
 
-        /* process short options (more than one allowed after dash) */
-        do {
-            /* if looking for a parameter, don't process more single character
-               options until we have the parameter */
-            if (get) {
-                if (get == 3)
-                    throw(EINVAL, "invalid usage: "
-                                  "-s must be followed by space");
-                break;      /* allow -pnnn and -bnnn, fall to parameter code */
-            }
+    /* compute the check value and write the trailer */
+    left = item->in_len;
+    check = CHECK(0L, Z_NULL, 0);
+    while (left > MAXP2) {
+        check = CHECK(check, next, MAXP2);
+        left -= MAXP2;
+        next += MAXP2;
+    }
+    check = CHECK(check, next, (unsigned)left);
+    if (out->size - out->len < 8)
+        grow_space(out);
+    if (g.form) {
+        PUT4M(out->buf + out->len, check);
+        out->len += 4;
+    }
+    else {
+        PUT4L(out->buf + out->len, check);
+        PUT4L(out->buf + out->len + 4, item->in_len);
+        out->len += 8;
+    }
+}
 
-            /* process next single character option or compression level */
-            bad[1] = *arg;
-            switch (*arg) {
-            case '0': case '1': case '2': case '3': case '4':
-            case '5': case '6': case '7': case '8': case '9':
-                g.level = *arg - '0';
-                while (arg[1] >= '0' && arg[1] <= '9') {
-                    if (g.level && (INT_MAX - (arg[1] - '0')) / g.level < 10)
-                        throw(EINVAL, "only levels 0..9 and 11 are allowed");
-                    g.level = g.level * 10 + *++arg - '0';
-                }
-                if (g.level == 10 || g.level > 11)
-                    throw(EINVAL, "only levels 0..9 and 11 are allowed");
-                new_opts();
-                break;
-            case 'F':  g.zopts.blocksplittinglast = 1;  break;
-            case 'I':  get = 4;  break;
-            case 'K':  g.form = 2;  g.sufx = ".zip";  break;
-            case 'L':
-                fputs(VERSION, stderr);
-                fputs("Copyright (C) 2007-2015 Mark Adler\n", stderr);
-                fputs("Subject to the terms of the zlib license.\n",
-                      stderr);
-                fputs("No warranty is provided or implied.\n", stderr);
-                exit(0);
-            case 'M':  get = 5;  break;
-            case 'N':  g.headis |= 0xf;  break;
-            case 'O':  g.zopts.blocksplitting = 0;  break;
-            case 'R':  g.rsync = 1;  break;
-            case 'S':  get = 3;  break;
-            case 'T':  g.headis &= ~0xa;  break;
-            case 'V':  fputs(VERSION, stderr);  exit(0);
-            case 'Z':
-                throw(EINVAL, "invalid option: LZW output not supported: %s",
-                      bad);
-            case 'a':
-                throw(EINVAL, "invalid option: no ascii conversion: %s",
-                      bad);
-            case 'b':  get = 1;  break;
-            case 'c':  g.pipeout = 1;  break;
-            case 'd':  if (!g.decode) g.headis >>= 2;  g.decode = 1;  break;
-            case 'f':  g.force = 1;  break;
-            case 'h':  help();  break;
-            case 'i':  g.setdict = 0;  break;
-            case 'k':  g.keep = 1;  break;
-            case 'l':  g.list = 1;  break;
-            case 'n':  g.headis &= ~5;  break;
-            case 'p':  get = 2;  break;
-            case 'q':  g.verbosity = 0;  break;
-            case 'r':  g.recurse = 1;  break;
-            case 't':  g.decode = 2;  break;
-            case 'v':  g.verbosity++;  break;
-            case 'z':  g.form = 1;  g.sufx = ".zz";  break;
-            default:
-                throw(EINVAL, "invalid option: %s", bad);
-            }
-        } while (*++arg);
-        if (*arg == 0)
-            return 0;
+/* batch work: compress the job's buffer using the compress thread's deflate
+   stream */
+local void lib_deflate(struct job *job, z_stream *strm, void **own)
+{
+    struct space out;
+    ball_t err;
+
+    (void)own;
+    out.buf = NULL;
+    out.size = 0;
+    out.len = 0;
+    try {
+        lib_deflate_item(job->batch->items + job->seq, strm, &out);
+        lib_batch_done(job, &out, 0);
+    }
+    catch (err) {
+        lib_batch_done(job, &out, err.code);
+        drop(err);
     }
+}
 
-    /* process option parameter for -b, -p, -S, -I, or -M */
-    if (get) {
-        size_t n;
+/* decompress item to io->out with infchk(), using the thread's own struct
+   globals and window in *own for the decompression state, allocating them
+   the first time */
+local void lib_inflate_item(pigz_batch *item, void **own, struct lib_io *io)
+{
+    struct lib_inflate *state;
 
-        if (get == 1) {
-            n = num(arg);
-            g.block = n << 10;                  /* chunk size */
-            if (g.block < DICT)
-                throw(EINVAL, "block size too small (must be >= 32K)");
-            if (n != g.block >> 10 ||
-                OUTPOOL(g.block) < g.block ||
-                (ssize_t)OUTPOOL(g.block) < 0 ||
-                g.block > (1UL << 29))          /* limited by append_len() */
-                throw(EINVAL, "block size too large: %s", arg);
-            new_opts();
-        }
-        else if (get == 2) {
-            n = num(arg);
-            g.procs = (int)n;                   /* # processes */
-            if (g.procs < 1)
-                throw(EINVAL, "invalid number of processes: %s", arg);
-            if ((size_t)g.procs != n || INBUFS(g.procs) < 1)
-                throw(EINVAL, "too many processes: %s", arg);
-#ifdef NOTHREAD
-            if (g.procs > 1)
-                throw(EINVAL, "compiled without threads");
-#endif
-            new_opts();
-        }
-        else if (get == 3)
-            g.sufx = arg;                       /* gz suffix */
-        else if (get == 4)
-            g.zopts.numiterations = num(arg);   /* optimization iterations */
-        else if (get == 5)
-            g.zopts.blocksplittingmax = num(arg);   /* max block splits */
-        get = 0;
+    if (*own == NULL) {
+        *own = alloc(NULL, sizeof(struct lib_inflate));
+        memset(*own, 0, sizeof(struct lib_inflate));
+    }
+    state = *own;
+    BIND(&state->gl);
+    g.prog = "libpigz";
+    g.inf = g.outf = "<libpigz>";
+    g.ind = g.outd = IOFUNC;
+    g.get = lib_batch_get;
+    g.put = lib_batch_put;
+    g.io = io;
+    g.window = state->window;
+    g.procs = 1;
+    g.decode = 1;
+    io->out.size = (item->in_len << 2) + 1024;
+    io->out.buf = alloc(NULL, io->out.size);
+    in_init();
+    if (get_header(0) != 8)
+        throw(EINVAL, "not gzip, zlib, or zip data");
+    infchk();
+}
+
+/* batch work: decompress the job's buffer */
+local void lib_inflate(struct job *job, z_stream *strm, void **own)
+{
+    pigz_batch *item = job->batch->items + job->seq;
+    struct lib_io io;
+    ball_t err;
+
+    (void)strm;
+    io.next = item->in;
+    io.left = item->in_len;
+    io.out.buf = NULL;
+    io.out.size = 0;
+    io.out.len = 0;
+    try {
+        lib_inflate_item(item, own, &io);
+        lib_batch_done(job, &io.out, 0);
+    }
+    catch (err) {
+        lib_batch_done(job, &io.out, err.code);
+        drop(err);
+    }
+}
+
+/* put a job for each of the n items in the compress list for work(), using
+   the -p option in opts for the number of threads, and wait for all of them
+   to be done -- return the first error, or zero */
+local int lib_batch(const char *opts, pigz_batch *items, size_t n,
+                    void (*work)(struct job *, z_stream *, void **))
+{
+    int ret = 0;
+    size_t k;
+    char *copy = NULL;
+    struct globals *was = gp, *opt;
+    struct job *jobs;
+    struct batch batch;
+    ball_t err;
+
+    /* make a job for each item */
+    if (n == 0)
         return 0;
+    if (n > LONG_MAX || n > (size_t)-1 / sizeof(struct job))
+        return EOVERFLOW;
+    opt = calloc(1, sizeof(struct globals));
+    jobs = malloc(n * sizeof(struct job));
+    if (opt == NULL || jobs == NULL) {
+        free(jobs);
+        free(opt);
+        return ENOMEM;
+    }
+    batch.items = items;
+    batch.left = NULL;
+    batch.work = work;
+    for (k = 0; k < n; k++) {
+        items[k].out = NULL;
+        items[k].out_len = 0;
+        items[k].err = 0;
+        jobs[k].seq = (long)k;
+        jobs[k].ctx = opt;
+        jobs[k].batch = &batch;
+        jobs[k].next = jobs + k + 1;
     }
+    jobs[n - 1].next = NULL;
 
-    /* neither an option nor parameter */
-    return 1;
+    /* get the options, start compress threads as needed, and put the jobs at
+       the end of the compress list */
+    pthread_mutex_lock(&lib_lock);
+    ATOM_INIT();
+    BIND(opt);
+    try {
+        lib_options(opts, &copy);
+        if (g.form > 1)
+            throw(EINVAL, "zip not supported for batches");
+        setup_compress();
+        batch.left = new_lock((long)n);
+        label_lock(batch.left, "batch", "left");
+        possess(compress_have);
+        while (cthreads < g.procs && (size_t)cthreads < n) {
+            (void)launch(compress_thread, NULL);
+            ATOM_ADD(cthreads, 1);
+        }
+        *compress_tail = jobs;
+        compress_tail = &(jobs[n - 1].next);
+        twist(compress_have, BY, (long)n);
+    }
+    catch (err) {
+        BIND(was);
+        pthread_mutex_unlock(&lib_lock);
+        if (batch.left != NULL)
+            free_lock(batch.left);
+        RELEASE(copy);
+        free(jobs);
+        free(opt);
+        drop(err);
+        return err.code;
+    }
+    BIND(was);
+    pthread_mutex_unlock(&lib_lock);
+
+    /* wait for all of the jobs to be done */
+    possess(batch.left);
+    wait_for(batch.left, TO_BE, 0);
+    release(batch.left);
+    free_lock(batch.left);
+    for (k = 0; k < n; k++)
+        if (items[k].err) {
+            ret = items[k].err;
+            break;
+        }
+    RELEASE(copy);
+    free(jobs);
+    free(opt);
+    return ret;
 }
 
-#ifndef NOTHREAD
-/* handle error received from yarn function */
-local void cut_yarn(int err)
+int pigz_compress_batch(const char *opts, pigz_batch *items, size_t n)
 {
-    throw(err, err == ENOMEM ? "not enough memory" : "internal threads error");
+    return lib_batch(opts, items, n, lib_deflate);
+}
+
+int pigz_decompress_batch(const char *opts, pigz_batch *items, size_t n)
+{
+    return lib_batch(opts, items, n, lib_inflate);
 }
+
 #endif
 
 /* Process command line arguments. */
+#ifdef PIGZ_LIB
+int pigz_main(int argc, char **argv)
+#else
 int main(int argc, char **argv)
+#endif
 {
     int n;                          /* general index */
-    int noop;                       /* true to suppress option decoding */
-    unsigned long done;             /* number of named files processed */
     char *opts, *p;                 /* environment default options, marker */
+#ifndef NOTHREAD
+    int skip, serve, bench;         /* for --daemon, --socket, and --bench */
+#endif
     ball_t err;                     /* error information from throw() */
 
     try {
@@ -4080,6 +9344,7 @@ int main(int argc, char **argv)
         yarn_prefix = g.prog;           /* prefix for yarn error messages */
         yarn_abort = cut_yarn;          /* call on thread error */
 #endif
+        ATOM_INIT();                    /* lock for counters if needed */
 #ifdef DEBUG
         gettimeofday(&start, NULL);     /* starting time for log entries */
         log_init();                     /* initialize logging */
@@ -4088,6 +9353,31 @@ int main(int argc, char **argv)
         /* set all options to defaults */
         defaults();
 
+#ifndef NOTHREAD
+        /* look through the command-line options for --daemon or --socket,
+           and for --bench, which loads the named files instead of processing
+           them -- the options are then set again from the defaults */
+        for (n = 1; n < argc && strcmp(argv[n], "--") && g.sock == NULL; n++)
+            (void)option(argv[n]);
+        option(NULL);
+        bench = g.bench;
+        if (g.sock != NULL) {
+            /* pass this command to a daemon, or serve as a daemon (the
+               daemon does not use the GZIP and PIGZ environment variables)
+               -- the path is the argument before n, or is in it after = */
+            p = g.sock;
+            skip = p == argv[n - 1] ? 2 : 1;
+            n -= skip;
+            serve = g.serve;
+            defaults();
+            if (serve)
+                dmn_serve(p, argc, argv, n, skip);
+            exit(dmn_client(p, argc, argv, n, skip));
+        }
+        defaults();
+        g.bench = bench;
+#endif
+
         /* process user environment variable defaults in GZIP */
         opts = getenv("GZIP");
         if (opts != NULL) {
@@ -4125,47 +9415,17 @@ int main(int argc, char **argv)
             }
             option(NULL);
         }
+#ifndef NOTHREAD
+        if (g.sock != NULL)
+            throw(EINVAL, "--%s can only be on the command line",
+                  g.serve ? "daemon" : "socket");
+#endif
 
-        /* decompress if named "unpigz" or "gunzip", to stdout if "*cat" */
-        if (strcmp(g.prog, "unpigz") == 0 || strcmp(g.prog, "gunzip") == 0) {
-            if (!g.decode)
-                g.headis >>= 2;
-            g.decode = 1;
-        }
-        if ((n = strlen(g.prog)) > 2 && strcmp(g.prog + n - 3, "cat") == 0) {
-            if (!g.decode)
-                g.headis >>= 2;
-            g.decode = 1;
-            g.pipeout = 1;
-        }
-
-        /* if no arguments and compressed data to/from terminal, show help */
-        if (argc < 2 && isatty(g.decode ? 0 : 1))
-            help();
-
-        /* process command-line arguments */
-        done = noop = 0;
-        for (n = 1; n < argc; n++)
-            /* ignore options after "--" */
-            if (noop == 0 && strcmp(argv[n], "--") == 0) {
-                noop = 1;
-                option(NULL);
-            }
-            /* process argument, interpreting if option */
-            else if (noop || option(argv[n])) {
-                /* argv[n] is a name to process */
-                if (done == 1 && g.pipeout && !g.decode && !g.list &&
-                    g.form > 1)
-                    complain("warning: output will be concatenated zip files"
-                             " -- %s will not be able to extract", g.prog);
-                process(strcmp(argv[n], "-") ? argv[n] : NULL);
-                done++;
-            }
-        option(NULL);
-
-        /* list stdin or compress stdin to stdout if no file names provided */
-        if (done == 0)
-            process(NULL);
+        /* process the command line, then summarize and close up */
+        process_args(argc, argv);
+#ifndef NOTHREAD
+        run_end();
+#endif
     }
     always {
         /* release resources */
@@ -0,0 +1,129 @@
+/* pigz.h -- interface of libpigz, pigz as a library
+ * Copyright (C) 2007-2015 Mark Adler
+ * Version 2.3.3  24 Jan 2015  Mark Adler
+ */
+
+/*
+  This software is provided 'as-is', without any express or implied
+  warranty.  In no event will the author be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the following restrictions:
+
+  1. The origin of this software must not be misrepresented; you must not
+     claim that you wrote the original software. If you use this software
+     in a product, an acknowledgment in the product documentation would be
+     appreciated but is not required.
+  2. Altered source versions must be plainly marked as such, and must not be
+     misrepresented as being the original software.
+  3. This notice may not be removed or altered from any source distribution.
+
+  Mark Adler
+  madler@alumni.caltech.edu
+ */
+
+/* libpigz provides the parallel compressor of pigz to applications, without
+   running pigz as a separate process.  Each stream is compressed with its own
+   options, and any number of streams may be compressed at the same time.  All
+   of the streams share one set of compression threads, which grows as needed
+   to the largest number of processes requested by a stream (-p), and which
+   persists for the life of the process.
+
+   The compressed data is delivered to the sink function provided when the
+   stream is created, which is called from a thread other than the caller's.
+   The sink must accept all of the data it is given.  Input is provided with
+   pigz_compress_write(), which returns once the data has been copied into the
+   compressor's buffers.  pigz_compress_flush() returns once all of the input
+   so far has been compressed and delivered to the sink, ending on a byte
+   boundary so that it can be decompressed.  pigz_compress_end() completes the
+   stream with the trailer and frees the stream.  The functions for one stream
+   must not be called from more than one thread at a time.
+
+   Decompression is not done in parallel by pigz, so pigz_decompress_*() use
+   zlib's inflate() directly, decoding gzip or zlib streams, including
+   concatenated gzip members, and delivering the result to the sink from the
+   caller's thread.
+
+   For many small buffers, such as messages, each needing its own stream,
+   pigz_compress_batch() compresses each buffer in an array as a separate
+   gzip or zlib stream, with the buffers divided among the compression
+   threads.  pigz_decompress_batch() does the reverse, also with the buffers
+   divided among the threads.
+
+   The functions return zero on success, or an errno value on failure: EINVAL
+   for invalid options or invalid compressed data, ENOMEM if out of memory.
+   Once a compression stream has failed, no more output is delivered to its
+   sink, and the error is returned by its functions, ending with
+   pigz_compress_end(), which must still be called to free the stream.
+   The library is built with "make libpigz.a".  The pigz command is available
+   as pigz_main(). */
+
+#ifndef PIGZ_H
+#define PIGZ_H
+
+#include <stddef.h>     /* size_t */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* a compression or decompression stream */
+typedef struct pigz_stream pigz_stream;
+
+/* function to deliver output data to the application */
+typedef void (*pigz_sink)(void *opaque, const unsigned char *buf, size_t len);
+
+/* start a compression stream using the pigz options in opts, separated by
+   spaces (e.g. "-9 -b 256 -z"), or NULL for the defaults, and deliver the
+   compressed data to sink(opaque, buf, len) -- return NULL with errno set on
+   failure */
+pigz_stream *pigz_compress_init(const char *opts, pigz_sink sink,
+                                void *opaque);
+
+/* compress buf[0..len-1] */
+int pigz_compress_write(pigz_stream *strm, const void *buf, size_t len);
+
+/* deliver all of the compressed data for the input so far */
+int pigz_compress_flush(pigz_stream *strm);
+
+/* finish the compressed stream and free strm */
+int pigz_compress_end(pigz_stream *strm);
+
+/* start a decompression stream, delivering the decompressed data to
+   sink(opaque, buf, len) -- return NULL with errno set on failure */
+pigz_stream *pigz_decompress_init(pigz_sink sink, void *opaque);
+
+/* decompress buf[0..len-1] */
+int pigz_decompress_write(pigz_stream *strm, const void *buf, size_t len);
+
+/* verify that the compressed data was complete and free strm */
+int pigz_decompress_end(pigz_stream *strm);
+
+/* one buffer of a batch, with its result */
+typedef struct {
+    const void *in;         /* input data */
+    size_t in_len;          /* length of input data */
+    unsigned char *out;     /* output data (allocated -- free() when done) */
+    size_t out_len;         /* length of output data */
+    int err;                /* zero, or errno value for this buffer */
+} pigz_batch;
+
+/* compress each of items[0..n-1] as an independent gzip or zlib stream, using
+   the pigz options in opts (-K is not supported), and wait for all of them --
+   return zero if all succeeded, or else the first item error */
+int pigz_compress_batch(const char *opts, pigz_batch *items, size_t n);
+
+/* decompress each of items[0..n-1], each of which is gzip, zlib, or zip data,
+   with up to the -p option in opts threads -- return as for compress */
+int pigz_decompress_batch(const char *opts, pigz_batch *items, size_t n);
+
+/* run the pigz command with the given arguments, returning the exit code */
+int pigz_main(int argc, char **argv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,6 +1,6 @@
 /* yarn.c -- generic thread operations implemented using pthread functions
  * Copyright (C) 2008, 2011, 2012, 2015 Mark Adler
- * Version 1.4  19 Jan 2015  Mark Adler
+ * Version 1.5  18 Oct 2026  Mark Adler
  * For conditions of distribution and use, see copyright notice in yarn.h
  */
 
@@ -19,6 +19,8 @@
                        Fix documentation in yarn.h for yarn_prefix
    1.4    19 Jan 2015  Allow yarn_abort() to avoid error message to stderr
                        Accept and do nothing for NULL argument to free_lock()
+   1.5    18 Oct 2026  Add yarn_count(), label_lock(), and yarn_count_show() to
+                       count lock use and contention
  */
 
 /* for thread portability */
@@ -32,6 +34,8 @@
 /* external libraries and entities referenced */
 #include <stdio.h>      /* fprintf(), stderr */
 #include <stdlib.h>     /* exit(), malloc(), free(), NULL */
+#include <string.h>     /* strcmp() */
+#include <time.h>       /* clock_gettime(), CLOCK_MONOTONIC */
 #include <pthread.h>    /* pthread_t, pthread_create(), pthread_join(), */
     /* pthread_attr_t, pthread_attr_init(), pthread_attr_destroy(),
        PTHREAD_CREATE_JOINABLE, pthread_attr_setdetachstate(),
@@ -39,8 +43,9 @@
        pthread_mutex_t, PTHREAD_MUTEX_INITIALIZER, pthread_mutex_init(),
        pthread_mutex_lock(), pthread_mutex_unlock(), pthread_mutex_destroy(),
        pthread_cond_t, PTHREAD_COND_INITIALIZER, pthread_cond_init(),
-       pthread_cond_broadcast(), pthread_cond_wait(), pthread_cond_destroy() */
-#include <errno.h>      /* ENOMEM, EAGAIN, EINVAL */
+       pthread_cond_broadcast(), pthread_cond_wait(), pthread_cond_destroy(),
+       pthread_mutex_trylock() */
+#include <errno.h>      /* ENOMEM, EAGAIN, EINVAL, EBUSY */
 
 /* interface definition */
 #include "yarn.h"
@@ -87,33 +92,172 @@ local void *my_malloc(size_t size)
     return block;
 }
 
+/* -- lock use counts -- */
+
+/* When counting is turned on with yarn_count(), each new lock gets a count of
+   its use, which is updated only while the lock is possessed.  When the lock
+   is freed, its count is added to the total for its label, so that the many
+   short-lived locks with the same label are reported together. */
+
+struct count {
+    char *name;                 /* label of the lock */
+    char *what;                 /* second part of the label, or NULL */
+    unsigned long locks;        /* number of locks counted */
+    unsigned long possess;      /* number of possessions */
+    unsigned long contend;      /* possessions that had to wait */
+    unsigned long twist;        /* number of twists */
+    unsigned long wait;         /* wait_for() calls that had to wait */
+    unsigned long futile;       /* wakeups that had to wait again */
+    double secs;                /* seconds waiting in wait_for() */
+    struct count *next;         /* next in list */
+    struct count *prior;        /* previous in list of live counts */
+};
+
+/* true if counting, list of counts of locks not freed yet, totals of the
+   counts of freed locks by label, and the lock for those lists */
+local int counting = 0;
+local struct count *live = NULL;
+local struct count *totals = NULL;
+local pthread_mutex_t counts_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* return a monotonic time in seconds */
+local double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* add the counts in from to the entry with the same label in *list, creating
+   the entry if needed */
+local void fold(struct count **list, struct count *from)
+{
+    struct count *to;
+
+    for (to = *list; to != NULL; to = to->next)
+        if ((to->name == from->name || (to->name != NULL &&
+                                        from->name != NULL &&
+                                        strcmp(to->name, from->name) == 0)) &&
+            (to->what == from->what || (to->what != NULL &&
+                                        from->what != NULL &&
+                                        strcmp(to->what, from->what) == 0)))
+            break;
+    if (to == NULL) {
+        to = my_malloc(sizeof(struct count));
+        to->name = from->name;
+        to->what = from->what;
+        to->locks = to->possess = to->contend = to->twist = to->wait =
+            to->futile = 0;
+        to->secs = 0;
+        to->next = *list;
+        *list = to;
+    }
+    to->locks += from->locks;
+    to->possess += from->possess;
+    to->contend += from->contend;
+    to->twist += from->twist;
+    to->wait += from->wait;
+    to->futile += from->futile;
+    to->secs += from->secs;
+}
+
+void yarn_count(int on)
+{
+    counting = on;
+}
+
+void yarn_count_show(void)
+{
+    struct count *all = NULL, *c;
+    char label[64];
+
+    pthread_mutex_lock(&counts_mutex);
+    for (c = totals; c != NULL; c = c->next)
+        fold(&all, c);
+    for (c = live; c != NULL; c = c->next)
+        fold(&all, c);
+    pthread_mutex_unlock(&counts_mutex);
+    if (all == NULL)
+        return;
+    fprintf(stderr, "%-22s %7s %10s %9s %9s %9s %9s %9s\n", "lock", "locks",
+            "possess", "contended", "twists", "waits", "futile", "wait s");
+    while ((c = all) != NULL) {
+        snprintf(label, sizeof(label), "%s%s%s",
+                 c->name == NULL ? "(unlabeled)" : c->name,
+                 c->what == NULL ? "" : "->", c->what == NULL ? "" : c->what);
+        fprintf(stderr, "%-22s %7lu %10lu %9lu %9lu %9lu %9lu %9.3f\n", label,
+                c->locks, c->possess, c->contend, c->twist, c->wait, c->futile,
+                c->secs);
+        all = c->next;
+        my_free(c);
+    }
+}
+
 /* -- lock functions -- */
 
 struct lock_s {
     pthread_mutex_t mutex;
     pthread_cond_t cond;
     long value;
+    struct count *count;        /* use count, or NULL if not counting */
 };
 
 lock *new_lock(long initial)
 {
     int ret;
     lock *bolt;
+    struct count *c;
 
     bolt = my_malloc(sizeof(struct lock_s));
     if ((ret = pthread_mutex_init(&(bolt->mutex), NULL)) ||
         (ret = pthread_cond_init(&(bolt->cond), NULL)))
         fail(ret);
     bolt->value = initial;
+    bolt->count = NULL;
+    if (counting) {
+        c = my_malloc(sizeof(struct count));
+        c->name = c->what = NULL;
+        c->locks = 1;
+        c->possess = c->contend = c->twist = c->wait = c->futile = 0;
+        c->secs = 0;
+        c->prior = NULL;
+        pthread_mutex_lock(&counts_mutex);
+        c->next = live;
+        if (live != NULL)
+            live->prior = c;
+        live = c;
+        pthread_mutex_unlock(&counts_mutex);
+        bolt->count = c;
+    }
     return bolt;
 }
 
+void label_lock(lock *bolt, char *name, char *what)
+{
+    if (bolt->count != NULL) {
+        bolt->count->name = name;
+        bolt->count->what = what;
+    }
+}
+
 void possess(lock *bolt)
 {
     int ret;
 
-    if ((ret = pthread_mutex_lock(&(bolt->mutex))) != 0)
+    if (bolt->count == NULL) {
+        if ((ret = pthread_mutex_lock(&(bolt->mutex))) != 0)
+            fail(ret);
+        return;
+    }
+    ret = pthread_mutex_trylock(&(bolt->mutex));
+    if (ret == EBUSY) {
+        ret = pthread_mutex_lock(&(bolt->mutex));
+        bolt->count->contend++;
+    }
+    if (ret != 0)
         fail(ret);
+    bolt->count->possess++;
 }
 
 void release(lock *bolt)
@@ -132,6 +276,8 @@ void twist(lock *bolt, enum twist_op op, long val)
         bolt->value = val;
     else if (op == BY)
         bolt->value += val;
+    if (bolt->count != NULL)
+        bolt->count->twist++;
     if ((ret = pthread_cond_broadcast(&(bolt->cond))) ||
         (ret = pthread_mutex_unlock(&(bolt->mutex))))
         fail(ret);
@@ -139,31 +285,48 @@ void twist(lock *bolt, enum twist_op op, long val)
 
 #define until(a) while(!(a))
 
-void wait_for(lock *bolt, enum wait_op op, long val)
+/* return true if the lock value is as wait_for() is waiting for */
+local int ready(lock *bolt, enum wait_op op, long val)
 {
-    int ret;
-
     switch (op) {
     case TO_BE:
-        until (bolt->value == val)
-            if ((ret = pthread_cond_wait(&(bolt->cond), &(bolt->mutex))) != 0)
-                fail(ret);
-        break;
+        return bolt->value == val;
     case NOT_TO_BE:
-        until (bolt->value != val)
-            if ((ret = pthread_cond_wait(&(bolt->cond), &(bolt->mutex))) != 0)
-                fail(ret);
-        break;
+        return bolt->value != val;
     case TO_BE_MORE_THAN:
-        until (bolt->value > val)
-            if ((ret = pthread_cond_wait(&(bolt->cond), &(bolt->mutex))) != 0)
-                fail(ret);
-        break;
+        return bolt->value > val;
     case TO_BE_LESS_THAN:
-        until (bolt->value < val)
+        return bolt->value < val;
+    }
+    return 1;
+}
+
+void wait_for(lock *bolt, enum wait_op op, long val)
+{
+    int ret;
+    double start;
+
+    if (ready(bolt, op, val))
+        return;
+    if (bolt->count == NULL) {
+        do {
             if ((ret = pthread_cond_wait(&(bolt->cond), &(bolt->mutex))) != 0)
                 fail(ret);
+        } until (ready(bolt, op, val));
+        return;
+    }
+
+    /* count the wait, the time waiting, and any wakeups to no avail */
+    bolt->count->wait++;
+    start = now();
+    for (;;) {
+        if ((ret = pthread_cond_wait(&(bolt->cond), &(bolt->mutex))) != 0)
+            fail(ret);
+        if (ready(bolt, op, val))
+            break;
+        bolt->count->futile++;
     }
+    bolt->count->secs += now() - start;
 }
 
 long peek_lock(lock *bolt)
@@ -180,6 +343,18 @@ void free_lock(lock *bolt)
     if ((ret = pthread_cond_destroy(&(bolt->cond))) ||
         (ret = pthread_mutex_destroy(&(bolt->mutex))))
         fail(ret);
+    if (bolt->count != NULL) {
+        pthread_mutex_lock(&counts_mutex);
+        fold(&totals, bolt->count);
+        if (bolt->count->prior == NULL)
+            live = bolt->count->next;
+        else
+            bolt->count->prior->next = bolt->count->next;
+        if (bolt->count->next != NULL)
+            bolt->count->next->prior = bolt->count->prior;
+        pthread_mutex_unlock(&counts_mutex);
+        my_free(bolt->count);
+    }
     my_free(bolt);
 }
 
@@ -196,7 +371,8 @@ struct thread_s {
 local lock threads_lock = {
     PTHREAD_MUTEX_INITIALIZER,
     PTHREAD_COND_INITIALIZER,
-    0                           /* number of threads exited but not joined */
+    0,                          /* number of threads exited but not joined */
+    NULL                        /* not counted */
 };
 local thread *threads = NULL;       /* list of extant threads */
 
@@ -1,6 +1,6 @@
 /* yarn.h -- generic interface for thread operations
  * Copyright (C) 2008, 2011, 2012, 2015 Mark Adler
- * Version 1.4  19 Jan 2015  Mark Adler
+ * Version 1.5  18 Oct 2026  Mark Adler
  */
 
 /*
@@ -90,6 +90,18 @@
    free_lock(lock) - free the resources allocated by new_lock() (application
         must assure that the lock is released before calling free_lock())
 
+   -- Lock use counts --
+
+   yarn_count(1) - count the use of locks made by new_lock() from now on: the
+        number of possess() calls, those that found the lock held by another
+        thread, the number of twist() calls, the wait_for() calls that had to
+        wait, the wakeups that found the value still not as waited for, and
+        the seconds spent waiting -- yarn_count(0) stops counting for new locks
+   label_lock(lock, name, what) - label the counts of lock with the name and
+        what strings (what may be NULL), which must remain valid -- locks with
+        the same label are counted together (does nothing if not counting)
+   yarn_count_show() - write the counts to stderr, one line per label
+
    -- Memory allocation ---
 
    yarn_mem(better_malloc, better_free) - set the memory allocation and free
@@ -132,3 +144,7 @@ enum wait_op {
 void wait_for(lock *, enum wait_op, long);
 long peek_lock(lock *);
 void free_lock(lock *);
+
+void yarn_count(int);
+void label_lock(lock *, char *, char *);
+void yarn_count_show(void);